@@ -38,9 +38,12 @@
 #define CONF_BATCH_SIZE_WIDTH "batch_size_width"
 #define CONF_BATCH_SIZE_HEIGHT "batch_size_height"
 #define CONF_BATCH_SIZE_SCALE "batch_size_scale"
+#define CONF_BATCH_CONCURRENT_PHOTOS "batch_concurrent_photos"
+#define CONF_BATCH_MEMORY_BUDGET "batch_memory_budget"
 #define CONF_ROI_GRID "roi_grid"
 #define CONF_CROP_ASPECT "crop_aspect"
 #define CONF_SHOW_FILENAMES "show_filenames_in_iconview"
+#define CONF_THUMBNAIL_SIZE "thumbnail_size"
 #define CONF_USE_SYSTEM_THEME "use_system_theme"
 #define CONF_FULLSCREEN "fullscreen"
 #define CONF_SHOW_TOOLBOX_FULLSCREEN "show_toolbox_fullscreen"
@@ -66,6 +69,7 @@
 #define CONF_LIBRARY_TAG_SEARCH "library_tag_search"
 #define CONF_EXPORT_AS_FOLDER "export_as_folder"
 #define CONF_EXPORT_AS_SIZE_PERCENT "export_as_size_percent"
+#define CONF_EXPORT_DEMOSAIC "export_demosaic"
 #define CONF_MAIN_WINDOW_WIDTH "main_window_width"
 #define CONF_MAIN_WINDOW_HEIGHT "main_window_height"
 #define CONF_MAIN_WINDOW_POS_X "main_window_pos_x"
@@ -89,10 +93,13 @@
 #define CONF_MAP_ZOOM "map_zoom"
 
 #define DEFAULT_CONF_EXPORT_FILENAME "%f_%2c"
+#define DEFAULT_CONF_EXPORT_DEMOSAIC "adaptive-homogeneity"
 #define DEFAULT_CONF_BATCH_DIRECTORY "batch_exports/"
 #define DEFAULT_CONF_BATCH_FILENAME "%f_%2c"
 #define DEFAULT_CONF_BATCH_FILETYPE "jpeg"
 #define DEFAULT_CONF_BATCH_JPEG_QUALITY "100"
+#define DEFAULT_CONF_BATCH_CONCURRENT_PHOTOS 2
+#define DEFAULT_CONF_BATCH_MEMORY_BUDGET 1024 /* MB */
 #define DEFAULT_CONF_FULLSCREEN FALSE
 #define DEFAULT_CONF_SHOW_TOOLBOX_FULLSCREEN TRUE
 #define DEFAULT_CONF_SHOW_TOOLBOX TRUE
@@ -112,6 +119,7 @@
 #define DEFAULT_CONF_LOAD_RECURSIVE FALSE
 #define DEFAULT_CONF_USE_SYSTEM_THEME FALSE
 #define DEFAULT_CONF_SHOW_FILENAMES FALSE
+#define DEFAULT_CONF_THUMBNAIL_SIZE 128
 #define DEFAULT_CONF_LIBRARY_AUTOTAG FALSE
 #define DEFAULT_CONF_MAIN_WINDOW_WIDTH 800
 #define DEFAULT_CONF_MAIN_WINDOW_HEIGHT 600
@@ -29,6 +29,7 @@ static const GDebugKey rs_debug_keys[] = {
 	{ "processing", RS_DEBUG_PROCESSING },
 	{ "library", RS_DEBUG_LIBRARY },
 	{ "locking", RS_DEBUG_LOCKING },
+	{ "trace", RS_DEBUG_TRACE },
 };
 
 void
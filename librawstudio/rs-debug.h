@@ -32,6 +32,7 @@ typedef enum {
 	RS_DEBUG_PROCESSING  = 1 << 3,
 	RS_DEBUG_LIBRARY     = 1 << 4,
 	RS_DEBUG_LOCKING     = 1 << 5,
+	RS_DEBUG_TRACE       = 1 << 6,
 } RSDebugFlag;
 
 #define RS_DEBUG(type,x,a...) \
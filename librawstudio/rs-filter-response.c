@@ -17,9 +17,14 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
  */
 
+#include <unistd.h> /* getpid() */
+#include <string.h> /* memcpy() */
 #include "rs-filter-response.h"
 #include "rs-image16.h"
 
+/* Protects placing an area image in a full size image, responses can be shared by threads */
+static GMutex image_lock;
+
 struct _RSFilterResponse {
 	RSFilterParam parent;
 	gboolean dispose_has_run;
@@ -28,9 +33,14 @@ struct _RSFilterResponse {
 	GdkRectangle roi;
 	gboolean quick;
 	RS_IMAGE16 *image;
+	gboolean image_area_set;
+	GdkRectangle image_area; /* The part of the image covered by image */
+	gint image_width;
+	gint image_height;
 	GdkPixbuf *image8;
 	gint width;
 	gint height;
+	GArray *trace;
 };
 
 G_DEFINE_TYPE(RSFilterResponse, rs_filter_response, RS_TYPE_FILTER_PARAM)
@@ -49,6 +59,9 @@ rs_filter_response_dispose(GObject *object)
 
 		if (filter_response->image8)
 			g_object_unref(filter_response->image8);
+
+		if (filter_response->trace)
+			g_array_free(filter_response->trace, TRUE);
 	}
 
 	G_OBJECT_CLASS (rs_filter_response_parent_class)->dispose (object);
@@ -75,9 +88,11 @@ rs_filter_response_init(RSFilterResponse *filter_response)
 	filter_response->roi_set = FALSE;
 	filter_response->quick = FALSE;
 	filter_response->image = NULL;
+	filter_response->image_area_set = FALSE;
 	filter_response->image8 = NULL;
 	filter_response->width = -1;
 	filter_response->height = -1;
+	filter_response->trace = NULL;
 	filter_response->dispose_has_run = FALSE;
 }
 
@@ -109,6 +124,12 @@ rs_filter_response_clone(RSFilterResponse *filter_response)
 		new_filter_response->width = filter_response->width;
 		new_filter_response->height = filter_response->height;
 
+		if (filter_response->trace)
+		{
+			new_filter_response->trace = g_array_sized_new(FALSE, FALSE, sizeof(RSFilterTrace), filter_response->trace->len + 4);
+			g_array_append_vals(new_filter_response->trace, filter_response->trace->data, filter_response->trace->len);
+		}
+
 		rs_filter_param_clone(RS_FILTER_PARAM(new_filter_response), RS_FILTER_PARAM(filter_response));
 	}
 
@@ -201,6 +222,35 @@ rs_filter_response_set_image(RSFilterResponse *filter_response, RS_IMAGE16 *imag
 
 	if (image)
 		filter_response->image = g_object_ref(image);
+	filter_response->image_area_set = FALSE;
+}
+
+/**
+ * Set 16 bit image data covering only a part of the image. This can be used
+ * to answer a ROI request without allocating the whole image
+ * @param filter_response A RSFilterResponse
+ * @param image A RS_IMAGE16 the size of area
+ * @param area The part of the image covered by image, must contain the ROI
+ * @param width Width of the whole image
+ * @param height Height of the whole image
+ */
+void
+rs_filter_response_set_image_area(RSFilterResponse *filter_response, RS_IMAGE16 *image, const GdkRectangle *area, gint width, gint height)
+{
+	g_return_if_fail(RS_IS_FILTER_RESPONSE(filter_response));
+	g_return_if_fail(RS_IS_IMAGE16(image));
+	g_return_if_fail(area != NULL);
+	g_return_if_fail(image->w == area->width && image->h == area->height);
+	g_return_if_fail(area->x >= 0 && area->y >= 0 && area->x + area->width <= width && area->y + area->height <= height);
+
+	rs_filter_response_set_image(filter_response, image);
+	if (area->x != 0 || area->y != 0 || area->width != width || area->height != height)
+	{
+		filter_response->image_area_set = TRUE;
+		filter_response->image_area = *area;
+		filter_response->image_width = width;
+		filter_response->image_height = height;
+	}
 }
 
 /**
@@ -216,19 +266,84 @@ rs_filter_response_set_image(RSFilterResponse *filter_response, RS_IMAGE16 *imag
 }
 
 /**
- * Get 16 bit image data
+ * Get 16 bit image data. If only a part of the image was set, it is placed
+ * in an image of the whole size, only the ROI of that is valid
  * @param filter_response A RSFilterResponse
  * @return A RS_IMAGE16 (must be unreffed after usage) or NULL if none is set
  */
 RS_IMAGE16 *
 rs_filter_response_get_image(const RSFilterResponse *filter_response)
 {
+	RSFilterResponse *response = (RSFilterResponse *) filter_response;
 	RS_IMAGE16 *ret = NULL;
 
 	g_return_val_if_fail(RS_IS_FILTER_RESPONSE(filter_response), NULL);
 
+	g_mutex_lock(&image_lock);
+	if (response->image && response->image_area_set)
+	{
+		RS_IMAGE16 *area_image = response->image;
+		const GdkRectangle *area = &response->image_area;
+		RS_IMAGE16 *image = rs_image16_new(response->image_width, response->image_height, area_image->channels, area_image->pixelsize);
+		gint y;
+
+		image->filters = area_image->filters;
+		for(y = 0; y < area->height; y++)
+			memcpy(GET_PIXEL(image, area->x, area->y + y), GET_PIXEL(area_image, 0, y), area->width * area_image->pixelsize * sizeof(gushort));
+
+		response->image = image;
+		response->image_area_set = FALSE;
+		g_object_unref(area_image);
+	}
+
+	if (response->image)
+		ret = g_object_ref(response->image);
+	g_mutex_unlock(&image_lock);
+
+	return ret;
+}
+
+/**
+ * Get 16 bit image data as set, without placing a part of the image in an
+ * image of the whole size
+ * @param filter_response A RSFilterResponse
+ * @param area Set to the part of the image covered by the returned image
+ * @param width Set to the width of the whole image, can be NULL
+ * @param height Set to the height of the whole image, can be NULL
+ * @return A RS_IMAGE16 (must be unreffed after usage) or NULL if none is set
+ */
+RS_IMAGE16 *
+rs_filter_response_get_image_area(const RSFilterResponse *filter_response, GdkRectangle *area, gint *width, gint *height)
+{
+	RS_IMAGE16 *ret = NULL;
+
+	g_return_val_if_fail(RS_IS_FILTER_RESPONSE(filter_response), NULL);
+	g_return_val_if_fail(area != NULL, NULL);
+
+	g_mutex_lock(&image_lock);
 	if (filter_response->image)
+	{
 		ret = g_object_ref(filter_response->image);
+		if (filter_response->image_area_set)
+		{
+			*area = filter_response->image_area;
+			if (width)
+				*width = filter_response->image_width;
+			if (height)
+				*height = filter_response->image_height;
+		}
+		else
+		{
+			area->x = area->y = 0;
+			area->width = ret->w;
+			area->height = ret->h;
+			if (width)
+				*width = ret->w;
+			if (height)
+				*height = ret->h;
+		}
+	}
+	g_mutex_unlock(&image_lock);
 
 	return ret;
 }
@@ -348,3 +463,123 @@ rs_filter_response_get_height(const RSFilterResponse *filter_response)
 	else
 		return -1;
 }
+
+/**
+ * Add a trace record to a response, this should only be called from RSFilter
+ * @param filter_response A RSFilterResponse
+ * @param trace A RSFilterTrace, this will be copied
+ */
+void
+rs_filter_response_add_trace(RSFilterResponse *filter_response, const RSFilterTrace *trace)
+{
+	g_return_if_fail(RS_IS_FILTER_RESPONSE(filter_response));
+	g_return_if_fail(trace != NULL);
+
+	if (!filter_response->trace)
+		filter_response->trace = g_array_sized_new(FALSE, FALSE, sizeof(RSFilterTrace), 16);
+
+	g_array_append_vals(filter_response->trace, trace, 1);
+}
+
+/**
+ * Get the trace records of all filters involved in rendering a response
+ * @param filter_response A RSFilterResponse
+ * @param n_traces Pointer to a guint where the number of records will be written
+ * @return An array of RSFilterTrace owned by the response or NULL if none, in
+ *         the order the filters finished
+ */
+const RSFilterTrace *
+rs_filter_response_get_trace(const RSFilterResponse *filter_response, guint *n_traces)
+{
+	g_return_val_if_fail(RS_IS_FILTER_RESPONSE(filter_response), NULL);
+	g_return_val_if_fail(n_traces != NULL, NULL);
+
+	*n_traces = 0;
+
+	if (!filter_response->trace)
+		return NULL;
+
+	*n_traces = filter_response->trace->len;
+
+	return (const RSFilterTrace *) filter_response->trace->data;
+}
+
+/* Append a string to a JSON string value, escaping what JSON requires */
+static void
+append_json_escaped(GString *str, const gchar *text)
+{
+	for(; *text; text++)
+	{
+		const guchar c = *text;
+
+		if (c == '"' || c == '\\')
+		{
+			g_string_append_c(str, '\\');
+			g_string_append_c(str, c);
+		}
+		else if (c == '\n')
+			g_string_append(str, "\\n");
+		else if (c == '\t')
+			g_string_append(str, "\\t");
+		else if (c < 0x20)
+			g_string_append_printf(str, "\\u%04x", c);
+		else
+			g_string_append_c(str, c);
+	}
+}
+
+/**
+ * Format the trace of a response as Chrome trace events
+ * @param filter_response A RSFilterResponse
+ * @return A newly allocated string with one JSON event per line, each
+ *         followed by a comma, this must be freed with g_free()
+ */
+gchar *
+rs_filter_response_get_trace_json(const RSFilterResponse *filter_response)
+{
+	const RSFilterTrace *trace;
+	guint i, n_traces;
+	gint64 first = G_MAXINT64;
+	GString *str = g_string_new("");
+
+	g_return_val_if_fail(RS_IS_FILTER_RESPONSE(filter_response), NULL);
+
+	trace = rs_filter_response_get_trace(filter_response, &n_traces);
+
+	/* Cached responses carry records from earlier requests, only report what
+	 * happened during this request */
+	for(i = 0; i < n_traces; i++)
+		if (trace[i].depth == 0)
+			first = MIN(first, trace[i].start);
+
+	for(i = 0; i < n_traces; i++)
+	{
+		const RSFilterTrace *t = &trace[i];
+		gchar mpix[G_ASCII_DTOSTR_BUF_SIZE];
+
+		if (t->start < first)
+			continue;
+
+		g_ascii_formatd(mpix, sizeof(mpix), "%.2f", t->mpix_per_second);
+		g_string_append(str, "{\"name\":\"");
+		append_json_escaped(str, t->name);
+		if (t->label)
+		{
+			g_string_append(str, " (");
+			append_json_escaped(str, t->label);
+			g_string_append_c(str, ')');
+		}
+		g_string_append_printf(str,
+			"\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%u,"
+			"\"ts\":%" G_GINT64_FORMAT ",\"dur\":%" G_GINT64_FORMAT ",\"args\":{"
+			"\"self_us\":%" G_GINT64_FORMAT ",\"mpix_s\":%s,\"bytes\":%" G_GSIZE_FORMAT ",\"w\":%d,\"h\":%d",
+			t->image8 ? "image8" : "image",
+			(gint) getpid(), t->thread,
+			t->start, t->total, t->elapsed, mpix, t->bytes, t->width, t->height);
+		if (t->roi_set)
+			g_string_append_printf(str, ",\"roi\":[%d,%d,%d,%d]", t->roi.x, t->roi.y, t->roi.width, t->roi.height);
+		g_string_append(str, "}},\n");
+	}
+
+	return g_string_free(str, FALSE);
+}
@@ -36,6 +36,25 @@ G_BEGIN_DECLS
 
 typedef struct _RSFilterResponse RSFilterResponse;
 
+/* Timing and allocation record for a single filter in a request */
+typedef struct {
+	const gchar *name;		/* Type name of the filter */
+	const gchar *label;		/* Label of the filter or NULL */
+	gint depth;				/* Distance from the filter the request was made to */
+	gboolean image8;		/* TRUE for rs_filter_get_image8() requests */
+	gboolean roi_set;
+	GdkRectangle roi;		/* Only valid if roi_set is TRUE */
+	gint width;				/* Size of the rendered area */
+	gint height;
+	gint64 start;			/* Monotonic time in microseconds */
+	gint64 total;			/* Wall time including previous filters in microseconds */
+	gint64 elapsed;			/* Wall time spent in this filter alone in microseconds */
+	gdouble mpix_per_second;
+	gsize bytes;			/* Size of image data allocated by this filter */
+	gconstpointer image;	/* Output image, for identity only - not referenced */
+	guint thread;			/* Thread the filter was rendered in */
+} RSFilterTrace;
+
 typedef struct {
   RSFilterParamClass parent_class;
 } RSFilterResponseClass;
@@ -109,6 +128,28 @@ void rs_filter_response_set_image(RSFilterResponse *filter_response, RS_IMAGE16
  */
 RS_IMAGE16 *rs_filter_response_get_image(const RSFilterResponse *filter_response);
 
+/**
+ * Set 16 bit image data covering only a part of the image. This can be used
+ * to answer a ROI request without allocating the whole image
+ * @param filter_response A RSFilterResponse
+ * @param image A RS_IMAGE16 the size of area
+ * @param area The part of the image covered by image, must contain the ROI
+ * @param width Width of the whole image
+ * @param height Height of the whole image
+ */
+void rs_filter_response_set_image_area(RSFilterResponse *filter_response, RS_IMAGE16 *image, const GdkRectangle *area, gint width, gint height);
+
+/**
+ * Get 16 bit image data as set, without placing a part of the image in an
+ * image of the whole size
+ * @param filter_response A RSFilterResponse
+ * @param area Set to the part of the image covered by the returned image
+ * @param width Set to the width of the whole image, can be NULL
+ * @param height Set to the height of the whole image, can be NULL
+ * @return A RS_IMAGE16 (must be unreffed after usage) or NULL if none is set
+ */
+RS_IMAGE16 *rs_filter_response_get_image_area(const RSFilterResponse *filter_response, GdkRectangle *area, gint *width, gint *height);
+
 /**
  * Set 8 bit image data
  * @param filter_response A RSFilterResponse
@@ -160,6 +201,30 @@ gint rs_filter_response_get_width(const RSFilterResponse *filter_response);
  */
 gint rs_filter_response_get_height(const RSFilterResponse *filter_response);
 
+/**
+ * Add a trace record to a response, this should only be called from RSFilter
+ * @param filter_response A RSFilterResponse
+ * @param trace A RSFilterTrace, this will be copied
+ */
+void rs_filter_response_add_trace(RSFilterResponse *filter_response, const RSFilterTrace *trace);
+
+/**
+ * Get the trace records of all filters involved in rendering a response
+ * @param filter_response A RSFilterResponse
+ * @param n_traces Pointer to a guint where the number of records will be written
+ * @return An array of RSFilterTrace owned by the response or NULL if none, in
+ *         the order the filters finished
+ */
+const RSFilterTrace *rs_filter_response_get_trace(const RSFilterResponse *filter_response, guint *n_traces);
+
+/**
+ * Format the trace of a response as Chrome trace events
+ * @param filter_response A RSFilterResponse
+ * @return A newly allocated string with one JSON event per line, each
+ *         followed by a comma, this must be freed with g_free()
+ */
+gchar *rs_filter_response_get_trace_json(const RSFilterResponse *filter_response);
+
 G_END_DECLS
 
 #endif /* RS_FILTER_RESPONSE_H */
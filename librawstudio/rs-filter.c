@@ -18,19 +18,22 @@
  */
 
 #include <stdlib.h> /* system() */
+#include <unistd.h> /* getpid() */
 #include <rawstudio.h>
 #include "rs-filter.h"
 
-#if 0 /* Change to 1 to enable performance info */
-#define filter_performance printf
-#define FILTER_SHOW_PERFORMANCE
-#else
-#define filter_performance(...) {}
-#endif
+/* Nesting depth of get_image calls in the current thread */
+static GPrivate trace_depth;
 
-/* How much time should a filter at least have taken to show performance number */
-#define FILTER_PERF_ELAPSED_MIN 0.001
-#define CHAIN_PERF_ELAPSED_MIN 0.001
+/* Sequential id of the current thread, 0 if not assigned yet */
+static GPrivate trace_thread;
+static gint trace_threads = 0;
+
+/* Traces are only needed for the performance output and the trace file */
+#define TRACE_ENABLED() G_UNLIKELY(rs_debug_flags & (RS_DEBUG_PERFORMANCE | RS_DEBUG_TRACE))
+
+static GMutex trace_file_lock;
+static FILE *trace_file = NULL;
 
 G_DEFINE_TYPE (RSFilter, rs_filter, G_TYPE_OBJECT)
 
@@ -196,6 +199,174 @@ clamp_roi(const GdkRectangle *roi, RSFilter *filter, const RSFilterRequest *requ
 	return new_roi;
 }
 
+static inline gint
+trace_enter(void)
+{
+	gint depth = GPOINTER_TO_INT(g_private_get(&trace_depth));
+	g_private_set(&trace_depth, GINT_TO_POINTER(depth + 1));
+
+	return depth;
+}
+
+static inline void
+trace_leave(gint depth)
+{
+	g_private_set(&trace_depth, GINT_TO_POINTER(depth));
+}
+
+/**
+ * Get a small id for the current thread, stable for the lifetime of the thread
+ * @return Thread id, starting from 1
+ */
+static guint
+trace_thread_id(void)
+{
+	guint id = GPOINTER_TO_UINT(g_private_get(&trace_thread));
+
+	if (id == 0)
+	{
+		id = g_atomic_int_add(&trace_threads, 1) + 1;
+		g_private_set(&trace_thread, GUINT_TO_POINTER(id));
+	}
+
+	return id;
+}
+
+/**
+ * Write a finished request to the trace file as Chrome trace events
+ * Load the file in chrome://tracing or any compatible viewer
+ */
+static void
+trace_write(RSFilterResponse *response)
+{
+	gchar *json = rs_filter_response_get_trace_json(response);
+
+	g_mutex_lock(&trace_file_lock);
+	if (!trace_file)
+	{
+		gchar *basename = g_strdup_printf("rawstudio-trace-%d.json", (gint) getpid());
+		gchar *filename = g_build_filename(g_get_tmp_dir(), basename, NULL);
+
+		/* The JSON array format allows the closing bracket to be missing */
+		if ((trace_file = fopen(filename, "w")))
+		{
+			fputs("[\n", trace_file);
+			g_message("Writing filter trace to %s", filename);
+		}
+		else
+			g_warning("Could not open %s for filter trace", filename);
+
+		g_free(filename);
+		g_free(basename);
+	}
+	if (trace_file)
+	{
+		fputs(json, trace_file);
+		fflush(trace_file);
+	}
+	g_mutex_unlock(&trace_file_lock);
+
+	g_free(json);
+}
+
+/**
+ * Record timing for a filter on a response
+ * @param filter The filter that rendered the response
+ * @param request The request, after ROI clamping
+ * @param response The response from filter
+ * @param depth Nesting depth as returned by trace_enter()
+ * @param start Monotonic time in microseconds when the filter was called
+ * @param image8 TRUE if this was a get_image8() request
+ */
+static void
+trace_record(RSFilter *filter, const RSFilterRequest *request, RSFilterResponse *response, gint depth, gint64 start, gboolean image8)
+{
+	RSFilterTrace trace;
+	const RSFilterTrace *previous;
+	GdkRectangle *roi;
+	guint i, n_previous;
+	gint64 previous_total = 0;
+	gconstpointer previous_image = NULL;
+
+	trace.name = RS_FILTER_NAME(filter);
+	trace.label = filter->label;
+	trace.depth = depth;
+	trace.image8 = image8;
+	trace.start = start;
+	trace.total = g_get_monotonic_time() - start;
+	trace.bytes = 0;
+	trace.image = NULL;
+	trace.thread = trace_thread_id();
+	trace.width = trace.height = 0;
+
+	if ((roi = rs_filter_request_get_roi(request)))
+	{
+		trace.roi_set = TRUE;
+		trace.roi = *roi;
+	}
+	else
+		trace.roi_set = FALSE;
+
+	if (image8 && rs_filter_response_has_image8(response))
+	{
+		GdkPixbuf *pixbuf = rs_filter_response_get_image8(response);
+		trace.image = pixbuf;
+		trace.width = gdk_pixbuf_get_width(pixbuf);
+		trace.height = gdk_pixbuf_get_height(pixbuf);
+		trace.bytes = gdk_pixbuf_get_rowstride(pixbuf) * trace.height;
+		g_object_unref(pixbuf);
+	}
+	else if (!image8 && rs_filter_response_has_image(response))
+	{
+		GdkRectangle area;
+		RS_IMAGE16 *image = rs_filter_response_get_image_area(response, &area, NULL, NULL);
+		trace.image = image;
+		trace.width = image->w;
+		trace.height = image->h;
+		trace.bytes = image->rowstride * image->h * sizeof(gushort);
+		g_object_unref(image);
+	}
+
+	/* Subtract the time spent in filters called from this one */
+	previous = rs_filter_response_get_trace(response, &n_previous);
+	for(i = 0; i < n_previous; i++)
+		if (previous[i].depth == depth + 1 && previous[i].start >= start)
+		{
+			previous_total += previous[i].total;
+			previous_image = previous[i].image;
+		}
+	trace.elapsed = MAX(0, trace.total - previous_total);
+
+	/* Passing on an image allocated by someone else is free */
+	if (trace.image && trace.image == previous_image)
+		trace.bytes = 0;
+
+	if (trace.roi_set)
+	{
+		trace.width = MIN(trace.width, trace.roi.width);
+		trace.height = MIN(trace.height, trace.roi.height);
+	}
+
+	if (trace.elapsed > 0)
+		trace.mpix_per_second = ((gdouble) trace.width * trace.height) / trace.elapsed;
+	else
+		trace.mpix_per_second = 0.0;
+
+	rs_filter_response_add_trace(response, &trace);
+
+	RS_DEBUG(PERFORMANCE, "%*s%s%s%s%s%s took %.1fms [%.1f Mpix/s] [w: %d, h: %d, allocated: %" G_GSIZE_FORMAT " bytes]",
+		depth*2, "", trace.name, image8 ? " (8 bit)" : "",
+		trace.label ? " (" : "", trace.label ? trace.label : "", trace.label ? ")" : "",
+		trace.elapsed / 1000.0, trace.mpix_per_second, trace.width, trace.height, trace.bytes);
+
+	if (depth == 0)
+	{
+		RS_DEBUG(PERFORMANCE, "Complete %s chain took %.1fms", image8 ? "8 bit" : "16 bit", trace.total / 1000.0);
+		if (G_UNLIKELY(rs_debug_flags & RS_DEBUG_TRACE))
+			trace_write(response);
+	}
+}
+
 /**
  * Get the output image from a RSFilter
  * @param filter A RSFilter
@@ -207,25 +378,15 @@ rs_filter_get_image(RSFilter *filter, const RSFilterRequest *request)
 {
 	GdkRectangle* roi = NULL;
 	RSFilterRequest *r = NULL;
+	RSFilterResponse *response;
+	RS_IMAGE16 *image;
+	GdkRectangle area;
 
 	g_return_val_if_fail(RS_IS_FILTER(filter), NULL);
 	g_return_val_if_fail(RS_IS_FILTER_REQUEST(request), NULL);
 
 	RS_DEBUG(FILTERS, "rs_filter_get_image(%s [%p])", RS_FILTER_NAME(filter), filter);
 
-	/* This timer-hack will break badly when multithreaded! */
-	static gfloat last_elapsed = 0.0;
-	static gint count = -1;
-	gfloat elapsed;
-	static GTimer *gt = NULL;
-
-	RSFilterResponse *response;
-	RS_IMAGE16 *image;
-
-	if (count == -1)
-		gt = g_timer_new();
-	count++;
-
 	if (filter->enabled && (roi = rs_filter_request_get_roi(request)))
 	{
 		roi = clamp_roi(roi, filter, request);
@@ -238,54 +399,34 @@ rs_filter_get_image(RSFilter *filter, const RSFilterRequest *request)
 	}
 
 	if (RS_FILTER_GET_CLASS(filter)->get_image && filter->enabled)
-		response = RS_FILTER_GET_CLASS(filter)->get_image(filter, request);
+	{
+		if (TRACE_ENABLED())
+		{
+			gint64 start = g_get_monotonic_time();
+			gint depth = trace_enter();
+			response = RS_FILTER_GET_CLASS(filter)->get_image(filter, request);
+			trace_leave(depth);
+
+			g_assert(RS_IS_FILTER_RESPONSE(response));
+			trace_record(filter, request, response, depth, start, FALSE);
+		}
+		else
+			response = RS_FILTER_GET_CLASS(filter)->get_image(filter, request);
+	}
 	else
 		response = rs_filter_get_image(filter->previous, request);
 
 	g_assert(RS_IS_FILTER_RESPONSE(response));
 
-	image = rs_filter_response_get_image(response);
-
-	elapsed = g_timer_elapsed(gt, NULL) - last_elapsed;
+	image = rs_filter_response_get_image_area(response, &area, NULL, NULL);
 
 	if (roi)
 		g_free(roi);
 	if (r)
 		g_object_unref(r);
 
-#ifdef FILTER_SHOW_PERFORMANCE
-	if ((elapsed > FILTER_PERF_ELAPSED_MIN) && (image != NULL)) 
-	{
-		gint iw = image->w;
-		gint ih = image->h;
-		if (rs_filter_response_get_roi(response)) 
-		{
-			roi = rs_filter_response_get_roi(response);
-			iw = roi->width;
-			ih = roi->height;
-		}
-		filter_performance("%s took: \033[32m%.0f\033[0mms", RS_FILTER_NAME(filter), elapsed*1000);
-		if ((elapsed > 0.001) && (image != NULL))
-			filter_performance(" [\033[33m%.01f\033[0mMpix/s]", ((gfloat)(iw*ih))/elapsed/1000000.0);
-		if (image)
-			filter_performance(" [w: %d, h: %d, roi-w:%d, roi-h:%d, channels: %d, pixelsize: %d, rowstride: %d]",
-				image->w, image->h, iw, ih, image->channels, image->pixelsize, image->rowstride);
-		filter_performance("\n");
-	}
-#endif
 	g_assert(RS_IS_IMAGE16(image) || (image == NULL));
-	last_elapsed += elapsed;
 
-	count--;
-	if (count == -1)
-	{
-		last_elapsed = 0.0;
-		if (g_timer_elapsed(gt,NULL) > CHAIN_PERF_ELAPSED_MIN)
-			filter_performance("Complete 16 bit chain took: \033[32m%.0f\033[0mms\n\n", g_timer_elapsed(gt, NULL)*1000.0);
-		rs_filter_param_set_float(RS_FILTER_PARAM(response), "16-bit-time", g_timer_elapsed(gt, NULL));
-		g_timer_destroy(gt);
-	}
-	
 	if (image)
 		g_object_unref(image);
 
@@ -302,17 +443,6 @@ rs_filter_get_image(RSFilter *filter, const RSFilterRequest *request)
 RSFilterResponse *
 rs_filter_get_image8(RSFilter *filter, const RSFilterRequest *request)
 {
-	g_return_val_if_fail(RS_IS_FILTER(filter), NULL);
-	g_return_val_if_fail(RS_IS_FILTER_REQUEST(request), NULL);
-
-	RS_DEBUG(FILTERS, "rs_filter_get_image8(%s [%p])", RS_FILTER_NAME(filter), filter);
-
-	/* This timer-hack will break badly when multithreaded! */
-	static gfloat last_elapsed = 0.0;
-	static gint count = -1;
-	gfloat elapsed, temp;
-	static GTimer *gt = NULL;
-
 	RSFilterResponse *response = NULL;
 	GdkPixbuf *image = NULL;
 	GdkRectangle* roi = NULL;
@@ -321,9 +451,7 @@ rs_filter_get_image8(RSFilter *filter, const RSFilterRequest *request)
 	g_return_val_if_fail(RS_IS_FILTER(filter), NULL);
 	g_return_val_if_fail(RS_IS_FILTER_REQUEST(request), NULL);
 
-	if (count == -1)
-		gt = g_timer_new();
-	count++;
+	RS_DEBUG(FILTERS, "rs_filter_get_image8(%s [%p])", RS_FILTER_NAME(filter), filter);
 
 	if (filter->enabled && (roi = rs_filter_request_get_roi(request)))
 	{
@@ -337,56 +465,34 @@ rs_filter_get_image8(RSFilter *filter, const RSFilterRequest *request)
 	}
 
 	if (RS_FILTER_GET_CLASS(filter)->get_image8 && filter->enabled)
-		response = RS_FILTER_GET_CLASS(filter)->get_image8(filter, request);
+	{
+		if (TRACE_ENABLED())
+		{
+			gint64 start = g_get_monotonic_time();
+			gint depth = trace_enter();
+			response = RS_FILTER_GET_CLASS(filter)->get_image8(filter, request);
+			trace_leave(depth);
+
+			g_assert(RS_IS_FILTER_RESPONSE(response));
+			trace_record(filter, request, response, depth, start, TRUE);
+		}
+		else
+			response = RS_FILTER_GET_CLASS(filter)->get_image8(filter, request);
+	}
 	else if (filter->previous)
 		response = rs_filter_get_image8(filter->previous, request);
 
 	g_assert(RS_IS_FILTER_RESPONSE(response));
 
 	image = rs_filter_response_get_image8(response);
-	elapsed = g_timer_elapsed(gt, NULL) - last_elapsed;
-
-	/* Subtract 16 bit time */
-	if (rs_filter_param_get_float(RS_FILTER_PARAM(response), "16-bit-time", &temp))
-		elapsed -= temp;
 
 	if (roi)
 		g_free(roi);
 	if (r)
 		g_object_unref(r);
 
-#ifdef FILTER_SHOW_PERFORMANCE
-	if ((elapsed > FILTER_PERF_ELAPSED_MIN) && (image != NULL)) {
-		gint iw = gdk_pixbuf_get_width(image);
-		gint ih = gdk_pixbuf_get_height(image);
-		if (rs_filter_response_get_roi(response)) 
-		{
-			GdkRectangle *roi = rs_filter_response_get_roi(response);
-			iw = roi->width;
-			ih = roi->height;
-		}
-		filter_performance("%s took: \033[32m%.0f\033[0mms", RS_FILTER_NAME(filter), elapsed * 1000);
-		filter_performance(" [\033[33m%.01f\033[0mMpix/s]", ((gfloat)(iw * ih)) / elapsed / 1000000.0);
-		filter_performance("\n");
-	}
-#endif
-
-	last_elapsed += elapsed;
-
 	g_assert(GDK_IS_PIXBUF(image) || (image == NULL));
 
-	count--;
-	if (count == -1)
-	{
-		last_elapsed = 0.0;
-		rs_filter_param_get_float(RS_FILTER_PARAM(response), "16-bit-time", &last_elapsed);
-		last_elapsed = g_timer_elapsed(gt, NULL)-last_elapsed;
-		if (last_elapsed > CHAIN_PERF_ELAPSED_MIN)
-			filter_performance("Complete 8 bit chain took: \033[32m%.0f\033[0mms\n\n", last_elapsed*1000.0);
-		g_timer_destroy(gt);
-		last_elapsed = 0.0;
-	}
-
 	if (image)
 		g_object_unref(image);
 
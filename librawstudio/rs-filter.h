@@ -73,7 +73,8 @@ type_name##_get_type(GTypeModule *module) \
 typedef enum {
 	RS_FILTER_CHANGED_PIXELDATA   = 1<<0,
 	RS_FILTER_CHANGED_DIMENSION   = 1<<0 | 1<<1, /* This implies pixeldata changed */
-	RS_FILTER_CHANGED_ICC_PROFILE = 1<<2
+	RS_FILTER_CHANGED_ICC_PROFILE = 1<<2,
+	RS_FILTER_CHANGED_SETTINGS    = 1<<3  /* The RSSettings rendered from changed or was replaced */
 } RSFilterChangedMask;
 
 typedef struct _RSFilter RSFilter;
@@ -182,6 +182,7 @@ rs_image16_new_subframe(RS_IMAGE16 *input, GdkRectangle *rectangle)
 	RS_IMAGE16 *output;
 	gint width, height;
 	gint x, y;
+	gint row, col;
 
 	g_return_val_if_fail(RS_IS_IMAGE16(input), NULL);
 	g_return_val_if_fail(rectangle->x >= 0, NULL);
@@ -218,6 +219,12 @@ rs_image16_new_subframe(RS_IMAGE16 *input, GdkRectangle *rectangle)
 	output->pixelsize = input->pixelsize;
 	output->filters = input->filters;
 
+	/* The X-Trans pattern must follow the new origin */
+	if (input->filters == RS_FILTERS_XTRANS)
+		for (row = 0; row < 6; row++)
+			for (col = 0; col < 6; col++)
+				output->xtrans[row][col] = XTRANS_COLOR(input, row + y, col + x);
+
 	output->pixels = GET_PIXEL(input, x, y);
 	output->pixels_refcount = input->pixels_refcount + 1;
 
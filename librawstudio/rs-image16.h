@@ -40,6 +40,7 @@ struct _rs_image16 {
 	gushort *pixels;
 	gint pixels_refcount;
 	guint filters;
+	guchar xtrans[6][6]; /* Colors of the CFA when filters is RS_FILTERS_XTRANS */
 	gboolean dispose_has_run;
 };
 
@@ -59,6 +60,20 @@ GType rs_image16_get_type (void);
  */
 #define GET_PIXEL(image, x, y) ((image)->pixels + (y)*(image)->rowstride + (x)*(image)->pixelsize)
 
+/**
+ * Value of RS_IMAGE16::filters for sensors using a 6x6 X-Trans pattern, the
+ * same value dcraw uses. The pattern itself is found in RS_IMAGE16::xtrans
+ */
+#define RS_FILTERS_XTRANS 9
+
+/**
+ * Get the color of a pixel in an X-Trans image
+ * @param image RS_IMAGE16 with filters set to RS_FILTERS_XTRANS
+ * @param row Row, must be -6 or above
+ * @param col Column, must be -6 or above
+ */
+#define XTRANS_COLOR(image, row, col) ((image)->xtrans[((row)+6) % 6][((col)+6) % 6])
+
 #define GET_PIXBUF_PIXEL(pixbuf, x, y) (gdk_pixbuf_get_pixels((pixbuf)) + (y)*gdk_pixbuf_get_rowstride((pixbuf)) + (x)*gdk_pixbuf_get_n_channels((pixbuf)))
 
 extern RS_IMAGE16 *rs_image16_new(const guint width, const guint height, const guint channels, const guint pixelsize);
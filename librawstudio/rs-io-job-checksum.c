@@ -36,7 +36,7 @@ execute(RSIoJob *job)
 {
 	RSIoJobChecksum *checksum = RS_IO_JOB_CHECKSUM(job);
 
-	rs_io_lock();
+	rs_io_lock_file(checksum->path);
 	checksum->checksum = rs_file_checksum(checksum->path);
 	rs_io_unlock();
 }
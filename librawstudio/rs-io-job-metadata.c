@@ -58,7 +58,8 @@ rs_io_job_metadata_dispose(GObject *object)
 		metadata->dispose_has_run = TRUE;
 
 		g_free(metadata->path);
-		g_object_unref(metadata->metadata);
+		if (metadata->metadata)
+			g_object_unref(metadata->metadata);
 	}
 	G_OBJECT_CLASS(rs_io_job_metadata_parent_class)->dispose(object);
 }
@@ -55,7 +55,7 @@ execute(RSIoJob *job)
 #if __gnu_linux__
 			while(bytes_read < st.st_size)
 			{
-				rs_io_lock();
+				rs_io_lock_file(prefetch->path);
 				gint length = MIN(st.st_size-bytes_read, 1024*1024);
 				readahead(fd, bytes_read, length);
 				bytes_read += length;
@@ -68,7 +68,7 @@ execute(RSIoJob *job)
 
 			while(bytes_read < st.st_size)
 			{
-				rs_io_lock();
+				rs_io_lock_file(prefetch->path);
 				bytes_read += read(fd, tmp+bytes_read, MIN(st.st_size-bytes_read, 1024*1024));
 				rs_io_unlock();
 			}
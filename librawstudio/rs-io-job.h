@@ -37,6 +37,11 @@ typedef struct {
 	gint idle_class;
 	gint priority;
 	gpointer user_data;
+	gint64 queued; /* Monotonic time of rs_io_idle_add_job() */
+
+	/* Private, owned by rs-io */
+	guint serial;
+	GSequenceIter *iter;
 } RSIoJob;
 
 typedef struct {
@@ -17,16 +17,27 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
  */
 
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#if __gnu_linux__
+#include <sys/vfs.h>
+#include <sys/sysmacros.h>
+#endif /* __gnu_linux__ */
 #include "rs-io.h"
 
 static GMutex init_lock;
-static GAsyncQueue *queue = NULL;
-static GRecMutex io_lock;
-static GTimer *io_lock_timer = NULL;
+static gboolean initialized = FALSE;
+
+/* Everything below is protected by queue_lock. Workers sleep on queue_cond
+ * while the queue is empty or paused */
+static GMutex queue_lock;
+static GCond queue_cond;
+static GSequence *queue = NULL;
+static guint queue_serial = 0;
 static gboolean pause_queue = FALSE;
 static gint queue_active_count = 0;
-static GMutex count_lock;
-
+static GHashTable *stats = NULL;
 
 static gint
 queue_sort(gconstpointer a, gconstpointer b, gpointer user_data)
@@ -39,43 +50,78 @@ queue_sort(gconstpointer a, gconstpointer b, gpointer user_data)
 	if (b)
 		id2 = RS_IO_JOB(b)->priority;
 
+	/* Jobs of equal priority are executed in the order they were added */
+	if (id1 == id2 && a && b)
+	{
+		id1 = RS_IO_JOB(a)->serial;
+		id2 = RS_IO_JOB(b)->serial;
+	}
+
 	return (id1 > id2 ? +1 : id1 == id2 ? 0 : -1);
 }
 
+/* Must be called with queue_lock held */
+static void
+queue_remove(RSIoJob *job)
+{
+	g_sequence_remove(job->iter);
+	job->iter = NULL;
+}
+
+static void
+stats_add(RSIoJob *job, gint64 started, gint64 finished)
+{
+	GType type = G_OBJECT_TYPE(job);
+	RSIoStats *entry = g_hash_table_lookup(stats, GSIZE_TO_POINTER(type));
+	gdouble wait = (started - job->queued) / (gdouble) G_USEC_PER_SEC;
+	gdouble run = (finished - started) / (gdouble) G_USEC_PER_SEC;
+
+	if (!entry)
+	{
+		entry = g_new0(RSIoStats, 1);
+		entry->job_type = g_type_name(type);
+		g_hash_table_insert(stats, GSIZE_TO_POINTER(type), entry);
+	}
+
+	entry->jobs++;
+	entry->wait += wait;
+	entry->wait_max = MAX(entry->wait_max, wait);
+	entry->run += run;
+	entry->run_max = MAX(entry->run_max, run);
+}
+
 static gpointer
 queue_worker(gpointer data)
 {
-	GAsyncQueue *queue = data;
 	RSIoJob *job;
+	gint64 started;
 
+	/* Everything done by the io workers can wait for the user */
+	rs_io_set_thread_priority(RS_IO_PRIORITY_BACKGROUND);
+
+	g_mutex_lock(&queue_lock);
 	while (1)
 	{
-		if (pause_queue)
-			g_usleep(1000);
-		else
-		{
-			g_mutex_lock(&count_lock);
-			job = g_async_queue_try_pop(queue);
-			if (job)
-				queue_active_count++;
-			g_mutex_unlock(&count_lock);
-
-			/* If we somehow got NULL, continue. I'm not sure this will ever happen, but this is better than random segfaults :) */
-			if (job)
-			{
-				rs_io_job_execute(job);
-				rs_io_job_do_callback(job);
-				g_mutex_lock(&count_lock);
-				queue_active_count--;
-				g_mutex_unlock(&count_lock);
-			}
-			else
-			{
-				/* Sleep 1 ms */
-				g_usleep(1000);
-			}
-		}
+		while (pause_queue || g_sequence_get_length(queue) == 0)
+			g_cond_wait(&queue_cond, &queue_lock);
+
+		job = g_sequence_get(g_sequence_get_begin_iter(queue));
+		queue_remove(job);
+		queue_active_count++;
+		g_mutex_unlock(&queue_lock);
+
+		started = g_get_monotonic_time();
+		rs_io_job_execute(job);
+		rs_io_job_do_callback(job);
+
+		g_mutex_lock(&queue_lock);
+		stats_add(job, started, g_get_monotonic_time());
+		queue_active_count--;
+
+		/* The queue's reference */
+		g_object_unref(job);
 	}
+	g_mutex_unlock(&queue_lock);
 
 	return NULL;
 }
@@ -85,20 +131,25 @@ init(void)
 {
 	int i;
 	g_mutex_lock(&init_lock);
-	if (!queue)
+	if (!initialized)
 	{
-		queue = g_async_queue_new();
+		g_mutex_lock(&queue_lock);
+		queue = g_sequence_new(NULL);
+		stats = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_free);
+		g_mutex_unlock(&queue_lock);
+
 		for (i = 0; i < rs_get_number_of_processor_cores(); i++)
-			g_thread_new("io worker", queue_worker, queue);
+			g_thread_new("io worker", queue_worker, NULL);
 
-		io_lock_timer = g_timer_new();
+		initialized = TRUE;
 	}
 	g_mutex_unlock(&init_lock);
 }
 
 /**
  * Add a RSIoJob to be executed later
- * @param job A RSIoJob. This will be unreffed upon completion
+ * @param job A RSIoJob. This will be unreffed upon completion or cancellation, ref it
+ *            before adding it to keep using it with rs_io_idle_cancel() or rs_io_idle_set_priority()
  * @param idle_class A user defined variable, this can be used with rs_io_idle_cancel_class() to cancel a batch of queued reads
  * @param priority Lower value means higher priority
  * @param user_data A pointer to pass to the callback
@@ -108,20 +159,27 @@ rs_io_idle_add_job(RSIoJob *job, gint idle_class, gint priority, gpointer user_d
 {
 	g_return_if_fail(RS_IS_IO_JOB(job));
 
+	init();
+
 	job->idle_class = idle_class;
 	job->priority = priority;
 	job->user_data = user_data;
 
-	g_async_queue_push_sorted(queue, job, queue_sort, NULL);
+	g_mutex_lock(&queue_lock);
+	job->queued = g_get_monotonic_time();
+	job->serial = queue_serial++;
+	job->iter = g_sequence_insert_sorted(queue, job, queue_sort, NULL);
+	g_cond_signal(&queue_cond);
+	g_mutex_unlock(&queue_lock);
 }
 
 /**
  * Prefetch a file
  * @param path Absolute path to a file to prefetch
  * @param idle_class A user defined variable, this can be used with rs_io_idle_cancel_class() to cancel a batch of queued reads
- * @return A pointer to a RSIoJob, this can be used with rs_io_idle_cancel()
+ * @return A new reference to the RSIoJob for rs_io_idle_cancel(), unref when done
  */
-const RSIoJob *
+RSIoJob *
 rs_io_idle_prefetch_file(const gchar *path, gint idle_class)
 {
 	g_return_val_if_fail(path != NULL, NULL);
@@ -130,7 +188,7 @@ rs_io_idle_prefetch_file(const gchar *path, gint idle_class)
 	init();
 
 	RSIoJob *job = rs_io_job_prefetch_new(path);
-	rs_io_idle_add_job(job, idle_class, 20, NULL);
+	rs_io_idle_add_job(g_object_ref(job), idle_class, 20, NULL);
 
 	return job;
 }
@@ -141,9 +199,9 @@ rs_io_idle_prefetch_file(const gchar *path, gint idle_class)
  * @param idle_class A user defined variable, this can be used with rs_io_idle_cancel_class() to cancel a batch of queued reads
  * @param callback A callback to call when the data is ready or NULL
  * @param user_data Data to pass to the callback
- * @return A pointer to a RSIoJob, this can be used with rs_io_idle_cancel()
+ * @return A new reference to the RSIoJob for rs_io_idle_cancel(), unref when done
  */
-const RSIoJob *
+RSIoJob *
 rs_io_idle_read_metadata(const gchar *path, gint idle_class, RSGotMetadataCB callback, gpointer user_data)
 {
 	g_return_val_if_fail(path != NULL, NULL);
@@ -152,7 +210,7 @@ rs_io_idle_read_metadata(const gchar *path, gint idle_class, RSGotMetadataCB cal
 	init();
 
 	RSIoJob *job = rs_io_job_metadata_new(path, callback);
-	rs_io_idle_add_job(job, idle_class, 10, user_data);
+	rs_io_idle_add_job(g_object_ref(job), idle_class, 10, user_data);
 
 	return job;
 }
@@ -163,9 +221,9 @@ rs_io_idle_read_metadata(const gchar *path, gint idle_class, RSGotMetadataCB cal
  * @param idle_class A user defined variable, this can be used with rs_io_idle_cancel_class() to cancel a batch of queued reads
  * @param callback A callback to call when the data is ready or NULL
  * @param user_data Data to pass to the callback
- * @return A pointer to a RSIoJob, this can be used with rs_io_idle_cancel()
+ * @return A new reference to the RSIoJob for rs_io_idle_cancel(), unref when done
  */
-const RSIoJob *
+RSIoJob *
 rs_io_idle_read_checksum(const gchar *path, gint idle_class, RSGotChecksumCB callback, gpointer user_data)
 {
 	g_return_val_if_fail(path != NULL, NULL);
@@ -174,7 +232,7 @@ rs_io_idle_read_checksum(const gchar *path, gint idle_class, RSGotChecksumCB cal
 	init();
 
 	RSIoJob *job = rs_io_job_checksum_new(path, callback);
-	rs_io_idle_add_job(job, idle_class, 30, user_data);
+	rs_io_idle_add_job(g_object_ref(job), idle_class, 30, user_data);
 
 	return job;
 }
@@ -185,9 +243,9 @@ rs_io_idle_read_checksum(const gchar *path, gint idle_class, RSGotChecksumCB cal
  * @param tag_id The id of the tag to add.
  * @param auto_tag Is the tag an automatically generated tag
  * @param idle_class A user defined variable, this can be used with rs_io_idle_cancel_class() to cancel a batch of queued reads
- * @return A pointer to a RSIoJob, this can be used with rs_io_idle_cancel()
+ * @return A new reference to the RSIoJob for rs_io_idle_cancel(), unref when done
  */
-const RSIoJob *
+RSIoJob *
 rs_io_idle_add_tag(const gchar *filename, gint tag_id, gboolean auto_tag, gint idle_class)
 {
 	g_return_val_if_fail(filename != NULL, NULL);
@@ -196,7 +254,7 @@ rs_io_idle_add_tag(const gchar *filename, gint tag_id, gboolean auto_tag, gint i
 	init();
 
 	RSIoJob *job = rs_io_job_tagging_new(filename, tag_id, auto_tag);
-	rs_io_idle_add_job(job, idle_class, 50, NULL);
+	rs_io_idle_add_job(g_object_ref(job), idle_class, 50, NULL);
 
 	return job;
 }
@@ -205,9 +263,9 @@ rs_io_idle_add_tag(const gchar *filename, gint tag_id, gboolean auto_tag, gint i
  * Restore tags of a new directory or add tags to a photo
  * @param path Absolute path to a directory to restore tags to
  * @param idle_class A user defined variable, this can be used with rs_io_idle_cancel_class() to cancel a batch of queued reads
- * @return A pointer to a RSIoJob, this can be used with rs_io_idle_cancel()
+ * @return A new reference to the RSIoJob for rs_io_idle_cancel(), unref when done
  */
-const RSIoJob *
+RSIoJob *
 rs_io_idle_restore_tags(const gchar *path, gint idle_class)
 {
 	g_return_val_if_fail(path != NULL, NULL);
@@ -216,116 +274,314 @@ rs_io_idle_restore_tags(const gchar *path, gint idle_class)
 	init();
 
 	RSIoJob *job = rs_io_job_tagging_new(path, -1, FALSE);
-	rs_io_idle_add_job(job, idle_class, 50, NULL);
+	rs_io_idle_add_job(g_object_ref(job), idle_class, 50, NULL);
 
 	return job;
 }
 
 /**
- * Cancel a complete class of idle requests
+ * Cancel a complete class of idle requests. Callbacks of cancelled jobs are
+ * never called, so user_data owned by the job must be freed by the caller
  * @param idle_class The class identifier
  */
 void
 rs_io_idle_cancel_class(gint idle_class)
 {
-	/* This behaves like rs_io_idle_cancel_class(), please see comments there */
-	RSIoJob *current_job;
-	RSIoJob *marker_job = rs_io_job_new();
+	GSequenceIter *iter, *next;
+	RSIoJob *job;
 
 	init();
 
-	g_async_queue_lock(queue);
+	g_mutex_lock(&queue_lock);
+	for (iter = g_sequence_get_begin_iter(queue); !g_sequence_iter_is_end(iter); iter = next)
+	{
+		next = g_sequence_iter_next(iter);
+		job = g_sequence_get(iter);
+		if (job->idle_class == idle_class)
+		{
+			queue_remove(job);
+			g_object_unref(job);
+		}
+	}
+	g_mutex_unlock(&queue_lock);
+}
+
+/**
+ * Cancel an idle request
+ * @param job A RSIoJob as returned by one of the rs_io_idle_*() functions
+ * @return TRUE if the job was cancelled, FALSE if it has already been started
+ */
+gboolean
+rs_io_idle_cancel(RSIoJob *job)
+{
+	gboolean cancelled = FALSE;
 
-	/* Put a marker in the queue, we will rotate the complete queue, so we have to know when we're around */
-	g_async_queue_push_unlocked(queue, marker_job);
+	g_return_val_if_fail(RS_IS_IO_JOB(job), FALSE);
 
-	while((current_job = g_async_queue_pop_unlocked(queue)))
+	init();
+
+	g_mutex_lock(&queue_lock);
+	if (job->iter)
 	{
-		/* If current job matches marker, we're done */
-		if (current_job == marker_job)
-			break;
+		queue_remove(job);
+		g_object_unref(job);
+		cancelled = TRUE;
+	}
+	g_mutex_unlock(&queue_lock);
+
+	return cancelled;
+}
+
+/**
+ * Change the priority of a queued request
+ * @param job A RSIoJob as returned by one of the rs_io_idle_*() functions
+ * @param priority Lower value means higher priority
+ * @return TRUE if the job is still queued, FALSE if it has already been started
+ */
+gboolean
+rs_io_idle_set_priority(RSIoJob *job, gint priority)
+{
+	gboolean queued = FALSE;
+
+	g_return_val_if_fail(RS_IS_IO_JOB(job), FALSE);
+
+	init();
 
-		/* Of the job's idle_class doesn't match the class to cancel, we put the job back in the queue */
-		if (current_job->idle_class != idle_class)
+	g_mutex_lock(&queue_lock);
+	if (job->iter)
+	{
+		if (job->priority != priority)
 		{
-			g_async_queue_push_unlocked(queue, current_job);
+			job->priority = priority;
+			g_sequence_sort_changed(job->iter, queue_sort, NULL);
 		}
+		queued = TRUE;
 	}
+	g_mutex_unlock(&queue_lock);
 
-	/* Make sure the queue is sorted */
-	g_async_queue_sort_unlocked(queue, queue_sort, NULL);
+	return queued;
+}
 
-	g_async_queue_unlock(queue);
+/* A device, as seen by the I/O scheduler. Protected by device_lock */
+typedef struct {
+	gint64 id;
+	const gchar *kind;
+	gint slots;       /* Number of threads allowed to do I/O concurrently */
+	gint active[RS_IO_PRIORITY_MAX];
+	gint waiting[RS_IO_PRIORITY_MAX];
+} RSIoDevice;
+
+/* Per thread I/O state */
+typedef struct {
+	RSIoPriority priority;
+	RSIoDevice *device; /* The device we're holding a slot on, if any */
+	RSIoPriority locked_priority;
+	gint depth;         /* rs_io_lock() can be nested */
+	gint64 locked;
+} RSIoThread;
+
+static GMutex device_lock;
+static GCond device_cond;
+static GHashTable *devices = NULL;
+static RSIoDevice default_device = { -1, "unknown", 2 };
+static GPrivate thread_key = G_PRIVATE_INIT(g_free);
+
+static RSIoThread *
+get_thread(void)
+{
+	RSIoThread *thread = g_private_get(&thread_key);
 
-	g_object_unref(marker_job);
+	if (!thread)
+	{
+		thread = g_new0(RSIoThread, 1);
+		thread->priority = RS_IO_PRIORITY_FOREGROUND;
+		g_private_set(&thread_key, thread);
+	}
+
+	return thread;
 }
 
 /**
- * Cancel an idle request
- * @param request_id A request_id as returned by rs_io_idle_read_complete_file()
+ * Guess how many concurrent readers a device handles well
  */
-void
-rs_io_idle_cancel(RSIoJob *job)
+static void
+device_probe(RSIoDevice *device, const gchar *path, dev_t dev)
 {
-	/* This behaves like rs_io_idle_cancel_class(), please see comments there */
-	RSIoJob *current_job;
-	RSIoJob *marker_job = rs_io_job_new();
+	device->kind = "unknown";
+	device->slots = 2;
 
-	init();
+#if __gnu_linux__
+	struct statfs fs;
+	gchar *sysfs;
+	FILE *fp;
+	gint rotational = -1;
 
-	g_async_queue_lock(queue);
+	if (statfs(path, &fs) == 0)
+		switch ((guint) fs.f_type)
+		{
+			case 0x6969:     /* NFS */
+			case 0x517B:     /* SMB */
+			case 0xFF534D42: /* CIFS */
+			case 0xFE534D42: /* SMB2 */
+			case 0x65735546: /* FUSE */
+			case 0x5346414F: /* AFS */
+				/* Network mounts are latency bound, keep a few requests in flight */
+				device->kind = "network";
+				device->slots = 4;
+				return;
+		}
 
-	/* Put a marker in the queue, we will rotate the complete queue, so we have to know when we're around */
-	g_async_queue_push_unlocked(queue, marker_job);
+	/* Partitions don't have a queue directory of their own, look at the disk */
+	sysfs = g_strdup_printf("/sys/dev/block/%u:%u/queue/rotational", major(dev), minor(dev));
+	if (!g_file_test(sysfs, G_FILE_TEST_EXISTS))
+	{
+		g_free(sysfs);
+		sysfs = g_strdup_printf("/sys/dev/block/%u:%u/../queue/rotational", major(dev), minor(dev));
+	}
+	fp = fopen(sysfs, "r");
+	if (fp)
+	{
+		if (fscanf(fp, "%d", &rotational) != 1)
+			rotational = -1;
+		fclose(fp);
+	}
+	g_free(sysfs);
 
-	while((current_job = g_async_queue_pop_unlocked(queue)))
+	if (rotational == 1)
+	{
+		/* Seeking between concurrent readers will kill throughput */
+		device->kind = "rotational";
+		device->slots = 1;
+	}
+	else if (rotational == 0)
 	{
-		/* If current job matches marker, we're done */
-		if (current_job == marker_job)
-			break;
+		device->kind = "solid state";
+		device->slots = CLAMP(rs_get_number_of_processor_cores(), 2, 8);
+	}
+#endif /* __gnu_linux__ */
+}
+
+static RSIoDevice *
+device_get(const gchar *path)
+{
+	RSIoDevice *device;
+	struct stat st;
+	gchar *dir = NULL;
+	gint64 id;
+
+	if (!path)
+		return &default_device;
 
-		if (current_job != job)
-			g_async_queue_push_unlocked(queue, current_job);
+	/* Files we're about to write doesn't exist yet, use the directory */
+	if (stat(path, &st) != 0)
+	{
+		dir = g_path_get_dirname(path);
+		if (stat(dir, &st) != 0)
+		{
+			g_free(dir);
+			return &default_device;
+		}
 	}
 
-	/* Make sure the queue is sorted */
-	g_async_queue_sort_unlocked(queue, queue_sort, NULL);
+	id = (gint64) st.st_dev;
+
+	g_mutex_lock(&device_lock);
+	if (!devices)
+		devices = g_hash_table_new_full(g_int64_hash, g_int64_equal, NULL, g_free);
+
+	device = g_hash_table_lookup(devices, &id);
+	if (!device)
+	{
+		device = g_new0(RSIoDevice, 1);
+		device->id = id;
+		device_probe(device, dir ? dir : path, st.st_dev);
+		g_hash_table_insert(devices, &device->id, device);
+		RS_DEBUG(LOCKING, "IO device %" G_GINT64_FORMAT " is %s, allowing %d concurrent readers",
+			device->id, device->kind, device->slots);
+	}
+	g_mutex_unlock(&device_lock);
 
-	g_async_queue_unlock(queue);
+	g_free(dir);
 
-	g_object_unref(marker_job);
+	return device;
+}
+
+/* Must be called with device_lock held */
+static gboolean
+device_available(RSIoDevice *device, RSIoPriority priority)
+{
+	gint p, active = 0;
+
+	/* Anything waiting with higher priority goes first */
+	for (p = 0; p < priority; p++)
+		if (device->waiting[p] > 0)
+			return FALSE;
+
+	/* Lower priority I/O doesn't count against us. Background I/O is done in
+	 * small chunks, so the worst case is a single slot being oversubscribed
+	 * for a short while */
+	for (p = 0; p <= priority; p++)
+		active += device->active[p];
+
+	return (active < device->slots);
+}
+
+/**
+ * Set the I/O priority of the calling thread
+ * @param priority The priority used by rs_io_lock() from this thread
+ */
+void
+rs_io_set_thread_priority(RSIoPriority priority)
+{
+	g_return_if_fail(priority < RS_IO_PRIORITY_MAX);
+
+	get_thread()->priority = priority;
 }
 
 /**
  * Aquire the IO lock
  */
 void
-rs_io_lock_real(const gchar *source_file, gint line, const gchar *caller)
+rs_io_lock_real(const gchar *path, const gchar *source_file, gint line, const gchar *caller)
 {
-	RS_DEBUG(LOCKING, "[%s:%d %s()] \033[33mrequesting\033[0m IO lock (thread %p)",
-		source_file, line, caller,
-		(g_timer_start(io_lock_timer), g_thread_self()));
+	RSIoThread *thread = get_thread();
+	RSIoDevice *device;
+	RSIoPriority priority = thread->priority;
+	gint64 requested;
 
-	/* Each loop tries approx every millisecond, so we wait 10 secs */
-	int tries_left = 10*1000;
+	/* Nested locks use the slot we're already holding */
+	if (thread->depth++ > 0)
+		return;
 
-	while (FALSE == g_rec_mutex_trylock(&io_lock))
+	device = device_get(path);
+	requested = g_get_monotonic_time();
+
+	RS_DEBUG(LOCKING, "[%s:%d %s()] \033[33mrequesting\033[0m IO lock for %s, priority %d (thread %p)",
+		source_file, line, caller, path ? path : "(unknown)", priority, g_thread_self());
+
+	g_mutex_lock(&device_lock);
+	device->waiting[priority]++;
+	while (!device_available(device, priority))
 	{
-		g_usleep(1000);
-		if (--tries_left <= 0)
-		{
-			RS_DEBUG(LOCKING, "[%s:%d %s()] \033[31mIO Lock was not released after \033[36m%.2f\033[0mms\033[0m, ignoring IO lock (thread %p)",
+		/* Waiting is fine, but we want to know about it */
+		if (!g_cond_wait_until(&device_cond, &device_lock, g_get_monotonic_time() + 10 * G_TIME_SPAN_SECOND))
+			RS_DEBUG(LOCKING, "[%s:%d %s()] \033[31mstill waiting for IO lock after \033[36m%.2f\033[0ms (thread %p)",
 				source_file, line, caller,
-				g_timer_elapsed(io_lock_timer, NULL)*1000.0,
-				(g_timer_start(io_lock_timer), g_thread_self()));
-			return;
-		}
+				(g_get_monotonic_time() - requested) / (gdouble) G_USEC_PER_SEC,
+				g_thread_self());
 	}
+	device->waiting[priority]--;
+	device->active[priority]++;
+	g_mutex_unlock(&device_lock);
+
+	thread->device = device;
+	thread->locked_priority = priority;
+	thread->locked = g_get_monotonic_time();
 
 	RS_DEBUG(LOCKING, "[%s:%d %s()] \033[32mgot\033[0m IO lock after \033[36m%.2f\033[0mms (thread %p)",
 		source_file, line, caller,
-		g_timer_elapsed(io_lock_timer, NULL)*1000.0,
-		(g_timer_start(io_lock_timer), g_thread_self()));
+		(thread->locked - requested) / 1000.0,
+		g_thread_self());
 }
 
 /**
@@ -334,12 +590,25 @@ rs_io_lock_real(const gchar *source_file, gint line, const gchar *caller)
 void
 rs_io_unlock_real(const gchar *source_file, gint line, const gchar *caller)
 {
+	RSIoThread *thread = get_thread();
+	RSIoDevice *device = thread->device;
+
+	g_return_if_fail(thread->depth > 0);
+
+	if (--thread->depth > 0)
+		return;
+
 	RS_DEBUG(LOCKING, "[%s:%d %s()] releasing IO lock after \033[36m%.2f\033[0mms (thread %p)",
 		source_file, line, caller,
-		g_timer_elapsed(io_lock_timer, NULL)*1000.0,
+		(g_get_monotonic_time() - thread->locked) / 1000.0,
 		g_thread_self());
 
-	g_rec_mutex_unlock(&io_lock);
+	g_mutex_lock(&device_lock);
+	device->active[thread->locked_priority]--;
+	g_cond_broadcast(&device_cond);
+	g_mutex_unlock(&device_lock);
+
+	thread->device = NULL;
 }
 
 /**
@@ -348,7 +617,9 @@ rs_io_unlock_real(const gchar *source_file, gint line, const gchar *caller)
 void
 rs_io_idle_pause(void)
 {
+	g_mutex_lock(&queue_lock);
 	pause_queue = TRUE;
+	g_mutex_unlock(&queue_lock);
 }
 
 /**
@@ -357,7 +628,10 @@ rs_io_idle_pause(void)
 void
 rs_io_idle_unpause(void)
 {
+	g_mutex_lock(&queue_lock);
 	pause_queue = FALSE;
+	g_cond_broadcast(&queue_cond);
+	g_mutex_unlock(&queue_lock);
 }
 
 /**
@@ -366,8 +640,43 @@ rs_io_idle_unpause(void)
 gint
 rs_io_get_jobs_left(void)
 {
-	g_mutex_lock(&count_lock);
-	gint left = g_async_queue_length(queue) + queue_active_count;
-	g_mutex_unlock(&count_lock);
+	g_mutex_lock(&queue_lock);
+	gint left = (queue ? g_sequence_get_length(queue) : 0) + queue_active_count;
+	g_mutex_unlock(&queue_lock);
 	return left;
-}
\ No newline at end of file
+}
+
+/**
+ * Returns the number of jobs waiting in the queue, not counting running jobs
+ */
+gint
+rs_io_get_queue_depth(void)
+{
+	g_mutex_lock(&queue_lock);
+	gint depth = (queue ? g_sequence_get_length(queue) : 0);
+	g_mutex_unlock(&queue_lock);
+	return depth;
+}
+
+/**
+ * Get latency counters for each type of job executed so far
+ * @return A list of RSIoStats, free with g_list_free_full(list, g_free)
+ */
+GList *
+rs_io_get_stats(void)
+{
+	GList *list = NULL;
+	GHashTableIter iter;
+	gpointer value;
+
+	g_mutex_lock(&queue_lock);
+	if (stats)
+	{
+		g_hash_table_iter_init(&iter, stats);
+		while (g_hash_table_iter_next(&iter, NULL, &value))
+			list = g_list_prepend(list, g_memdup(value, sizeof(RSIoStats)));
+	}
+	g_mutex_unlock(&queue_lock);
+
+	return list;
+}
@@ -22,9 +22,19 @@
 #ifndef RS_IO_H
 #define RS_IO_H
 
+typedef struct {
+	const gchar *job_type; /* Type name of the RSIoJob */
+	guint jobs;            /* Number of jobs executed */
+	gdouble wait;          /* Total seconds spent in the queue */
+	gdouble wait_max;
+	gdouble run;           /* Total seconds spent executing */
+	gdouble run_max;
+} RSIoStats;
+
 /**
  * Add a RSIoJob to be executed later
- * @param job A RSIoJob. This will be unreffed upon completion
+ * @param job A RSIoJob. This will be unreffed upon completion or cancellation, ref it
+ *            before adding it to keep using it with rs_io_idle_cancel() or rs_io_idle_set_priority()
  * @param idle_class A user defined variable, this can be used with rs_io_idle_cancel_class() to cancel a batch of queued reads
  * @param priority Lower value means higher priority
  * @param user_data A pointer to pass to the callback
@@ -36,9 +46,9 @@ rs_io_idle_add_job(RSIoJob *job, gint idle_class, gint priority, gpointer user_d
  * Prefetch a file
  * @param path Absolute path to a file to prefetch
  * @param idle_class A user defined variable, this can be used with rs_io_idle_cancel_class() to cancel a batch of queued reads
- * @return A pointer to a RSIoJob, this can be used with rs_io_idle_cancel()
+ * @return A new reference to the RSIoJob for rs_io_idle_cancel(), unref when done
  */
-const RSIoJob *
+RSIoJob *
 rs_io_idle_prefetch_file(const gchar *path, gint idle_class);
 
 /**
@@ -47,9 +57,9 @@ rs_io_idle_prefetch_file(const gchar *path, gint idle_class);
  * @param idle_class A user defined variable, this can be used with rs_io_idle_cancel_class() to cancel a batch of queued reads
  * @param callback A callback to call when the data is ready or NULL
  * @param user_data Data to pass to the callback
- * @return A pointer to a RSIoJob, this can be used with rs_io_idle_cancel()
+ * @return A new reference to the RSIoJob for rs_io_idle_cancel(), unref when done
  */
-const RSIoJob *
+RSIoJob *
 rs_io_idle_read_metadata(const gchar *path, gint idle_class, RSGotMetadataCB callback, gpointer user_data);
 
 /**
@@ -58,9 +68,9 @@ rs_io_idle_read_metadata(const gchar *path, gint idle_class, RSGotMetadataCB cal
  * @param idle_class A user defined variable, this can be used with rs_io_idle_cancel_class() to cancel a batch of queued reads
  * @param callback A callback to call when the data is ready or NULL
  * @param user_data Data to pass to the callback
- * @return A pointer to a RSIoJob, this can be used with rs_io_idle_cancel()
+ * @return A new reference to the RSIoJob for rs_io_idle_cancel(), unref when done
  */
-const RSIoJob *
+RSIoJob *
 rs_io_idle_read_checksum(const gchar *path, gint idle_class, RSGotChecksumCB callback, gpointer user_data);
 
 /**
@@ -69,34 +79,45 @@ rs_io_idle_read_checksum(const gchar *path, gint idle_class, RSGotChecksumCB cal
  * @param tag_id The id of the tag to add.
  * @param auto_tag Is the tag an automatically generated tag
  * @param idle_class A user defined variable, this can be used with rs_io_idle_cancel_class() to cancel a batch of queued reads
- * @return A pointer to a RSIoJob, this can be used with rs_io_idle_cancel()
+ * @return A new reference to the RSIoJob for rs_io_idle_cancel(), unref when done
  */
-const RSIoJob *
+RSIoJob *
 rs_io_idle_add_tag(const gchar *filename, gint tag_id, gboolean auto_tag, gint idle_class);
 
 /**
  * Restore tags of a new directory
  * @param path Absolute path to a directory to restore tags to
  * @param idle_class A user defined variable, this can be used with rs_io_idle_cancel_class() to cancel a batch of queued reads
- * @return A pointer to a RSIoJob, this can be used with rs_io_idle_cancel()
+ * @return A new reference to the RSIoJob for rs_io_idle_cancel(), unref when done
  */
-const RSIoJob *
+RSIoJob *
 rs_io_idle_restore_tags(const gchar *path, gint idle_class);
 
 /**
- * Cancel a complete class of idle requests
+ * Cancel a complete class of idle requests. Callbacks of cancelled jobs are
+ * never called, so user_data owned by the job must be freed by the caller
  * @param idle_class The class identifier
  */
 void
 rs_io_idle_cancel_class(gint idle_class);
 
 /**
- * Cancel a idle request
- * @param request_id A request_id as returned by rs_io_idle_read_complete_file()
+ * Cancel an idle request
+ * @param job A RSIoJob as returned by one of the rs_io_idle_*() functions
+ * @return TRUE if the job was cancelled, FALSE if it has already been started
  */
-void
+gboolean
 rs_io_idle_cancel(RSIoJob *job);
 
+/**
+ * Change the priority of a queued request
+ * @param job A RSIoJob as returned by one of the rs_io_idle_*() functions
+ * @param priority Lower value means higher priority
+ * @return TRUE if the job is still queued, FALSE if it has already been started
+ */
+gboolean
+rs_io_idle_set_priority(RSIoJob *job, gint priority);
+
 /**
  * Pause the worker threads
  */
@@ -109,14 +130,31 @@ rs_io_idle_pause(void);
 void
 rs_io_idle_unpause(void);
 
-#define rs_io_lock() rs_io_lock_real(__FILE__, __LINE__, __FUNCTION__)
+typedef enum {
+	RS_IO_PRIORITY_FOREGROUND = 0, /* The user is waiting for this */
+	RS_IO_PRIORITY_BACKGROUND,     /* Prefetching, metadata and checksums */
+	RS_IO_PRIORITY_MAX
+} RSIoPriority;
+
+/**
+ * Set the I/O priority of the calling thread, threads start out as RS_IO_PRIORITY_FOREGROUND
+ * @param priority The priority used by rs_io_lock() from this thread
+ */
+void
+rs_io_set_thread_priority(RSIoPriority priority);
+
+#define rs_io_lock() rs_io_lock_real(NULL, __FILE__, __LINE__, __FUNCTION__)
+#define rs_io_lock_file(path) rs_io_lock_real((path), __FILE__, __LINE__, __FUNCTION__)
 #define rs_io_unlock() rs_io_unlock_real(__FILE__, __LINE__, __FUNCTION__)
 
 /**
- * Aquire the IO lock
+ * Aquire the IO lock. The number of threads doing I/O concurrently is limited
+ * per device, and threads with a higher priority are let in first. Nested
+ * calls from the same thread reuse the slot already held.
+ * @param path The file about to be read or written, or NULL if unknown
  */
 void
-rs_io_lock_real(const gchar *source_file, gint line, const gchar *caller);
+rs_io_lock_real(const gchar *path, const gchar *source_file, gint line, const gchar *caller);
 
 /**
  * Release the IO lock
@@ -130,4 +168,17 @@ rs_io_unlock_real(const gchar *source_file, gint line, const gchar *caller);
 gint
 rs_io_get_jobs_left(void);
 
+/**
+ * Returns the number of jobs waiting in the queue, not counting running jobs
+ */
+gint
+rs_io_get_queue_depth(void);
+
+/**
+ * Get latency counters for each type of job executed so far
+ * @return A list of RSIoStats, free with g_list_free_full(list, g_free)
+ */
+GList *
+rs_io_get_stats(void);
+
 #endif /* RS_IO_H */
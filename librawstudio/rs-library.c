@@ -63,7 +63,7 @@
 #include <libxml/xmlwriter.h>
 #include <sqlite3.h>
 
-#define LIBRARY_VERSION 2
+#define LIBRARY_VERSION 3
 #define TAGS_XML_FILE "tags.xml"
 #define MAX_SEARCH_RESULTS 1000
 #include "rs-types.h"
@@ -237,6 +237,31 @@ library_check_version(sqlite3 *db)
 			library_execute_sql(db, "COMMIT;");
 			break;
 
+		case 2:
+			/* Identifiers used to be MD5 of 1 KiB, replace them with the sampled checksum */
+			library_execute_sql(db, "BEGIN TRANSACTION;");
+			sqlite3_prepare_v2(db, "select id,filename from library", -1, &stmt, NULL);
+			while (sqlite3_step(stmt) == SQLITE_ROW)
+			{
+				gchar *identifier;
+				id = (gint) sqlite3_column_int(stmt, 0);
+				identifier = rs_file_checksum((gchar *) sqlite3_column_text(stmt, 1));
+				if (identifier)
+				{
+					rc = sqlite3_prepare_v2(db, "update library set identifier = ?1 WHERE id = ?2;", -1, &stmt_update, NULL);
+					rc = sqlite3_bind_text(stmt_update, 1, identifier, -1, SQLITE_TRANSIENT);
+					rc = sqlite3_bind_int(stmt_update, 2, id);
+					rc = sqlite3_step(stmt_update);
+					library_sqlite_error(db, rc);
+					sqlite3_finalize(stmt_update);
+					g_free(identifier);
+				}
+			}
+			sqlite3_finalize(stmt);
+			library_set_version(db, version+1);
+			library_execute_sql(db, "COMMIT;");
+			break;
+
 		default:
 			/* We should never hit this */
 			g_warning("Some error occured in library_check_version() - please notify developers");
@@ -460,6 +485,56 @@ library_is_photo_tagged(RSLibrary *library, gint photo_id, gint tag_id)
 		return FALSE;
 }
 
+/**
+ * Looks for photos with the same identifier as a newly added photo, whose
+ * files no longer exist. These have been moved or renamed, so their tags
+ * are carried over to the new entry and the old entry is removed
+ * @param library A RSLibrary
+ * @param photo_id The newly added photo
+ * @param identifier The identifier of the new photo
+ */
+static void
+library_adopt_moved_photos(RSLibrary *library, gint photo_id, const gchar *identifier)
+{
+	sqlite3 *db = library->db;
+	sqlite3_stmt *stmt;
+	GSList *moved = NULL, *node;
+	gint rc;
+
+	rc = sqlite3_prepare_v2(db, "SELECT id, filename FROM library WHERE identifier = ?1 AND id != ?2;", -1, &stmt, NULL);
+	rc = sqlite3_bind_text(stmt, 1, identifier, -1, SQLITE_TRANSIENT);
+	rc = sqlite3_bind_int(stmt, 2, photo_id);
+	library_sqlite_error(db, rc);
+	while (sqlite3_step(stmt) == SQLITE_ROW)
+	{
+		const gchar *filename = (const gchar *) sqlite3_column_text(stmt, 1);
+		if (filename && !g_file_test(filename, G_FILE_TEST_EXISTS))
+		{
+			RS_DEBUG(LIBRARY, "'%s' has been moved, keeping its tags", filename);
+			moved = g_slist_prepend(moved, GINT_TO_POINTER(sqlite3_column_int(stmt, 0)));
+		}
+	}
+	sqlite3_finalize(stmt);
+
+	for (node = moved; node; node = node->next)
+	{
+		gint old_id = GPOINTER_TO_INT(node->data);
+
+		/* Tags already on the new photo stay where they are */
+		rc = sqlite3_prepare_v2(db, "UPDATE phototags SET photo = ?1 WHERE photo = ?2 AND tag NOT IN (SELECT tag FROM phototags WHERE photo = ?1);", -1, &stmt, NULL);
+		rc = sqlite3_bind_int(stmt, 1, photo_id);
+		rc = sqlite3_bind_int(stmt, 2, old_id);
+		rc = sqlite3_step(stmt);
+		if (rc != SQLITE_DONE)
+			library_sqlite_error(db, rc);
+		sqlite3_finalize(stmt);
+
+		library_photo_delete_tags(library, old_id);
+		library_delete_photo(library, old_id);
+	}
+	g_slist_free(moved);
+}
+
 static void
 got_checksum(const gchar *checksum, gpointer user_data)
 {
@@ -467,6 +542,8 @@ got_checksum(const gchar *checksum, gpointer user_data)
 	sqlite3 *db = library->db;
 	sqlite3_stmt *stmt;
 
+	library_adopt_moved_photos(library, GPOINTER_TO_INT(user_data), checksum);
+
 	sqlite3_prepare_v2(db, "UPDATE LIBRARY SET  identifier=?1 WHERE id=?2;", -1, &stmt, NULL);
 	sqlite3_bind_text(stmt, 1, checksum, -1, SQLITE_TRANSIENT);
 	sqlite3_bind_int(stmt, 2, GPOINTER_TO_INT(user_data));
@@ -492,7 +569,7 @@ library_add_photo(RSLibrary *library, const gchar *filename)
 		library_sqlite_error(db, rc);
 	sqlite3_finalize(stmt);
 
-	rs_io_idle_read_checksum(filename, -1, got_checksum, GINT_TO_POINTER(id));
+	g_object_unref(rs_io_idle_read_checksum(filename, -1, got_checksum, GINT_TO_POINTER(id)));
 
 	return id;
 }
@@ -22,14 +22,20 @@
 #include <config.h>
 #include <libxml/encoding.h>
 #include <libxml/xmlwriter.h>
+#include <stdio.h>
+#include <string.h>
 #include "gettext.h"
 
 G_DEFINE_TYPE (RSMetadata, rs_metadata, G_TYPE_OBJECT)
 
+static const gint thumbnail_sizes[RS_METADATA_THUMBNAIL_SIZES] = { RS_METADATA_THUMBNAIL_MIN, 256, RS_METADATA_THUMBNAIL_MAX };
+static gint thumbnail_size = RS_METADATA_THUMBNAIL_MIN;
+
 static void
 rs_metadata_dispose (GObject *object)
 {
 	RSMetadata *metadata = RS_METADATA(object);
+	gint i;
 
 	if (!metadata->dispose_has_run)
 	{
@@ -43,6 +49,9 @@ rs_metadata_dispose (GObject *object)
 			g_free(metadata->time_ascii);
 		if (metadata->thumbnail)
 			g_object_unref(metadata->thumbnail);
+		for(i=0;i<RS_METADATA_THUMBNAIL_SIZES;i++)
+			if (metadata->thumbnails[i])
+				g_object_unref(metadata->thumbnails[i]);
 		if (metadata->lens_identifier)
 			g_free(metadata->lens_identifier);
 
@@ -100,6 +109,8 @@ rs_metadata_init (RSMetadata *metadata)
 	for(i=0;i<4;i++)
 		metadata->cam_mul[i] = 1.0f;
 	metadata->thumbnail = NULL;
+	for(i=0;i<RS_METADATA_THUMBNAIL_SIZES;i++)
+		metadata->thumbnails[i] = NULL;
 
 	/* Lens info */
 	metadata->lens_id = -1;
@@ -117,90 +128,708 @@ rs_metadata_new (void)
 	return g_object_new (RS_TYPE_METADATA, NULL);
 }
 
-#define METACACHEVERSION 11
+/*
+ * Metadata and thumbnails for all photos in a directory are kept in a single
+ * append-only pack in the dotdir. The pack starts with a small header
+ * followed by records, each record being:
+ *
+ *   guint32 magic, guint32 length, then length bytes of:
+ *   gint64 mtime, gint64 size, guint32 flags, string name,
+ *   the numeric metadata fields, four strings, guint32 thumbnail count and
+ *   for each thumbnail guint32 size, guint32 length and the JPEG data.
+ *
+ * Strings are stored as a guint16 length followed by the bytes. A record
+ * always supersedes earlier records with the same name, deleted photos get
+ * a record with METAPACK_DELETED set. The pack is only a cache, so it is
+ * written in host byte order and simply discarded if the header mismatches.
+ */
+#define METAPACK_MAGIC "RSMP"
+#define METAPACK_VERSION 2
+#define METAPACK_BYTE_ORDER 0x01020304
+#define METAPACK_HEADER_SIZE 16
+#define METAPACK_RECORD_MAGIC 0x524d5352
+#define METAPACK_DELETED (1<<0)
+#define METAPACK_ALL_SIZES (1<<1) /* Thumbnails were generated in all sizes */
+#define METAPACK_NULL_STRING G_MAXUINT16
+#define METAPACK_KEEP 4 /* Number of directory packs kept open */
+#define METAPACK_COMPACT_MIN (1024*1024)
+
+typedef struct {
+	gsize offset; /* Offset of record body */
+	guint32 length;
+	gint64 mtime;
+	gint64 size;
+} MetaPackEntry;
+
+typedef struct {
+	gchar *path;
+	GMappedFile *map;
+	GHashTable *index; /* basename -> MetaPackEntry */
+	gsize live;
+	gsize dead;
+} MetaPack;
+
+typedef struct {
+	const guchar *pos;
+	const guchar *end;
+} MetaPackReader;
+
+static GMutex metapack_lock;
+static GHashTable *metapacks = NULL; /* pack path -> MetaPack */
+
+static gboolean
+metapack_read(MetaPackReader *reader, gpointer dest, gsize n)
+{
+	if (reader->pos + n > reader->end)
+		return FALSE;
+
+	memcpy(dest, reader->pos, n);
+	reader->pos += n;
+
+	return TRUE;
+}
+
+static gboolean
+metapack_read_string(MetaPackReader *reader, gchar **str)
+{
+	guint16 len;
+
+	if (!metapack_read(reader, &len, sizeof(len)))
+		return FALSE;
+
+	if (len == METAPACK_NULL_STRING)
+		*str = NULL;
+	else if (reader->pos + len > reader->end)
+		return FALSE;
+	else
+	{
+		*str = g_strndup((const gchar *) reader->pos, len);
+		reader->pos += len;
+	}
+
+	return TRUE;
+}
+
+static void
+metapack_write_string(GByteArray *record, const gchar *str)
+{
+	guint16 len = METAPACK_NULL_STRING;
+
+	if (str)
+		len = MIN(strlen(str), METAPACK_NULL_STRING-1);
+
+	g_byte_array_append(record, (guint8 *) &len, sizeof(len));
+	if (str)
+		g_byte_array_append(record, (const guint8 *) str, len);
+}
+
+static void
+metapack_write_int(GByteArray *record, gint32 value)
+{
+	g_byte_array_append(record, (guint8 *) &value, sizeof(value));
+}
+
+static void
+metapack_write_double(GByteArray *record, gdouble value)
+{
+	g_byte_array_append(record, (guint8 *) &value, sizeof(value));
+}
+
+static void
+metapack_write_thumbnail(GByteArray *record, GdkPixbuf *pixbuf, guint32 size)
+{
+	gchar *jpeg = NULL;
+	gsize jpeg_length = 0;
+	guint32 length;
+
+	gdk_pixbuf_save_to_buffer(pixbuf, &jpeg, &jpeg_length, "jpeg", NULL, "quality", "90", NULL);
+
+	length = jpeg_length;
+	g_byte_array_append(record, (guint8 *) &size, sizeof(size));
+	g_byte_array_append(record, (guint8 *) &length, sizeof(length));
+	if (jpeg)
+		g_byte_array_append(record, (guint8 *) jpeg, jpeg_length);
+	g_free(jpeg);
+}
+
+static void
+metapack_free(MetaPack *pack)
+{
+	if (pack->map)
+		g_mapped_file_unref(pack->map);
+	g_hash_table_destroy(pack->index);
+	g_free(pack->path);
+	g_free(pack);
+}
+
+/**
+ * Builds the index of a pack by walking all records sequentially
+ * @param pack A MetaPack
+ * @return TRUE if the whole pack was valid, FALSE if it has a broken tail or header
+ */
+static gboolean
+metapack_scan(MetaPack *pack)
+{
+	MetaPackReader reader;
+	MetaPackEntry *entry, *old;
+	const guchar *data;
+	gsize length;
+	guint32 header[3];
+
+	g_hash_table_remove_all(pack->index);
+	pack->live = 0;
+	pack->dead = 0;
+
+	if (pack->map)
+		g_mapped_file_unref(pack->map);
+	pack->map = g_mapped_file_new(pack->path, FALSE, NULL);
+	if (!pack->map)
+		return TRUE;
+
+	data = (const guchar *) g_mapped_file_get_contents(pack->map);
+	length = g_mapped_file_get_length(pack->map);
+
+	if (length < METAPACK_HEADER_SIZE || memcmp(data, METAPACK_MAGIC, 4) != 0)
+		return FALSE;
+	memcpy(header, data+4, sizeof(header));
+	if (header[0] != METAPACK_VERSION || header[1] != METAPACK_BYTE_ORDER)
+		return FALSE;
+
+	reader.pos = data + METAPACK_HEADER_SIZE;
+	reader.end = data + length;
+	while (reader.pos < reader.end)
+	{
+		guint32 record[2];
+		guint32 flags;
+		gchar *name;
+		MetaPackReader body;
+
+		if (!metapack_read(&reader, record, sizeof(record)))
+			return FALSE;
+		if (record[0] != METAPACK_RECORD_MAGIC || reader.pos + record[1] > reader.end)
+			return FALSE;
+
+		body.pos = reader.pos;
+		body.end = reader.pos + record[1];
+		entry = g_new(MetaPackEntry, 1);
+		entry->offset = reader.pos - data;
+		entry->length = record[1];
+		if (!metapack_read(&body, &entry->mtime, sizeof(entry->mtime))
+			|| !metapack_read(&body, &entry->size, sizeof(entry->size))
+			|| !metapack_read(&body, &flags, sizeof(flags))
+			|| !metapack_read_string(&body, &name)
+			|| !name)
+		{
+			g_free(entry);
+			return FALSE;
+		}
+		reader.pos = body.end;
+
+		if ((old = g_hash_table_lookup(pack->index, name)))
+		{
+			pack->live -= old->length;
+			pack->dead += old->length;
+		}
+
+		if (flags & METAPACK_DELETED)
+		{
+			g_hash_table_remove(pack->index, name);
+			pack->dead += entry->length;
+			g_free(entry);
+			g_free(name);
+		}
+		else
+		{
+			g_hash_table_replace(pack->index, name, entry);
+			pack->live += entry->length;
+		}
+	}
+
+	return TRUE;
+}
+
+/**
+ * Rewrites a pack keeping only current records
+ * @param pack A scanned MetaPack
+ */
+static void
+metapack_compact(MetaPack *pack)
+{
+	GHashTableIter iter;
+	MetaPackEntry *entry;
+	const gchar *data = NULL;
+	gchar *temp_path;
+	guint32 header[3] = { METAPACK_VERSION, METAPACK_BYTE_ORDER, 0 };
+	gboolean ok;
+	FILE *fp;
+
+	RS_DEBUG(PERFORMANCE, "Compacting %s, %"G_GSIZE_FORMAT" of %"G_GSIZE_FORMAT" bytes used", pack->path, pack->live, pack->live + pack->dead);
+
+	temp_path = g_strdup_printf("%s.tmp", pack->path);
+	fp = g_fopen(temp_path, "wb");
+	if (!fp)
+	{
+		g_free(temp_path);
+		return;
+	}
+
+	ok = (fwrite(METAPACK_MAGIC, 4, 1, fp) == 1) && (fwrite(header, sizeof(header), 1, fp) == 1);
+
+	if (pack->map)
+		data = g_mapped_file_get_contents(pack->map);
+	g_hash_table_iter_init(&iter, pack->index);
+	while (ok && data && g_hash_table_iter_next(&iter, NULL, (gpointer) &entry))
+		ok = (fwrite(data + entry->offset - 2*sizeof(guint32), entry->length + 2*sizeof(guint32), 1, fp) == 1);
+
+	if (fclose(fp) == 0 && ok && g_rename(temp_path, pack->path) == 0)
+		metapack_scan(pack);
+	else
+		g_unlink(temp_path);
+
+	g_free(temp_path);
+}
+
+/**
+ * Get the directory holding the pack for a photo. Unlike rs_dotdir_get() a
+ * read-only directory falls back to a cache directory named from the path
+ * of the directory, so all its photos share one pack
+ * @param filename The full path to the photo
+ * @return The directory, free with g_free(), or NULL if none is available
+ */
+static gchar *
+metapack_dir(const gchar *filename)
+{
+	gchar *directory;
+	gchar *dir;
+	gchar *md5;
+
+	directory = g_path_get_dirname(filename);
+	dir = rs_dotdir_get(directory);
+	if (!dir)
+	{
+		md5 = g_compute_checksum_for_string(G_CHECKSUM_MD5, directory, -1);
+		dir = g_strdup_printf("%s/read-only-cache/%s", rs_confdir_get(), md5);
+		g_free(md5);
+		if (!g_file_test(dir, G_FILE_TEST_IS_DIR) && g_mkdir_with_parents(dir, 0700) != 0)
+		{
+			g_free(dir);
+			dir = NULL;
+		}
+	}
+	g_free(directory);
+
+	return dir;
+}
+
+/**
+ * Get the pack holding the cache for a photo, the pack is opened and indexed if needed
+ * @note metapack_lock must be held
+ * @param filename The full path to the photo
+ * @return The MetaPack or NULL if no dotdir is available
+ */
+static MetaPack *
+metapack_get(const gchar *filename)
+{
+	MetaPack *pack;
+	gchar *dotdir;
+	gchar *path;
+	GTimer *gt;
+
+	dotdir = metapack_dir(filename);
+	if (!dotdir)
+		return NULL;
+
+	path = g_build_filename(dotdir, DOTDIR_METAPACK, NULL);
+	g_free(dotdir);
+
+	if (!metapacks)
+		metapacks = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, (GDestroyNotify) metapack_free);
+
+	pack = g_hash_table_lookup(metapacks, path);
+	if (pack)
+	{
+		g_free(path);
+		return pack;
+	}
+
+	/* Packs are cheap to reopen, keep only the ones most likely in use */
+	if (g_hash_table_size(metapacks) >= METAPACK_KEEP)
+		g_hash_table_remove_all(metapacks);
+
+	pack = g_new0(MetaPack, 1);
+	pack->path = path;
+	pack->index = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+
+	gt = g_timer_new();
+	if (!metapack_scan(pack))
+	{
+		/* Broken tail or foreign header, keep what we could read */
+		RS_DEBUG(PERFORMANCE, "%s is damaged, rewriting", pack->path);
+		metapack_compact(pack);
+	}
+	else if (pack->dead > pack->live && pack->live + pack->dead > METAPACK_COMPACT_MIN)
+		metapack_compact(pack);
+	RS_DEBUG(PERFORMANCE, "Indexed %u photos in %s in %.03fs", g_hash_table_size(pack->index), pack->path, g_timer_elapsed(gt, NULL));
+	g_timer_destroy(gt);
+
+	g_hash_table_insert(metapacks, pack->path, pack);
+
+	return pack;
+}
+
+/**
+ * Appends a record to the pack holding the cache for a photo
+ * @note metapack_lock must be held
+ * @param pack A MetaPack
+ * @param name The basename of the photo
+ * @param record The serialized record including magic and length
+ * @param mtime Modification time of the photo
+ * @param size Size of the photo
+ * @param deleted TRUE if the record marks the photo as deleted
+ */
+static void
+metapack_append(MetaPack *pack, const gchar *name, GByteArray *record, gint64 mtime, gint64 size, gboolean deleted)
+{
+	MetaPackEntry *entry, *old;
+	guint32 header[3] = { METAPACK_VERSION, METAPACK_BYTE_ORDER, 0 };
+	gboolean ok = TRUE;
+	glong offset;
+	FILE *fp;
+
+	fp = g_fopen(pack->path, "ab");
+	if (!fp)
+		return;
+
+	fseek(fp, 0, SEEK_END);
+	offset = ftell(fp);
+	if (offset == 0)
+	{
+		ok = (fwrite(METAPACK_MAGIC, 4, 1, fp) == 1) && (fwrite(header, sizeof(header), 1, fp) == 1);
+		offset = METAPACK_HEADER_SIZE;
+	}
+	if (ok)
+		ok = (fwrite(record->data, record->len, 1, fp) == 1);
+	if (fclose(fp) != 0 || !ok || offset < 0)
+		return;
+
+	if ((old = g_hash_table_lookup(pack->index, name)))
+	{
+		pack->live -= old->length;
+		pack->dead += old->length;
+	}
+
+	if (deleted)
+	{
+		g_hash_table_remove(pack->index, name);
+		pack->dead += record->len - 2*sizeof(guint32);
+		return;
+	}
+
+	entry = g_new(MetaPackEntry, 1);
+	entry->offset = offset + 2*sizeof(guint32);
+	entry->length = record->len - 2*sizeof(guint32);
+	entry->mtime = mtime;
+	entry->size = size;
+	g_hash_table_replace(pack->index, g_strdup(name), entry);
+	pack->live += entry->length;
+}
+
+/**
+ * Starts a new pack record
+ * @param name The basename of the photo
+ * @param st Stat of the photo or NULL
+ * @param flags Record flags
+ * @return A new GByteArray, the length is filled in by metapack_record_finish()
+ */
+static GByteArray *
+metapack_record_new(const gchar *name, GStatBuf *st, guint32 flags)
+{
+	GByteArray *record = g_byte_array_new();
+	guint32 head[2] = { METAPACK_RECORD_MAGIC, 0 };
+	gint64 mtime = st ? st->st_mtime : 0;
+	gint64 size = st ? st->st_size : 0;
+
+	g_byte_array_append(record, (guint8 *) head, sizeof(head));
+	g_byte_array_append(record, (guint8 *) &mtime, sizeof(mtime));
+	g_byte_array_append(record, (guint8 *) &size, sizeof(size));
+	g_byte_array_append(record, (guint8 *) &flags, sizeof(flags));
+	metapack_write_string(record, name);
+
+	return record;
+}
+
+static void
+metapack_record_finish(GByteArray *record)
+{
+	guint32 length = record->len - 2*sizeof(guint32);
+
+	memcpy(record->data + sizeof(guint32), &length, sizeof(length));
+}
+
 void
 rs_metadata_cache_save(RSMetadata *metadata, const gchar *filename)
 {
 	if (!filename)
 	  return;
 
-	gchar *cache_filename;
+	GByteArray *record;
+	GStatBuf st;
+	MetaPack *pack;
+	gchar *basename;
 	gchar *thumb_filename;
-	xmlTextWriterPtr writer;
-	static GMutex lock;
+	guint32 count = 0;
+	gint i;
 
 	g_return_if_fail(RS_IS_METADATA(metadata));
 
-	g_mutex_lock(&lock);
+	if (g_stat(filename, &st) != 0)
+		return;
 
-	cache_filename = rs_metadata_dotdir_helper(filename, DOTDIR_METACACHE);
+	basename = g_path_get_basename(filename);
+	record = metapack_record_new(basename, &st, metadata->thumbnails[0] ? METAPACK_ALL_SIZES : 0);
+	metapack_write_int(record, metadata->make);
+	metapack_write_int(record, metadata->timestamp);
+	metapack_write_int(record, metadata->orientation);
+	metapack_write_int(record, metadata->iso);
+	metapack_write_int(record, metadata->focallength);
+	metapack_write_int(record, metadata->lens_id);
+	metapack_write_double(record, metadata->aperture);
+	metapack_write_double(record, metadata->exposurebias);
+	metapack_write_double(record, metadata->shutterspeed);
+	for(i=0;i<4;i++)
+		metapack_write_double(record, metadata->cam_mul[i]);
+	metapack_write_double(record, metadata->contrast);
+	metapack_write_double(record, metadata->saturation);
+	metapack_write_double(record, metadata->color_tone);
+	metapack_write_double(record, metadata->lens_min_focal);
+	metapack_write_double(record, metadata->lens_max_focal);
+	metapack_write_double(record, metadata->lens_min_aperture);
+	metapack_write_double(record, metadata->lens_max_aperture);
+	metapack_write_string(record, metadata->make_ascii);
+	metapack_write_string(record, metadata->model_ascii);
+	metapack_write_string(record, metadata->time_ascii);
+	metapack_write_string(record, metadata->fixed_lens_identifier);
+
+	/* Sizes sharing a pixbuf are only stored once, the source was small */
+	for(i=0;i<RS_METADATA_THUMBNAIL_SIZES;i++)
+		if (metadata->thumbnails[i] && (i == 0 || metadata->thumbnails[i] != metadata->thumbnails[i-1]))
+			count++;
+	if (count == 0 && metadata->thumbnail)
+		count = 1;
+	g_byte_array_append(record, (guint8 *) &count, sizeof(count));
+	if (metadata->thumbnails[0])
+	{
+		for(i=0;i<RS_METADATA_THUMBNAIL_SIZES;i++)
+			if (i == 0 || metadata->thumbnails[i] != metadata->thumbnails[i-1])
+				metapack_write_thumbnail(record, metadata->thumbnails[i], thumbnail_sizes[i]);
+	}
+	else if (metadata->thumbnail)
+		metapack_write_thumbnail(record, metadata->thumbnail,
+			MAX(gdk_pixbuf_get_width(metadata->thumbnail), gdk_pixbuf_get_height(metadata->thumbnail)));
+	metapack_record_finish(record);
+
+	/* All sizes are in the pack now, only keep the one in use. A different
+	   size is loaded from the pack when the thumbnail size changes */
+	for(i=0;i<RS_METADATA_THUMBNAIL_SIZES;i++)
+		if (metadata->thumbnails[i])
+		{
+			g_object_unref(metadata->thumbnails[i]);
+			metadata->thumbnails[i] = NULL;
+		}
+
+	g_mutex_lock(&metapack_lock);
+	pack = metapack_get(filename);
+	if (pack)
+		metapack_append(pack, basename, record, st.st_mtime, st.st_size, FALSE);
+	g_mutex_unlock(&metapack_lock);
+
+	g_byte_array_free(record, TRUE);
+	g_free(basename);
 
-	writer = xmlNewTextWriterFilename(cache_filename, 0);
-	if (writer)
+	/* An exported thumbnail would be stale now */
+	thumb_filename = rs_metadata_dotdir_helper(filename, DOTDIR_THUMB);
+	g_unlink(thumb_filename);
+	g_free(thumb_filename);
+}
+
+/**
+ * Loads metadata and thumbnail for a photo from the directory pack
+ * @param metadata A RSMetadata to fill
+ * @param filename The full path to the photo
+ * @return TRUE if a current record was found, FALSE otherwise
+ */
+static gboolean
+rs_metadata_cache_load_pack(RSMetadata *metadata, const gchar *filename)
+{
+	MetaPackReader reader;
+	MetaPackEntry *entry;
+	MetaPack *pack;
+	GMappedFile *map = NULL;
+	GdkPixbufLoader *loader;
+	GStatBuf st;
+	gchar *basename;
+	gchar *name = NULL;
+	gchar *make_ascii = NULL, *model_ascii = NULL, *time_ascii = NULL, *fixed_lens_identifier = NULL;
+	guint32 head[2];
+	const guchar *data;
+	gsize offset = 0;
+	guint32 length = 0;
+	guint32 flags;
+	gint64 skip;
+	gint32 value[6];
+	gdouble values[14];
+	guint32 count = 0, size, i;
+	guint32 best_size = 0, best_length = 0;
+	const guchar *best = NULL;
+	const guint32 wanted = rs_metadata_get_thumbnail_size();
+	gboolean ret;
+
+	if (g_stat(filename, &st) != 0)
+		return FALSE;
+
+	basename = g_path_get_basename(filename);
+
+	g_mutex_lock(&metapack_lock);
+	pack = metapack_get(filename);
+	entry = pack ? g_hash_table_lookup(pack->index, basename) : NULL;
+	if (entry && entry->mtime == (gint64) st.st_mtime && entry->size == (gint64) st.st_size)
 	{
-		xmlTextWriterSetIndent(writer, 1);
+		/* Records appended since the pack was mapped need a fresh mapping */
+		if (!pack->map || entry->offset + entry->length > g_mapped_file_get_length(pack->map))
+		{
+			if (pack->map)
+				g_mapped_file_unref(pack->map);
+			pack->map = g_mapped_file_new(pack->path, FALSE, NULL);
+		}
+		if (pack->map && entry->offset + entry->length <= g_mapped_file_get_length(pack->map))
+		{
+			map = g_mapped_file_ref(pack->map);
+			offset = entry->offset;
+			length = entry->length;
+		}
+	}
+	g_mutex_unlock(&metapack_lock);
 
-		xmlTextWriterStartDocument(writer, NULL, "ISO-8859-1", NULL);
-		xmlTextWriterStartElement(writer, BAD_CAST "rawstudio-metadata");
-		xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "version", "%d", METACACHEVERSION);
-		if (metadata->make != MAKE_UNKNOWN)
-			xmlTextWriterWriteFormatElement(writer, BAD_CAST "make", "%d", metadata->make);
-		if (metadata->make_ascii)
-			xmlTextWriterWriteFormatElement(writer, BAD_CAST "make_ascii","%s", metadata->make_ascii);
-		if (metadata->model_ascii)
-			xmlTextWriterWriteFormatElement(writer, BAD_CAST "model_ascii", "%s", metadata->model_ascii);
-		if (metadata->time_ascii)
-			xmlTextWriterWriteFormatElement(writer, BAD_CAST "time_ascii", "%s", metadata->time_ascii);
-		if (metadata->timestamp > -1)
-			xmlTextWriterWriteFormatElement(writer, BAD_CAST "timestamp", "%d", metadata->timestamp);
-		/* Can we make orientation conditional? */
-		xmlTextWriterWriteFormatElement(writer, BAD_CAST "orientation", "%u", metadata->orientation);
-		if (metadata->aperture > -1.0)
-			xmlTextWriterWriteFormatElement(writer, BAD_CAST "aperture", "%f", metadata->aperture);
-		if (metadata->exposurebias != -999.0)
-			xmlTextWriterWriteFormatElement(writer, BAD_CAST "exposurebias", "%f", metadata->exposurebias);
-		if (metadata->iso > 0)
-			xmlTextWriterWriteFormatElement(writer, BAD_CAST "iso", "%u", metadata->iso);
-		if (metadata->shutterspeed > -1.0)
-			xmlTextWriterWriteFormatElement(writer, BAD_CAST "shutterspeed", "%f", metadata->shutterspeed);
-		if (metadata->cam_mul[0] > 0.0)
-			xmlTextWriterWriteFormatElement(writer, BAD_CAST "cam_mul", "%f %f %f %f", metadata->cam_mul[0], metadata->cam_mul[1], metadata->cam_mul[2], metadata->cam_mul[3]);
-		if (metadata->contrast > -1.0)
-			xmlTextWriterWriteFormatElement(writer, BAD_CAST "contrast", "%f", metadata->contrast);
-		if (metadata->saturation > -1.0)
-			xmlTextWriterWriteFormatElement(writer, BAD_CAST "saturation", "%f", metadata->saturation);
-		if (metadata->color_tone > -1.0)
-			xmlTextWriterWriteFormatElement(writer, BAD_CAST "color_tone", "%f", metadata->color_tone);
-		if (metadata->focallength > 0)
-			xmlTextWriterWriteFormatElement(writer, BAD_CAST "focallength", "%d", metadata->focallength);
-		if (metadata->lens_id > -1.0)
-			xmlTextWriterWriteFormatElement(writer, BAD_CAST "lens_id", "%d", metadata->lens_id);
-		if (metadata->lens_min_focal > -1)
-			xmlTextWriterWriteFormatElement(writer, BAD_CAST "lens_min_focal", "%f", metadata->lens_min_focal);
-		if (metadata->lens_max_focal > -1.0)
-			xmlTextWriterWriteFormatElement(writer, BAD_CAST "lens_max_focal", "%f", metadata->lens_max_focal);
-		if (metadata->lens_min_aperture > -1.0)
-			xmlTextWriterWriteFormatElement(writer, BAD_CAST "lens_min_aperture", "%f", metadata->lens_min_aperture);
-		if (metadata->lens_max_aperture > -1.0)
-			xmlTextWriterWriteFormatElement(writer, BAD_CAST "lens_max_aperture", "%f", metadata->lens_max_aperture);
-		if (metadata->fixed_lens_identifier)
-			xmlTextWriterWriteFormatElement(writer, BAD_CAST "fixed_lens_identifier", "%s", metadata->fixed_lens_identifier);
-		xmlTextWriterEndDocument(writer);
-		xmlFreeTextWriter(writer);
+	if (!map)
+	{
+		g_free(basename);
+		return FALSE;
 	}
-	g_free(cache_filename);
-	g_mutex_unlock(&lock);
 
-	if (metadata->thumbnail)
+	data = (const guchar *) g_mapped_file_get_contents(map);
+
+	/* Another process may have appended to or compacted the pack since we
+	   indexed it, so make sure a record for this photo is still there */
+	ret = (offset >= METAPACK_HEADER_SIZE + sizeof(head));
+	if (ret)
 	{
-		thumb_filename = rs_metadata_dotdir_helper(filename, DOTDIR_THUMB);
-		gdk_pixbuf_save(metadata->thumbnail, thumb_filename, "jpeg", NULL, "quality", "90", NULL);
-		g_free(thumb_filename);
+		memcpy(head, data + offset - sizeof(head), sizeof(head));
+		ret = (head[0] == METAPACK_RECORD_MAGIC && head[1] == length);
+	}
+
+	reader.pos = data + offset;
+	reader.end = data + offset + length;
+
+	ret = ret
+		&& metapack_read(&reader, &skip, sizeof(skip))
+		&& metapack_read(&reader, &skip, sizeof(skip))
+		&& metapack_read(&reader, &flags, sizeof(flags))
+		&& metapack_read_string(&reader, &name)
+		&& name && g_str_equal(name, basename)
+		&& metapack_read(&reader, value, sizeof(value))
+		&& metapack_read(&reader, values, sizeof(values))
+		&& metapack_read_string(&reader, &make_ascii)
+		&& metapack_read_string(&reader, &model_ascii)
+		&& metapack_read_string(&reader, &time_ascii)
+		&& metapack_read_string(&reader, &fixed_lens_identifier)
+		&& metapack_read(&reader, &count, sizeof(count));
+	g_free(name);
+	g_free(basename);
+
+	/* Pick the smallest thumbnail covering the wanted size, or the largest we have */
+	for(i=0;ret && i<count;i++)
+	{
+		ret = metapack_read(&reader, &size, sizeof(size))
+			&& metapack_read(&reader, &length, sizeof(length))
+			&& reader.pos + length <= reader.end;
+		if (ret && length > 0 && (!best || (best_size < wanted && size > best_size) || (size >= wanted && size < best_size)))
+		{
+			best = reader.pos;
+			best_size = size;
+			best_length = length;
+		}
+		reader.pos += length;
+	}
+
+	/* A record without thumbnails is a hit, the photo simply has none. Only
+	   thumbnails of old caches are worth regenerating in a larger size */
+	if (count > 0 && (!best || (best_size < wanted && !(flags & METAPACK_ALL_SIZES))))
+		ret = FALSE;
+
+	if (ret)
+	{
+		metadata->make = value[0];
+		metadata->timestamp = value[1];
+		metadata->orientation = value[2];
+		metadata->iso = value[3];
+		metadata->focallength = value[4];
+		metadata->lens_id = value[5];
+		metadata->aperture = values[0];
+		metadata->exposurebias = values[1];
+		metadata->shutterspeed = values[2];
+		metadata->cam_mul[0] = values[3];
+		metadata->cam_mul[1] = values[4];
+		metadata->cam_mul[2] = values[5];
+		metadata->cam_mul[3] = values[6];
+		metadata->contrast = values[7];
+		metadata->saturation = values[8];
+		metadata->color_tone = values[9];
+		metadata->lens_min_focal = values[10];
+		metadata->lens_max_focal = values[11];
+		metadata->lens_min_aperture = values[12];
+		metadata->lens_max_aperture = values[13];
+
+		loader = best ? gdk_pixbuf_loader_new_with_type("jpeg", NULL) : NULL;
+		if (loader)
+		{
+			if (gdk_pixbuf_loader_write(loader, best, best_length, NULL) && gdk_pixbuf_loader_close(loader, NULL))
+			{
+				metadata->thumbnail = gdk_pixbuf_loader_get_pixbuf(loader);
+				if (metadata->thumbnail)
+					g_object_ref(metadata->thumbnail);
+			}
+			else
+				gdk_pixbuf_loader_close(loader, NULL);
+			g_object_unref(loader);
+		}
+		if (best && !metadata->thumbnail)
+			ret = FALSE;
 	}
+
+	/* Strings are only handed over on success, the caller falls back to the photo otherwise */
+	if (ret)
+	{
+		metadata->make_ascii = make_ascii;
+		metadata->model_ascii = model_ascii;
+		metadata->time_ascii = time_ascii;
+		metadata->fixed_lens_identifier = fixed_lens_identifier;
+	}
+	else
+	{
+		g_free(make_ascii);
+		g_free(model_ascii);
+		g_free(time_ascii);
+		g_free(fixed_lens_identifier);
+	}
+
+	g_mapped_file_unref(map);
+
+	return ret;
 }
 
+#define METACACHEVERSION 11
 static gboolean
-rs_metadata_cache_load(RSMetadata *metadata, const gchar *filename)
+rs_metadata_cache_load_xml(RSMetadata *metadata, const gchar *filename)
 {
 	if (!filename)
 	  return FALSE;
@@ -413,6 +1042,32 @@ rs_metadata_cache_load(RSMetadata *metadata, const gchar *filename)
 }
 #undef METACACHEVERSION
 
+static gboolean
+rs_metadata_cache_load(RSMetadata *metadata, const gchar *filename)
+{
+	if (!filename)
+	  return FALSE;
+
+	gchar *cache_filename;
+
+	g_return_val_if_fail(RS_IS_METADATA(metadata), FALSE);
+
+	if (rs_metadata_cache_load_pack(metadata, filename))
+		return TRUE;
+
+	/* Move caches from earlier versions into the pack */
+	if (rs_metadata_cache_load_xml(metadata, filename))
+	{
+		rs_metadata_cache_save(metadata, filename);
+		cache_filename = rs_metadata_dotdir_helper(filename, DOTDIR_METACACHE);
+		g_unlink(cache_filename);
+		g_free(cache_filename);
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
 
 static void generate_lens_identifier(RSMetadata *meta)
 {
@@ -570,6 +1225,76 @@ rs_metadata_get_thumbnail(RSMetadata *metadata)
 	return metadata->thumbnail;
 }
 
+static GdkPixbuf *
+thumbnail_scale(GdkPixbuf *pixbuf, gint size)
+{
+	gint width = gdk_pixbuf_get_width(pixbuf);
+	gint height = gdk_pixbuf_get_height(pixbuf);
+
+	if (width <= size && height <= size)
+		return g_object_ref(pixbuf);
+
+	rs_constrain_to_bounding_box(size, size, &width, &height);
+
+	return gdk_pixbuf_scale_simple(pixbuf, MAX(width, 1), MAX(height, 1), GDK_INTERP_BILINEAR);
+}
+
+static gint
+thumbnail_index(gint size)
+{
+	gint i;
+
+	for(i=0;i<RS_METADATA_THUMBNAIL_SIZES-1;i++)
+		if (thumbnail_sizes[i] >= size)
+			break;
+
+	return i;
+}
+
+void
+rs_metadata_set_thumbnail(RSMetadata *metadata, GdkPixbuf *pixbuf)
+{
+	GdkPixbuf *source = pixbuf;
+	gint i;
+
+	g_return_if_fail(RS_IS_METADATA(metadata));
+	g_return_if_fail(GDK_IS_PIXBUF(pixbuf));
+
+	/* Each size is scaled from the next larger one, the source is only filtered once */
+	for(i=RS_METADATA_THUMBNAIL_SIZES-1;i>=0;i--)
+	{
+		GdkPixbuf *thumbnail = thumbnail_scale(source, thumbnail_sizes[i]);
+
+		/* Never keep the pixels of the caller, they may be mapped from a file */
+		if (thumbnail == pixbuf)
+		{
+			g_object_unref(thumbnail);
+			thumbnail = gdk_pixbuf_copy(pixbuf);
+		}
+
+		if (metadata->thumbnails[i])
+			g_object_unref(metadata->thumbnails[i]);
+		metadata->thumbnails[i] = thumbnail;
+		source = thumbnail;
+	}
+
+	if (metadata->thumbnail)
+		g_object_unref(metadata->thumbnail);
+	metadata->thumbnail = g_object_ref(metadata->thumbnails[thumbnail_index(rs_metadata_get_thumbnail_size())]);
+}
+
+void
+rs_metadata_set_thumbnail_size(gint size)
+{
+	g_atomic_int_set(&thumbnail_size, CLAMP(size, 16, RS_METADATA_THUMBNAIL_MAX));
+}
+
+gint
+rs_metadata_get_thumbnail_size(void)
+{
+	return g_atomic_int_get(&thumbnail_size);
+}
+
 /**
  * Deletes the on-disk cache (if any) for a photo
  * @param filename The full path to the photo - not the cache itself
@@ -581,8 +1306,25 @@ rs_metadata_delete_cache(const gchar *filename)
 
 	gchar *cache_filename;
 	gchar *thumb_filename;
+	gchar *basename;
+	GByteArray *record;
+	MetaPack *pack;
+
+	/* Mark the photo as deleted in the pack */
+	basename = g_path_get_basename(filename);
+	g_mutex_lock(&metapack_lock);
+	pack = metapack_get(filename);
+	if (pack && g_hash_table_lookup(pack->index, basename))
+	{
+		record = metapack_record_new(basename, NULL, METAPACK_DELETED);
+		metapack_record_finish(record);
+		metapack_append(pack, basename, record, 0, 0, TRUE);
+		g_byte_array_free(record, TRUE);
+	}
+	g_mutex_unlock(&metapack_lock);
+	g_free(basename);
 
-	/* Delete the metadata cache itself */
+	/* Delete the metadata cache of earlier versions */
 	cache_filename = rs_metadata_dotdir_helper(filename, DOTDIR_METACACHE);
 	g_unlink(cache_filename);
 	g_free(cache_filename);
@@ -593,6 +1335,32 @@ rs_metadata_delete_cache(const gchar *filename)
 	g_free(thumb_filename);
 }
 
+/**
+ * Get the filename of a JPEG thumbnail for a photo. Thumbnails live in the
+ * metadata pack, the file is written on demand
+ * @param filename The full path to the photo
+ * @return The filename of the thumbnail, free with g_free()
+ */
+gchar *
+rs_metadata_get_thumbnail_filename(const gchar *filename)
+{
+	RSMetadata *metadata;
+	gchar *thumb_filename;
+
+	g_return_val_if_fail(filename != NULL, NULL);
+
+	thumb_filename = rs_metadata_dotdir_helper(filename, DOTDIR_THUMB);
+	if (!g_file_test(thumb_filename, G_FILE_TEST_IS_REGULAR))
+	{
+		metadata = rs_metadata_new();
+		if (rs_metadata_load(metadata, filename) && metadata->thumbnail)
+			gdk_pixbuf_save(metadata->thumbnail, thumb_filename, "jpeg", NULL, "quality", "90", NULL);
+		g_object_unref(metadata);
+	}
+
+	return thumb_filename;
+}
+
 gchar *
 rs_metadata_dotdir_helper(const gchar *filename, const gchar *extension)
 {
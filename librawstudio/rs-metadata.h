@@ -25,9 +25,15 @@
 G_BEGIN_DECLS
 
 #define DOTDIR_METACACHE "metacache.xml"
+#define DOTDIR_METAPACK "metacache.pack"
 #define DOTDIR_THUMB "thumb.jpg"
 #define DOTDIR_THUMB_PNG "thumb.png"
 
+/* Thumbnails are kept in these bounding box sizes */
+#define RS_METADATA_THUMBNAIL_SIZES 3
+#define RS_METADATA_THUMBNAIL_MIN 128
+#define RS_METADATA_THUMBNAIL_MAX 512
+
 #define RS_TYPE_METADATA rs_metadata_get_type()
 #define RS_METADATA(obj) (G_TYPE_CHECK_INSTANCE_CAST ((obj), RS_TYPE_METADATA, RSMetadata))
 #define RS_METADATA_CLASS(klass) (G_TYPE_CHECK_CLASS_CAST ((klass), RS_TYPE_METADATA, RSMetadataClass))
@@ -94,6 +100,10 @@ struct _RSMetadata {
 	gdouble lens_max_aperture;
 	gchar *fixed_lens_identifier;
 	gchar *lens_identifier;
+
+	/* All thumbnail sizes, smallest first, until saved by rs_metadata_cache_save().
+	   thumbnail refers to one of these */
+	GdkPixbuf *thumbnails[RS_METADATA_THUMBNAIL_SIZES];
 };
 
 typedef struct {
@@ -109,10 +119,31 @@ extern void rs_metadata_normalize_wb(RSMetadata *metadata);
 extern gchar *rs_metadata_get_short_description(RSMetadata *metadata);
 extern GdkPixbuf *rs_metadata_get_thumbnail(RSMetadata *metadata);
 
+/**
+ * Generate all thumbnail sizes from an image, the image is not scaled up
+ * @param metadata A RSMetadata
+ * @param pixbuf The source image, preferably at least RS_METADATA_THUMBNAIL_MAX pixels. It is
+ *               never referenced by metadata, the caller keeps ownership
+ */
+extern void rs_metadata_set_thumbnail(RSMetadata *metadata, GdkPixbuf *pixbuf);
+
+/**
+ * Set the thumbnail size used for RSMetadata->thumbnail from now on
+ * @param size The wanted bounding box size in pixels
+ */
+extern void rs_metadata_set_thumbnail_size(gint size);
+
+/**
+ * Get the thumbnail size used for RSMetadata->thumbnail
+ * @return The bounding box size in pixels
+ */
+extern gint rs_metadata_get_thumbnail_size(void);
+
 /* Attempts to load cached metadata first, then falls back to reading from file */
 extern gboolean rs_metadata_load(RSMetadata *metadata, const gchar *filename);
 
-/* Save metadata to cache xml file and sidecar thumbnail*/
+/* Append metadata and thumbnail to the metadata pack of the directory, only the
+   thumbnail of the current size is kept in memory afterwards */
 extern void rs_metadata_cache_save(RSMetadata *metadata, const gchar *filename);
 
 /**
@@ -121,6 +152,13 @@ extern void rs_metadata_cache_save(RSMetadata *metadata, const gchar *filename);
  */
 extern void rs_metadata_delete_cache(const gchar *filename);
 
+/**
+ * Get the filename of a JPEG thumbnail for a photo, written on demand
+ * @param filename The filename of the PHOTO
+ * @return The filename of the thumbnail, free with g_free()
+ */
+extern gchar *rs_metadata_get_thumbnail_filename(const gchar *filename);
+
 extern gchar * rs_metadata_dotdir_helper(const gchar *filename, const gchar *extension);
 
 G_END_DECLS
@@ -31,14 +31,37 @@
 #include <string.h>
 #include "rs-rawfile.h"
 
+#ifndef G_OS_WIN32
+/* A mapping of a file, shared by all RAWFILEs opened on the same file. This
+ * way loading metadata and decoding the image of a photo only maps and reads
+ * the file once */
+typedef struct {
+	gchar *filename;
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	time_t mtime;
+	gint fd;
+	void *map;
+	gint users;
+} RawMap;
+
+/* Number of unused maps to keep around for the next raw_open_file() */
+#define RAW_MAP_KEEP 4
+
+static GMutex maps_lock;
+static GList *maps = NULL; /* Most recently used first */
+#endif
+
 struct _RAWFILE {
 #ifdef G_OS_WIN32
 	HANDLE filehandle;
 	HANDLE maphandle;
 #else
-	gint fd;
+	RawMap *shared;
 #endif
 	gboolean is_map;
+	gchar *filename;
 	guint size;
 	void *map;
 	gushort byteorder;
@@ -300,6 +323,7 @@ raw_create_from_memory(void *memory, guint size, guint first_ifd_offset, gushort
 	rawfile = g_malloc(sizeof(RAWFILE));
 
 	rawfile->is_map = FALSE;
+	rawfile->filename = NULL;
 	rawfile->size = size;
 	rawfile->map = memory;
 	rawfile->base = 0;
@@ -308,13 +332,100 @@ raw_create_from_memory(void *memory, guint size, guint first_ifd_offset, gushort
 	return rawfile;
 }
 
+#ifndef G_OS_WIN32
+static void
+map_free(RawMap *map)
+{
+	munmap(map->map, map->size);
+	close(map->fd);
+	g_free(map->filename);
+	g_free(map);
+}
+
+/* Unmap unused maps we don't want to keep, must be called with maps_lock held */
+static void
+maps_trim(void)
+{
+	GList *node, *next;
+	gint unused = 0;
+
+	for (node = maps; node; node = next)
+	{
+		RawMap *map = node->data;
+		next = g_list_next(node);
+
+		if (map->users == 0 && ++unused > RAW_MAP_KEEP)
+		{
+			maps = g_list_delete_link(maps, node);
+			map_free(map);
+		}
+	}
+}
+
+static RawMap *
+map_get(const gchar *filename, struct stat *st)
+{
+	RawMap *map = NULL;
+	GList *node;
+	gint fd;
+
+	g_mutex_lock(&maps_lock);
+	for (node = maps; node; node = g_list_next(node))
+	{
+		RawMap *candidate = node->data;
+		if (candidate->dev == st->st_dev && candidate->ino == st->st_ino
+			&& candidate->size == st->st_size && candidate->mtime == st->st_mtime
+			&& g_str_equal(candidate->filename, filename))
+		{
+			map = candidate;
+			maps = g_list_delete_link(maps, node);
+			break;
+		}
+	}
+
+	if (!map && (fd = open(filename, O_RDONLY)) != -1)
+	{
+		void *data = mmap(NULL, st->st_size, PROT_READ, MAP_SHARED, fd, 0);
+		if (data == MAP_FAILED)
+			close(fd);
+		else
+		{
+			map = g_new0(RawMap, 1);
+			map->filename = g_strdup(filename);
+			map->dev = st->st_dev;
+			map->ino = st->st_ino;
+			map->size = st->st_size;
+			map->mtime = st->st_mtime;
+			map->fd = fd;
+			map->map = data;
+		}
+	}
+
+	if (map)
+	{
+		map->users++;
+		maps = g_list_prepend(maps, map);
+		maps_trim();
+	}
+	g_mutex_unlock(&maps_lock);
+
+	return map;
+}
+
+static void
+map_release(RawMap *map)
+{
+	g_mutex_lock(&maps_lock);
+	map->users--;
+	maps_trim();
+	g_mutex_unlock(&maps_lock);
+}
+#endif
+
 RAWFILE *
 raw_open_file(const gchar *filename)
 {
 	struct stat st;
-#ifndef G_OS_WIN32
-	gint fd;
-#endif
 	RAWFILE *rawfile;
 
 	g_return_val_if_fail(filename != NULL, NULL);
@@ -349,21 +460,16 @@ raw_open_file(const gchar *filename)
 	}
 
 #else
-	if ((fd = open(filename, O_RDONLY)) == -1)
-	{
-		g_free(rawfile);
-		return(NULL);
-	}
-	rawfile->map = mmap(NULL, rawfile->size, PROT_READ, MAP_SHARED, fd, 0);
-	if(rawfile->map == MAP_FAILED)
+	/* mmap() will fail on empty files */
+	if (st.st_size == 0 || !(rawfile->shared = map_get(filename, &st)))
 	{
-		close(fd);
 		g_free(rawfile);
 		return(NULL);
 	}
+	rawfile->map = rawfile->shared->map;
 	rawfile->is_map = TRUE;
-	rawfile->fd = fd;
 #endif
+	rawfile->filename = g_strdup(filename);
 	rawfile->base = 0;
 	rawfile->byteorder = 0x4D4D;
 	return(rawfile);
@@ -402,10 +508,10 @@ raw_close_file(RAWFILE *rawfile)
 		CloseHandle(rawfile->maphandle);
 		CloseHandle(rawfile->filehandle);
 #else
-		munmap(rawfile->map, rawfile->size);
-		close(rawfile->fd);
+		map_release(rawfile->shared);
 #endif
 	}
+	g_free(rawfile->filename);
 	g_free(rawfile);
 	return;
 }
@@ -466,3 +572,51 @@ raw_get_filesize(RAWFILE *rawfile)
 
 	return rawfile->size;
 }
+
+/**
+ * Get the name of the file backing a RAWFILE
+ * @param rawfile A RAWFILE
+ * @return The filename, or NULL for RAWFILEs created from memory
+ */
+const gchar *
+raw_get_filename(RAWFILE *rawfile)
+{
+	g_return_val_if_fail(rawfile != NULL, NULL);
+
+	return rawfile->filename;
+}
+
+/**
+ * Read the complete file into memory, sequentially. Use this before accessing
+ * most of the file, to avoid reading it a page at a time as it is touched
+ * @param rawfile A RAWFILE
+ */
+void
+raw_read_ahead(RAWFILE *rawfile)
+{
+	volatile guchar sum = 0;
+	guint pos;
+	gsize page;
+
+	g_return_if_fail(rawfile != NULL);
+
+	if (!rawfile->is_map)
+		return;
+
+#ifdef G_OS_WIN32
+	page = 4096;
+#else
+	page = sysconf(_SC_PAGESIZE);
+	madvise(rawfile->map, rawfile->size, MADV_SEQUENTIAL);
+	madvise(rawfile->map, rawfile->size, MADV_WILLNEED);
+#endif
+
+	/* Fault in every page */
+	for (pos = 0; pos < rawfile->size; pos += page)
+		sum += ((guchar *) rawfile->map)[pos];
+
+#ifndef G_OS_WIN32
+	/* Metadata parsers jump around, don't let the kernel drop pages behind us */
+	madvise(rawfile->map, rawfile->size, MADV_NORMAL);
+#endif
+}
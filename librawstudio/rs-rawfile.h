@@ -52,5 +52,7 @@ void raw_set_byteorder(RAWFILE *rawfile, gushort byteorder);
 guint get_first_ifd_offset(RAWFILE *rawfile);
 void *raw_get_map(RAWFILE *rawfile);
 guint raw_get_filesize(RAWFILE *rawfile);
+const gchar *raw_get_filename(RAWFILE *rawfile);
+void raw_read_ahead(RAWFILE *rawfile);
 
 #endif /* RAWFILE_H */
@@ -211,6 +211,7 @@ rs_settings_init (RSSettings *self)
 {
 	self->commit = 0;
 	self->commit_todo = 0;
+	self->serial = 0;
 	self->curve_knots = NULL;
 	self->wb_ascii = NULL;
 	rs_settings_reset(self, MASK_ALL);
@@ -361,6 +362,7 @@ static void
 rs_settings_update_settings(RSSettings *settings, const RSSettingsMask changed_mask)
 {
 	GTimer *gt = g_timer_new();
+	settings->serial++;
 	g_signal_emit(settings, signals[SETTINGS_CHANGED], 0, changed_mask);
 	gfloat time = g_timer_elapsed(gt, NULL);
 
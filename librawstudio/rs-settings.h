@@ -67,6 +67,7 @@ typedef struct _RSsettings {
 	GObject parent;
 	gint commit;
 	RSSettingsMask commit_todo;
+	guint serial; /* Incremented before every "settings-changed" */
 	gfloat exposure;
 	gfloat saturation;
 	gfloat hue;
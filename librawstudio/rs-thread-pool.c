@@ -0,0 +1,160 @@
+/*
+ * * Copyright (C) 2006-2011 Anders Brander <anders@brander.dk>, 
+ * * Anders Kvist <akv@lnxbx.dk> and Klaus Post <klauspost@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <rawstudio.h>
+#include "rs-thread-pool.h"
+
+typedef struct {
+	GThreadFunc func;
+	guchar *items;
+	gsize item_size;
+	gint n_items;
+
+	gint next;		/* Next element to process, atomic */
+	gint ref_count;	/* Atomic */
+
+	GMutex done_mutex;
+	GCond done_cond;
+	gint remaining;	/* Protected by done_mutex */
+} RSThreadPoolTask;
+
+static GThreadPool *pool = NULL;
+static guint pool_threads = 0;
+
+static void
+task_unref(RSThreadPoolTask *task)
+{
+	if (g_atomic_int_dec_and_test(&task->ref_count))
+	{
+		g_mutex_clear(&task->done_mutex);
+		g_cond_clear(&task->done_cond);
+		g_slice_free(RSThreadPoolTask, task);
+	}
+}
+
+/**
+ * Process elements from a task until none are left
+ * @param task A RSThreadPoolTask
+ */
+static void
+task_process(RSThreadPoolTask *task)
+{
+	gint i;
+
+	while ((i = g_atomic_int_add(&task->next, 1)) < task->n_items)
+	{
+		task->func(task->items + i * task->item_size);
+
+		g_mutex_lock(&task->done_mutex);
+		if (--task->remaining == 0)
+			g_cond_signal(&task->done_cond);
+		g_mutex_unlock(&task->done_mutex);
+	}
+}
+
+static void
+pool_worker(gpointer data, gpointer unused)
+{
+	RSThreadPoolTask *task = data;
+
+	task_process(task);
+	task_unref(task);
+}
+
+/**
+ * Return the shared GThreadPool, creating it if needed
+ * @note This function should be thread safe
+ */
+static GThreadPool *
+get_pool(void)
+{
+	static GMutex lock;
+
+	g_mutex_lock(&lock);
+	if (!pool)
+	{
+		pool_threads = rs_get_number_of_processor_cores();
+		/* Exclusive threads are started at once and kept alive, so we never
+		 * pay for thread creation in the render path */
+		pool = g_thread_pool_new(pool_worker, NULL, pool_threads, TRUE, NULL);
+	}
+	g_mutex_unlock(&lock);
+
+	return pool;
+}
+
+/**
+ * Call func once for every element of an array using the shared worker pool
+ * and return when all calls have finished.
+ * @note The calling thread will process elements itself while waiting, so it
+ *       is safe to call this from inside a worker.
+ * @note func must return normally, it must NOT call g_thread_exit()
+ * @param func A function to call with a pointer to each element, the return
+ *             value is ignored
+ * @param items An array of n_items elements
+ * @param item_size The size of one element in bytes
+ * @param n_items The number of elements in items
+ */
+void
+rs_thread_pool_run(GThreadFunc func, gpointer items, gsize item_size, guint n_items)
+{
+	RSThreadPoolTask *task;
+	GThreadPool *p;
+	guint i, helpers;
+
+	g_return_if_fail(func != NULL);
+	g_return_if_fail(items != NULL || n_items == 0);
+
+	if (n_items == 0)
+		return;
+
+	/* Don't bother the pool with a single element */
+	if (n_items == 1)
+	{
+		func(items);
+		return;
+	}
+
+	p = get_pool();
+	helpers = MIN(n_items - 1, pool_threads);
+
+	task = g_slice_new(RSThreadPoolTask);
+	task->func = func;
+	task->items = items;
+	task->item_size = item_size;
+	task->n_items = n_items;
+	task->next = 0;
+	task->remaining = n_items;
+	task->ref_count = 1 + helpers;
+	g_mutex_init(&task->done_mutex);
+	g_cond_init(&task->done_cond);
+
+	for (i = 0; i < helpers; i++)
+		g_thread_pool_push(p, task, NULL);
+
+	/* Help out while we wait */
+	task_process(task);
+
+	g_mutex_lock(&task->done_mutex);
+	while (task->remaining > 0)
+		g_cond_wait(&task->done_cond, &task->done_mutex);
+	g_mutex_unlock(&task->done_mutex);
+
+	task_unref(task);
+}
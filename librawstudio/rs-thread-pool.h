@@ -0,0 +1,44 @@
+/*
+ * * Copyright (C) 2006-2011 Anders Brander <anders@brander.dk>, 
+ * * Anders Kvist <akv@lnxbx.dk> and Klaus Post <klauspost@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef RS_THREAD_POOL_H
+#define RS_THREAD_POOL_H
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/**
+ * Call func once for every element of an array using the shared worker pool
+ * and return when all calls have finished.
+ * @note The calling thread will process elements itself while waiting, so it
+ *       is safe to call this from inside a worker.
+ * @note func must return normally, it must NOT call g_thread_exit()
+ * @param func A function to call with a pointer to each element, the return
+ *             value is ignored
+ * @param items An array of n_items elements
+ * @param item_size The size of one element in bytes
+ * @param n_items The number of elements in items
+ */
+void
+rs_thread_pool_run(GThreadFunc func, gpointer items, gsize item_size, guint n_items);
+
+G_END_DECLS
+
+#endif /* RS_THREAD_POOL_H */
@@ -230,8 +230,22 @@ rs_detect_cpu_features(void)
        : "=a" (eax), "=c" (ecx),  "=d" (edx) \
        : "0" (cmd) \
      ); \
+} while(0)
+/* Extended features are returned in ebx, which may be the PIC register */
+#define cpuid_ebx(cmd, sub, eax, ebx, ecx, edx) \
+  do { \
+     eax = ebx = edx = 0;	\
+     asm ( \
+       "push %%"REG_b"\n\t"\
+       "cpuid\n\t" \
+       "mov %%ebx, %%esi\n\t" \
+       "pop %%"REG_b"\n\t" \
+       : "=a" (eax), "=S" (ebx), "=c" (ecx),  "=d" (edx) \
+       : "0" (cmd), "2" (sub) \
+     ); \
 } while(0)
 	guint eax;
+	guint ebx;
 	guint edx;
 	guint ecx;
 	static GMutex lock;
@@ -276,6 +290,8 @@ rs_detect_cpu_features(void)
 
 			if (std_dsc)
 			{
+				const guint max_std = std_dsc;
+
 				/* Request for standard features */
 				cpuid(0x00000001, std_dsc, ecx, edx);
 
@@ -302,6 +318,14 @@ rs_detect_cpu_features(void)
 						if ((eax & 0x6) == 0x6)
 							cpuflags |= RS_CPU_FLAG_AVX;
 				}
+
+				/* AVX2 also needs the OS support checked for AVX above */
+				if (max_std >= 7 && (cpuflags & RS_CPU_FLAG_AVX))
+				{
+					cpuid_ebx(0x00000007, 0, eax, ebx, ecx, edx);
+					if (ebx & 0x00000020)
+						cpuflags |= RS_CPU_FLAG_AVX2;
+				}
 			}
 
 			/* Is there extensions */
@@ -341,10 +365,12 @@ rs_detect_cpu_features(void)
 	report("SSE4.1",RS_CPU_FLAG_SSE4_1);
 	report("SSE4.2",RS_CPU_FLAG_SSE4_2);
 	report("AVX",RS_CPU_FLAG_AVX);
+	report("AVX2",RS_CPU_FLAG_AVX2);
 #undef report
 
 	return(stored_cpuflags);
 #undef cpuid
+#undef cpuid_ebx
 }
 
 #else
@@ -723,39 +749,163 @@ rs_split_string(const gchar *str, const gchar *delimiters) {
 	return glist;
 }
 
-gchar *
-rs_file_checksum(const gchar *filename)
+/* The checksum covers the start of the file, which holds the Exif data
+ * in all known formats, and evenly spaced stripes across the rest */
+#define CHECKSUM_HEADER (64*1024)
+#define CHECKSUM_STRIPES 16
+#define CHECKSUM_STRIPE (4*1024)
+
+#define XXH_PRIME64_1 G_GUINT64_CONSTANT(0x9E3779B185EBCA87)
+#define XXH_PRIME64_2 G_GUINT64_CONSTANT(0xC2B2AE3D27D4EB4F)
+#define XXH_PRIME64_3 G_GUINT64_CONSTANT(0x165667B19E3779F9)
+#define XXH_PRIME64_4 G_GUINT64_CONSTANT(0x85EBCA77C2B2AE63)
+#define XXH_PRIME64_5 G_GUINT64_CONSTANT(0x27D4EB2F165667C5)
+#define XXH_ROTL64(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+static inline guint64
+xxh64_read64(const guchar *p)
 {
-	gchar *checksum = NULL;
-	struct stat st;
-	gint fd;
+	guint64 v;
+	memcpy(&v, p, sizeof(v));
+	return GUINT64_FROM_LE(v);
+}
 
-	g_return_val_if_fail(filename != NULL, NULL);
+static inline guint32
+xxh64_read32(const guchar *p)
+{
+	guint32 v;
+	memcpy(&v, p, sizeof(v));
+	return GUINT32_FROM_LE(v);
+}
 
-	fd = open(filename, O_RDONLY);
-	if (fd > 0)
+static inline guint64
+xxh64_round(guint64 acc, guint64 input)
+{
+	acc += input * XXH_PRIME64_2;
+	acc = XXH_ROTL64(acc, 31);
+	return acc * XXH_PRIME64_1;
+}
+
+static inline guint64
+xxh64_merge(guint64 acc, guint64 val)
+{
+	acc ^= xxh64_round(0, val);
+	return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+/* XXH64 as specified by the xxHash project */
+static guint64
+xxh64(const guchar *p, gsize length, guint64 seed)
+{
+	const guchar *end = p + length;
+	guint64 h;
+
+	if (length >= 32)
 	{
-		fstat(fd, &st);
+		const guchar *limit = end - 32;
+		guint64 v1 = seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+		guint64 v2 = seed + XXH_PRIME64_2;
+		guint64 v3 = seed;
+		guint64 v4 = seed - XXH_PRIME64_1;
+
+		do {
+			v1 = xxh64_round(v1, xxh64_read64(p));
+			v2 = xxh64_round(v2, xxh64_read64(p+8));
+			v3 = xxh64_round(v3, xxh64_read64(p+16));
+			v4 = xxh64_round(v4, xxh64_read64(p+24));
+			p += 32;
+		} while (p <= limit);
+
+		h = XXH_ROTL64(v1, 1) + XXH_ROTL64(v2, 7) + XXH_ROTL64(v3, 12) + XXH_ROTL64(v4, 18);
+		h = xxh64_merge(h, v1);
+		h = xxh64_merge(h, v2);
+		h = xxh64_merge(h, v3);
+		h = xxh64_merge(h, v4);
+	}
+	else
+		h = seed + XXH_PRIME64_5;
 
-		gint offset = 0;
-		gint length = st.st_size;
+	h += (guint64) length;
 
-		/* If the file is bigger than 2 KiB, we sample 1 KiB in the middle of the file */
-		if (st.st_size > 2048)
+	while (p + 8 <= end)
+	{
+		h ^= xxh64_round(0, xxh64_read64(p));
+		h = XXH_ROTL64(h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+		p += 8;
+	}
+
+	if (p + 4 <= end)
+	{
+		h ^= (guint64) xxh64_read32(p) * XXH_PRIME64_1;
+		h = XXH_ROTL64(h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+		p += 4;
+	}
+
+	while (p < end)
+	{
+		h ^= (*p) * XXH_PRIME64_5;
+		h = XXH_ROTL64(h, 11) * XXH_PRIME64_1;
+		p++;
+	}
+
+	h ^= h >> 33;
+	h *= XXH_PRIME64_2;
+	h ^= h >> 29;
+	h *= XXH_PRIME64_3;
+	h ^= h >> 32;
+
+	return h;
+}
+
+gchar *
+rs_checksum_for_data(const guchar *data, gsize length)
+{
+	/* Two independent lanes gives us 128 bits, the file size is part of the seed */
+	guint64 h1 = (guint64) length;
+	guint64 h2 = ((guint64) length) ^ XXH_PRIME64_3;
+	gint i;
+
+	g_return_val_if_fail(data != NULL || length == 0, NULL);
+
+	if (length <= CHECKSUM_HEADER + CHECKSUM_STRIPES * CHECKSUM_STRIPE)
+	{
+		h1 = xxh64(data, length, h1);
+		h2 = xxh64(data, length, h2);
+	}
+	else
+	{
+		h1 = xxh64(data, CHECKSUM_HEADER, h1);
+		h2 = xxh64(data, CHECKSUM_HEADER, h2);
+
+		/* The last stripe ends at the end of the file */
+		for(i=0;i<CHECKSUM_STRIPES;i++)
 		{
-			offset = st.st_size/2;
-			length = 1024;
+			gsize offset = CHECKSUM_HEADER + (length - CHECKSUM_HEADER - CHECKSUM_STRIPE) / (CHECKSUM_STRIPES-1) * i;
+			if (i == CHECKSUM_STRIPES-1)
+				offset = length - CHECKSUM_STRIPE;
+			h1 = xxh64(data + offset, CHECKSUM_STRIPE, h1);
+			h2 = xxh64(data + offset, CHECKSUM_STRIPE, h2);
 		}
+	}
 
-		guchar buffer[length];
+	return g_strdup_printf("%016" G_GINT64_MODIFIER "x%016" G_GINT64_MODIFIER "x", h1, h2);
+}
 
-		lseek(fd, offset, SEEK_SET);
-		gint bytes_read = read(fd, buffer, length);
+gchar *
+rs_file_checksum(const gchar *filename)
+{
+	gchar *checksum = NULL;
+	RAWFILE *rawfile;
 
-		close(fd);
+	g_return_val_if_fail(filename != NULL, NULL);
 
-		if (bytes_read == length)
-			checksum = g_compute_checksum_for_data(G_CHECKSUM_MD5, buffer, length);
+	/* This will reuse the mapping if the file was just loaded, and only
+	 * touches the pages we sample otherwise */
+	rawfile = raw_open_file(filename);
+	if (rawfile)
+	{
+		checksum = rs_checksum_for_data(raw_get_map(rawfile), raw_get_filesize(rawfile));
+		raw_close_file(rawfile);
 	}
 
 	return checksum;
@@ -160,6 +160,19 @@ CanonEv(gint val);
 GList *
 rs_split_string(const gchar *str, const gchar *delimiters);
 
+/**
+ * Computes a checksum of a photo, suitable for identifying the photo
+ * @param data The complete file contents
+ * @param length Length of data in bytes
+ * @return A newly allocated 32 character hex string, must be freed with g_free()
+ */
+gchar * rs_checksum_for_data(const guchar *data, gsize length);
+
+/**
+ * Computes the checksum of a file, see rs_checksum_for_data()
+ * @param photo Path to a file
+ * @return A newly allocated 32 character hex string or NULL on error
+ */
 gchar * rs_file_checksum(const gchar *photo);
 
 const gchar * rs_human_aperture(gdouble aperture);
@@ -20,6 +20,8 @@
 /* Plugin tmpl version 4 */
 
 #include <rawstudio.h>
+#include <string.h>
+#include <unistd.h>
 
 #if 0 /* Change to 1 to enable debugging info */
 #define filter_debug g_debug
@@ -32,16 +34,27 @@
 #define RS_CACHE_CLASS(klass) (G_TYPE_CHECK_CLASS_CAST ((klass), RS_TYPE_CACHE, RSCacheClass))
 #define RS_IS_CACHE(obj) (G_TYPE_CHECK_INSTANCE_TYPE ((obj), RS_TYPE_CACHE))
 
+/* Maximum number of responses kept by a single instance, for all settings together */
+#define CACHE_MAX_ENTRIES 24
+
+/* Bounds for the memory budget shared by all instances */
+#define CACHE_BUDGET_MIN (128*1024*1024)
+#define CACHE_BUDGET_MAX (G_GUINT64_CONSTANT(2048)*1024*1024)
+
 typedef struct _RSCache RSCache;
 typedef struct _RSCacheClass RSCacheClass;
 
 struct _RSCache {
 	RSFilter parent;
 
-	RSFilterResponse *cached_image;
+	GList *entries; /* Most recently used first, protected by entries_lock */
+	guint generation;
+	RSSettings *settings; /* The settings previous filters render from, not referenced */
+	guint serial; /* The serial of settings when we last heard from them */
 	gboolean ignore_changed;
 	RSFilterChangedMask mask;
 	gboolean ignore_roi;
+	gboolean partial_roi;
 	gint latency;
 	GMutex cache_mutex;
 };
@@ -50,12 +63,38 @@ struct _RSCacheClass {
 	RSFilterClass parent_class;
 };
 
+/* A cached response and the request it can answer. Entries belong to a
+ * single RSCache, but the LRU list and the byte count are shared by all
+ * instances, so all entries are protected by entries_lock. */
+typedef struct {
+	RSCache *cache;
+	RSFilterResponse *response;
+	gboolean image8;
+	gboolean quick;
+	gboolean roi_set;
+	GdkRectangle roi;
+	RSColorSpace *colorspace;
+	gboolean any_colorspace; /* The requested colorspace had no influence */
+	RSSettings *settings; /* The settings rendered from, NULL if unknown, not referenced */
+	guint serial; /* The serial of settings the response is valid for, once switched away from */
+	gboolean relabeled; /* Rendered from other settings that rendered the same */
+	gsize bytes;
+	GList lru_link;
+} CacheEntry;
+
+static GMutex entries_lock;
+static GQueue lru = G_QUEUE_INIT;
+static gsize cached_bytes = 0;
+static GList *caches = NULL; /* All instances, protected by entries_lock */
+static GHashTable *watched_settings = NULL; /* Settings we hold a weak reference to, protected by entries_lock */
+
 RS_DEFINE_FILTER(rs_cache, RSCache)
 
 enum {
 	PROP_0,
 	PROP_LATENCY,
-	PROP_IGNORE_ROI
+	PROP_IGNORE_ROI,
+	PROP_PARTIAL_ROI
 };
 
 static void finalize(GObject *object);
@@ -94,6 +133,12 @@ rs_cache_class_init(RSCacheClass *klass)
 			FALSE,
 			G_PARAM_READWRITE)
 	);
+	g_object_class_install_property(object_class,
+		PROP_PARTIAL_ROI, g_param_spec_boolean(
+			"partial-roi", "partial-roi", "Only render the part of a ROI not already cached. Only use this if all previous filters are pixel exact for any ROI",
+			FALSE,
+			G_PARAM_READWRITE)
+	);
 
 	filter_class->name = "Listen for changes and caches image data";
 	filter_class->get_image = get_image;
@@ -106,9 +151,17 @@ rs_cache_init(RSCache *cache)
 {
 	cache->ignore_changed = FALSE;
 	cache->ignore_roi = FALSE;
+	cache->partial_roi = FALSE;
 	cache->latency = 0;
-	cache->cached_image = rs_filter_response_new();
+	cache->entries = NULL;
+	cache->generation = 0;
+	cache->settings = NULL;
+	cache->serial = 0;
 	g_mutex_init(&cache->cache_mutex);
+
+	g_mutex_lock(&entries_lock);
+	caches = g_list_prepend(caches, cache);
+	g_mutex_unlock(&entries_lock);
 }
 
 static void
@@ -116,6 +169,9 @@ finalize(GObject *object)
 {
 	RSCache *cache = RS_CACHE(object);
 	flush(cache);
+	g_mutex_lock(&entries_lock);
+	caches = g_list_remove(caches, cache);
+	g_mutex_unlock(&entries_lock);
 	g_mutex_clear(&cache->cache_mutex);
 }
 
@@ -132,6 +188,9 @@ get_property(GObject *object, guint property_id, GValue *value, GParamSpec *pspe
 		case PROP_IGNORE_ROI:
 			g_value_set_boolean(value, cache->ignore_roi);
 			break;
+		case PROP_PARTIAL_ROI:
+			g_value_set_boolean(value, cache->partial_roi);
+			break;
 		default:
 			G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
 	}
@@ -150,6 +209,9 @@ set_property(GObject *object, guint property_id, const GValue *value, GParamSpec
 		case PROP_IGNORE_ROI:
 			cache->ignore_roi = g_value_get_boolean(value);
 			break;
+		case PROP_PARTIAL_ROI:
+			cache->partial_roi = g_value_get_boolean(value);
+			break;
 		default:
 			G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
 	}
@@ -164,172 +226,462 @@ rectangle_is_inside(GdkRectangle *outer_rect, GdkRectangle *inner_rect)
 		inner_rect->y + inner_rect->height <= outer_rect->y + outer_rect->height;
 }
 
-static gint get_cached_width(RSCache *cache)
+static gboolean
+rectangle_intersect(GdkRectangle *a, GdkRectangle *b, GdkRectangle *dest)
 {
-	gint ret = -1;
-	if (rs_filter_response_has_image(cache->cached_image)) {
-		RS_IMAGE16 *img = rs_filter_response_get_image(cache->cached_image);
-		ret = img->w;
-		g_object_unref(img);
-	}
+	gint x1 = MAX(a->x, b->x);
+	gint y1 = MAX(a->y, b->y);
+	gint x2 = MIN(a->x + a->width, b->x + b->width);
+	gint y2 = MIN(a->y + a->height, b->y + b->height);
+
+	if (x2 <= x1 || y2 <= y1)
+		return FALSE;
+
+	dest->x = x1;
+	dest->y = y1;
+	dest->width = x2 - x1;
+	dest->height = y2 - y1;
+	return TRUE;
+}
 
-	if (rs_filter_response_has_image8(cache->cached_image)) {
-		GdkPixbuf *img  =  rs_filter_response_get_image8(cache->cached_image);
-		ret = gdk_pixbuf_get_width(img);
-		g_object_unref(img);
-	}
-	return ret;
+static void
+rectangle_union(GdkRectangle *a, GdkRectangle *b, GdkRectangle *dest)
+{
+	gint x1 = MIN(a->x, b->x);
+	gint y1 = MIN(a->y, b->y);
+	gint x2 = MAX(a->x + a->width, b->x + b->width);
+	gint y2 = MAX(a->y + a->height, b->y + b->height);
+
+	dest->x = x1;
+	dest->y = y1;
+	dest->width = x2 - x1;
+	dest->height = y2 - y1;
 }
 
-static gint get_cached_height(RSCache *cache)
+#define RECT_AREA(r) ((gint64) (r)->width * (r)->height)
+
+/**
+ * Get the number of bytes all caches together may hold
+ * @return The budget in bytes, a quarter of physical memory within sane bounds
+ */
+static gsize
+get_budget(void)
 {
-	gint ret = -1;
-	if (rs_filter_response_has_image(cache->cached_image)) {
-		RS_IMAGE16 *img = rs_filter_response_get_image(cache->cached_image);
-		ret = img->h;
-		g_object_unref(img);
+	static gsize budget = 0;
+
+	if (budget == 0)
+	{
+		guint64 temp = CACHE_BUDGET_MIN;
+#if defined(_SC_PHYS_PAGES) && defined(_SC_PAGESIZE)
+		glong pages = sysconf(_SC_PHYS_PAGES);
+		glong page_size = sysconf(_SC_PAGESIZE);
+		if (pages > 0 && page_size > 0)
+			temp = CLAMP((guint64) pages * page_size / 4, CACHE_BUDGET_MIN, MIN(CACHE_BUDGET_MAX, G_MAXSIZE));
+#endif
+		budget = temp;
 	}
+	return budget;
+}
+
+/**
+ * Estimate the memory used by a response. Only rows inside the ROI are ever
+ * written, and pages outside it are never committed, so only those are counted
+ */
+static gsize
+response_bytes(RSFilterResponse *response, gboolean image8)
+{
+	GdkRectangle *roi = rs_filter_response_get_roi(response);
+	gsize row_bytes = 0;
+	gint rows = 0;
 
-	if (rs_filter_response_has_image8(cache->cached_image)) {
-		GdkPixbuf *img  =  rs_filter_response_get_image8(cache->cached_image);
-		ret = gdk_pixbuf_get_height(img);
-		g_object_unref(img);
+	if (image8)
+	{
+		GdkPixbuf *pixbuf = rs_filter_response_get_image8(response);
+		if (pixbuf)
+		{
+			row_bytes = gdk_pixbuf_get_rowstride(pixbuf);
+			rows = gdk_pixbuf_get_height(pixbuf);
+			g_object_unref(pixbuf);
+		}
 	}
-	return ret;
+	else
+	{
+		GdkRectangle area;
+		RS_IMAGE16 *image = rs_filter_response_get_image_area(response, &area, NULL, NULL);
+		if (image)
+		{
+			row_bytes = image->rowstride * sizeof(gushort);
+			rows = image->h;
+			g_object_unref(image);
+		}
+	}
+
+	if (roi)
+		rows = MIN(rows, roi->height);
+
+	return row_bytes * rows;
 }
 
+/* Must be called with entries_lock held */
 static void
-set_roi_to_full(RSCache *cache) {
-	GdkRectangle *r = g_new(GdkRectangle, 1);
-	r->x = 0;
-	r->y = 0;
-
-	if (rs_filter_response_has_image(cache->cached_image)) {
-		RS_IMAGE16 *img = rs_filter_response_get_image(cache->cached_image);
-		r->width = img->w;
-		r->height = img->h;
-		rs_filter_response_set_roi(cache->cached_image,r);
-		g_object_unref(img);
-	}
+entry_free(CacheEntry *entry)
+{
+	RSCache *cache = entry->cache;
 
-	if (rs_filter_response_has_image8(cache->cached_image)) {
-		GdkPixbuf *img  =  rs_filter_response_get_image8(cache->cached_image);
-		r->width = gdk_pixbuf_get_width(img);
-		r->height = gdk_pixbuf_get_height(img);
-		rs_filter_response_set_roi(cache->cached_image,r);
-		g_object_unref(img);
+	g_queue_unlink(&lru, &entry->lru_link);
+	cache->entries = g_list_remove(cache->entries, entry);
+	cached_bytes -= entry->bytes;
+	g_object_unref(entry->response);
+	g_free(entry);
+}
+
+/* Must be called with entries_lock held */
+static void
+entry_touch(CacheEntry *entry)
+{
+	RSCache *cache = entry->cache;
+
+	g_queue_unlink(&lru, &entry->lru_link);
+	g_queue_push_head_link(&lru, &entry->lru_link);
+	cache->entries = g_list_remove(cache->entries, entry);
+	cache->entries = g_list_prepend(cache->entries, entry);
+}
+
+/**
+ * Find an entry that can answer a request, must be called with entries_lock held
+ * @param cache A RSCache
+ * @param image8 TRUE to look for 8 bit images
+ * @param quick TRUE if a quick render is acceptable
+ * @param roi The requested ROI or NULL for the whole image
+ * @param colorspace The requested colorspace, can be NULL
+ * @return A matching entry or NULL
+ */
+static CacheEntry *
+entry_find(RSCache *cache, gboolean image8, gboolean quick, GdkRectangle *roi, RSColorSpace *colorspace)
+{
+	GList *node;
+
+	for (node = cache->entries; node; node = g_list_next(node))
+	{
+		CacheEntry *entry = node->data;
+
+		if (entry->image8 != image8 || entry->settings != cache->settings)
+			continue;
+		if (entry->quick && !quick)
+			continue;
+		if (entry->colorspace != colorspace && !entry->any_colorspace)
+			continue;
+		if (entry->roi_set && !(roi && rectangle_is_inside(&entry->roi, roi)))
+			continue;
+
+		return entry;
 	}
-	filter_debug("Cache[%p]: Setting request ROI to full from cache!", cache);
-	filter_debug("Cache[%p]: Saved   ROI x:%d, y:%d, w:%d, h:%d", cache, r->x, r->y, r->width, r->height);
+
+	return NULL;
 }
 
-static RSFilterResponse *
-get_image(RSFilter *filter, const RSFilterRequest *_request)
+/**
+ * Add a response to the cache and evict old entries until all caches are
+ * within budget, must be called with entries_lock held. Responses are
+ * kept for the current settings, and stay around when settings are switched
+ */
+static void
+entry_add(RSCache *cache, RSFilterResponse *response, gboolean image8, gboolean quick, GdkRectangle *roi, RSColorSpace *colorspace, guint generation)
 {
-	RSCache *cache = RS_CACHE(filter);
-	RSFilterRequest *request = rs_filter_request_clone(_request);
-	GdkRectangle *roi = rs_filter_request_get_roi(request);
+	CacheEntry *entry;
+	GList *node, *next;
+	gboolean any_colorspace = FALSE;
+
+	/* 8 bit images are always converted to the requested colorspace, but 16
+	 * bit images are only converted by a colorspace transform. If upstream
+	 * delivered another colorspace than requested, the request colorspace
+	 * made no difference, and this response can answer requests for any
+	 * colorspace. This lets an export reuse what rendering a preview of
+	 * the same photo left in the cache. */
+	if (!image8 && rs_filter_param_get_object_with_type(RS_FILTER_PARAM(response), "colorspace", RS_TYPE_COLOR_SPACE) != colorspace)
+	{
+		any_colorspace = TRUE;
+		colorspace = NULL;
+	}
 
-	filter_debug("Cache[%p]: getimage() called", filter);
+	/* Settings changed while we were rendering, this can never be hit */
+	if (generation != cache->generation)
+		return;
 
-	g_mutex_lock(&cache->cache_mutex);
-	if (roi && cache->ignore_roi)
+	/* Drop entries the new response makes redundant */
+	for (node = cache->entries; node; node = next)
 	{
-		roi = NULL;
-		rs_filter_request_set_roi(request, NULL);
-		filter_debug("Cache[%p]: Disabling ROI for upward calls", filter);
+		CacheEntry *old = node->data;
+		next = g_list_next(node);
+
+		if (old->settings != cache->settings)
+			continue;
+		if (old->image8 != image8 || old->colorspace != colorspace || old->any_colorspace != any_colorspace)
+			continue;
+		if (quick && !old->quick)
+			continue;
+		if (roi && !(old->roi_set && rectangle_is_inside(roi, &old->roi)))
+			continue;
+
+		entry_free(old);
 	}
 
-	if (rs_filter_response_has_image(cache->cached_image)) {
+	while (g_list_length(cache->entries) >= CACHE_MAX_ENTRIES)
+		entry_free(g_list_last(cache->entries)->data);
 
-		if (rs_filter_response_get_quick(cache->cached_image) && !rs_filter_request_get_quick(request))
-		{
-			filter_debug("Cache[%p]: Cached image is quick and requested image is not!", filter);
-			flush(cache);
-		}
+	entry = g_new0(CacheEntry, 1);
+	entry->cache = cache;
+	entry->response = g_object_ref(response);
+	entry->image8 = image8;
+	entry->quick = quick;
+	if (roi)
+	{
+		entry->roi_set = TRUE;
+		entry->roi = *roi;
+	}
+	entry->colorspace = colorspace;
+	entry->any_colorspace = any_colorspace;
+	entry->settings = cache->settings;
+	entry->serial = cache->serial;
+	entry->bytes = response_bytes(response, image8);
+	entry->lru_link.data = entry;
+
+	cache->entries = g_list_prepend(cache->entries, entry);
+	g_queue_push_head_link(&lru, &entry->lru_link);
+	cached_bytes += entry->bytes;
+
+	filter_debug("Cache[%p]: Added %"G_GSIZE_FORMAT" bytes, %"G_GSIZE_FORMAT" bytes cached in total", cache, entry->bytes, cached_bytes);
+
+	/* Evict least recently used entries from all caches, but keep the one we just added */
+	while (cached_bytes > get_budget() && lru.tail && lru.tail->data != entry)
+		entry_free(lru.tail->data);
+}
 
-		if (!rs_filter_response_get_roi(cache->cached_image) && roi)
-			set_roi_to_full(cache);
+/**
+ * Find the entry sharing most pixels with a ROI that is not fully covered,
+ * must be called with entries_lock held
+ * @param cache A RSCache
+ * @param image8 TRUE to look for 8 bit images
+ * @param quick TRUE if a quick render is acceptable
+ * @param roi The requested ROI
+ * @param colorspace The requested colorspace, can be NULL
+ * @param target Set to the ROI the stitched response should cover
+ * @return The best entry or NULL if rendering the whole ROI is cheaper
+ */
+static CacheEntry *
+entry_find_partial(RSCache *cache, gboolean image8, gboolean quick, GdkRectangle *roi, RSColorSpace *colorspace, GdkRectangle *target)
+{
+	CacheEntry *best = NULL;
+	gint64 best_missing = RECT_AREA(roi);
+	GList *node;
 
-		if (!roi && rs_filter_response_get_roi(cache->cached_image))
-		{
-				roi = g_new(GdkRectangle, 1);
-				roi->x = 0;
-				roi->y = 0;
-				roi->width = get_cached_width(cache);
-				roi->height = get_cached_height(cache);
-				rs_filter_request_set_roi(request, roi);
-				filter_debug("Cache[%p]: Setting request ROI from cache!", filter);
-		}
-		if (rs_filter_response_get_roi(cache->cached_image) && roi)
+	for (node = cache->entries; node; node = g_list_next(node))
+	{
+		CacheEntry *entry = node->data;
+		GdkRectangle grown, overlap;
+		gint64 missing;
+
+		if (entry->image8 != image8 || entry->settings != cache->settings)
+			continue;
+		if (entry->quick && !quick)
+			continue;
+		if (entry->colorspace != colorspace && !entry->any_colorspace)
+			continue;
+		if (!entry->roi_set)
+			continue;
+		if (!rectangle_intersect(&entry->roi, roi, &overlap))
+			continue;
+
+		/* Grow the cached area, unless that would make us copy more than
+		 * twice the requested area on every following request */
+		rectangle_union(&entry->roi, roi, &grown);
+		if (RECT_AREA(&grown) > 2 * RECT_AREA(roi))
+			grown = *roi;
+		else
+			overlap = entry->roi;
+
+		missing = RECT_AREA(&grown) - RECT_AREA(&overlap);
+		if (missing < best_missing)
 		{
-			roi->x = MAX(0, roi->x);
-			roi->y = MAX(0, roi->y);
-			roi->width = MIN(roi->width, get_cached_width(cache));
-			roi->height = MIN(roi->height, get_cached_height(cache));
+			best = entry;
+			best_missing = missing;
+			*target = grown;
 		}
+	}
+
+	return best;
+}
+
+/**
+ * Copy a rectangle between images covering different parts of the whole image
+ * @param dest The image to copy to
+ * @param dest_area The part of the whole image covered by dest
+ * @param src The image to copy from
+ * @param src_area The part of the whole image covered by src
+ * @param rect The rectangle to copy, must be inside both areas
+ */
+static void
+copy_rect(RS_IMAGE16 *dest, GdkRectangle *dest_area, RS_IMAGE16 *src, GdkRectangle *src_area, GdkRectangle *rect)
+{
+	gint y;
+	const gsize row_bytes = rect->width * src->pixelsize * sizeof(gushort);
+
+	for (y = rect->y; y < rect->y + rect->height; y++)
+		memcpy(GET_PIXEL(dest, rect->x - dest_area->x, y - dest_area->y),
+			GET_PIXEL(src, rect->x - src_area->x, y - src_area->y), row_bytes);
+}
 
-		if (!cache->ignore_roi && roi)
+/**
+ * Render the parts of target not covered by a cached response and stitch
+ * them together with the cached pixels in a new buffer. 16 bit images only
+ * get a buffer the size of target
+ * @param filter A RSCache
+ * @param request The request to render strips for
+ * @param cached The cached response to reuse pixels from
+ * @param target The ROI to cover, must overlap the ROI of cached
+ * @param image8 TRUE for 8 bit images
+ * @return A new response covering target, or NULL if the strips could not be stitched
+ */
+static RSFilterResponse *
+render_partial(RSFilter *filter, RSFilterRequest *request, RSFilterResponse *cached, GdkRectangle *target, gboolean image8)
+{
+	GdkRectangle overlap, strips[4], cached_area, strip_area;
+	RSFilterResponse *response = NULL;
+	RS_IMAGE16 *image = NULL, *cached_image = NULL;
+	GdkPixbuf *pixbuf = NULL, *cached_pixbuf = NULL;
+	gboolean ok = TRUE;
+	gint width = 0, height = 0, strip_width, strip_height;
+	gint i;
+
+	if (!rectangle_intersect(rs_filter_response_get_roi(cached), target, &overlap))
+		return NULL;
+
+	/* Full width strips above and below, narrow strips left and right */
+	strips[0].x = target->x;
+	strips[0].y = target->y;
+	strips[0].width = target->width;
+	strips[0].height = overlap.y - target->y;
+
+	strips[1].x = target->x;
+	strips[1].y = overlap.y + overlap.height;
+	strips[1].width = target->width;
+	strips[1].height = target->y + target->height - strips[1].y;
+
+	strips[2].x = target->x;
+	strips[2].y = overlap.y;
+	strips[2].width = overlap.x - target->x;
+	strips[2].height = overlap.height;
+
+	strips[3].x = overlap.x + overlap.width;
+	strips[3].y = overlap.y;
+	strips[3].width = target->x + target->width - strips[3].x;
+	strips[3].height = overlap.height;
+
+	if (image8)
+	{
+		cached_pixbuf = rs_filter_response_get_image8(cached);
+		pixbuf = gdk_pixbuf_new(GDK_COLORSPACE_RGB, gdk_pixbuf_get_has_alpha(cached_pixbuf), 8,
+			gdk_pixbuf_get_width(cached_pixbuf), gdk_pixbuf_get_height(cached_pixbuf));
+		ok = (pixbuf != NULL);
+		if (ok)
+			gdk_pixbuf_copy_area(cached_pixbuf, overlap.x, overlap.y, overlap.width, overlap.height, pixbuf, overlap.x, overlap.y);
+	}
+	else
+	{
+		cached_image = rs_filter_response_get_image_area(cached, &cached_area, &width, &height);
+		ok = cached_image && rectangle_is_inside(&cached_area, &overlap);
+		if (ok)
 		{
-			if (rs_filter_response_get_roi(cache->cached_image)) 
-				if (!rectangle_is_inside(rs_filter_response_get_roi(cache->cached_image), roi))
-				{
-					filter_debug("Cache[%p]: Cached image ROI does not cover requested ROI!", filter);
-#if 0
-					GdkRectangle *r = rs_filter_response_get_roi(cache->cached_image);
-					filter_debug("Cache[%p]: Request ROI x:%d, y:%d, w:%d, h:%d", filter, roi->x, roi->y, roi->width, roi->height);
-					filter_debug("Cache[%p]: Cached  ROI x:%d, y:%d, w:%d, h:%d", filter, r->x, r->y, r->width, r->height);
-#endif
-					flush(cache);
-				}
+			image = rs_image16_new(target->width, target->height, cached_image->channels, cached_image->pixelsize);
+			image->filters = cached_image->filters;
+			copy_rect(image, target, cached_image, &cached_area, &overlap);
 		}
 	}
 
-	if (!rs_filter_response_has_image(cache->cached_image))
+	for (i = 0; ok && i < 4; i++)
 	{
-		filter_debug("Cache[%p]: Cached image NOT found", filter);
-		g_object_unref(cache->cached_image);
-		cache->cached_image = rs_filter_get_image(filter->previous, request);
+		if (strips[i].width <= 0 || strips[i].height <= 0)
+			continue;
 
-		if (cache->cached_image && !roi)
-			set_roi_to_full(cache);
-		else
+		filter_debug("Cache[%p]: Rendering strip x:%d, y:%d, w:%d, h:%d", filter, strips[i].x, strips[i].y, strips[i].width, strips[i].height);
+		rs_filter_request_set_roi(request, &strips[i]);
+
+		if (response)
+			g_object_unref(response);
+
+		if (image8)
 		{
-			rs_filter_response_set_roi(cache->cached_image, roi);
-			if (roi)
-				filter_debug("Cache[%p]: Saved   ROI x:%d, y:%d, w:%d, h:%d", filter, roi->x, roi->y, roi->width, roi->height);
+			response = rs_filter_get_image8(filter->previous, request);
+			GdkPixbuf *strip = rs_filter_response_get_image8(response);
+			ok = strip
+				&& gdk_pixbuf_get_width(strip) == gdk_pixbuf_get_width(pixbuf)
+				&& gdk_pixbuf_get_height(strip) == gdk_pixbuf_get_height(pixbuf)
+				&& gdk_pixbuf_get_n_channels(strip) == gdk_pixbuf_get_n_channels(pixbuf);
+			if (ok)
+				gdk_pixbuf_copy_area(strip, strips[i].x, strips[i].y, strips[i].width, strips[i].height, pixbuf, strips[i].x, strips[i].y);
+			if (strip)
+				g_object_unref(strip);
 		}
-
-		if (rs_filter_request_get_quick(request))
+		else
 		{
-			rs_filter_response_set_quick(cache->cached_image);
-			filter_debug("Cache[%p]: Setting image as quick", filter);
+			response = rs_filter_get_image(filter->previous, request);
+			RS_IMAGE16 *strip = rs_filter_response_get_image_area(response, &strip_area, &strip_width, &strip_height);
+			ok = strip
+				&& strip_width == width
+				&& strip_height == height
+				&& strip->pixelsize == image->pixelsize
+				&& rectangle_is_inside(&strip_area, &strips[i]);
+			if (ok)
+				copy_rect(image, target, strip, &strip_area, &strips[i]);
+			if (strip)
+				g_object_unref(strip);
 		}
 	}
 
-	RSFilterResponse *fr = rs_filter_response_clone(cache->cached_image);
-	RS_IMAGE16* img = rs_filter_response_get_image(cache->cached_image);
-	rs_filter_response_set_image(fr, img);
-
-	if (img)
-		g_object_unref(img);
+	if (ok && response)
+	{
+		/* Keep parameters and trace from the last strip rendered */
+		RSFilterResponse *stitched = rs_filter_response_clone(response);
+		if (image8)
+			rs_filter_response_set_image8(stitched, pixbuf);
+		else
+			rs_filter_response_set_image_area(stitched, image, target, width, height);
+		g_object_unref(response);
+		response = stitched;
+	}
+	else if (response)
+	{
+		filter_debug("Cache[%p]: Strips could not be stitched", filter);
+		g_object_unref(response);
+		response = NULL;
+	}
 
-	g_object_unref(request);
-	g_mutex_unlock(&cache->cache_mutex);
+	if (pixbuf)
+		g_object_unref(pixbuf);
+	if (cached_pixbuf)
+		g_object_unref(cached_pixbuf);
+	if (image)
+		g_object_unref(image);
+	if (cached_image)
+		g_object_unref(cached_image);
 
-	return fr;
+	return response;
 }
 
-
 static RSFilterResponse *
-get_image8(RSFilter *filter, const RSFilterRequest *_request)
+cache_get(RSFilter *filter, const RSFilterRequest *_request, gboolean image8)
 {
 	RSCache *cache = RS_CACHE(filter);
 	RSFilterRequest *request = rs_filter_request_clone(_request);
 	GdkRectangle *roi = rs_filter_request_get_roi(request);
-	filter_debug("Cache[%p]: getimage8() called", filter);
+	RSFilterResponse *cached = NULL;
+	RSFilterResponse *partial = NULL;
+	RSFilterResponse *fr;
+	CacheEntry *entry;
+	GdkRectangle target;
+	gboolean stitched = FALSE;
+	guint generation;
 
-	g_mutex_lock(&cache->cache_mutex);
 	if (roi && cache->ignore_roi)
 	{
 		roi = NULL;
@@ -337,78 +689,260 @@ get_image8(RSFilter *filter, const RSFilterRequest *_request)
 		filter_debug("Cache[%p]: Disabling ROI for upward calls", filter);
 	}
 
-	if (rs_filter_response_has_image8(cache->cached_image)) {
+	gboolean quick = rs_filter_request_get_quick(request);
+	RSColorSpace *colorspace = rs_filter_param_get_object_with_type(RS_FILTER_PARAM(request), "colorspace", RS_TYPE_COLOR_SPACE);
 
-		if (rs_filter_response_get_quick(cache->cached_image) && !rs_filter_request_get_quick(request))
-		{
-			filter_debug("Cache[%p]: Cached image is quick and requested image is not!", filter);
-			flush(cache);
-		}
+	/* cache_mutex serializes rendering, so identical concurrent requests only render once */
+	g_mutex_lock(&cache->cache_mutex);
 
-		if (!rs_filter_response_get_roi(cache->cached_image) && roi)
+	g_mutex_lock(&entries_lock);
+	entry = entry_find(cache, image8, quick, roi, colorspace);
+	if (entry)
+	{
+		entry_touch(entry);
+		cached = g_object_ref(entry->response);
+	}
+	else if (roi && cache->partial_roi)
+	{
+		entry = entry_find_partial(cache, image8, quick, roi, colorspace, &target);
+		if (entry)
 		{
-			set_roi_to_full(cache);
+			entry_touch(entry);
+			partial = g_object_ref(entry->response);
 		}
+	}
+	generation = cache->generation;
+	g_mutex_unlock(&entries_lock);
 
-		if (!cache->ignore_roi && roi) 
-			if (rs_filter_response_get_roi(cache->cached_image)) 
-				if (!rectangle_is_inside(rs_filter_response_get_roi(cache->cached_image), roi))
-				{
-					filter_debug("Cache[%p]: Cached image ROI does not cover requested ROI!", filter);
-					flush(cache);
-				}
+	if (partial)
+	{
+		GdkRectangle requested = *roi;
+
+		cached = render_partial(filter, request, partial, &target, image8);
+		g_object_unref(partial);
 
-		if (!roi && rs_filter_response_get_roi(cache->cached_image))
+		/* render_partial() leaves the ROI of the last strip in the request */
+		stitched = (cached != NULL);
+		rs_filter_request_set_roi(request, stitched ? &target : &requested);
+		roi = rs_filter_request_get_roi(request);
+		if (stitched)
+			filter_debug("Cache[%p]: Cached image%s partially found", filter, image8 ? "8" : "");
+	}
+
+	if (!cached || stitched)
+	{
+		if (!cached)
 		{
-			filter_debug("Cache[%p]: Cached image has ROI, but request does not.", filter);
-			flush(cache);
+			filter_debug("Cache[%p]: Cached image%s NOT found", filter, image8 ? "8" : "");
+			if (image8)
+				cached = rs_filter_get_image8(filter->previous, request);
+			else
+				cached = rs_filter_get_image(filter->previous, request);
 		}
 
-		RSColorSpace *cached_space = NULL;
-		if (cache->cached_image)
-			cached_space = rs_filter_param_get_object_with_type(RS_FILTER_PARAM(cache->cached_image), "colorspace", RS_TYPE_COLOR_SPACE);
+		rs_filter_response_set_roi(cached, roi);
+		if (roi)
+			filter_debug("Cache[%p]: Saved   ROI x:%d, y:%d, w:%d, h:%d", filter, roi->x, roi->y, roi->width, roi->height);
 
-		RSColorSpace *requested_space = rs_filter_param_get_object_with_type(RS_FILTER_PARAM(request), "colorspace", RS_TYPE_COLOR_SPACE);
+		if (quick)
+		{
+			rs_filter_response_set_quick(cached);
+			filter_debug("Cache[%p]: Setting image as quick", filter);
+		}
 
-		if (cached_space && requested_space)
-			if (cached_space != requested_space)
-			{
-				filter_debug("Cache[%p]: Colorspace does not match Cached:%s vs Requested:%s.", filter, 
-										 rs_color_space_get_name(cached_space), rs_color_space_get_name(requested_space));
-				flush(cache);
-			}
+		if (image8 ? rs_filter_response_has_image8(cached) : rs_filter_response_has_image(cached))
+		{
+			g_mutex_lock(&entries_lock);
+			entry_add(cache, cached, image8, quick, roi, colorspace, generation);
+			g_mutex_unlock(&entries_lock);
+		}
 	}
 
-	if (!rs_filter_response_has_image8(cache->cached_image))
+	fr = rs_filter_response_clone(cached);
+	if (image8)
 	{
-		filter_debug("Cache[%p]: Cached image8 NOT found", filter);
-		g_object_unref(cache->cached_image);
-		cache->cached_image = rs_filter_get_image8(filter->previous, request);
-		rs_filter_response_set_roi(cache->cached_image, roi);
-		if (rs_filter_request_get_quick(request))
-			rs_filter_response_set_quick(cache->cached_image);
+		GdkPixbuf *img = rs_filter_response_get_image8(cached);
+		rs_filter_response_set_image8(fr, img);
+		if (img)
+			g_object_unref(img);
+	}
+	else
+	{
+		/* Pass on only the area we have, the caller can ask for the whole image */
+		GdkRectangle area;
+		gint width, height;
+		RS_IMAGE16 *img = rs_filter_response_get_image_area(cached, &area, &width, &height);
+		if (img)
+		{
+			rs_filter_response_set_image_area(fr, img, &area, width, height);
+			g_object_unref(img);
+		}
 	}
 
-	RSFilterResponse *fr = rs_filter_response_clone(cache->cached_image);
-	GdkPixbuf* img = rs_filter_response_get_image8(cache->cached_image);
-	rs_filter_response_set_image8(fr, img);
-
-	if (img)
-		g_object_unref(img);
-
+	g_object_unref(cached);
 	g_object_unref(request);
 	g_mutex_unlock(&cache->cache_mutex);
 
 	return fr;
 }
 
+static RSFilterResponse *
+get_image(RSFilter *filter, const RSFilterRequest *request)
+{
+	filter_debug("Cache[%p]: getimage() called", filter);
+
+	return cache_get(filter, request, FALSE);
+}
+
+static RSFilterResponse *
+get_image8(RSFilter *filter, const RSFilterRequest *request)
+{
+	filter_debug("Cache[%p]: getimage8() called", filter);
+
+	return cache_get(filter, request, TRUE);
+}
 
 static void
 flush(RSCache *cache)
 {
 	filter_debug("Cache[%p]: Cache flushed", cache);
-	g_object_unref(cache->cached_image);
-	cache->cached_image = rs_filter_response_new();
+	g_mutex_lock(&entries_lock);
+	while (cache->entries)
+		entry_free(cache->entries->data);
+	g_mutex_unlock(&entries_lock);
+}
+
+/**
+ * Drop all responses rendered from settings that are being finalized
+ */
+static void
+settings_weak_notify(gpointer data, GObject *where_the_object_was)
+{
+	GList *node, *next;
+
+	g_mutex_lock(&entries_lock);
+	g_hash_table_remove(watched_settings, where_the_object_was);
+
+	for (node = lru.head; node; node = next)
+	{
+		CacheEntry *entry = node->data;
+		next = g_list_next(node);
+
+		if ((GObject *) entry->settings == where_the_object_was)
+			entry_free(entry);
+	}
+
+	for (node = caches; node; node = g_list_next(node))
+	{
+		RSCache *cache = node->data;
+
+		if ((GObject *) cache->settings == where_the_object_was)
+		{
+			cache->settings = NULL;
+			cache->serial = 0;
+		}
+	}
+	g_mutex_unlock(&entries_lock);
+}
+
+/**
+ * Make sure responses are dropped when settings are finalized, must be
+ * called with entries_lock held. The weak reference is kept for the lifetime
+ * of settings, so it is never removed while they may be finalizing
+ * @param settings A RSSettings we hold a reference to
+ */
+static void
+watch_settings(RSSettings *settings)
+{
+	if (!watched_settings)
+		watched_settings = g_hash_table_new(NULL, NULL);
+
+	if (!g_hash_table_contains(watched_settings, settings))
+	{
+		g_hash_table_add(watched_settings, settings);
+		g_object_weak_ref(G_OBJECT(settings), settings_weak_notify, NULL);
+	}
+}
+
+/**
+ * Follow the settings previous filters render from. Responses rendered from
+ * other settings, like other snapshots of the photo, are kept and used again
+ * when we switch back, unless those settings changed in the meantime. If
+ * previous filters render the same from the new settings, the responses we
+ * have are moved to them instead
+ * @param cache A RSCache
+ * @param mask A mask indicating what changed
+ */
+static void
+settings_changed(RSCache *cache, RSFilterChangedMask mask)
+{
+	RSSettings *settings = NULL;
+	GList *node, *next;
+	guint serial = 0;
+
+	/* Never hold entries_lock while asking filters, they may be rendering */
+	rs_filter_get_recursive(RS_FILTER(cache), "settings", &settings, NULL);
+	if (settings)
+		serial = settings->serial;
+
+	g_mutex_lock(&entries_lock);
+	cache->generation++;
+	if (settings)
+		watch_settings(settings);
+
+	if (settings != cache->settings)
+	{
+		filter_debug("Cache[%p]: Settings switched from %p to %p", cache, cache->settings, settings);
+		for (node = cache->entries; node; node = next)
+		{
+			CacheEntry *entry = node->data;
+			next = g_list_next(node);
+
+			if (entry->settings == cache->settings)
+			{
+				if (!(mask & RS_FILTER_CHANGED_PIXELDATA))
+				{
+					entry->settings = settings;
+					entry->relabeled = TRUE;
+				}
+				/* Changes that mattered to us were signalled while we rendered
+				 * from the old settings, so entries are valid for them as they are now */
+				else if (entry->settings)
+				{
+					entry->serial = cache->settings->serial;
+					entry->relabeled = FALSE;
+				}
+				else
+					entry_free(entry);
+			}
+			else if (entry->settings == settings && entry->serial != serial)
+				entry_free(entry);
+		}
+		cache->settings = settings;
+	}
+	else if (mask & RS_FILTER_CHANGED_PIXELDATA)
+	{
+		/* More filters may signal a single change, only the first one is news.
+		 * Filters further up switch settings after us, and may render relabeled
+		 * entries differently */
+		const gboolean news = (serial != cache->serial);
+
+		filter_debug("Cache[%p]: Settings %p changed", cache, settings);
+		for (node = cache->entries; node; node = next)
+		{
+			CacheEntry *entry = node->data;
+			next = g_list_next(node);
+
+			if (entry->settings == settings && (news || entry->relabeled))
+				entry_free(entry);
+		}
+	}
+	cache->serial = serial;
+	g_mutex_unlock(&entries_lock);
+
+	/* Unreffing settings may end up in settings_weak_notify() */
+	if (settings)
+		g_object_unref(settings);
 }
 
 static void
@@ -417,9 +951,16 @@ previous_changed(RSFilter *filter, RSFilter *parent, RSFilterChangedMask mask)
 	RSCache *cache = RS_CACHE(filter);
 
 	filter_debug("Cache[%p]: Previous Changed (%x)", filter, mask);
-	g_mutex_lock(&cache->cache_mutex);
-	if (mask & RS_FILTER_CHANGED_PIXELDATA)
+	if (mask & RS_FILTER_CHANGED_SETTINGS)
+		settings_changed(cache, mask);
+	else if (mask & RS_FILTER_CHANGED_PIXELDATA)
+	{
+		/* Bumping the generation also keeps renders already in flight from
+		 * being stored, so we don't have to wait for them here */
+		g_mutex_lock(&entries_lock);
+		cache->generation++;
+		g_mutex_unlock(&entries_lock);
 		flush(cache);
-	g_mutex_unlock(&cache->cache_mutex);
+	}
 	rs_filter_changed(filter, mask);
 }
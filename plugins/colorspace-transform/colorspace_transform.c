@@ -164,15 +164,30 @@ get_image8(RSFilter *filter, const RSFilterRequest *request)
 	RSFilterResponse *response;
 	RS_IMAGE16 *input;
 	GdkPixbuf *output = NULL;
+	GdkPixbuf *output_area;
 	GdkRectangle *roi;
+	GdkRectangle area, area_roi;
+	gint width, height;
 	int i;
 
 	previous_response = rs_filter_get_image(filter->previous, request);
-	input = rs_filter_response_get_image(previous_response);
+	roi = rs_filter_request_get_roi(request);
+
+	/* Convert straight from a part of the image, if the ROI is inside it */
+	input = rs_filter_response_get_image_area(previous_response, &area, &width, &height);
+	if (input && (area.width != width || area.height != height)
+		&& !(roi && roi->x >= area.x && roi->y >= area.y
+		&& roi->x + roi->width <= area.x + area.width && roi->y + roi->height <= area.y + area.height))
+	{
+		g_object_unref(input);
+		input = rs_filter_response_get_image(previous_response);
+		area.x = area.y = 0;
+		area.width = width = input->w;
+		area.height = height = input->h;
+	}
 	if (!RS_IS_IMAGE16(input))
 		return previous_response;
 
-	roi = rs_filter_request_get_roi(request);
 	RSColorSpace *input_space = rs_filter_param_get_object_with_type(RS_FILTER_PARAM(previous_response), "colorspace", RS_TYPE_COLOR_SPACE);
 	RSColorSpace *output_space = rs_filter_param_get_object_with_type(RS_FILTER_PARAM(request), "colorspace", RS_TYPE_COLOR_SPACE);
 
@@ -197,10 +212,21 @@ get_image8(RSFilter *filter, const RSFilterRequest *request)
 	printf("\033[33m8 output_space: %s\n\033[0m", (output_space) ? G_OBJECT_TYPE_NAME(output_space) : "none");
 #endif
 
-	output = gdk_pixbuf_new(GDK_COLORSPACE_RGB, TRUE, 8, input->w, input->h);
+	output = gdk_pixbuf_new(GDK_COLORSPACE_RGB, TRUE, 8, width, height);
 
 	/* Process output */
-	convert_colorspace8(colorspace_transform, input, output, input_space, output_space, roi);
+	if (area.width != width || area.height != height)
+	{
+		output_area = gdk_pixbuf_new_subpixbuf(output, area.x, area.y, area.width, area.height);
+		area_roi.x = roi->x - area.x;
+		area_roi.y = roi->y - area.y;
+		area_roi.width = roi->width;
+		area_roi.height = roi->height;
+		convert_colorspace8(colorspace_transform, input, output_area, input_space, output_space, &area_roi);
+		g_object_unref(output_area);
+	}
+	else
+		convert_colorspace8(colorspace_transform, input, output, input_space, output_space, roi);
 
 	rs_filter_response_set_image8(response, output);
 	rs_filter_param_set_object(RS_FILTER_PARAM(response), "colorspace", output_space);
@@ -523,15 +549,9 @@ convert_colorspace8(RSColorspaceTransform *colorspace_transform, RS_IMAGE16 *inp
 			t[i].matrix = &mat;
 			t[i].table8 = NULL;
 			t[i].single_thread = (threads == 1);
-			if (threads == 1)
-				start_single_cs8_transform_thread(&t[0]);
-			else
-				t[i].threadid = g_thread_new("RSColorspaceTransform worker", start_single_cs8_transform_thread, &t[i]);
 		}
 
-		/* Wait for threads to finish */
-		for(i = 0; threads > 1 && i < threads; i++)
-			g_thread_join(t[i].threadid);
+		rs_thread_pool_run(start_single_cs8_transform_thread, t, sizeof(ThreadInfo), threads);
 
 		g_free(t);
 	}
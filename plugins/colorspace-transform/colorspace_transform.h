@@ -40,7 +40,6 @@ typedef struct _RSColorspaceTransformClass RSColorspaceTransformClass;
 
 typedef struct {
 	RSColorspaceTransform *cst;
-	GThread *threadid;
 	gint start_x;
 	gint start_y;
 	gint end_x;
@@ -45,13 +45,14 @@ static RS_xy_COORD neutral_to_xy(RSDcp *dcp, const RS_VECTOR3 *neutral);
 static RS_MATRIX3 find_xyz_to_camera(RSDcp *dcp, const RS_xy_COORD *white_xy, RS_MATRIX3 *forward_matrix);
 static void set_white_xy(RSDcp *dcp, const RS_xy_COORD *xy);
 static void precalc(RSDcp *dcp);
-static void pre_cache_tables(RSDcp *dcp);
+static void pre_cache_tables(ThreadInfo *t);
 static void render(ThreadInfo* t);
 static void read_profile(RSDcp *dcp, RSDcpFile *dcp_file);
 static void free_dcp_profile(RSDcp *dcp);
 static void set_prophoto_wb(RSDcp *dcp, gfloat warmth, gfloat tint);
 static void calculate_huesat_maps(RSDcp *dcp, gfloat temp);
-static GRecMutex dcp_mutex;
+static void update_render(RSDcp *dcp);
+static void render_unref(RSDcpRender *render);
 
 G_MODULE_EXPORT void
 rs_plugin_load(RSPlugin *plugin)
@@ -70,6 +71,7 @@ finalize(GObject *object)
 	g_free(dcp->_looktable_precalc_unaligned);
 
 	free_dcp_profile(dcp);	
+	render_unref(dcp->render);
 	
 	if (dcp->settings_signal_id && dcp->settings)
 	{
@@ -79,6 +81,7 @@ finalize(GObject *object)
 	dcp->settings_signal_id = 0;
 	dcp->settings = NULL;
 	dcp->read_out_curve = NULL;
+	g_rec_mutex_clear(&dcp->lock);
 }
 
 static void
@@ -124,6 +127,8 @@ settings_changed(RSSettings *settings, RSSettingsMask mask, RSDcp *dcp)
 {
 	gboolean changed = FALSE;
 
+	g_rec_mutex_lock(&dcp->lock);
+
 	if (mask & MASK_EXPOSURE)
 	{
 		g_object_get(settings, "exposure", &dcp->exposure, NULL);
@@ -289,9 +294,14 @@ settings_changed(RSSettings *settings, RSSettingsMask mask, RSDcp *dcp)
 		changed = TRUE;
 	}
 
+	if (changed)
+		update_render(dcp);
+
+	g_rec_mutex_unlock(&dcp->lock);
+
 	if (changed)
 	{
-		rs_filter_changed(RS_FILTER(dcp), RS_FILTER_CHANGED_PIXELDATA);
+		rs_filter_changed(RS_FILTER(dcp), RS_FILTER_CHANGED_PIXELDATA | RS_FILTER_CHANGED_SETTINGS);
 	}
 }
 
@@ -345,6 +355,7 @@ rs_dcp_init(RSDcp *dcp)
 	dcp->use_profile = FALSE;
 	dcp->curve_is_flat = TRUE;
 	dcp->read_out_curve = NULL;
+	g_rec_mutex_init(&dcp->lock);
 	/* Standard D65, this default should really not be used */
 	dcp->white_xy.x = 0.31271f;
 	dcp->white_xy.y = 0.32902f;
@@ -361,6 +372,9 @@ rs_dcp_init(RSDcp *dcp)
 	dcp->looktable_precalc = (PrecalcHSM*)ALIGNTO16(dcp->_looktable_precalc_unaligned);
 	memset(dcp->huesatmap_precalc, 0, sizeof(PrecalcHSM));
 	memset(dcp->looktable_precalc, 0, sizeof(PrecalcHSM));
+
+	dcp->render = NULL;
+	update_render(dcp);
 }
 
 #undef ALIGNTO16
@@ -398,6 +412,7 @@ get_property(GObject *object, guint property_id, GValue *value, GParamSpec *pspe
 	switch (property_id)
 	{
 		case PROP_SETTINGS:
+			g_value_set_object(value, dcp->settings);
 			break;
 		case PROP_USE_PROFILE:
 			g_value_set_boolean(value, dcp->use_profile);
@@ -437,25 +452,31 @@ set_property(GObject *object, guint property_id, const GValue *value, GParamSpec
 			g_object_weak_ref(G_OBJECT(dcp->settings), settings_weak_notify, dcp);
 			break;
 		case PROP_PROFILE:
-			g_rec_mutex_lock(&dcp_mutex);
+			g_rec_mutex_lock(&dcp->lock);
 			read_profile(dcp, g_value_get_object(value));
+			update_render(dcp);
 			changed = TRUE;
-			g_rec_mutex_unlock(&dcp_mutex);
+			g_rec_mutex_unlock(&dcp->lock);
 			break;
 		case PROP_READ_OUT_CURVE:
+			g_rec_mutex_lock(&dcp->lock);
 			temp = g_value_get_object(value);
 			if (temp != dcp->read_out_curve)
 				changed = TRUE;
 			dcp->read_out_curve = temp;
+			if (changed)
+				update_render(dcp);
+			g_rec_mutex_unlock(&dcp->lock);
 			break;
 		case PROP_USE_PROFILE:
-			g_rec_mutex_lock(&dcp_mutex);
+			g_rec_mutex_lock(&dcp->lock);
 			dcp->use_profile = g_value_get_boolean(value);
 			if (!dcp->use_profile)
 				free_dcp_profile(dcp);
 			else
 				precalc(dcp);
-			g_rec_mutex_unlock(&dcp_mutex);
+			update_render(dcp);
+			g_rec_mutex_unlock(&dcp->lock);
 			break;
 		default:
 			G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
@@ -479,7 +500,7 @@ start_single_dcp_thread(gpointer _thread_info)
 	ThreadInfo* t = _thread_info;
 	RS_IMAGE16 *tmp = t->tmp;
 
-	pre_cache_tables(t->dcp);
+	pre_cache_tables(t);
 	if (tmp->pixelsize == 4  && (rs_detect_cpu_features() & RS_CPU_FLAG_SSE2) && !t->dcp->read_out_curve)
 	{
 		if ((rs_detect_cpu_features() & RS_CPU_FLAG_AVX) && render_AVX(t))
@@ -519,10 +540,7 @@ start_single_dcp_thread(gpointer _thread_info)
 	else
 		render(t);
 
-	if (!t->single_thread)
-		g_thread_exit(NULL);
-
-	return NULL; /* Make the compiler shut up - we'll never return */
+	return NULL;
 }
 
 static inline void 
@@ -559,11 +577,13 @@ get_image(RSFilter *filter, const RSFilterRequest *request)
 
 	RSFilterRequest *request_clone = rs_filter_request_clone(request);
 
+	g_rec_mutex_lock(&dcp->lock);
 	if (!dcp->use_profile)
 	{
 		gfloat premul[4] = {dcp->pre_mul.x, dcp->pre_mul.y, dcp->pre_mul.z, 1.0};
 		rs_filter_param_set_float4(RS_FILTER_PARAM(request_clone), "premul", premul);
 	}
+	g_rec_mutex_unlock(&dcp->lock);
 
 	rs_filter_param_set_object(RS_FILTER_PARAM(request_clone), "colorspace", klass->prophoto);
 	previous_response = rs_filter_get_image(filter->previous, request_clone);
@@ -600,8 +620,12 @@ get_image(RSFilter *filter, const RSFilterRequest *request)
 	rs_filter_response_set_image(response, output);
 	g_object_unref(output);
 
-	g_rec_mutex_lock(&dcp_mutex);
-	init_exposure(dcp);
+	/* Hold on to the current tables, settings can change while we render
+	 * without affecting this image */
+	g_rec_mutex_lock(&dcp->lock);
+	RSDcpRender *render = dcp->render;
+	g_atomic_int_inc(&render->ref_count);
+	g_rec_mutex_unlock(&dcp->lock);
 
 	guint i, y_offset, y_per_thread, threaded_h;
 	guint threads = rs_get_number_of_processor_cores();
@@ -619,42 +643,131 @@ get_image(RSFilter *filter, const RSFilterRequest *request)
 		t[i].tmp = tmp;
 		t[i].start_y = y_offset;
 		t[i].start_x = 0;
-		t[i].dcp = dcp;
+		t[i].dcp = render;
 		y_offset += y_per_thread;
 		y_offset = MIN(tmp->h, y_offset);
 		t[i].end_y = y_offset;
 		for(j = 0; j < 256; j++)
 			t[i].curve_input_values[j] = 0;
 		t[i].single_thread = (threads == 1);
-		if (threads == 1)
-			start_single_dcp_thread(&t[0]);
-		else	
-			t[i].threadid = g_thread_new("RSDcp worker", start_single_dcp_thread, &t[i]);
 	}
 
-	/* Wait for threads to finish */
-	for(i = 0; threads > 1 && i < threads; i++)
-		g_thread_join(t[i].threadid);
-
-	/* Settings can change now */
-	g_rec_mutex_unlock(&dcp_mutex);
+	rs_thread_pool_run(start_single_dcp_thread, t, sizeof(ThreadInfo), threads);
 
 	/* If we must deliver histogram data, do it now */
-	if (dcp->read_out_curve)
+	if (render->read_out_curve)
 	{
 		gint *values = g_malloc0(256*sizeof(gint));
 		for(i = 0; i < threads; i++)
 			for(j = 0; j < 256; j++)
 				values[j] += t[i].curve_input_values[j];
-		rs_curve_set_histogram_data(RS_CURVE_WIDGET(dcp->read_out_curve), values);
+		rs_curve_set_histogram_data(RS_CURVE_WIDGET(render->read_out_curve), values);
 		g_free(values);
 	}
+	render_unref(render);
 	g_free(t);
 	g_object_unref(tmp);
 
 	return response;
 }
 
+static PrecalcHSM *
+precalc_copy(const PrecalcHSM *precalc, const RSHuesatMap *map)
+{
+	PrecalcHSM *copy;
+
+	g_assert(0 == posix_memalign((void**)&copy, 16, sizeof(PrecalcHSM)));
+	*copy = *precalc;
+	copy->lookups = NULL;
+
+	if (precalc->lookups && map)
+	{
+		gsize size = precalc->valStep[0] * (map->val_divisions + 1) * 4 * sizeof(gfloat);
+		g_assert(0 == posix_memalign((void**)&copy->lookups, 16, size));
+		memcpy(copy->lookups, precalc->lookups, size);
+	}
+
+	return copy;
+}
+
+/**
+ * Build new render tables from the current parameters and make them the
+ * ones used by renders started from now on. Renders already running keep
+ * their own reference to the old tables.
+ * @note Must be called with dcp->lock held
+ * @param dcp A RSDcp
+ */
+static void
+update_render(RSDcp *dcp)
+{
+	RSDcpRender *render = g_new0(RSDcpRender, 1);
+
+	init_exposure(dcp);
+
+	render->ref_count = 1;
+	render->exposure = dcp->exposure;
+	render->saturation = dcp->saturation;
+	render->contrast = dcp->contrast;
+	render->hue = dcp->hue;
+	render->channelmixer_red = dcp->channelmixer_red;
+	render->channelmixer_green = dcp->channelmixer_green;
+	render->channelmixer_blue = dcp->channelmixer_blue;
+	render->curve_is_flat = dcp->curve_is_flat;
+	render->use_profile = dcp->use_profile;
+	render->camera_white = dcp->camera_white;
+	render->camera_to_prophoto = dcp->camera_to_prophoto;
+	render->exposure_slope = dcp->exposure_slope;
+	render->exposure_black = dcp->exposure_black;
+	render->exposure_radius = dcp->exposure_radius;
+	render->exposure_qscale = dcp->exposure_qscale;
+	render->read_out_curve = dcp->read_out_curve;
+
+	if (dcp->huesatmap)
+		render->huesatmap = g_object_ref(dcp->huesatmap);
+	if (dcp->looktable)
+		render->looktable = g_object_ref(dcp->looktable);
+
+	g_assert(0 == posix_memalign((void**)&render->curve_samples, 16, sizeof(gfloat)*2*257));
+	memcpy(render->curve_samples, dcp->curve_samples, sizeof(gfloat)*2*257);
+
+	if (dcp->tone_curve_lut)
+	{
+		g_assert(0 == posix_memalign((void**)&render->tone_curve_lut, 16, sizeof(gfloat)*2*1025));
+		memcpy(render->tone_curve_lut, dcp->tone_curve_lut, sizeof(gfloat)*2*1025);
+	}
+
+	render->huesatmap_precalc = precalc_copy(dcp->huesatmap_precalc, dcp->huesatmap);
+	render->looktable_precalc = precalc_copy(dcp->looktable_precalc, dcp->looktable);
+
+	render_unref(dcp->render);
+	dcp->render = render;
+}
+
+static void
+render_unref(RSDcpRender *render)
+{
+	if (!render || !g_atomic_int_dec_and_test(&render->ref_count))
+		return;
+
+	if (render->huesatmap)
+		g_object_unref(render->huesatmap);
+	if (render->looktable)
+		g_object_unref(render->looktable);
+
+	free(render->curve_samples);
+	if (render->tone_curve_lut)
+		free(render->tone_curve_lut);
+
+	if (render->huesatmap_precalc->lookups)
+		free(render->huesatmap_precalc->lookups);
+	if (render->looktable_precalc->lookups)
+		free(render->looktable_precalc->lookups);
+	free(render->huesatmap_precalc);
+	free(render->looktable_precalc);
+
+	g_free(render);
+}
+
 /* dng_color_spec::NeutralToXY */
 static RS_xy_COORD
 neutral_to_xy(RSDcp *dcp, const RS_VECTOR3 *neutral)
@@ -724,7 +837,7 @@ RGBtoHSV(gfloat r, gfloat g, gfloat b, gfloat *h, gfloat *s, gfloat *v)
 }
 
 inline gfloat
-exposure_ramp (RSDcp *dcp, gfloat x)
+exposure_ramp (const RSDcpRender *dcp, gfloat x)
 {
 	if (x <= dcp->exposure_black - dcp->exposure_radius)
 		return 0.0;
@@ -1035,8 +1148,9 @@ rgb_tone(gfloat *_r, gfloat *_g, gfloat *_b, const gfloat * const tone_lut)
 }
 
 static void 
-pre_cache_tables(RSDcp *dcp)
+pre_cache_tables(ThreadInfo *t)
 {
+	const RSDcpRender *dcp = t->dcp;
 	int i;
 	gfloat unused = 0;
 	const int cache_line_bytes = 64;
@@ -1094,14 +1208,14 @@ pre_cache_tables(RSDcp *dcp)
 	}
 
 	/* This is needed so the optimizer doesn't believe the value is unused */
-	dcp->junk_value = unused;
+	t->junk_value = unused;
 }
 
 static void
 render(ThreadInfo* t)
 {
 	RS_IMAGE16 *image = t->tmp;
-	RSDcp *dcp = t->dcp;
+	RSDcpRender *dcp = t->dcp;
 
 	gint x, y;
 	gfloat h, s, v;
@@ -1458,14 +1572,14 @@ precalc(RSDcp *dcp)
 	}};
 
 	/* Camera to ProPhoto */
-	g_rec_mutex_lock(&dcp_mutex);
+	g_rec_mutex_lock(&dcp->lock);
 	if (dcp->use_profile)
 		matrix3_multiply(&xyz_to_prophoto, &dcp->camera_to_pcs, &dcp->camera_to_prophoto); /* verified by SDK */
 	if (dcp->huesatmap && (rs_detect_cpu_features() & RS_CPU_FLAG_SSE2))
 		calc_hsm_constants(dcp->huesatmap, dcp->huesatmap_precalc); 
 	if (dcp->looktable && (rs_detect_cpu_features() & RS_CPU_FLAG_SSE2))
 		calc_hsm_constants(dcp->looktable, dcp->looktable_precalc); 
-	g_rec_mutex_unlock(&dcp_mutex);
+	g_rec_mutex_unlock(&dcp->lock);
 }
 
 static void
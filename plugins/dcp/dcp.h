@@ -41,6 +41,41 @@ typedef struct {
 	gfloat* lookups;
 } PrecalcHSM;
 
+/* Everything the renderers read. Built from RSDcp whenever a parameter
+ * changes and never modified after that, so it can be shared by renders
+ * running while the filter changes */
+typedef struct {
+	gint ref_count;
+
+	gfloat exposure;
+	gfloat saturation;
+	gfloat contrast;
+	gfloat hue;
+	gfloat channelmixer_red;
+	gfloat channelmixer_green;
+	gfloat channelmixer_blue;
+
+	gfloat *curve_samples;
+	gboolean curve_is_flat;
+
+	gboolean use_profile;
+	gfloat *tone_curve_lut;
+
+	RSHuesatMap *looktable;
+	RSHuesatMap *huesatmap;
+
+	RS_VECTOR3 camera_white;
+	RS_MATRIX3 camera_to_prophoto;
+
+	gfloat exposure_slope;
+	gfloat exposure_black;
+	gfloat exposure_radius;
+	gfloat exposure_qscale;
+
+	PrecalcHSM *huesatmap_precalc;
+	PrecalcHSM *looktable_precalc;
+	RSCurveWidget* read_out_curve;
+} RSDcpRender;
 
 struct _RSDcp {
 	RSFilter parent;
@@ -103,8 +138,11 @@ struct _RSDcp {
 	PrecalcHSM *looktable_precalc;
 	void* _huesatmap_precalc_unaligned;
 	void* _looktable_precalc_unaligned;
-	gfloat junk_value;
 	RSCurveWidget* read_out_curve;
+
+	RSDcpRender *render; /* Rebuilt from the parameters above on every change */
+
+	GRecMutex lock; /* Protects all parameters above, never held while rendering */
 };
 
 struct _RSDcpClass {
@@ -114,14 +152,14 @@ struct _RSDcpClass {
 };
 
 typedef struct {
-	RSDcp *dcp;
-	GThread *threadid;
+	RSDcpRender *dcp;
 	gint start_x;
 	gint start_y;
 	gint end_y;
 	RS_IMAGE16 *tmp;
 	guint curve_input_values[256];
 	gboolean single_thread;
+	gfloat junk_value;
 } ThreadInfo;
 
 gboolean render_SSE2(ThreadInfo* t);
@@ -0,0 +1,98 @@
+/*
+ * * Copyright (C) 2006-2011 Anders Brander <anders@brander.dk>,
+ * * Anders Kvist <akv@lnxbx.dk> and Klaus Post <klauspost@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/* Plugin tmpl version 4 */
+
+#include <rawstudio.h>
+
+extern void ahd_homogeneity_pixel(const gfloat *lab, guchar *homo, const gint ts, const gint o);
+extern void ahd_homogeneity_map_SSE2(const gfloat *lab, guchar *homo, const gint ts, const gint row_end, const gint col_end);
+
+#if defined (__AVX__)
+#include <immintrin.h>
+
+/* Eight pixels at a time, see ahd_homogeneity_pixel() for the scalar version */
+void
+ahd_homogeneity_map_AVX(const gfloat *lab, guchar *homo, const gint ts, const gint row_end, const gint col_end)
+{
+	const gint dir[4] = { -1, 1, -ts, ts };
+	const __m256 sign_mask = _mm256_set1_ps(-0.0f);
+	const __m256 ones = _mm256_set1_ps(1.0f);
+	gint tr, tc, d, i;
+
+	for (tr=2; tr < row_end; tr++)
+	{
+		for (tc=2; tc+8 <= col_end; tc+=8)
+		{
+			const gint o = tr*ts+tc;
+			__m256 ldiff[2][4], abdiff[2][4], leps, abeps;
+
+			for (d=0; d < 2; d++)
+			{
+				const gfloat *L = lab + (d*3)*ts*ts + o;
+				const gfloat *A = L + ts*ts;
+				const gfloat *B = A + ts*ts;
+				__m256 l = _mm256_loadu_ps(L);
+				__m256 a = _mm256_loadu_ps(A);
+				__m256 b = _mm256_loadu_ps(B);
+				for (i=0; i < 4; i++)
+				{
+					__m256 da = _mm256_sub_ps(a, _mm256_loadu_ps(A+dir[i]));
+					__m256 db = _mm256_sub_ps(b, _mm256_loadu_ps(B+dir[i]));
+					ldiff[d][i] = _mm256_andnot_ps(sign_mask, _mm256_sub_ps(l, _mm256_loadu_ps(L+dir[i])));
+					abdiff[d][i] = _mm256_add_ps(_mm256_mul_ps(da, da), _mm256_mul_ps(db, db));
+				}
+			}
+
+			leps = _mm256_min_ps(_mm256_max_ps(ldiff[0][0], ldiff[0][1]), _mm256_max_ps(ldiff[1][2], ldiff[1][3]));
+			abeps = _mm256_min_ps(_mm256_max_ps(abdiff[0][0], abdiff[0][1]), _mm256_max_ps(abdiff[1][2], abdiff[1][3]));
+
+			for (d=0; d < 2; d++)
+			{
+				/* AVX has no 256 bit integer ops, so count in floats */
+				__m256 count = _mm256_setzero_ps();
+				__m128i lo, hi;
+				for (i=0; i < 4; i++)
+				{
+					__m256 mask = _mm256_and_ps(_mm256_cmp_ps(ldiff[d][i], leps, _CMP_LE_OQ), _mm256_cmp_ps(abdiff[d][i], abeps, _CMP_LE_OQ));
+					count = _mm256_add_ps(count, _mm256_and_ps(mask, ones));
+				}
+				__m256i count_i = _mm256_cvttps_epi32(count);
+				lo = _mm256_castsi256_si128(count_i);
+				hi = _mm256_extractf128_si256(count_i, 1);
+				lo = _mm_packs_epi32(lo, hi);
+				lo = _mm_packus_epi16(lo, lo);
+				_mm_storel_epi64((__m128i *) (homo + d*ts*ts + o), lo);
+			}
+		}
+
+		for (; tc < col_end; tc++)
+			ahd_homogeneity_pixel(lab, homo, ts, tr*ts+tc);
+	}
+}
+
+#else // not defined (__AVX__)
+
+void
+ahd_homogeneity_map_AVX(const gfloat *lab, guchar *homo, const gint ts, const gint row_end, const gint col_end)
+{
+	ahd_homogeneity_map_SSE2(lab, homo, ts, row_end, col_end);
+}
+
+#endif // not defined (__AVX__)
@@ -0,0 +1,214 @@
+/*
+ * * Copyright (C) 2006-2011 Anders Brander <anders@brander.dk>,
+ * * Anders Kvist <akv@lnxbx.dk> and Klaus Post <klauspost@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/* Plugin tmpl version 4 */
+
+#include <rawstudio.h>
+
+extern void ppg_green_row(const gushort *cfa, const gint p, gushort *out, gint col, const gint end);
+extern void ppg_green_row_SSE2(const gushort *cfa, const gint p, gushort *out, gint col, const gint end);
+extern void ppg_rb_at_green_row(const gushort *cfa, const gint p, const gushort *green_up, const gushort *green, const gushort *green_down, gushort *out, gint col, const gint end, const gint c);
+extern void ppg_rb_at_green_row_SSE2(const gushort *cfa, const gint p, const gushort *green_up, const gushort *green, const gushort *green_down, gushort *out, gint col, const gint end, const gint c);
+extern void ppg_rb_at_rb_row(const gushort *cfa, const gint p, const gushort *green_up, const gushort *green, const gushort *green_down, gushort *out, gint col, const gint end, const gint c);
+extern void ppg_rb_at_rb_row_SSE2(const gushort *cfa, const gint p, const gushort *green_up, const gushort *green, const gushort *green_down, gushort *out, gint col, const gint end, const gint c);
+extern void hotpixel_row(gushort *img, gint x, const gint end, const gint rowstride);
+extern void hotpixel_row_SSE2(gushort *img, gint x, const gint end, const gint rowstride);
+
+#if defined (__AVX2__)
+#include <immintrin.h>
+
+/* 16 values loaded, the odd ones masked out, gives 8 pixels of the same color */
+#define LOAD_EVEN(ptr) _mm256_and_si256(_mm256_loadu_si256((const __m256i *) (ptr)), even_mask)
+#define SELECT(mask, a, b) _mm256_blendv_epi8(b, a, mask)
+
+static inline __m256i
+clip_epi32(__m256i x)
+{
+	return _mm256_min_epi32(_mm256_max_epi32(x, _mm256_setzero_si256()), _mm256_set1_epi32(65535));
+}
+
+static inline void
+store_every_fourth(gushort *out, __m256i x)
+{
+	guint32 v[8] __attribute__ ((aligned (32)));
+	gint i;
+
+	_mm256_store_si256((__m256i *) v, x);
+	for (i = 0; i < 8; i++)
+		out[i*8] = v[i];
+}
+
+/* See ppg_green_row() for the scalar version */
+void
+ppg_green_row_AVX2(const gushort *cfa, const gint p, gushort *out, gint col, const gint end)
+{
+	const __m256i even_mask = _mm256_set1_epi32(0xffff);
+
+	for (; col + 18 <= end; col += 16)
+	{
+		const gushort *pix = cfa + col;
+		__m256i c0 = LOAD_EVEN(pix);
+		__m256i l1 = LOAD_EVEN(pix-1), r1 = LOAD_EVEN(pix+1);
+		__m256i l2 = LOAD_EVEN(pix-2), r2 = LOAD_EVEN(pix+2);
+		__m256i l3 = LOAD_EVEN(pix-3), r3 = LOAD_EVEN(pix+3);
+		__m256i u1 = LOAD_EVEN(pix-p), d1 = LOAD_EVEN(pix+p);
+		__m256i u2 = LOAD_EVEN(pix-2*p), d2 = LOAD_EVEN(pix+2*p);
+		__m256i u3 = LOAD_EVEN(pix-3*p), d3 = LOAD_EVEN(pix+3*p);
+		__m256i guessA, guessB, diffA, diffB, sum;
+
+		guessA = _mm256_sub_epi32(_mm256_sub_epi32(_mm256_slli_epi32(_mm256_add_epi32(_mm256_add_epi32(l1, c0), r1), 1), l2), r2);
+		sum = _mm256_add_epi32(_mm256_add_epi32(_mm256_abs_epi32(_mm256_sub_epi32(l2, c0)), _mm256_abs_epi32(_mm256_sub_epi32(r2, c0))), _mm256_abs_epi32(_mm256_sub_epi32(l1, r1)));
+		diffA = _mm256_add_epi32(_mm256_add_epi32(_mm256_slli_epi32(sum, 1), sum),
+			_mm256_slli_epi32(_mm256_add_epi32(_mm256_abs_epi32(_mm256_sub_epi32(r3, r1)), _mm256_abs_epi32(_mm256_sub_epi32(l3, l1))), 1));
+
+		guessB = _mm256_sub_epi32(_mm256_sub_epi32(_mm256_slli_epi32(_mm256_add_epi32(_mm256_add_epi32(u1, c0), d1), 1), u2), d2);
+		sum = _mm256_add_epi32(_mm256_add_epi32(_mm256_abs_epi32(_mm256_sub_epi32(u2, c0)), _mm256_abs_epi32(_mm256_sub_epi32(d2, c0))), _mm256_abs_epi32(_mm256_sub_epi32(u1, d1)));
+		diffB = _mm256_add_epi32(_mm256_add_epi32(_mm256_slli_epi32(sum, 1), sum),
+			_mm256_slli_epi32(_mm256_add_epi32(_mm256_abs_epi32(_mm256_sub_epi32(d3, d1)), _mm256_abs_epi32(_mm256_sub_epi32(u3, u1))), 1));
+
+		guessA = _mm256_min_epi32(_mm256_max_epi32(_mm256_srai_epi32(guessA, 2), _mm256_min_epi32(l1, r1)), _mm256_max_epi32(l1, r1));
+		guessB = _mm256_min_epi32(_mm256_max_epi32(_mm256_srai_epi32(guessB, 2), _mm256_min_epi32(u1, d1)), _mm256_max_epi32(u1, d1));
+
+		store_every_fourth(out + col*4 + 1, SELECT(_mm256_cmpgt_epi32(diffA, diffB), guessB, guessA));
+	}
+
+	ppg_green_row(cfa, p, out, col, end);
+}
+
+/* See ppg_rb_at_green_row() for the scalar version */
+void
+ppg_rb_at_green_row_AVX2(const gushort *cfa, const gint p, const gushort *green_up, const gushort *green, const gushort *green_down, gushort *out, gint col, const gint end, const gint c)
+{
+	const __m256i even_mask = _mm256_set1_epi32(0xffff);
+
+	for (; col + 18 <= end; col += 16)
+	{
+		const gushort *pix = cfa + col;
+		__m256i c2 = _mm256_slli_epi32(LOAD_EVEN(pix), 1);
+		__m256i h, v;
+
+		h = _mm256_add_epi32(_mm256_add_epi32(LOAD_EVEN(pix-1), LOAD_EVEN(pix+1)), c2);
+		h = _mm256_sub_epi32(_mm256_sub_epi32(h, LOAD_EVEN(green+col-1)), LOAD_EVEN(green+col+1));
+		v = _mm256_add_epi32(_mm256_add_epi32(LOAD_EVEN(pix-p), LOAD_EVEN(pix+p)), c2);
+		v = _mm256_sub_epi32(_mm256_sub_epi32(v, LOAD_EVEN(green_up+col)), LOAD_EVEN(green_down+col));
+
+		store_every_fourth(out + col*4 + c, clip_epi32(_mm256_srai_epi32(h, 1)));
+		store_every_fourth(out + col*4 + 2 - c, clip_epi32(_mm256_srai_epi32(v, 1)));
+	}
+
+	ppg_rb_at_green_row(cfa, p, green_up, green, green_down, out, col, end, c);
+}
+
+/* See ppg_rb_at_rb_row() for the scalar version */
+void
+ppg_rb_at_rb_row_AVX2(const gushort *cfa, const gint p, const gushort *green_up, const gushort *green, const gushort *green_down, gushort *out, gint col, const gint end, const gint c)
+{
+	const __m256i even_mask = _mm256_set1_epi32(0xffff);
+
+	for (; col + 18 <= end; col += 16)
+	{
+		const gushort *pix = cfa + col;
+		__m256i g0 = LOAD_EVEN(green+col);
+		__m256i ul = LOAD_EVEN(pix-p-1), dr = LOAD_EVEN(pix+p+1);
+		__m256i ur = LOAD_EVEN(pix-p+1), dl = LOAD_EVEN(pix+p-1);
+		__m256i gul = LOAD_EVEN(green_up+col-1), gdr = LOAD_EVEN(green_down+col+1);
+		__m256i gur = LOAD_EVEN(green_up+col+1), gdl = LOAD_EVEN(green_down+col-1);
+		__m256i g2 = _mm256_slli_epi32(g0, 1);
+		__m256i diffA, diffB, guessA, guessB;
+
+		diffA = _mm256_add_epi32(_mm256_add_epi32(_mm256_abs_epi32(_mm256_sub_epi32(ul, dr)), _mm256_abs_epi32(_mm256_sub_epi32(gul, g0))), _mm256_abs_epi32(_mm256_sub_epi32(gdr, g0)));
+		guessA = _mm256_sub_epi32(_mm256_sub_epi32(_mm256_add_epi32(_mm256_add_epi32(ul, dr), g2), gul), gdr);
+
+		diffB = _mm256_add_epi32(_mm256_add_epi32(_mm256_abs_epi32(_mm256_sub_epi32(ur, dl)), _mm256_abs_epi32(_mm256_sub_epi32(gur, g0))), _mm256_abs_epi32(_mm256_sub_epi32(gdl, g0)));
+		guessB = _mm256_sub_epi32(_mm256_sub_epi32(_mm256_add_epi32(_mm256_add_epi32(ur, dl), g2), gur), gdl);
+
+		store_every_fourth(out + col*4 + c, clip_epi32(_mm256_srai_epi32(SELECT(_mm256_cmpgt_epi32(diffA, diffB), guessB, guessA), 1)));
+	}
+
+	ppg_rb_at_rb_row(cfa, p, green_up, green, green_down, out, col, end, c);
+}
+
+#undef LOAD_EVEN
+#undef SELECT
+
+#define ABSDIFF_EPU16(a, b) _mm256_or_si256(_mm256_subs_epu16(a, b), _mm256_subs_epu16(b, a))
+
+/* 16 pixels are tested at a time, blocks with a candidate are handed to hotpixel_row() */
+void
+hotpixel_row_AVX2(gushort *img, gint x, const gint end, const gint rowstride)
+{
+	const gint p = rowstride * 2;
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i threshold = _mm256_set1_epi16(2000);
+
+	for (; x + 16 <= end; x += 16)
+	{
+		__m256i c = _mm256_loadu_si256((__m256i *) &img[x]);
+		__m256i left = _mm256_loadu_si256((__m256i *) &img[x-2]);
+		__m256i right = _mm256_loadu_si256((__m256i *) &img[x+2]);
+		__m256i up = _mm256_loadu_si256((__m256i *) &img[x-p]);
+		__m256i down = _mm256_loadu_si256((__m256i *) &img[x+p]);
+		__m256i d, d2, rejected;
+
+		d = _mm256_min_epu16(_mm256_min_epu16(ABSDIFF_EPU16(c, left), ABSDIFF_EPU16(c, right)),
+			_mm256_min_epu16(ABSDIFF_EPU16(c, up), ABSDIFF_EPU16(c, down)));
+		d2 = _mm256_max_epu16(ABSDIFF_EPU16(left, right), ABSDIFF_EPU16(up, down));
+
+		/* d2 * 8, saturating works since d can never be above 65535 */
+		d2 = _mm256_adds_epu16(d2, d2);
+		d2 = _mm256_adds_epu16(d2, d2);
+		d2 = _mm256_adds_epu16(d2, d2);
+
+		rejected = _mm256_or_si256(_mm256_cmpeq_epi16(_mm256_subs_epu16(d, d2), zero), _mm256_cmpeq_epi16(_mm256_subs_epu16(d, threshold), zero));
+		if ((guint) _mm256_movemask_epi8(rejected) != 0xffffffff)
+			hotpixel_row(img, x, x + 16, rowstride);
+	}
+
+	hotpixel_row_SSE2(img, x, end, rowstride);
+}
+
+#undef ABSDIFF_EPU16
+
+#else // not defined (__AVX2__)
+
+void
+ppg_green_row_AVX2(const gushort *cfa, const gint p, gushort *out, gint col, const gint end)
+{
+	ppg_green_row_SSE2(cfa, p, out, col, end);
+}
+
+void
+ppg_rb_at_green_row_AVX2(const gushort *cfa, const gint p, const gushort *green_up, const gushort *green, const gushort *green_down, gushort *out, gint col, const gint end, const gint c)
+{
+	ppg_rb_at_green_row_SSE2(cfa, p, green_up, green, green_down, out, col, end, c);
+}
+
+void
+ppg_rb_at_rb_row_AVX2(const gushort *cfa, const gint p, const gushort *green_up, const gushort *green, const gushort *green_down, gushort *out, gint col, const gint end, const gint c)
+{
+	ppg_rb_at_rb_row_SSE2(cfa, p, green_up, green, green_down, out, col, end, c);
+}
+
+void
+hotpixel_row_AVX2(gushort *img, gint x, const gint end, const gint rowstride)
+{
+	hotpixel_row_SSE2(img, x, end, rowstride);
+}
+
+#endif // not defined (__AVX2__)
@@ -0,0 +1,300 @@
+/*
+ * * Copyright (C) 2006-2011 Anders Brander <anders@brander.dk>,
+ * * Anders Kvist <akv@lnxbx.dk> and Klaus Post <klauspost@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/* Plugin tmpl version 4 */
+
+#include <rawstudio.h>
+
+extern void ahd_homogeneity_pixel(const gfloat *lab, guchar *homo, const gint ts, const gint o);
+extern void ahd_homogeneity_map(const gfloat *lab, guchar *homo, const gint ts, const gint row_end, const gint col_end);
+extern void ppg_green_row(const gushort *cfa, const gint p, gushort *out, gint col, const gint end);
+extern void ppg_rb_at_green_row(const gushort *cfa, const gint p, const gushort *green_up, const gushort *green, const gushort *green_down, gushort *out, gint col, const gint end, const gint c);
+extern void ppg_rb_at_rb_row(const gushort *cfa, const gint p, const gushort *green_up, const gushort *green, const gushort *green_down, gushort *out, gint col, const gint end, const gint c);
+extern void hotpixel_row(gushort *img, gint x, const gint end, const gint rowstride);
+
+#if defined (__SSE2__)
+#include <emmintrin.h>
+
+/* Four pixels at a time, see ahd_homogeneity_pixel() for the scalar version */
+void
+ahd_homogeneity_map_SSE2(const gfloat *lab, guchar *homo, const gint ts, const gint row_end, const gint col_end)
+{
+	const gint dir[4] = { -1, 1, -ts, ts };
+	const __m128 sign_mask = _mm_set1_ps(-0.0f);
+	gint tr, tc, d, i;
+
+	for (tr=2; tr < row_end; tr++)
+	{
+		for (tc=2; tc+4 <= col_end; tc+=4)
+		{
+			const gint o = tr*ts+tc;
+			__m128 ldiff[2][4], abdiff[2][4], leps, abeps;
+			__m128i count[2];
+
+			for (d=0; d < 2; d++)
+			{
+				const gfloat *L = lab + (d*3)*ts*ts + o;
+				const gfloat *A = L + ts*ts;
+				const gfloat *B = A + ts*ts;
+				__m128 l = _mm_loadu_ps(L);
+				__m128 a = _mm_loadu_ps(A);
+				__m128 b = _mm_loadu_ps(B);
+				for (i=0; i < 4; i++)
+				{
+					__m128 da = _mm_sub_ps(a, _mm_loadu_ps(A+dir[i]));
+					__m128 db = _mm_sub_ps(b, _mm_loadu_ps(B+dir[i]));
+					ldiff[d][i] = _mm_andnot_ps(sign_mask, _mm_sub_ps(l, _mm_loadu_ps(L+dir[i])));
+					abdiff[d][i] = _mm_add_ps(_mm_mul_ps(da, da), _mm_mul_ps(db, db));
+				}
+			}
+
+			leps = _mm_min_ps(_mm_max_ps(ldiff[0][0], ldiff[0][1]), _mm_max_ps(ldiff[1][2], ldiff[1][3]));
+			abeps = _mm_min_ps(_mm_max_ps(abdiff[0][0], abdiff[0][1]), _mm_max_ps(abdiff[1][2], abdiff[1][3]));
+
+			for (d=0; d < 2; d++)
+			{
+				/* Masks are all ones, so subtracting them counts */
+				count[d] = _mm_setzero_si128();
+				for (i=0; i < 4; i++)
+				{
+					__m128 mask = _mm_and_ps(_mm_cmple_ps(ldiff[d][i], leps), _mm_cmple_ps(abdiff[d][i], abeps));
+					count[d] = _mm_sub_epi32(count[d], _mm_castps_si128(mask));
+				}
+				count[d] = _mm_packs_epi32(count[d], count[d]);
+				count[d] = _mm_packus_epi16(count[d], count[d]);
+				*(gint32 *) (homo + d*ts*ts + o) = _mm_cvtsi128_si32(count[d]);
+			}
+		}
+
+		for (; tc < col_end; tc++)
+			ahd_homogeneity_pixel(lab, homo, ts, tr*ts+tc);
+	}
+}
+
+/* PPG works on every second pixel. Loading 8 values and masking out the
+   odd ones gives us 4 of them in 32 bit lanes, with room for the math */
+#define LOAD_EVEN(ptr) _mm_and_si128(_mm_loadu_si128((const __m128i *) (ptr)), even_mask)
+
+static inline __m128i
+abs_epi32(__m128i x)
+{
+	__m128i sign = _mm_srai_epi32(x, 31);
+	return _mm_sub_epi32(_mm_xor_si128(x, sign), sign);
+}
+
+static inline __m128i
+select_epi32(__m128i mask, __m128i a, __m128i b)
+{
+	return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+static inline __m128i
+min_epi32(__m128i a, __m128i b)
+{
+	return select_epi32(_mm_cmpgt_epi32(a, b), b, a);
+}
+
+static inline __m128i
+max_epi32(__m128i a, __m128i b)
+{
+	return select_epi32(_mm_cmpgt_epi32(a, b), a, b);
+}
+
+/* Same as clampbits16() */
+static inline __m128i
+clip_epi32(__m128i x)
+{
+	return min_epi32(max_epi32(x, _mm_setzero_si128()), _mm_set1_epi32(65535));
+}
+
+static inline void
+store_every_fourth(gushort *out, __m128i x)
+{
+	out[0] = _mm_extract_epi16(x, 0);
+	out[8] = _mm_extract_epi16(x, 2);
+	out[16] = _mm_extract_epi16(x, 4);
+	out[24] = _mm_extract_epi16(x, 6);
+}
+
+void
+ppg_green_row_SSE2(const gushort *cfa, const gint p, gushort *out, gint col, const gint end)
+{
+	const __m128i even_mask = _mm_set1_epi32(0xffff);
+
+	/* Stop early enough to never read beyond end+2 */
+	for (; col + 10 <= end; col += 8)
+	{
+		const gushort *pix = cfa + col;
+		__m128i c0 = LOAD_EVEN(pix);
+		__m128i l1 = LOAD_EVEN(pix-1), r1 = LOAD_EVEN(pix+1);
+		__m128i l2 = LOAD_EVEN(pix-2), r2 = LOAD_EVEN(pix+2);
+		__m128i l3 = LOAD_EVEN(pix-3), r3 = LOAD_EVEN(pix+3);
+		__m128i u1 = LOAD_EVEN(pix-p), d1 = LOAD_EVEN(pix+p);
+		__m128i u2 = LOAD_EVEN(pix-2*p), d2 = LOAD_EVEN(pix+2*p);
+		__m128i u3 = LOAD_EVEN(pix-3*p), d3 = LOAD_EVEN(pix+3*p);
+		__m128i guessA, guessB, diffA, diffB, sum;
+
+		guessA = _mm_sub_epi32(_mm_sub_epi32(_mm_slli_epi32(_mm_add_epi32(_mm_add_epi32(l1, c0), r1), 1), l2), r2);
+		sum = _mm_add_epi32(_mm_add_epi32(abs_epi32(_mm_sub_epi32(l2, c0)), abs_epi32(_mm_sub_epi32(r2, c0))), abs_epi32(_mm_sub_epi32(l1, r1)));
+		diffA = _mm_add_epi32(_mm_add_epi32(_mm_slli_epi32(sum, 1), sum),
+			_mm_slli_epi32(_mm_add_epi32(abs_epi32(_mm_sub_epi32(r3, r1)), abs_epi32(_mm_sub_epi32(l3, l1))), 1));
+
+		guessB = _mm_sub_epi32(_mm_sub_epi32(_mm_slli_epi32(_mm_add_epi32(_mm_add_epi32(u1, c0), d1), 1), u2), d2);
+		sum = _mm_add_epi32(_mm_add_epi32(abs_epi32(_mm_sub_epi32(u2, c0)), abs_epi32(_mm_sub_epi32(d2, c0))), abs_epi32(_mm_sub_epi32(u1, d1)));
+		diffB = _mm_add_epi32(_mm_add_epi32(_mm_slli_epi32(sum, 1), sum),
+			_mm_slli_epi32(_mm_add_epi32(abs_epi32(_mm_sub_epi32(d3, d1)), abs_epi32(_mm_sub_epi32(u3, u1))), 1));
+
+		guessA = min_epi32(max_epi32(_mm_srai_epi32(guessA, 2), min_epi32(l1, r1)), max_epi32(l1, r1));
+		guessB = min_epi32(max_epi32(_mm_srai_epi32(guessB, 2), min_epi32(u1, d1)), max_epi32(u1, d1));
+
+		store_every_fourth(out + col*4 + 1, select_epi32(_mm_cmpgt_epi32(diffA, diffB), guessB, guessA));
+	}
+
+	ppg_green_row(cfa, p, out, col, end);
+}
+
+void
+ppg_rb_at_green_row_SSE2(const gushort *cfa, const gint p, const gushort *green_up, const gushort *green, const gushort *green_down, gushort *out, gint col, const gint end, const gint c)
+{
+	const __m128i even_mask = _mm_set1_epi32(0xffff);
+
+	for (; col + 10 <= end; col += 8)
+	{
+		const gushort *pix = cfa + col;
+		__m128i c2 = _mm_slli_epi32(LOAD_EVEN(pix), 1);
+		__m128i h, v;
+
+		h = _mm_add_epi32(_mm_add_epi32(LOAD_EVEN(pix-1), LOAD_EVEN(pix+1)), c2);
+		h = _mm_sub_epi32(_mm_sub_epi32(h, LOAD_EVEN(green+col-1)), LOAD_EVEN(green+col+1));
+		v = _mm_add_epi32(_mm_add_epi32(LOAD_EVEN(pix-p), LOAD_EVEN(pix+p)), c2);
+		v = _mm_sub_epi32(_mm_sub_epi32(v, LOAD_EVEN(green_up+col)), LOAD_EVEN(green_down+col));
+
+		store_every_fourth(out + col*4 + c, clip_epi32(_mm_srai_epi32(h, 1)));
+		store_every_fourth(out + col*4 + 2 - c, clip_epi32(_mm_srai_epi32(v, 1)));
+	}
+
+	ppg_rb_at_green_row(cfa, p, green_up, green, green_down, out, col, end, c);
+}
+
+void
+ppg_rb_at_rb_row_SSE2(const gushort *cfa, const gint p, const gushort *green_up, const gushort *green, const gushort *green_down, gushort *out, gint col, const gint end, const gint c)
+{
+	const __m128i even_mask = _mm_set1_epi32(0xffff);
+
+	for (; col + 10 <= end; col += 8)
+	{
+		const gushort *pix = cfa + col;
+		__m128i g0 = LOAD_EVEN(green+col);
+		__m128i ul = LOAD_EVEN(pix-p-1), dr = LOAD_EVEN(pix+p+1);
+		__m128i ur = LOAD_EVEN(pix-p+1), dl = LOAD_EVEN(pix+p-1);
+		__m128i gul = LOAD_EVEN(green_up+col-1), gdr = LOAD_EVEN(green_down+col+1);
+		__m128i gur = LOAD_EVEN(green_up+col+1), gdl = LOAD_EVEN(green_down+col-1);
+		__m128i g2 = _mm_slli_epi32(g0, 1);
+		__m128i diffA, diffB, guessA, guessB;
+
+		diffA = _mm_add_epi32(_mm_add_epi32(abs_epi32(_mm_sub_epi32(ul, dr)), abs_epi32(_mm_sub_epi32(gul, g0))), abs_epi32(_mm_sub_epi32(gdr, g0)));
+		guessA = _mm_sub_epi32(_mm_sub_epi32(_mm_add_epi32(_mm_add_epi32(ul, dr), g2), gul), gdr);
+
+		diffB = _mm_add_epi32(_mm_add_epi32(abs_epi32(_mm_sub_epi32(ur, dl)), abs_epi32(_mm_sub_epi32(gur, g0))), abs_epi32(_mm_sub_epi32(gdl, g0)));
+		guessB = _mm_sub_epi32(_mm_sub_epi32(_mm_add_epi32(_mm_add_epi32(ur, dl), g2), gur), gdl);
+
+		store_every_fourth(out + col*4 + c, clip_epi32(_mm_srai_epi32(select_epi32(_mm_cmpgt_epi32(diffA, diffB), guessB, guessA), 1)));
+	}
+
+	ppg_rb_at_rb_row(cfa, p, green_up, green, green_down, out, col, end, c);
+}
+
+#undef LOAD_EVEN
+
+/* Unsigned 16 bit helpers built from saturating arithmetic */
+#define ABSDIFF_EPU16(a, b) _mm_or_si128(_mm_subs_epu16(a, b), _mm_subs_epu16(b, a))
+#define MIN_EPU16(a, b) _mm_subs_epu16(a, _mm_subs_epu16(a, b))
+#define MAX_EPU16(a, b) _mm_adds_epu16(b, _mm_subs_epu16(a, b))
+
+void
+hotpixel_row_SSE2(gushort *img, gint x, const gint end, const gint rowstride)
+{
+	const gint p = rowstride * 2;
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i threshold = _mm_set1_epi16(2000);
+
+	for (; x + 8 <= end; x += 8)
+	{
+		__m128i c = _mm_loadu_si128((__m128i *) &img[x]);
+		__m128i left = _mm_loadu_si128((__m128i *) &img[x-2]);
+		__m128i right = _mm_loadu_si128((__m128i *) &img[x+2]);
+		__m128i up = _mm_loadu_si128((__m128i *) &img[x-p]);
+		__m128i down = _mm_loadu_si128((__m128i *) &img[x+p]);
+		__m128i d, d2, rejected;
+
+		d = MIN_EPU16(MIN_EPU16(ABSDIFF_EPU16(c, left), ABSDIFF_EPU16(c, right)),
+			MIN_EPU16(ABSDIFF_EPU16(c, up), ABSDIFF_EPU16(c, down)));
+		d2 = MAX_EPU16(ABSDIFF_EPU16(left, right), ABSDIFF_EPU16(up, down));
+
+		/* d2 * 8, saturating works since d can never be above 65535 */
+		d2 = _mm_adds_epu16(d2, d2);
+		d2 = _mm_adds_epu16(d2, d2);
+		d2 = _mm_adds_epu16(d2, d2);
+
+		/* Not a candidate if d <= d2*8 or d <= 2000 */
+		rejected = _mm_or_si128(_mm_cmpeq_epi16(_mm_subs_epu16(d, d2), zero), _mm_cmpeq_epi16(_mm_subs_epu16(d, threshold), zero));
+		if (_mm_movemask_epi8(rejected) != 0xffff)
+			hotpixel_row(img, x, x + 8, rowstride);
+	}
+
+	hotpixel_row(img, x, end, rowstride);
+}
+
+#undef ABSDIFF_EPU16
+#undef MIN_EPU16
+#undef MAX_EPU16
+
+#else // not defined (__SSE2__)
+
+void
+ahd_homogeneity_map_SSE2(const gfloat *lab, guchar *homo, const gint ts, const gint row_end, const gint col_end)
+{
+	ahd_homogeneity_map(lab, homo, ts, row_end, col_end);
+}
+
+void
+ppg_green_row_SSE2(const gushort *cfa, const gint p, gushort *out, gint col, const gint end)
+{
+	ppg_green_row(cfa, p, out, col, end);
+}
+
+void
+ppg_rb_at_green_row_SSE2(const gushort *cfa, const gint p, const gushort *green_up, const gushort *green, const gushort *green_down, gushort *out, gint col, const gint end, const gint c)
+{
+	ppg_rb_at_green_row(cfa, p, green_up, green, green_down, out, col, end, c);
+}
+
+void
+ppg_rb_at_rb_row_SSE2(const gushort *cfa, const gint p, const gushort *green_up, const gushort *green, const gushort *green_down, gushort *out, gint col, const gint end, const gint c)
+{
+	ppg_rb_at_rb_row(cfa, p, green_up, green, green_down, out, col, end, c);
+}
+
+void
+hotpixel_row_SSE2(gushort *img, gint x, const gint end, const gint rowstride)
+{
+	hotpixel_row(img, x, end, rowstride);
+}
+
+#endif // not defined (__SSE2__)
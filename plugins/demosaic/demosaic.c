@@ -21,6 +21,7 @@
 
 #include <rawstudio.h>
 #include <string.h>
+#include <math.h>
 
 #define RS_TYPE_DEMOSAIC (rs_demosaic_type)
 #define RS_DEMOSAIC(obj) (G_TYPE_CHECK_INSTANCE_CAST ((obj), RS_TYPE_DEMOSAIC, RSDemosaic))
@@ -33,13 +34,15 @@ typedef struct {
 	RS_IMAGE16 *image;
 	RS_IMAGE16 *output;
 	guint filters;
-	GThread *threadid;
+	gint tile_start;
+	gint tile_end;
 } ThreadInfo;
 
 typedef enum {
 	RS_DEMOSAIC_NONE,
 	RS_DEMOSAIC_BILINEAR,
 	RS_DEMOSAIC_PPG,
+	RS_DEMOSAIC_AHD,
 	RS_DEMOSAIC_MAX,
 	RS_DEMOSAIC_NONE_HALF
 } RS_DEMOSAIC;
@@ -47,7 +50,8 @@ typedef enum {
 const static gchar *rs_demosaic_ascii[RS_DEMOSAIC_MAX] = {
 	"none",
 	"bilinear",
-	"pixel-grouping"
+	"pixel-grouping",
+	"adaptive-homogeneity"
 };
 
 typedef struct _RSDemosaic RSDemosaic;
@@ -79,6 +83,9 @@ static inline int fc_INDI (const unsigned int filters, const int row, const int
 static void border_interpolate_INDI (const ThreadInfo* t, int colors, int border);
 static void lin_interpolate_INDI(RS_IMAGE16 *image, RS_IMAGE16 *output, const unsigned int filters, const int colors);
 static void ppg_interpolate_INDI(RS_IMAGE16 *image, RS_IMAGE16 *output, const unsigned int filters, const int colors);
+static void ahd_interpolate_INDI(RS_IMAGE16 *image, RS_IMAGE16 *output, const unsigned int filters);
+static void ahd_init(void);
+static void xtrans_interpolate_INDI(RS_IMAGE16 *image, RS_IMAGE16 *output, const gboolean quick);
 static void none_interpolate_INDI(RS_IMAGE16 *in, RS_IMAGE16 *out, const unsigned int filters, const int colors, gboolean half_size);
 static void hotpixel_detect(const ThreadInfo* t);
 static void expand_cfa_data(const ThreadInfo* t);
@@ -105,7 +112,7 @@ rs_demosaic_class_init(RSDemosaicClass *klass)
 
 	g_object_class_install_property(object_class,
 		PROP_METHOD, g_param_spec_string(
-			"method", "demosaic method", "The demosaic algorithm to use (\"bilinear\" or \"pixel-grouping\")",
+			"method", "demosaic method", "The demosaic algorithm to use (\"bilinear\", \"pixel-grouping\" or \"adaptive-homogeneity\")",
 			rs_demosaic_ascii[RS_DEMOSAIC_PPG], G_PARAM_READWRITE)
 	);
 
@@ -117,6 +124,8 @@ rs_demosaic_class_init(RSDemosaicClass *klass)
 
 	filter_class->name = "Demosaic filter";
 	filter_class->get_image = get_image;
+
+	ahd_init();
 }
 
 static void
@@ -220,12 +229,23 @@ get_image(RSFilter *filter, const RSFilterRequest *request)
 		rs_filter_response_set_quick(response);
 	}
 
+	/* X-Trans has its own interpolation, with a quick version for previews */
+	if (input->filters == RS_FILTERS_XTRANS)
+	{
+		output = rs_image16_new(input->w, input->h, 3, 4);
+		rs_filter_response_set_image(response, output);
+		g_object_unref(output);
+		xtrans_interpolate_INDI(input, output, method == RS_DEMOSAIC_NONE);
+		g_object_unref(input);
+		return response;
+	}
+
 	/* Magic - Ask Dave ;) */
 	filters = input->filters;
 	filters &= ~((filters & 0x55555555) << 1);
 
-	/* Check if pattern is 2x2, otherwise we cannot do "none" demosaic */
-	if (method == RS_DEMOSAIC_NONE)
+	/* Check if pattern is 2x2, otherwise we cannot do "none" or AHD demosaic */
+	if (method == RS_DEMOSAIC_NONE || method == RS_DEMOSAIC_AHD)
 		if (! ( (filters & 0xff ) == ((filters >> 8) & 0xff) &&
 			((filters >> 16) & 0xff) == ((filters >> 24) & 0xff) &&
 			(filters & 0xff) == ((filters >> 24) &0xff)))
@@ -259,6 +279,9 @@ get_image(RSFilter *filter, const RSFilterRequest *request)
 	  case RS_DEMOSAIC_PPG:
 			ppg_interpolate_INDI(input,output, filters, 3);
 			break;
+		case RS_DEMOSAIC_AHD:
+			ahd_interpolate_INDI(input, output, filters);
+			break;
 		case RS_DEMOSAIC_NONE:
 			none_interpolate_INDI(input, output, filters, 3, FALSE);
 			break;
@@ -421,97 +444,204 @@ inline guint clampbits16(gint x) { guint32 _y_temp; if( (_y_temp=x>>16) ) x = ~_
 #define CLIP(x) clampbits16(x)
 #define ULIM(x,y,z) ((y) < (z) ? CLAMP(x,y,z) : CLAMP(x,z,y))
 
-static void
-interpolate_INDI_part(ThreadInfo *t)
-{
-  RS_IMAGE16 *image = t->output;
-  const unsigned int filters = t->filters;
-  
-  /* Subtract 3 from top and bottom  */
-  const int start_y = MAX(3, t->start_y);
-  const int end_y = MIN(image->h-3, t->end_y);
-  int row, col, c, d;
-	int diffA, diffB, guessA, guessB;
-	int p = image->pitch;
-	int p3 = p*3;
-  gushort (*pix)[4];
-
-  {
-/*  Fill in the green layer with gradients and pattern recognition: */
-  for (row=start_y; row < end_y; row++)
-    for (col=3+(FC(row,3) & 1), c=FC(row,col); col < image->w-3; col+=2) {
-      pix = (gushort (*)[4])GET_PIXEL(image, col, row);
-
-	guessA = (pix[-1][1] + pix[0][c] + pix[1][1]) * 2
-		      - pix[-2*1][c] - pix[2*1][c];
-	diffA = ( ABS(pix[-2*1][c] - pix[ 0][c]) +
-		    ABS(pix[ 2*1][c] - pix[ 0][c]) +
-		    ABS(pix[  -1][1] - pix[ 1][1]) ) * 3 +
-		  ( ABS(pix[ 3*1][1] - pix[ 1][1]) +
-		    ABS(pix[-3*1][1] - pix[-1][1]) ) * 2;
-
-	guessB = (pix[-p][1] + pix[0][c] + pix[p][1]) * 2
-		      - pix[-2*p][c] - pix[2*p][c];
-	diffB = ( ABS(pix[-2*p][c] - pix[ 0][c]) +
-		    ABS(pix[ 2*p][c] - pix[ 0][c]) +
-		    ABS(pix[  -p][1] - pix[ p][1]) ) * 3 +
-		  ( ABS(pix[ p3][1] - pix[ p][1]) +
-		    ABS(pix[-p3][1] - pix[-p][1]) ) * 2;
+/* Row kernels, one set per instruction set. They read the CFA directly and
+   handle every second pixel from col to end. The output has 4 channels */
+extern void ppg_green_row(const gushort *cfa, const gint p, gushort *out, gint col, const gint end);
+extern void ppg_green_row_SSE2(const gushort *cfa, const gint p, gushort *out, gint col, const gint end);
+extern void ppg_green_row_AVX2(const gushort *cfa, const gint p, gushort *out, gint col, const gint end);
+extern void ppg_rb_at_green_row(const gushort *cfa, const gint p, const gushort *green_up, const gushort *green, const gushort *green_down, gushort *out, gint col, const gint end, const gint c);
+extern void ppg_rb_at_green_row_SSE2(const gushort *cfa, const gint p, const gushort *green_up, const gushort *green, const gushort *green_down, gushort *out, gint col, const gint end, const gint c);
+extern void ppg_rb_at_green_row_AVX2(const gushort *cfa, const gint p, const gushort *green_up, const gushort *green, const gushort *green_down, gushort *out, gint col, const gint end, const gint c);
+extern void ppg_rb_at_rb_row(const gushort *cfa, const gint p, const gushort *green_up, const gushort *green, const gushort *green_down, gushort *out, gint col, const gint end, const gint c);
+extern void ppg_rb_at_rb_row_SSE2(const gushort *cfa, const gint p, const gushort *green_up, const gushort *green, const gushort *green_down, gushort *out, gint col, const gint end, const gint c);
+extern void ppg_rb_at_rb_row_AVX2(const gushort *cfa, const gint p, const gushort *green_up, const gushort *green, const gushort *green_down, gushort *out, gint col, const gint end, const gint c);
+
+typedef void (*PpgGreenFunc)(const gushort *cfa, const gint p, gushort *out, gint col, const gint end);
+typedef void (*PpgRBFunc)(const gushort *cfa, const gint p, const gushort *green_up, const gushort *green, const gushort *green_down, gushort *out, gint col, const gint end, const gint c);
+
+/*  Fill in the green layer with gradients and pattern recognition */
+void
+ppg_green_row(const gushort *cfa, const gint p, gushort *out, gint col, const gint end)
+{
+	const gint p3 = p*3;
+	gint diffA, diffB, guessA, guessB;
+
+	for (; col < end; col+=2)
+	{
+		const gushort *pix = cfa + col;
+
+		guessA = (pix[-1] + pix[0] + pix[1]) * 2 - pix[-2] - pix[2];
+		diffA = ( ABS(pix[-2] - pix[0]) +
+			ABS(pix[ 2] - pix[0]) +
+			ABS(pix[-1] - pix[1]) ) * 3 +
+			( ABS(pix[ 3] - pix[ 1]) +
+			ABS(pix[-3] - pix[-1]) ) * 2;
+
+		guessB = (pix[-p] + pix[0] + pix[p]) * 2 - pix[-2*p] - pix[2*p];
+		diffB = ( ABS(pix[-2*p] - pix[0]) +
+			ABS(pix[ 2*p] - pix[0]) +
+			ABS(pix[  -p] - pix[p]) ) * 3 +
+			( ABS(pix[ p3] - pix[ p]) +
+			ABS(pix[-p3] - pix[-p]) ) * 2;
 
 		if (diffA > diffB)
-			pix[0][1] = ULIM(guessB >> 2, pix[p][1], pix[-p][1]);
+			out[col*4+1] = ULIM(guessB >> 2, pix[p], pix[-p]);
 		else
-			pix[0][1] = ULIM(guessA >> 2, pix[1][1], pix[-1][1]);
-    }
-/*  Calculate red and blue for each green pixel:		*/
-  for (row=start_y-2; row < end_y+2; row++)
-    for (col=1+(FC(row,2) & 1), c=FC(row,col+1); col < image->w-1; col+=2) {
-      pix = (gushort (*)[4])GET_PIXEL(image, col, row);
-      pix[0][c] = CLIP((pix[-1][c] + pix[1][c] + 2*pix[0][1]
-          - pix[-1][1] - pix[1][1]) >> 1);
-      c=2-c;
-      pix[0][c] = CLIP((pix[-p][c] + pix[p][c] + 2*pix[0][1]
-          - pix[-p][1] - pix[p][1]) >> 1);
-      c=2-c;
-    }
+			out[col*4+1] = ULIM(guessA >> 2, pix[1], pix[-1]);
+	}
+}
 
-/*  Calculate blue for red pixels and vice versa:		*/
-	for (row=start_y-2; row < end_y+2; row++)
-		for (col=1+(FC(row,1) & 1), c=2-FC(row,col); col < image->w-1; col+=2) {
-			pix = (gushort (*)[4])GET_PIXEL(image, col, row);
-			d = 1 + p;
-			diffA = ABS(pix[-d][c] - pix[d][c]) +
-				ABS(pix[-d][1] - pix[0][1]) +
-				ABS(pix[ d][1] - pix[0][1]);
-			guessA = pix[-d][c] + pix[d][c] + 2*pix[0][1]
-			- pix[-d][1] - pix[d][1];
-
-			d = p - 1;
-			diffB = ABS(pix[-d][c] - pix[d][c]) +
-				ABS(pix[-d][1] - pix[0][1]) +
-				ABS(pix[ d][1] - pix[0][1]);
-			guessB = pix[-d][c] + pix[d][c] + 2*pix[0][1]
-				- pix[-d][1] - pix[d][1];
-
-			if (diffA > diffB)
-				pix[0][c] = CLIP(guessB >> 1);
-			else
-				pix[0][c] = CLIP(guessA >> 1);
-		}
+/*  Calculate red and blue for each green pixel, c is the color to the left and right */
+void
+ppg_rb_at_green_row(const gushort *cfa, const gint p, const gushort *green_up, const gushort *green, const gushort *green_down, gushort *out, gint col, const gint end, const gint c)
+{
+	for (; col < end; col+=2)
+	{
+		const gushort *pix = cfa + col;
+		out[col*4+c] = CLIP((pix[-1] + pix[1] + 2*pix[0] - green[col-1] - green[col+1]) >> 1);
+		out[col*4+2-c] = CLIP((pix[-p] + pix[p] + 2*pix[0] - green_up[col] - green_down[col]) >> 1);
+	}
+}
+
+/*  Calculate blue for red pixels and vice versa, c is the color to calculate */
+void
+ppg_rb_at_rb_row(const gushort *cfa, const gint p, const gushort *green_up, const gushort *green, const gushort *green_down, gushort *out, gint col, const gint end, const gint c)
+{
+	gint diffA, diffB, guessA, guessB;
+
+	for (; col < end; col+=2)
+	{
+		const gushort *pix = cfa + col;
+
+		diffA = ABS(pix[-p-1] - pix[p+1]) +
+			ABS(green_up[col-1] - green[col]) +
+			ABS(green_down[col+1] - green[col]);
+		guessA = pix[-p-1] + pix[p+1] + 2*green[col]
+			- green_up[col-1] - green_down[col+1];
+
+		diffB = ABS(pix[-p+1] - pix[p-1]) +
+			ABS(green_up[col+1] - green[col]) +
+			ABS(green_down[col-1] - green[col]);
+		guessB = pix[-p+1] + pix[p-1] + 2*green[col]
+			- green_up[col+1] - green_down[col-1];
+
+		if (diffA > diffB)
+			out[col*4+c] = CLIP(guessB >> 1);
+		else
+			out[col*4+c] = CLIP(guessA >> 1);
 	}
 }
 
 gpointer
-start_interp_thread(gpointer _thread_info)
+start_interp_prepare_thread(gpointer _thread_info)
 {
 	ThreadInfo* t = _thread_info;
 	hotpixel_detect(t);
+
+	return NULL;
+}
+
+gpointer
+start_interp_expand_thread(gpointer _thread_info)
+{
+	ThreadInfo* t = _thread_info;
 	expand_cfa_data(t);
-	border_interpolate_INDI (t, 3, 3);
-	interpolate_INDI_part(t);
-	g_thread_exit(NULL);
 
-	return NULL; /* Make the compiler shut up - we'll never return */
+	return NULL;
+}
+
+gpointer
+start_interp_green_thread(gpointer _thread_info)
+{
+	ThreadInfo* t = _thread_info;
+	RS_IMAGE16 *image = t->image;
+	RS_IMAGE16 *output = t->output;
+	const guint filters = t->filters;
+	const gint start_y = MAX(3, t->start_y);
+	const gint end_y = MIN(output->h-3, t->end_y);
+	PpgGreenFunc green_row = ppg_green_row;
+	gint row;
+
+	if (rs_detect_cpu_features() & RS_CPU_FLAG_AVX2)
+		green_row = ppg_green_row_AVX2;
+	else if (rs_detect_cpu_features() & RS_CPU_FLAG_SSE2)
+		green_row = ppg_green_row_SSE2;
+
+	border_interpolate_INDI(t, 3, 3);
+
+	for (row=start_y; row < end_y; row++)
+		green_row(GET_PIXEL(image, 0, row), image->rowstride, GET_PIXEL(output, 0, row), 3+(FC(row,3) & 1), output->w-3);
+
+	return NULL;
+}
+
+static inline void
+ppg_extract_green(const RS_IMAGE16 *output, const gint row, gushort *green)
+{
+	const gushort *src = GET_PIXEL(output, 0, row);
+	gint col;
+
+	for (col=0; col < output->w; col++)
+		green[col] = src[col*4+1];
+}
+
+gpointer
+start_interp_rb_thread(gpointer _thread_info)
+{
+	ThreadInfo* t = _thread_info;
+	RS_IMAGE16 *image = t->image;
+	RS_IMAGE16 *output = t->output;
+	const guint filters = t->filters;
+	const gint start_y = MAX(1, t->start_y);
+	const gint end_y = MIN(output->h-1, t->end_y);
+	PpgRBFunc rb_at_green_row = ppg_rb_at_green_row;
+	PpgRBFunc rb_at_rb_row = ppg_rb_at_rb_row;
+	gushort *buffer, *green_up, *green, *green_down, *tmp;
+	gint row, col;
+
+	if (start_y >= end_y)
+		return NULL;
+
+	if (rs_detect_cpu_features() & RS_CPU_FLAG_AVX2)
+	{
+		rb_at_green_row = ppg_rb_at_green_row_AVX2;
+		rb_at_rb_row = ppg_rb_at_rb_row_AVX2;
+	}
+	else if (rs_detect_cpu_features() & RS_CPU_FLAG_SSE2)
+	{
+		rb_at_green_row = ppg_rb_at_green_row_SSE2;
+		rb_at_rb_row = ppg_rb_at_rb_row_SSE2;
+	}
+
+	/* The green of three rows, so the kernels can read it without striding */
+	buffer = g_new(gushort, output->w * 3);
+	green_up = buffer;
+	green = green_up + output->w;
+	green_down = green + output->w;
+	ppg_extract_green(output, start_y-1, green_up);
+	ppg_extract_green(output, start_y, green);
+
+	for (row=start_y; row < end_y; row++)
+	{
+		const gushort *cfa = GET_PIXEL(image, 0, row);
+		gushort *out = GET_PIXEL(output, 0, row);
+
+		ppg_extract_green(output, row+1, green_down);
+
+		col = 1+(FC(row,2) & 1);
+		rb_at_green_row(cfa, image->rowstride, green_up, green, green_down, out, col, output->w-1, FC(row,col+1));
+		col = 1+(FC(row,1) & 1);
+		rb_at_rb_row(cfa, image->rowstride, green_up, green, green_down, out, col, output->w-1, 2-FC(row,col));
+
+		tmp = green_up;
+		green_up = green;
+		green = green_down;
+		green_down = tmp;
+	}
+
+	g_free(buffer);
+
+	return NULL;
 }
 
 static void
@@ -534,17 +664,641 @@ ppg_interpolate_INDI(RS_IMAGE16 *image, RS_IMAGE16 *output, const unsigned int f
 		y_offset += y_per_thread;
 		y_offset = MIN(image->h, y_offset);
 		t[i].end_y = y_offset;
+	}
+
+	/* Each pass reads rows of its neighbours, so it must be done everywhere before the next */
+	rs_thread_pool_run(start_interp_prepare_thread, t, sizeof(ThreadInfo), threads);
+	rs_thread_pool_run(start_interp_expand_thread, t, sizeof(ThreadInfo), threads);
+	rs_thread_pool_run(start_interp_green_thread, t, sizeof(ThreadInfo), threads);
+	rs_thread_pool_run(start_interp_rb_thread, t, sizeof(ThreadInfo), threads);
+
+	g_free(t);
+}
+
+/*
+   X-Trans interpolation. The 6x6 pattern does not repeat in 2x2 blocks like
+   Bayer, but every 3x3 window holds all three colors and no row or column
+   has more than two non-green pixels in a row. Everything below relies on
+   that, patterns without it are only averaged.
+*/
+typedef struct {
+	gint color;             /* Color of this pixel */
+	gint dx[8];             /* Position of the 3x3 neighbours */
+	gint dy[8];
+	gint neighbour_color[8];
+	guint mul[3];           /* 4096 divided by the number of neighbours of each color */
+	gint green[4];          /* Distance to the nearest green left, right, up and down */
+} XTransCode;
+
+/**
+ * Build lookup tables for all 36 positions in the X-Trans pattern
+ * @param image An image with filters set to RS_FILTERS_XTRANS
+ * @param codes Table to fill, indexed by row%6 and col%6
+ * @return TRUE if the pattern can be interpolated from 3x3 neighbours, FALSE otherwise
+ */
+static gboolean
+xtrans_codes_init(const RS_IMAGE16 *image, XTransCode codes[6][6])
+{
+	static const gint dir[4][2] = { {-1, 0}, {1, 0}, {0, -1}, {0, 1} };
+	gboolean usable = TRUE;
+	gint row, col, x, y, i, c, d, count[3];
+
+	for (row=0; row < 6; row++)
+		for (col=0; col < 6; col++)
+		{
+			XTransCode *code = &codes[row][col];
+
+			code->color = XTRANS_COLOR(image, row, col);
+			count[0] = count[1] = count[2] = 0;
+			i = 0;
+			for (y=-1; y <= 1; y++)
+				for (x=-1; x <= 1; x++)
+				{
+					if (x == 0 && y == 0)
+						continue;
+					code->dx[i] = x;
+					code->dy[i] = y;
+					code->neighbour_color[i] = XTRANS_COLOR(image, row+y, col+x);
+					count[code->neighbour_color[i]]++;
+					i++;
+				}
+
+			for (c=0; c < 3; c++)
+			{
+				code->mul[c] = count[c] ? 4096 / count[c] : 0;
+				if (c != code->color && count[c] == 0)
+					usable = FALSE;
+			}
+
+			for (d=0; d < 4; d++)
+			{
+				if (XTRANS_COLOR(image, row+dir[d][1], col+dir[d][0]) == 1)
+					code->green[d] = 1;
+				else if (XTRANS_COLOR(image, row+dir[d][1]*2, col+dir[d][0]*2) == 1)
+					code->green[d] = 2;
+				else
+				{
+					code->green[d] = 0;
+					if (code->color != 1)
+						usable = FALSE;
+				}
+			}
+		}
+
+	return usable;
+}
+
+/* Average of each color around a pixel, growing the window until all colors are found */
+static inline void
+xtrans_average_pixel(const RS_IMAGE16 *image, RS_IMAGE16 *output, const gint row, const gint col)
+{
+	gushort *out = GET_PIXEL(output, col, row);
+	gint sum[3], count[3];
+	gint radius, x, y, c;
+
+	for (radius=1; radius <= 2; radius++)
+	{
+		sum[0] = sum[1] = sum[2] = 0;
+		count[0] = count[1] = count[2] = 0;
+		for (y=MAX(0, row-radius); y <= MIN(image->h-1, row+radius); y++)
+			for (x=MAX(0, col-radius); x <= MIN(image->w-1, col+radius); x++)
+			{
+				c = XTRANS_COLOR(image, y, x);
+				sum[c] += GET_PIXEL(image, x, y)[0];
+				count[c]++;
+			}
+		if (count[0] && count[1] && count[2])
+			break;
+	}
+
+	for (c=0; c < 3; c++)
+		out[c] = count[c] ? sum[c] / count[c] : 0;
+	out[XTRANS_COLOR(image, row, col)] = GET_PIXEL(image, col, row)[0];
+}
+
+static void
+xtrans_border(const ThreadInfo* t, const gint border)
+{
+	RS_IMAGE16 *image = t->image;
+	gint row, col;
+
+	for (row=t->start_y; row < t->end_y; row++)
+		for (col=0; col < image->w; col++)
+		{
+			if (col==border && row >= border && row < image->h-border)
+				col = image->w-border;
+			xtrans_average_pixel(image, t->output, row, col);
+		}
+}
+
+/* Quick version, every missing color is the average of the 3x3 neighbours */
+gpointer
+start_xtrans_quick_thread(gpointer _thread_info)
+{
+	ThreadInfo* t = _thread_info;
+	RS_IMAGE16 *image = t->image;
+	RS_IMAGE16 *output = t->output;
+	const gint start_y = MAX(1, t->start_y);
+	const gint end_y = MIN(image->h-1, t->end_y);
+	XTransCode codes[6][6];
+	gint row, col, i, c;
+
+	if (!xtrans_codes_init(image, codes))
+	{
+		for (row=t->start_y; row < t->end_y; row++)
+			for (col=0; col < image->w; col++)
+				xtrans_average_pixel(image, output, row, col);
+		return NULL;
+	}
+
+	xtrans_border(t, 1);
+
+	for (row=start_y; row < end_y; row++)
+	{
+		const gushort *cfa = GET_PIXEL(image, 0, row);
+		gushort *out = GET_PIXEL(output, 1, row);
+
+		for (col=1; col < image->w-1; col++, out += 4)
+		{
+			const XTransCode *code = &codes[row % 6][col % 6];
+			guint sum[3] = {0, 0, 0};
+
+			for (i=0; i < 8; i++)
+				sum[code->neighbour_color[i]] += cfa[col + code->dy[i]*image->rowstride + code->dx[i]];
+			for (c=0; c < 3; c++)
+				out[c] = (sum[c] * code->mul[c]) >> 12;
+			out[code->color] = cfa[col];
+		}
+	}
+
+	return NULL;
+}
+
+/* Green at red and blue pixels, weighted towards the direction with the smallest gradient */
+gpointer
+start_xtrans_green_thread(gpointer _thread_info)
+{
+	ThreadInfo* t = _thread_info;
+	RS_IMAGE16 *image = t->image;
+	RS_IMAGE16 *output = t->output;
+	const gint p = image->rowstride;
+	const gint start_y = MAX(2, t->start_y);
+	const gint end_y = MIN(image->h-2, t->end_y);
+	XTransCode codes[6][6];
+	gint row, col;
+
+	xtrans_codes_init(image, codes);
+	xtrans_border(t, 2);
+
+	for (row=start_y; row < end_y; row++)
+	{
+		const gushort *cfa = GET_PIXEL(image, 0, row);
+		gushort *out = GET_PIXEL(output, 2, row);
+
+		for (col=2; col < image->w-2; col++, out += 4)
+		{
+			const XTransCode *code = &codes[row % 6][col % 6];
+			const gushort *pix = cfa + col;
+			gint gl, gr, gu, gd, gh, gv, grad_h, grad_v;
+
+			out[code->color] = pix[0];
+			if (code->color == 1)
+				continue;
+
+			gl = pix[-code->green[0]];
+			gr = pix[code->green[1]];
+			gu = pix[-code->green[2]*p];
+			gd = pix[code->green[3]*p];
+
+			/* Linear between the nearest greens, which can be one or two pixels away */
+			gh = (gl * code->green[1] + gr * code->green[0]) / (code->green[0] + code->green[1]);
+			gv = (gu * code->green[3] + gd * code->green[2]) / (code->green[2] + code->green[3]);
+
+			grad_h = ABS(gl - gr) + 1;
+			grad_v = ABS(gu - gd) + 1;
+
+			out[1] = ((gint64) gh * grad_v + (gint64) gv * grad_h) / (grad_h + grad_v);
+		}
+	}
+
+	return NULL;
+}
+
+/* Green at red and blue pixels again, now from the color difference of the 3x3
+   neighbours, using red and blue from the previous pass. Neighbours with a
+   color close to ours count the most */
+gpointer
+start_xtrans_refine_thread(gpointer _thread_info)
+{
+	ThreadInfo* t = _thread_info;
+	RS_IMAGE16 *image = t->image;
+	RS_IMAGE16 *output = t->output;
+	const gint start_y = MAX(1, t->start_y);
+	const gint end_y = MIN(image->h-1, t->end_y);
+	XTransCode codes[6][6];
+	gint row, col, i;
+
+	xtrans_codes_init(image, codes);
+
+	for (row=start_y; row < end_y; row++)
+	{
+		const gushort *cfa = GET_PIXEL(image, 0, row);
+		gushort *out = GET_PIXEL(output, 1, row);
 
-		t[i].threadid = g_thread_new("RSDemosaic worker (ppg)", start_interp_thread, &t[i]);
+		for (col=1; col < image->w-1; col++, out += 4)
+		{
+			const XTransCode *code = &codes[row % 6][col % 6];
+			const gint c = code->color;
+			gint diff = 0, weight = 0;
+
+			if (c == 1)
+				continue;
+
+			for (i=0; i < 8; i++)
+				if (code->neighbour_color[i] == 1)
+				{
+					const gint dx = code->dx[i];
+					const gint dy = code->dy[i];
+					const gint v = out[dy*output->rowstride + dx*4 + c];
+					const gint w = 65536 / (ABS(v - cfa[col]) + 64);
+					diff += w * (cfa[col + dy*image->rowstride + dx] - v);
+					weight += w;
+				}
+
+			out[1] = CLIP(cfa[col] + diff / weight);
+		}
 	}
 
-	/* Wait for threads to finish */
-	for(i = 0; i < threads; i++)
-		g_thread_join(t[i].threadid);
+	return NULL;
+}
+
+/* Red and blue from the weighted color difference to green of the 3x3 neighbours */
+gpointer
+start_xtrans_rb_thread(gpointer _thread_info)
+{
+	ThreadInfo* t = _thread_info;
+	RS_IMAGE16 *image = t->image;
+	RS_IMAGE16 *output = t->output;
+	const gint start_y = MAX(1, t->start_y);
+	const gint end_y = MIN(image->h-1, t->end_y);
+	XTransCode codes[6][6];
+	gint row, col, i, c;
+
+	xtrans_codes_init(image, codes);
+
+	for (row=start_y; row < end_y; row++)
+	{
+		const gushort *cfa = GET_PIXEL(image, 0, row);
+		gushort *out = GET_PIXEL(output, 1, row);
+
+		for (col=1; col < image->w-1; col++, out += 4)
+		{
+			const XTransCode *code = &codes[row % 6][col % 6];
+			gint diff[3] = {0, 0, 0};
+			gint weight[3] = {0, 0, 0};
+
+			/* Neighbours with a green close to ours are more likely on the same side of an edge */
+			for (i=0; i < 8; i++)
+			{
+				const gint dx = code->dx[i];
+				const gint dy = code->dy[i];
+				const gint g = out[dy*output->rowstride + dx*4 + 1];
+				const gint w = 65536 / (ABS(g - out[1]) + 64);
+				const gint n = code->neighbour_color[i];
+				diff[n] += w * (cfa[col + dy*image->rowstride + dx] - g);
+				weight[n] += w;
+			}
+
+			for (c=0; c < 3; c += 2)
+				if (c != code->color)
+					out[c] = CLIP(out[1] + diff[c] / weight[c]);
+		}
+	}
+
+	return NULL;
+}
+
+static void
+xtrans_interpolate_INDI(RS_IMAGE16 *image, RS_IMAGE16 *output, const gboolean quick)
+{
+	guint i, y_offset, y_per_thread, threaded_h;
+	const guint threads = rs_get_number_of_processor_cores();
+	ThreadInfo *t = g_new(ThreadInfo, threads);
+	XTransCode codes[6][6];
+
+	threaded_h = image->h;
+	y_per_thread = (threaded_h + threads-1)/threads;
+	y_offset = 0;
+
+	for (i = 0; i < threads; i++)
+	{
+		t[i].image = image;
+		t[i].output = output;
+		t[i].filters = image->filters;
+		t[i].start_y = y_offset;
+		y_offset += y_per_thread;
+		y_offset = MIN(image->h, y_offset);
+		t[i].end_y = y_offset;
+	}
+
+	if (quick || !xtrans_codes_init(image, codes))
+		rs_thread_pool_run(start_xtrans_quick_thread, t, sizeof(ThreadInfo), threads);
+	else
+	{
+		/* Each pass reads neighbouring rows, so it must be done everywhere before the next */
+		rs_thread_pool_run(start_xtrans_green_thread, t, sizeof(ThreadInfo), threads);
+		rs_thread_pool_run(start_xtrans_rb_thread, t, sizeof(ThreadInfo), threads);
+		rs_thread_pool_run(start_xtrans_refine_thread, t, sizeof(ThreadInfo), threads);
+		rs_thread_pool_run(start_xtrans_rb_thread, t, sizeof(ThreadInfo), threads);
+	}
 
 	g_free(t);
 }
 
+/*
+   Adaptive Homogeneity-Directed interpolation by Keigo Hirakawa and
+   Thomas Parks, as implemented in dcraw. The image is processed in tiles
+   small enough to stay in cache, and tiles are spread across threads.
+*/
+#define AHD_TILE 128
+
+/* Homogeneity map kernels, one per instruction set */
+extern void ahd_homogeneity_pixel(const gfloat *lab, guchar *homo, const gint ts, const gint o);
+extern void ahd_homogeneity_map(const gfloat *lab, guchar *homo, const gint ts, const gint row_end, const gint col_end);
+extern void ahd_homogeneity_map_SSE2(const gfloat *lab, guchar *homo, const gint ts, const gint row_end, const gint col_end);
+extern void ahd_homogeneity_map_AVX(const gfloat *lab, guchar *homo, const gint ts, const gint row_end, const gint col_end);
+
+typedef void (*AhdHomogeneityFunc)(const gfloat *lab, guchar *homo, const gint ts, const gint row_end, const gint col_end);
+
+static gfloat ahd_cbrt[0x10000];
+static gfloat ahd_xyz_cam[3][3];
+
+static void
+ahd_init(void)
+{
+	/* XYZ from sRGB, the input has no known colorspace at this point */
+	static const gfloat xyz_rgb[3][3] = {
+		{ 0.412453f, 0.357580f, 0.180423f },
+		{ 0.212671f, 0.715160f, 0.072169f },
+		{ 0.019334f, 0.119193f, 0.950227f } };
+	static const gfloat d65_white[3] = { 0.950456f, 1.0f, 1.088754f };
+	gint i, j;
+
+	for (i=0; i < 0x10000; i++)
+	{
+		gfloat r = i / 65535.0f;
+		ahd_cbrt[i] = r > 0.008856f ? powf(r, 1.0f/3.0f) : 7.787f*r + 16.0f/116.0f;
+	}
+
+	for (i=0; i < 3; i++)
+		for (j=0; j < 3; j++)
+			ahd_xyz_cam[i][j] = xyz_rgb[i][j] / d65_white[i];
+}
+
+static inline void
+ahd_cielab(const gushort r, const gushort g, const gushort b, gfloat *L, gfloat *A, gfloat *B)
+{
+	gfloat x, y, z;
+
+	x = ahd_xyz_cam[0][0] * r + ahd_xyz_cam[0][1] * g + ahd_xyz_cam[0][2] * b + 0.5f;
+	y = ahd_xyz_cam[1][0] * r + ahd_xyz_cam[1][1] * g + ahd_xyz_cam[1][2] * b + 0.5f;
+	z = ahd_xyz_cam[2][0] * r + ahd_xyz_cam[2][1] * g + ahd_xyz_cam[2][2] * b + 0.5f;
+
+	x = ahd_cbrt[CLIP((gint) x)];
+	y = ahd_cbrt[CLIP((gint) y)];
+	z = ahd_cbrt[CLIP((gint) z)];
+
+	*L = 116.0f * y - 16.0f;
+	*A = 500.0f * (x - y);
+	*B = 200.0f * (y - z);
+}
+
+/* Planar tile buffers: two directions, three channels each */
+#define AHD_RGB(d,c) (rgb + ((d)*3+(c))*AHD_TILE*AHD_TILE)
+#define AHD_LAB(d,c) (lab + ((d)*3+(c))*AHD_TILE*AHD_TILE)
+
+void
+ahd_homogeneity_pixel(const gfloat *lab, guchar *homo, const gint ts, const gint o)
+{
+	const gint dir[4] = { -1, 1, -ts, ts };
+	gfloat ldiff[2][4], abdiff[2][4], leps, abeps;
+	gint d, i;
+
+	for (d=0; d < 2; d++)
+	{
+		const gfloat *L = lab + (d*3)*ts*ts;
+		const gfloat *A = L + ts*ts;
+		const gfloat *B = A + ts*ts;
+		for (i=0; i < 4; i++)
+		{
+			const gfloat da = A[o] - A[o+dir[i]];
+			const gfloat db = B[o] - B[o+dir[i]];
+			ldiff[d][i] = fabsf(L[o] - L[o+dir[i]]);
+			abdiff[d][i] = da*da + db*db;
+		}
+	}
+
+	leps = MIN(MAX(ldiff[0][0], ldiff[0][1]), MAX(ldiff[1][2], ldiff[1][3]));
+	abeps = MIN(MAX(abdiff[0][0], abdiff[0][1]), MAX(abdiff[1][2], abdiff[1][3]));
+
+	for (d=0; d < 2; d++)
+	{
+		guchar count = 0;
+		for (i=0; i < 4; i++)
+			if (ldiff[d][i] <= leps && abdiff[d][i] <= abeps)
+				count++;
+		homo[d*ts*ts+o] = count;
+	}
+}
+
+void
+ahd_homogeneity_map(const gfloat *lab, guchar *homo, const gint ts, const gint row_end, const gint col_end)
+{
+	gint tr, tc;
+
+	for (tr=2; tr < row_end; tr++)
+		for (tc=2; tc < col_end; tc++)
+			ahd_homogeneity_pixel(lab, homo, ts, tr*ts+tc);
+}
+
+static void
+ahd_interpolate_tile(const RS_IMAGE16 *cfa, RS_IMAGE16 *image, const guint filters, const gint top, const gint left,
+	gushort *rgb, gfloat *lab, guchar *homo, AhdHomogeneityFunc homogeneity_map)
+{
+	const gint w = cfa->rowstride;
+	const gint height = image->h;
+	const gint width = image->w;
+	gint row, col, tr, tc, c, d, f, i, j, val, hm[2];
+	const gushort *pix;
+
+	/* Interpolate green horizontally and vertically */
+	for (row = top; row < top+AHD_TILE && row < height-2; row++)
+	{
+		tr = row-top;
+		for (col = left + (FC(row,left) & 1); col < left+AHD_TILE && col < width-2; col+=2)
+		{
+			tc = col-left;
+			pix = GET_PIXEL(cfa, col, row);
+			val = ((pix[-1] + pix[0] + pix[1]) * 2 - pix[-2] - pix[2]) >> 2;
+			AHD_RGB(0,1)[tr*AHD_TILE+tc] = ULIM(val, pix[-1], pix[1]);
+			val = ((pix[-w] + pix[0] + pix[w]) * 2 - pix[-2*w] - pix[2*w]) >> 2;
+			AHD_RGB(1,1)[tr*AHD_TILE+tc] = ULIM(val, pix[-w], pix[w]);
+		}
+	}
+
+	/* Interpolate red and blue, and convert to CIELab */
+	for (d=0; d < 2; d++)
+	{
+		gushort *g = AHD_RGB(d,1);
+		for (row=top+1; row < top+AHD_TILE-1 && row < height-3; row++)
+		{
+			tr = row-top;
+			for (col=left+1; col < left+AHD_TILE-1 && col < width-3; col++)
+			{
+				const gint o = tr*AHD_TILE + (col-left);
+				pix = GET_PIXEL(cfa, col, row);
+				f = FC(row,col);
+				if (f == 1)
+				{
+					c = FC(row+1,col);
+					val = pix[0] + ((pix[-1] + pix[1] - g[o-1] - g[o+1]) >> 1);
+					AHD_RGB(d,2-c)[o] = CLIP(val);
+					val = pix[0] + ((pix[-w] + pix[w] - g[o-AHD_TILE] - g[o+AHD_TILE]) >> 1);
+					AHD_RGB(d,c)[o] = CLIP(val);
+				}
+				else
+				{
+					c = 2 - f;
+					val = g[o] + ((pix[-w-1] + pix[-w+1] + pix[w-1] + pix[w+1]
+						- g[o-AHD_TILE-1] - g[o-AHD_TILE+1] - g[o+AHD_TILE-1] - g[o+AHD_TILE+1] + 1) >> 2);
+					AHD_RGB(d,c)[o] = CLIP(val);
+				}
+				AHD_RGB(d,f)[o] = pix[0];
+				ahd_cielab(AHD_RGB(d,0)[o], AHD_RGB(d,1)[o], AHD_RGB(d,2)[o],
+					&AHD_LAB(d,0)[o], &AHD_LAB(d,1)[o], &AHD_LAB(d,2)[o]);
+			}
+		}
+	}
+
+	/* Build homogeneity maps from the CIELab images */
+	memset(homo, 0, 2*AHD_TILE*AHD_TILE);
+	homogeneity_map(lab, homo, AHD_TILE, MIN(AHD_TILE-2, height-4-top), MIN(AHD_TILE-2, width-4-left));
+
+	/* Combine the most homogenous pixels for the final result */
+	for (row=top+3; row < top+AHD_TILE-3 && row < height-5; row++)
+	{
+		tr = row-top;
+		for (col=left+3; col < left+AHD_TILE-3 && col < width-5; col++)
+		{
+			gushort *out = GET_PIXEL(image, col, row);
+			tc = col-left;
+			for (d=0; d < 2; d++)
+				for (hm[d]=0, i=tr-1; i <= tr+1; i++)
+					for (j=tc-1; j <= tc+1; j++)
+						hm[d] += homo[d*AHD_TILE*AHD_TILE + i*AHD_TILE + j];
+			if (hm[0] != hm[1])
+			{
+				d = hm[1] > hm[0];
+				for (c=0; c < 3; c++)
+					out[c] = AHD_RGB(d,c)[tr*AHD_TILE+tc];
+			}
+			else
+				for (c=0; c < 3; c++)
+					out[c] = (AHD_RGB(0,c)[tr*AHD_TILE+tc] + AHD_RGB(1,c)[tr*AHD_TILE+tc]) >> 1;
+		}
+	}
+}
+
+gpointer
+start_ahd_prepare_thread(gpointer _thread_info)
+{
+	ThreadInfo* t = _thread_info;
+	hotpixel_detect(t);
+	expand_cfa_data(t);
+
+	return NULL;
+}
+
+gpointer
+start_ahd_thread(gpointer _thread_info)
+{
+	ThreadInfo* t = _thread_info;
+	RS_IMAGE16 *image = t->output;
+	const guint filters = t->filters;
+	gint tile, left;
+	AhdHomogeneityFunc homogeneity_map = ahd_homogeneity_map;
+
+	if (rs_detect_cpu_features() & RS_CPU_FLAG_AVX)
+		homogeneity_map = ahd_homogeneity_map_AVX;
+	else if (rs_detect_cpu_features() & RS_CPU_FLAG_SSE2)
+		homogeneity_map = ahd_homogeneity_map_SSE2;
+
+	gushort *rgb = g_new(gushort, 2*3*AHD_TILE*AHD_TILE);
+	gfloat *lab = g_new(gfloat, 2*3*AHD_TILE*AHD_TILE);
+	guchar *homo = g_new(guchar, 2*AHD_TILE*AHD_TILE);
+
+	for (tile = t->tile_start; tile < t->tile_end; tile++)
+	{
+		const gint top = 2 + tile * (AHD_TILE-6);
+		for (left=2; left < image->w-5; left += AHD_TILE-6)
+			ahd_interpolate_tile(t->image, image, filters, top, left, rgb, lab, homo, homogeneity_map);
+	}
+
+	g_free(rgb);
+	g_free(lab);
+	g_free(homo);
+
+	return NULL;
+}
+
+gpointer
+start_ahd_border_thread(gpointer _thread_info)
+{
+	ThreadInfo* t = _thread_info;
+	border_interpolate_INDI(t, 3, 5);
+
+	return NULL;
+}
+
+static void
+ahd_interpolate_INDI(RS_IMAGE16 *image, RS_IMAGE16 *output, const unsigned int filters)
+{
+	guint i, y_offset, y_per_thread, tile_offset, tiles_per_thread;
+	const guint threads = rs_get_number_of_processor_cores();
+	ThreadInfo *t = g_new(ThreadInfo, threads);
+	gint tiles = 0;
+
+	/* Rows of tiles, each tile overlaps its neighbours by 6 pixels */
+	if (image->h > 7)
+		tiles = (image->h - 7 + AHD_TILE-7) / (AHD_TILE-6);
+
+	y_per_thread = (image->h + threads-1)/threads;
+	tiles_per_thread = (tiles + threads-1)/threads;
+	y_offset = 0;
+	tile_offset = 0;
+
+	for (i = 0; i < threads; i++)
+	{
+		t[i].image = image;
+		t[i].output = output;
+		t[i].filters = filters;
+		t[i].start_y = y_offset;
+		y_offset += y_per_thread;
+		y_offset = MIN(image->h, y_offset);
+		t[i].end_y = y_offset;
+		t[i].tile_start = tile_offset;
+		tile_offset += tiles_per_thread;
+		tile_offset = MIN(tiles, tile_offset);
+		t[i].tile_end = tile_offset;
+	}
+
+	/* Tiles read neighbouring rows, so every pass must be done everywhere before the next */
+	rs_thread_pool_run(start_ahd_prepare_thread, t, sizeof(ThreadInfo), threads);
+	rs_thread_pool_run(start_ahd_thread, t, sizeof(ThreadInfo), threads);
+	rs_thread_pool_run(start_ahd_border_thread, t, sizeof(ThreadInfo), threads);
+
+	g_free(t);
+}
 
 gpointer
 start_none_thread(gpointer _thread_info)
@@ -621,9 +1375,8 @@ start_none_thread(gpointer _thread_info)
 			memcpy(GET_PIXEL(t->output, 0, 0), GET_PIXEL(t->output, 0, 1), t->output->rowstride * 2);
 		}
 	}
-	g_thread_exit(NULL);
 
-	return NULL; /* Make the compiler shut up - we'll never return */
+	return NULL;
 }
 
 
@@ -671,9 +1424,8 @@ start_none_thread_half(gpointer _thread_info)
 		}
 
 	}
-	g_thread_exit(NULL);
 
-	return NULL; /* Make the compiler shut up - we'll never return */
+	return NULL;
 }
 
 
@@ -698,87 +1450,95 @@ none_interpolate_INDI(RS_IMAGE16 *in, RS_IMAGE16 *out, const unsigned int filter
 		y_offset += y_per_thread;
 		y_offset = MIN(out->h-1, y_offset);
 		t[i].end_y = y_offset;
-
-		if (half_size)
-			t[i].threadid = g_thread_new("RSDemosaic worker (none) (half-size)", start_none_thread_half, &t[i]);
-		else
-			t[i].threadid = g_thread_new("RSDemosaic worker (none)", start_none_thread, &t[i]);
 	}
 
-	/* Wait for threads to finish */
-	for(i = 0; i < threads; i++)
-		g_thread_join(t[i].threadid);
+	if (half_size)
+		rs_thread_pool_run(start_none_thread_half, t, sizeof(ThreadInfo), threads);
+	else
+		rs_thread_pool_run(start_none_thread, t, sizeof(ThreadInfo), threads);
 
 	g_free(t);
 }
 
-static void
-hotpixel_detect(const ThreadInfo* t)
-{
-
-	RS_IMAGE16 *image = t->image;
+/* Hot pixel detection, one row at a time. Pixels are fixed in place, so the
+   vector versions must fall back to this for any block holding a candidate */
+extern void hotpixel_row(gushort *img, gint x, const gint end, const gint rowstride);
+extern void hotpixel_row_SSE2(gushort *img, gint x, const gint end, const gint rowstride);
+extern void hotpixel_row_AVX2(gushort *img, gint x, const gint end, const gint rowstride);
 
-	gint x, y, end_y;
-	y = MAX( 4, t->start_y);
-	end_y = MIN(t->end_y, image->h - 4);
-
-	for(; y < end_y; y++)
-	{
-		gint col_end = image->w - 4;
-		gushort* img = GET_PIXEL(image, 0, y);
-		gint p = image->rowstride * 2;
-		gint p_one = image->rowstride;
-		for (x = 4; x < col_end ; x++) {
-			/* Calculate minimum difference to surrounding pixels */
-			gint left = (int)img[x - 2];
-			gint c = (int)img[x];
-			gint right = (int)img[x + 2];
-			gint up = (int)img[x - p];
-			gint down = (int)img[x + p];
-
-			gint d = ABS(c - left);
+void
+hotpixel_row(gushort *img, gint x, const gint end, const gint rowstride)
+{
+	gint p = rowstride * 2;
+	gint p_one = rowstride;
+	for (; x < end ; x++) {
+		/* Calculate minimum difference to surrounding pixels */
+		gint left = (int)img[x - 2];
+		gint c = (int)img[x];
+		gint right = (int)img[x + 2];
+		gint up = (int)img[x - p];
+		gint down = (int)img[x + p];
+
+		gint d = ABS(c - left);
+		d = MIN(d, ABS(c - right));
+		d = MIN(d, ABS(c - up));
+		d = MIN(d, ABS(c - down));
+
+		/* Also calculate maximum difference between surrounding pixels themselves */
+		gint d2 = ABS(left - right);
+		d2 = MAX(d2, ABS(up - down));
+
+		/* If difference larger than surrounding pixels by a factor of 4,
+			replace with left/right pixel interpolation */
+
+		if ((d > d2 * 8) && (d > 2000)) {
+			/* Do extended test! */
+			left = (int)img[x - 4];
+			right = (int)img[x + 4];
+			up = (int)img[x - p * 2];
+			down = (int)img[x + p * 2];
+
+			d = MIN(d, ABS(c - left));
 			d = MIN(d, ABS(c - right));
 			d = MIN(d, ABS(c - up));
 			d = MIN(d, ABS(c - down));
 
-			/* Also calculate maximum difference between surrounding pixels themselves */
-			gint d2 = ABS(left - right);
+			/* Create threshold for surrounding pixels - also include other colors */
+			d2 = MAX(d2, ABS(left - right));
 			d2 = MAX(d2, ABS(up - down));
-
-			/* If difference larger than surrounding pixels by a factor of 4,
-				replace with left/right pixel interpolation */
-
-			if ((d > d2 * 8) && (d > 2000)) {
-				/* Do extended test! */
-				left = (int)img[x - 4];
-				right = (int)img[x + 4];
-				up = (int)img[x - p * 2];
-				down = (int)img[x + p * 2];
-
-				d = MIN(d, ABS(c - left));
-				d = MIN(d, ABS(c - right));
-				d = MIN(d, ABS(c - up));
-				d = MIN(d, ABS(c - down));
-
-				/* Create threshold for surrounding pixels - also include other colors */
-				d2 = MAX(d2, ABS(left - right));
-				d2 = MAX(d2, ABS(up - down));
-				d = MIN(d, ABS(c - (int)img[x - 2 - p]));
-				d = MIN(d, ABS(c - (int)img[x + 2 - p]));
-				d = MIN(d, ABS(c - (int)img[x - 2 + p]));
-				d = MIN(d, ABS(c - (int)img[x + 2 + p]));
-				d2 = MAX(d2, ABS((int)img[x - 1] - (int)img[x + 1]));
-				d2 = MAX(d2, ABS((int)img[x - p_one] - (int)img[x + p_one]));
-				d2 = MAX(d2, ABS((int)img[x - 1 - p_one] - (int)img[x + 1 + p_one]));
-				d2 = MAX(d2, ABS((int)img[x - 1 + p_one] - (int)img[x + 1 - p_one]));
-				d2 = MAX(d2, ABS((int)img[x - 2 - p] - (int)img[x + 2 + p]));
-				d2 = MAX(d2, ABS((int)img[x - 2 + p] - (int)img[x + 2 - p]));
-
-				if ((d > d2 * 4) && (d > 1600)) {
-					img[x] = (gushort)(((gint)img[x-2] + (gint)img[x+2] + 1) >> 1);
-				}
+			d = MIN(d, ABS(c - (int)img[x - 2 - p]));
+			d = MIN(d, ABS(c - (int)img[x + 2 - p]));
+			d = MIN(d, ABS(c - (int)img[x - 2 + p]));
+			d = MIN(d, ABS(c - (int)img[x + 2 + p]));
+			d2 = MAX(d2, ABS((int)img[x - 1] - (int)img[x + 1]));
+			d2 = MAX(d2, ABS((int)img[x - p_one] - (int)img[x + p_one]));
+			d2 = MAX(d2, ABS((int)img[x - 1 - p_one] - (int)img[x + 1 + p_one]));
+			d2 = MAX(d2, ABS((int)img[x - 1 + p_one] - (int)img[x + 1 - p_one]));
+			d2 = MAX(d2, ABS((int)img[x - 2 - p] - (int)img[x + 2 + p]));
+			d2 = MAX(d2, ABS((int)img[x - 2 + p] - (int)img[x + 2 - p]));
+
+			if ((d > d2 * 4) && (d > 1600)) {
+				img[x] = (gushort)(((gint)img[x-2] + (gint)img[x+2] + 1) >> 1);
 			}
-
 		}
 	}
 }
+
+static void
+hotpixel_detect(const ThreadInfo* t)
+{
+	RS_IMAGE16 *image = t->image;
+	void (*detect_row)(gushort *img, gint x, const gint end, const gint rowstride) = hotpixel_row;
+
+	gint y, end_y;
+	y = MAX( 4, t->start_y);
+	end_y = MIN(t->end_y, image->h - 4);
+
+	if (rs_detect_cpu_features() & RS_CPU_FLAG_AVX2)
+		detect_row = hotpixel_row_AVX2;
+	else if (rs_detect_cpu_features() & RS_CPU_FLAG_SSE2)
+		detect_row = hotpixel_row_SSE2;
+
+	for(; y < end_y; y++)
+		detect_row(GET_PIXEL(image, 0, y), 4, image->w - 4, image->rowstride);
+}
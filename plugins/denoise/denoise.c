@@ -67,6 +67,9 @@ static void settings_changed(RSSettings *settings, RSSettingsMask mask, RSDenois
 
 static RSFilterClass *rs_denoise_parent_class = NULL;
 
+/* Square root of all 16 bit values, the FFT denoiser works on the same scale */
+static gfloat sqrt_table[65536];
+
 G_MODULE_EXPORT void
 rs_plugin_load(RSPlugin *plugin)
 {
@@ -92,6 +95,7 @@ rs_denoise_class_init(RSDenoiseClass *klass)
 {
 	RSFilterClass *filter_class = RS_FILTER_CLASS (klass);
 	GObjectClass *object_class = G_OBJECT_CLASS(klass);
+	gint i;
 	object_class->finalize = finalize;
 
 	rs_denoise_parent_class = g_type_class_peek_parent (klass);
@@ -107,11 +111,15 @@ rs_denoise_class_init(RSDenoiseClass *klass)
 
 	filter_class->name = "FFT denoise filter";
 	filter_class->get_image = get_image;
+
+	for (i = 0; i < 65536; i++)
+		sqrt_table[i] = sqrtf((gfloat) i);
 }
 
 
-static void
-settings_changed(RSSettings *settings, RSSettingsMask mask, RSDenoise *denoise)
+/* Copy the values we use from settings, returns TRUE if any of them changed */
+static gboolean
+settings_read(RSSettings *settings, RSSettingsMask mask, RSDenoise *denoise)
 {
 	gboolean changed = FALSE;
 
@@ -137,8 +145,14 @@ settings_changed(RSSettings *settings, RSSettingsMask mask, RSDenoise *denoise)
 		}
 	}
 
-	if (changed)
-		rs_filter_changed(RS_FILTER(denoise), RS_FILTER_CHANGED_PIXELDATA);
+	return changed;
+}
+
+static void
+settings_changed(RSSettings *settings, RSSettingsMask mask, RSDenoise *denoise)
+{
+	if (settings_read(settings, mask, denoise))
+		rs_filter_changed(RS_FILTER(denoise), RS_FILTER_CHANGED_PIXELDATA | RS_FILTER_CHANGED_SETTINGS);
 }
 
 static void
@@ -168,6 +182,7 @@ get_property(GObject *object, guint property_id, GValue *value, GParamSpec *pspe
 			g_value_set_int(value, denoise->denoise_chroma);
 			break;
 		case PROP_SETTINGS:
+			g_value_set_object(value, denoise->settings);
 			break;
 		default:
 			G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
@@ -184,12 +199,21 @@ set_property(GObject *object, guint property_id, const GValue *value, GParamSpec
 		case PROP_SETTINGS:
 			if (denoise->settings && denoise->settings_signal_id)
 			{
+				if (denoise->settings == g_value_get_object(value))
+				{
+					settings_changed(denoise->settings, MASK_ALL, denoise);
+					break;
+				}
 				g_signal_handler_disconnect(denoise->settings, denoise->settings_signal_id);
 				g_object_weak_unref(G_OBJECT(denoise->settings), settings_weak_notify, denoise);
 			}
 			denoise->settings = g_value_get_object(value);
 			denoise->settings_signal_id = g_signal_connect(denoise->settings, "settings-changed", G_CALLBACK(settings_changed), denoise);
-			settings_changed(denoise->settings, MASK_ALL, denoise);
+			/* Caches keep renders per settings, tell them even if we render the same */
+			if (settings_read(denoise->settings, MASK_ALL, denoise))
+				rs_filter_changed(RS_FILTER(denoise), RS_FILTER_CHANGED_PIXELDATA | RS_FILTER_CHANGED_SETTINGS);
+			else
+				rs_filter_changed(RS_FILTER(denoise), RS_FILTER_CHANGED_SETTINGS);
 			g_object_weak_ref(G_OBJECT(denoise->settings), settings_weak_notify, denoise);
 			break;
 		default:
@@ -224,24 +248,246 @@ bit_blt(char* dstp, int dst_pitch, const char* srcp, int src_pitch, int row_size
 }
 
 
+/*
+ * Quick denoise, used instead of the FFT denoiser for quick requests. This is
+ * a separable sigma filter, averaging only neighbours closer than a threshold,
+ * in the same square root YCbCr space the FFT denoiser uses.
+ */
+/* Same as SIGMA_FACTOR in fftdenoiser.h, sigma to noise level in square root space */
+#define QUICK_SIGMA_FACTOR 0.25f
+
+typedef struct {
+	RS_IMAGE16 *image;
+	gfloat *planes[3];
+	gint plane_pitch;
+	gint start_y;
+	gint end_y;
+	gfloat threshold[3];
+	gint radius[3];
+} QuickDenoiseInfo;
+
+static inline gfloat
+sigma_filter(const gfloat *in, const gint step, const gint from, const gint to, const gfloat threshold)
+{
+	const gfloat center = in[0];
+	gfloat sum = 0.0f;
+	gint count = 0;
+	gint i;
+
+	for (i = from; i <= to; i++)
+	{
+		const gfloat v = in[i*step];
+		if (fabsf(v - center) < threshold)
+		{
+			sum += v;
+			count++;
+		}
+	}
+
+	return count ? sum / (gfloat) count : center;
+}
+
+static gpointer
+quick_denoise_horizontal(gpointer _info)
+{
+	QuickDenoiseInfo *info = _info;
+	RS_IMAGE16 *image = info->image;
+	gfloat *buffer = g_new(gfloat, image->w * 3);
+	gfloat *row[3] = { buffer, buffer + image->w, buffer + image->w * 2 };
+	gint x, y, c;
+
+	for (y = info->start_y; y < info->end_y; y++)
+	{
+		const gushort *pix = GET_PIXEL(image, 0, y);
+
+		for (x = 0; x < image->w; x++)
+		{
+			const gfloat r = sqrt_table[pix[R]];
+			const gfloat g = sqrt_table[pix[G]];
+			const gfloat b = sqrt_table[pix[B]];
+			row[0][x] = r * 0.299f + g * 0.587f + b * 0.114f;
+			row[1][x] = r * -0.169f + g * -0.331f + b * 0.499f;
+			row[2][x] = r * 0.499f + g * -0.418f + b * -0.0813f;
+			pix += image->pixelsize;
+		}
+
+		for (c = 0; c < 3; c++)
+		{
+			gfloat *out = info->planes[c] + y * info->plane_pitch;
+			const gint radius = info->radius[c];
+
+			for (x = 0; x < image->w; x++)
+				out[x] = sigma_filter(&row[c][x], 1, -MIN(x, radius), MIN(image->w - 1 - x, radius), info->threshold[c]);
+		}
+	}
+
+	g_free(buffer);
+
+	return NULL;
+}
+
+static gpointer
+quick_denoise_vertical(gpointer _info)
+{
+	QuickDenoiseInfo *info = _info;
+	RS_IMAGE16 *image = info->image;
+	const gint pitch = info->plane_pitch;
+	gfloat yuv[3];
+	gint x, y, c;
+
+	for (y = info->start_y; y < info->end_y; y++)
+	{
+		gushort *pix = GET_PIXEL(image, 0, y);
+
+		for (x = 0; x < image->w; x++)
+		{
+			for (c = 0; c < 3; c++)
+			{
+				const gint radius = info->radius[c];
+				yuv[c] = sigma_filter(info->planes[c] + y * pitch + x, pitch, -MIN(y, radius), MIN(image->h - 1 - y, radius), info->threshold[c]);
+			}
+
+			const gfloat r = yuv[0] + 1.402f * yuv[2];
+			const gfloat g = yuv[0] - 0.344f * yuv[1] - 0.714f * yuv[2];
+			const gfloat b = yuv[0] + 1.772f * yuv[1];
+			pix[R] = (gushort) CLAMP(r * r + 0.5f, 0.0f, 65535.0f);
+			pix[G] = (gushort) CLAMP(g * g + 0.5f, 0.0f, 65535.0f);
+			pix[B] = (gushort) CLAMP(b * b + 0.5f, 0.0f, 65535.0f);
+			pix += image->pixelsize;
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Denoise an image in place, approximating the FFT denoiser at a fraction of the cost
+ * @param image An image with 3 channels
+ * @param sigma_luma Luma strength, as given to the FFT denoiser
+ * @param sigma_chroma Chroma strength, as given to the FFT denoiser
+ */
+static void
+quick_denoise(RS_IMAGE16 *image, gfloat sigma_luma, gfloat sigma_chroma)
+{
+	const guint threads = rs_get_number_of_processor_cores();
+	QuickDenoiseInfo *t;
+	gfloat *planes;
+	gint y_offset, y_per_thread;
+	guint i;
+
+	if (image->channels != 3 || (sigma_luma <= 0.0f && sigma_chroma <= 0.0f))
+		return;
+
+	t = g_new(QuickDenoiseInfo, threads);
+	planes = g_new(gfloat, image->w * image->h * 3);
+	y_per_thread = (image->h + threads - 1) / threads;
+	y_offset = 0;
+
+	for (i = 0; i < threads; i++)
+	{
+		t[i].image = image;
+		t[i].planes[0] = planes;
+		t[i].planes[1] = planes + image->w * image->h;
+		t[i].planes[2] = planes + image->w * image->h * 2;
+		t[i].plane_pitch = image->w;
+		/* Noise is removed where neighbours differ less than twice the noise
+		   level the FFT denoiser works with, which is sigma scaled by
+		   QUICK_SIGMA_FACTOR. Chroma noise is coarser so it gets a wider window */
+		t[i].threshold[0] = 2.0f * sigma_luma * QUICK_SIGMA_FACTOR;
+		t[i].threshold[1] = t[i].threshold[2] = 2.0f * sigma_chroma * QUICK_SIGMA_FACTOR;
+		t[i].radius[0] = (sigma_luma > 0.0f) ? 2 : 0;
+		t[i].radius[1] = t[i].radius[2] = (sigma_chroma > 0.0f) ? 4 : 0;
+		t[i].start_y = y_offset;
+		y_offset = MIN(image->h, y_offset + y_per_thread);
+		t[i].end_y = y_offset;
+	}
+
+	/* The vertical pass reads rows of all threads, so the horizontal must be done first */
+	rs_thread_pool_run(quick_denoise_horizontal, t, sizeof(QuickDenoiseInfo), threads);
+	rs_thread_pool_run(quick_denoise_vertical, t, sizeof(QuickDenoiseInfo), threads);
+
+	g_free(planes);
+	g_free(t);
+}
+
+/* Blocks touching the mirrored edges of a ROI render differ from a full
+   render, so a ROI needs all blocks overlapping it fully inside real data */
+#define DENOISE_MARGIN (FFT_BLOCK_SIZE - FFT_BLOCK_OVERLAP)
+#define DENOISE_BLOCK_STEP (FFT_BLOCK_SIZE - FFT_BLOCK_OVERLAP * 2)
+#define QUICK_DENOISE_MARGIN 4
+
+static gboolean
+denoise_active(RSDenoise *denoise)
+{
+	return (denoise->sharpen + denoise->denoise_luma + denoise->denoise_chroma) != 0;
+}
+
+/**
+ * Calculate the area needed from the previous filter to denoise a ROI
+ * @param roi The requested ROI
+ * @param width The width of the full image
+ * @param height The height of the full image
+ * @param quick TRUE if the quick denoiser will be used
+ * @param area The area to request will be written here
+ */
+static void
+denoise_area(const GdkRectangle *roi, const gint width, const gint height, const gboolean quick, GdkRectangle *area)
+{
+	const gint margin = quick ? QUICK_DENOISE_MARGIN : DENOISE_MARGIN;
+	gint x1, y1;
+
+	area->x = MAX(0, roi->x - margin);
+	area->y = MAX(0, roi->y - margin);
+
+	/* Start on the block grid of a full render, so blocks line up with
+	   those of neighbouring tiles and the seams disappear. Keep x even, so
+	   rows are copied from 16 byte boundaries */
+	if (quick)
+		area->x -= area->x & 1;
+	else
+	{
+		area->x -= area->x % DENOISE_BLOCK_STEP;
+		area->y -= area->y % DENOISE_BLOCK_STEP;
+	}
+
+	x1 = MIN(width, roi->x + roi->width + margin);
+	y1 = MIN(height, roi->y + roi->height + margin);
+
+	area->width = x1 - area->x;
+	area->height = y1 - area->y;
+}
+
 static RSFilterResponse *
 get_image(RSFilter *filter, const RSFilterRequest *request)
 {
 	RSDenoise *denoise = RS_DENOISE(filter);
 	GdkRectangle *roi;
+	GdkRectangle area;
+	gboolean use_area = FALSE;
+	RSFilterRequest *area_request;
 	RSFilterResponse *previous_response;
 	RSFilterResponse *response;
 	RS_IMAGE16 *input;
 	RS_IMAGE16 *output;
-	RS_IMAGE16 *tmp;
-
-	previous_response = rs_filter_get_image(filter->previous, request);
+	gint width, height;
+	const gboolean quick = rs_filter_request_get_quick(request);
 
-	if (!RS_IS_FILTER(filter->previous))
-		return previous_response;
+	if (!RS_IS_FILTER(filter->previous) || !denoise_active(denoise))
+		return rs_filter_get_image(filter->previous, request);
 
-	if ((denoise->sharpen + denoise->denoise_luma + denoise->denoise_chroma) == 0)
-		return previous_response;
+	/* Ask only for the ROI and the margin we need around it */
+	roi = rs_filter_request_get_roi(request);
+	if (roi && rs_filter_get_size_simple(filter->previous, request, &width, &height))
+	{
+		denoise_area(roi, width, height, quick, &area);
+		area_request = rs_filter_request_clone(request);
+		rs_filter_request_set_roi(area_request, &area);
+		previous_response = rs_filter_get_image(filter->previous, area_request);
+		g_object_unref(area_request);
+		use_area = TRUE;
+	}
+	else
+		previous_response = rs_filter_get_image(filter->previous, request);
 
 	input = rs_filter_response_get_image(previous_response);
 	
@@ -251,40 +497,36 @@ get_image(RSFilter *filter, const RSFilterRequest *request)
 	response = rs_filter_response_clone(previous_response);
 	g_object_unref(previous_response);
 
-	/* If the request is marked as "quick", bail out, we're slow */
-	if (rs_filter_request_get_quick(request))
-	{
-		rs_filter_response_set_image(response, input);
-		rs_filter_response_set_quick(response);
-		g_object_unref(input);
-		return response;
-	}
-	
 	gfloat scale = 1.0;
 	rs_filter_get_recursive(RS_FILTER(denoise), "scale", &scale, NULL);
 
-	if ((roi = rs_filter_request_get_roi(request)))
+	if (use_area && area.x + area.width <= input->w && area.y + area.height <= input->h)
 	{
-		/* Align so we start at even pixel counts */
-		roi->width += (roi->x&1);
-		roi->x -= (roi->x&1);
-		roi->width = MIN(input->w - roi->x, roi->width);
-		output = rs_image16_copy(input, FALSE);
-		tmp = rs_image16_new_subframe(output, roi);
-		bit_blt((char*)GET_PIXEL(tmp,0,0), tmp->rowstride * 2, 
-			(const char*)GET_PIXEL(input,roi->x,roi->y), input->rowstride * 2, tmp->w * tmp->pixelsize * 2, tmp->h);
+		/* Only the area is rendered, so only the area is allocated, copied and denoised */
+		output = rs_image16_new(area.width, area.height, input->channels, input->pixelsize);
+		bit_blt((char*)GET_PIXEL(output,0,0), output->rowstride * 2, 
+			(const char*)GET_PIXEL(input,area.x,area.y), input->rowstride * 2, output->w * output->pixelsize * 2, output->h);
+		rs_filter_response_set_image_area(response, output, &area, input->w, input->h);
+		rs_filter_response_set_roi(response, roi);
 	}
 	else
 	{
 		output = rs_image16_copy(input, TRUE);
-		tmp = g_object_ref(output);
+		rs_filter_response_set_image(response, output);
 	}
 
 	g_object_unref(input);
-	rs_filter_response_set_image(response, output);
-	g_object_unref(output);
 
-	denoise->info.image = tmp;
+	/* The FFT denoiser is too slow for quick requests, approximate it */
+	if (quick)
+	{
+		quick_denoise(output, ((float) denoise->denoise_luma * scale) / 3.0, ((float) denoise->denoise_chroma * scale) / 2.0);
+		rs_filter_response_set_quick(response);
+		g_object_unref(output);
+		return response;
+	}
+
+	denoise->info.image = output;
 	denoise->info.sigmaLuma = ((float) denoise->denoise_luma * scale) / 3.0;
 	denoise->info.sigmaChroma = ((float) denoise->denoise_chroma * scale) / 2.0;
 	denoise->info.sharpenLuma = 1.5f * (float) denoise->sharpen / 20.0f;
@@ -298,7 +540,7 @@ get_image(RSFilter *filter, const RSFilterRequest *request)
 	denoise->info.blueCorrection = 1.0f;
 
 	denoiseImage(&denoise->info);
-	g_object_unref(tmp);
+	g_object_unref(output);
 
 	return response;
 }
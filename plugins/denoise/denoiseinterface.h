@@ -30,6 +30,9 @@ G_BEGIN_DECLS
 extern "C" {
 #endif
 
+#define FFT_BLOCK_SIZE 128       // Preferable able to be factorized into primes, must be divideable by 4.
+#define FFT_BLOCK_OVERLAP 24    // Must be dividable by 4 (OVERLAP * 2 must be < SIZE)
+
 typedef enum {
   PROCESS_RGB, PROCESS_YUV, PROCESS_PATTERN_RGB, PROCESS_PATTERN_YUV
 } InitDenoiseMode;
@@ -27,8 +27,6 @@
 namespace RawStudio {
 namespace FFTFilter {
 
-#define FFT_BLOCK_SIZE 128       // Preferable able to be factorized into primes, must be divideable by 4.
-#define FFT_BLOCK_OVERLAP 24    // Must be dividable by 4 (OVERLAP * 2 must be < SIZE)
 #define SIGMA_FACTOR 0.25f;    // Amount to multiply sigma by to give reasonable amount
 
 class FFTDenoiser
@@ -271,12 +271,10 @@ settings_weak_notify(gpointer data, GObject *where_the_object_was)
 	lensfun->settings = NULL;
 }
 
-static void
-settings_changed(RSSettings *settings, RSSettingsMask mask, RSLensfun *lensfun)
+/* Copy the values we use from settings, returns TRUE if any of them changed */
+static gboolean
+settings_read(RSSettings *settings, RSLensfun *lensfun)
 {
-	if (NULL == settings || NULL == lensfun)
-		return;
-
 	gboolean changed = ! (float_closeto(settings->tca_kb, lensfun->tca_kb,0.001f) && 
 	float_closeto(settings->tca_kr, lensfun->tca_kr,0.001f) && 
 	float_closeto(settings->vignetting, lensfun->vignetting,0.001f));
@@ -285,8 +283,18 @@ settings_changed(RSSettings *settings, RSSettingsMask mask, RSLensfun *lensfun)
 		lensfun->tca_kb = settings->tca_kb;
 		lensfun->tca_kr = settings->tca_kr;
 		lensfun->vignetting = settings->vignetting;
-		rs_filter_changed(RS_FILTER(lensfun), RS_FILTER_CHANGED_PIXELDATA);
 	}
+	return changed;
+}
+
+static void
+settings_changed(RSSettings *settings, RSSettingsMask mask, RSLensfun *lensfun)
+{
+	if (NULL == settings || NULL == lensfun)
+		return;
+
+	if (settings_read(settings, lensfun))
+		rs_filter_changed(RS_FILTER(lensfun), RS_FILTER_CHANGED_PIXELDATA | RS_FILTER_CHANGED_SETTINGS);
 }
 
 static void
@@ -309,7 +317,11 @@ set_property(GObject *object, guint property_id, const GValue *value, GParamSpec
 			}
 			lensfun->settings = g_value_get_object(value);
 			lensfun->settings_signal_id = g_signal_connect(lensfun->settings, "settings-changed", G_CALLBACK(settings_changed), lensfun);
-			settings_changed(lensfun->settings, MASK_VIGNETTING|MASK_TCA, lensfun);
+			/* Caches keep renders per settings, tell them even if we render the same */
+			if (lensfun->settings && settings_read(lensfun->settings, lensfun))
+				rs_filter_changed(RS_FILTER(lensfun), RS_FILTER_CHANGED_PIXELDATA | RS_FILTER_CHANGED_SETTINGS);
+			else
+				rs_filter_changed(RS_FILTER(lensfun), RS_FILTER_CHANGED_SETTINGS);
 			g_object_weak_ref(G_OBJECT(lensfun->settings), settings_weak_notify, lensfun);
 			break;
 		case PROP_MAKE:
@@ -355,7 +367,6 @@ typedef struct {
 	lfModifier *mod;
 	RS_IMAGE16 *input;
 	RS_IMAGE16 *output;
-	GThread *threadid;
 	gint effective_flags;
 	GdkRectangle *roi;
 	gint stage;
@@ -686,12 +697,9 @@ get_image(RSFilter *filter, const RSFilterRequest *request)
 					y_offset += y_per_thread;
 					y_offset = MIN(vign_roi->y + vign_roi->height, y_offset);
 					t[i].end_y = y_offset;
-					t[i].threadid = g_thread_new("RSLensfun worker (phase 2)", thread_func, &t[i]);
 				}
-				
-				/* Wait for threads to finish */
-				for(i = 0; i < threads; i++)
-					g_thread_join(t[i].threadid);
+
+				rs_thread_pool_run(thread_func, t, sizeof(ThreadInfo), threads);
 
 				input = output;
 			}
@@ -715,12 +723,9 @@ get_image(RSFilter *filter, const RSFilterRequest *request)
 					y_offset = MIN(roi->y + roi->height, y_offset);
 					t[i].end_y = y_offset;
 					t[i].stage = 3;
-					t[i].threadid = g_thread_new("RSLensfun worker (phase 1+3)", thread_func, &t[i]);
 				}
-				
-				/* Wait for threads to finish */
-				for(i = 0; i < threads; i++)
-					g_thread_join(t[i].threadid);
+
+				rs_thread_pool_run(thread_func, t, sizeof(ThreadInfo), threads);
 			}
 			else
 			{
@@ -179,7 +179,7 @@ open_dcraw(const gchar *filename)
 
 	RSFilterResponse* response = rs_filter_response_new();
 
-	rs_io_lock();
+	rs_io_lock_file(filename);
 	if (!dcraw_open(raw, (char *) filename))
 	{
 		dcraw_load_raw(raw);
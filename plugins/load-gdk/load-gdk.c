@@ -154,7 +154,13 @@ load_gdk(const gchar *filename)
 static gboolean
 rs_gdk_load_meta(const gchar *service, RAWFILE *rawfile, guint offset, RSMetadata *meta)
 {
-	meta->thumbnail = gdk_pixbuf_new_from_file_at_size(service, 128, 128, NULL);
+	GdkPixbuf *thumbnail = gdk_pixbuf_new_from_file_at_size(service, RS_METADATA_THUMBNAIL_MAX, RS_METADATA_THUMBNAIL_MAX, NULL);
+
+	if (thumbnail)
+	{
+		rs_metadata_set_thumbnail(meta, thumbnail);
+		g_object_unref(thumbnail);
+	}
 	return FALSE;
 }
 
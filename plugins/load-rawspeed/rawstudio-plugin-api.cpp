@@ -17,6 +17,10 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
  */
 #include <rawstudio.h>
+#include <string.h> /* memcpy() */
+#ifndef G_OS_WIN32
+#include <unistd.h>
+#endif
 #include "StdAfx.h"
 #include "FileReader.h"
 #include "RawParser.h"
@@ -26,8 +30,89 @@
 
 #define TIME_LOAD 1
 
+/* RawSpeed may read a few bytes past the end of the file */
+#define FILEMAP_MARGIN 16
+
 using namespace RawSpeed;
 
+typedef struct {
+	const uchar8 *input;
+	gint input_pitch;		/* In bytes */
+	gint cpp;
+	RS_IMAGE16 *image;
+	gint start_y;
+	gint end_y;
+} ImportInfo;
+
+/**
+ * Copy rows from RawSpeed output to a RS_IMAGE16
+ */
+static gpointer
+import_rows(gpointer data)
+{
+	ImportInfo *t = (ImportInfo *) data;
+	RS_IMAGE16 *image = t->image;
+	gint row, col;
+
+	for(row = t->start_y; row < t->end_y; row++)
+	{
+		const gushort *in = (const gushort *) (t->input + (gsize) row * t->input_pitch);
+		gushort *out = GET_PIXEL(image, 0, row);
+
+		if (t->cpp == 1)
+			memcpy(out, in, image->w * sizeof(gushort));
+		else
+		{
+#if G_BYTE_ORDER == G_LITTLE_ENDIAN
+			/* Pixels in RS_IMAGE16 are 8 byte aligned, write each as a single store */
+			guint64 *out64 = (guint64 *) out;
+			for(col = 0; col < image->w; col++)
+			{
+				out64[col] = (guint64) in[0] | ((guint64) in[1] << 16) | ((guint64) in[2] << 32);
+				in += 3;
+			}
+#else
+			for(col = 0; col < image->w; col++)
+			{
+				*out++ = *in++;
+				*out++ = *in++;
+				*out++ = *in++;
+				*out++ = 0;
+			}
+#endif
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Convert RawSpeed output to a RS_IMAGE16, using all cores
+ */
+static void
+import_image(RawImage &r, RS_IMAGE16 *image)
+{
+	const guint threads = rs_get_number_of_processor_cores();
+	ImportInfo *t = g_new(ImportInfo, threads);
+	guint i, y_offset = 0;
+	guint y_per_thread = (image->h + threads-1)/threads;
+
+	for (i = 0; i < threads; i++)
+	{
+		t[i].input = r->getData(0, 0);
+		t[i].input_pitch = r->pitch;
+		t[i].cpp = r->getCpp();
+		t[i].image = image;
+		t[i].start_y = y_offset;
+		y_offset = MIN((guint) image->h, y_offset + y_per_thread);
+		t[i].end_y = y_offset;
+	}
+
+	rs_thread_pool_run(import_rows, t, sizeof(ImportInfo), threads);
+
+	g_free(t);
+}
+
 extern "C" {
 
 RSFilterResponse*
@@ -60,6 +145,12 @@ load_rawspeed(const gchar *filename)
 	FileReader f((LPCWSTR) filename);
 	RawDecoder *d = 0;
 	FileMap* m = 0;
+	RAWFILE *rawfile = NULL;
+#ifdef G_OS_WIN32
+	const guint page = 4096;
+#else
+	const guint page = sysconf(_SC_PAGESIZE);
+#endif
 
 #ifdef TIME_LOAD
 		GTimer *gt = g_timer_new();
@@ -68,19 +159,33 @@ load_rawspeed(const gchar *filename)
 
 	try
 	{
-		rs_io_lock();
-		m = f.readFile();
+		rs_io_lock_file(filename);
+		/* Decode directly from the mapping shared with the metadata loaders,
+		 * if the last page has room for RawSpeed reading past the end */
+		rawfile = raw_open_file(filename);
+		if (rawfile && (raw_get_filesize(rawfile) % page) != 0
+			&& (page - raw_get_filesize(rawfile) % page) >= FILEMAP_MARGIN)
+		{
+			raw_read_ahead(rawfile);
+			m = new FileMap((uchar8 *) raw_get_map(rawfile), raw_get_filesize(rawfile));
+		}
+		else
+			m = f.readFile();
 		rs_io_unlock();
 	}
 	catch (FileIOException &e)
 	{
 		rs_io_unlock();
+		if (rawfile)
+			raw_close_file(rawfile);
 		printf("RawSpeed: File IO Exception: %s\n", e.what());
 		return rs_filter_response_new();
 	}
 	catch (...)
 	{
 		rs_io_unlock();
+		if (rawfile)
+			raw_close_file(rawfile);
 		printf("RawSpeed: Exception when reading file\n");
 		return rs_filter_response_new();
 	}
@@ -97,7 +202,6 @@ load_rawspeed(const gchar *filename)
 		{
 			RawParser t(m);
 			d = t.getDecoder();
-			gint col, row;
 			gint cpp;
 
 #ifdef TIME_LOAD
@@ -113,6 +217,11 @@ load_rawspeed(const gchar *filename)
 			RawImage r = d->mRaw;
 			delete d; d = NULL;
 			delete m; m = NULL;
+			if (rawfile)
+			{
+				raw_close_file(rawfile);
+				rawfile = NULL;
+			}
 
       r->scaleBlackWhite();
 
@@ -139,26 +248,25 @@ load_rawspeed(const gchar *filename)
 			if (r->isCFA)
 				image->filters = r->cfa.getDcrawFilter();
 
+			/* dcraw filters cannot describe X-Trans, so we copy the pattern */
+			if (r->isCFA && image->filters == RS_FILTERS_XTRANS)
+				for (int row = 0; row < 6; row++)
+					for (int col = 0; col < 6; col++)
+						switch (r->cfa.getColorAt(col, row))
+						{
+							case CFA_RED:
+								image->xtrans[row][col] = 0;
+								break;
+							case CFA_BLUE:
+								image->xtrans[row][col] = 2;
+								break;
+							default:
+								image->xtrans[row][col] = 1;
+								break;
+						}
+
 
-      if (cpp == 1) 
-      {
-        BitBlt((uchar8 *)(GET_PIXEL(image,0,0)),image->pitch*2,
-          r->getData(0,0), r->pitch, r->getBpp()*r->dim.x, r->dim.y);
-      } else 
-      {
-        for(row=0;row<image->h;row++)
-        {
-          gushort *inpixel = (gushort*)&r->getData()[row*r->pitch];
-          gushort *outpixel = GET_PIXEL(image, 0, row);
-          for(col=0;col<image->w;col++)
-          {
-            *outpixel++ =  *inpixel++;
-            *outpixel++ =  *inpixel++;
-            *outpixel++ =  *inpixel++;
-            outpixel++;
-          }
-        }
-      }
+			import_image(r, image);
 	}
 		catch (RawDecoderException &e)
 		{
@@ -176,6 +284,8 @@ load_rawspeed(const gchar *filename)
 
 	if (d) delete d;
 	if (m) delete m;
+	if (rawfile)
+		raw_close_file(rawfile);
 
 	RSFilterResponse* response = rs_filter_response_new();
 	if (image)
@@ -219,10 +219,10 @@ ciff_load_meta(const gchar *service, RAWFILE *rawfile, guint offset, RSMetadata
 {
 	guint root=0;
 	GdkPixbuf *pixbuf = NULL, *pixbuf2 = NULL;
-	gdouble ratio;
+	gint width, height;
 	guint start=0, length=0;//, root=0;
 
-	rs_io_lock();
+	rs_io_lock_file(raw_get_filename(rawfile));
 	raw_init_file_tiff(rawfile, offset);
 	if (!raw_strcmp(rawfile, 6, "HEAPCCDR", 8))
 		return FALSE;
@@ -244,17 +244,20 @@ ciff_load_meta(const gchar *service, RAWFILE *rawfile, guint offset, RSMetadata
 
 	if ((start>0) && (length>0))
 	{
-		rs_io_lock();
+		rs_io_lock_file(raw_get_filename(rawfile));
 		pixbuf = raw_get_pixbuf(rawfile, start, length);
 		rs_io_unlock();
 
-		ratio = ((gdouble) gdk_pixbuf_get_width(pixbuf))/((gdouble) gdk_pixbuf_get_height(pixbuf));
-		if (ratio>1.0)
-			pixbuf2 = gdk_pixbuf_scale_simple(pixbuf, 128, (gint) (128.0/ratio), GDK_INTERP_BILINEAR);
-		else
-			pixbuf2 = gdk_pixbuf_scale_simple(pixbuf, (gint) (128.0*ratio), 128, GDK_INTERP_BILINEAR);
-		g_object_unref(pixbuf);
-		pixbuf = pixbuf2;
+		/* Scale to the largest thumbnail size, the smaller sizes are made from this */
+		width = gdk_pixbuf_get_width(pixbuf);
+		height = gdk_pixbuf_get_height(pixbuf);
+		if (width > RS_METADATA_THUMBNAIL_MAX || height > RS_METADATA_THUMBNAIL_MAX)
+		{
+			rs_constrain_to_bounding_box(RS_METADATA_THUMBNAIL_MAX, RS_METADATA_THUMBNAIL_MAX, &width, &height);
+			pixbuf2 = gdk_pixbuf_scale_simple(pixbuf, width, height, GDK_INTERP_BILINEAR);
+			g_object_unref(pixbuf);
+			pixbuf = pixbuf2;
+		}
 		switch (meta->orientation)
 		{
 			/* this is very COUNTER-intuitive - gdk_pixbuf_rotate_simple() is wierd */
@@ -269,7 +272,8 @@ ciff_load_meta(const gchar *service, RAWFILE *rawfile, guint offset, RSMetadata
 				pixbuf = pixbuf2;
 				break;
 		}
-		meta->thumbnail = pixbuf;
+		rs_metadata_set_thumbnail(meta, pixbuf);
+		g_object_unref(pixbuf);
 		return TRUE;
 	}
 	return FALSE;
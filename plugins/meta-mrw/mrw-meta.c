@@ -119,7 +119,7 @@ mrw_load_meta(const gchar *service, RAWFILE *rawfile, guint offset, RSMetadata *
 	GdkPixbuf *pixbuf=NULL, *pixbuf2=NULL;
 	guint start=0, length=0;
 
-	rs_io_lock();
+	rs_io_lock_file(raw_get_filename(rawfile));
 	raw_mrw_walker(rawfile, offset, meta);
 	rs_io_unlock();
 
@@ -137,7 +137,7 @@ mrw_load_meta(const gchar *service, RAWFILE *rawfile, guint offset, RSMetadata *
 	if ((start>0) && (length>0))
 	{
 		guchar *thumbbuffer;
-		gdouble ratio;
+		gint width, height;
 		GdkPixbufLoader *pl;
 
 		pixbuf = raw_get_pixbuf(rawfile, start, length);
@@ -149,7 +149,7 @@ mrw_load_meta(const gchar *service, RAWFILE *rawfile, guint offset, RSMetadata *
 
 			thumbbuffer = g_malloc(length);
 			thumbbuffer[0] = '\xff';
-			rs_io_lock();
+			rs_io_lock_file(raw_get_filename(rawfile));
 			raw_strcpy(rawfile, start+1, thumbbuffer+1, length-1);
 			rs_io_unlock();
 			pl = gdk_pixbuf_loader_new();
@@ -160,13 +160,16 @@ mrw_load_meta(const gchar *service, RAWFILE *rawfile, guint offset, RSMetadata *
 		}
 		
 		if (pixbuf==NULL) return TRUE;
-		ratio = ((gdouble) gdk_pixbuf_get_width(pixbuf))/((gdouble) gdk_pixbuf_get_height(pixbuf));
-		if (ratio>1.0)
-			pixbuf2 = gdk_pixbuf_scale_simple(pixbuf, 128, (gint) (128.0/ratio), GDK_INTERP_BILINEAR);
-		else
-			pixbuf2 = gdk_pixbuf_scale_simple(pixbuf, (gint) (128.0*ratio), 128, GDK_INTERP_BILINEAR);
-		g_object_unref(pixbuf);
-		pixbuf = pixbuf2;
+		/* Scale to the largest thumbnail size, the smaller sizes are made from this */
+		width = gdk_pixbuf_get_width(pixbuf);
+		height = gdk_pixbuf_get_height(pixbuf);
+		if (width > RS_METADATA_THUMBNAIL_MAX || height > RS_METADATA_THUMBNAIL_MAX)
+		{
+			rs_constrain_to_bounding_box(RS_METADATA_THUMBNAIL_MAX, RS_METADATA_THUMBNAIL_MAX, &width, &height);
+			pixbuf2 = gdk_pixbuf_scale_simple(pixbuf, width, height, GDK_INTERP_BILINEAR);
+			g_object_unref(pixbuf);
+			pixbuf = pixbuf2;
+		}
 		switch (meta->orientation)
 		{
 			/* this is very COUNTER-intuitive - gdk_pixbuf_rotate_simple() is wierd */
@@ -181,7 +184,8 @@ mrw_load_meta(const gchar *service, RAWFILE *rawfile, guint offset, RSMetadata *
 				pixbuf = pixbuf2;
 				break;
 		}
-		meta->thumbnail = pixbuf;
+		rs_metadata_set_thumbnail(meta, pixbuf);
+		g_object_unref(pixbuf);
 	}
 	return TRUE;
 }
@@ -75,7 +75,12 @@ rs_raf_load_meta(const gchar *service, RAWFILE *rawfile, guint offset, RSMetadat
 			raw_set_byteorder(rawfile, order);
 			raw_reset_base(rawfile);
 		}
-		meta->thumbnail = rs_raf_load_thumb(rawfile);
+		GdkPixbuf *thumbnail = rs_raf_load_thumb(rawfile);
+		if (thumbnail)
+		{
+			rs_metadata_set_thumbnail(meta, thumbnail);
+			g_object_unref(thumbnail);
+		}
 		rs_filetype_meta_load(".tiff", meta, rawfile, meta->preview_start+12);
 
 		return TRUE;
@@ -94,7 +99,7 @@ rs_raf_load_thumb(RAWFILE *rawfile)
 	{
 		raw_get_uint(rawfile, 84, &start);
 		raw_get_uint(rawfile, 88, &length);
-		rs_io_lock();
+		rs_io_lock_file(raw_get_filename(rawfile));
 		pixbuf = raw_get_pixbuf(rawfile, start, length);
 		rs_io_unlock();
 	}
@@ -104,11 +109,14 @@ rs_raf_load_thumb(RAWFILE *rawfile)
 		GdkPixbuf *pixbuf2;
 		gint width = gdk_pixbuf_get_width(pixbuf);
 		gint height = gdk_pixbuf_get_height(pixbuf);
-		rs_constrain_to_bounding_box(128, 128, &width, &height);
-		pixbuf2 = gdk_pixbuf_scale_simple(pixbuf, width, height, GDK_INTERP_BILINEAR);
+		if (width > RS_METADATA_THUMBNAIL_MAX || height > RS_METADATA_THUMBNAIL_MAX)
+		{
+			rs_constrain_to_bounding_box(RS_METADATA_THUMBNAIL_MAX, RS_METADATA_THUMBNAIL_MAX, &width, &height);
+			pixbuf2 = gdk_pixbuf_scale_simple(pixbuf, width, height, GDK_INTERP_BILINEAR);
 
-		g_object_unref(pixbuf);
-		pixbuf = pixbuf2;
+			g_object_unref(pixbuf);
+			pixbuf = pixbuf2;
+		}
 
 		/* Apparently raf-files does not contain any information about rotation ?! */
 	}
@@ -1831,7 +1831,7 @@ tiff_load_meta(const gchar *service, RAWFILE *rawfile, guint offset, RSMetadata
 	gushort ifd_num = 0;
 	guchar version;
 
-	rs_io_lock();
+	rs_io_lock_file(raw_get_filename(rawfile));
 
 	version = raw_init_file_tiff(rawfile, offset);
 
@@ -1899,7 +1899,7 @@ tif_load_meta(const gchar *service, RAWFILE *rawfile, guint offset, RSMetadata *
 static gboolean
 thumbnail_reader(const gchar *service, RAWFILE *rawfile, guint offset, guint length, RSMetadata *meta)
 {
-	rs_io_lock();
+	rs_io_lock_file(raw_get_filename(rawfile));
 	GdkPixbuf *pixbuf=NULL;
 	if ((offset>0) && (length>0) && (length<5000000))
 	{
@@ -1949,7 +1949,7 @@ thumbnail_store(GdkPixbuf *pixbuf, RSMetadata *meta)
 	GdkPixbuf *pixbuf2=NULL;
 	if (pixbuf)
 	{
-		gdouble ratio;
+		gint width, height;
 		/* Handle Canon/Nikon cropping */
 		if ((gdk_pixbuf_get_width(pixbuf) == 160) && (gdk_pixbuf_get_height(pixbuf)==120))
 		{
@@ -1959,14 +1959,16 @@ thumbnail_store(GdkPixbuf *pixbuf, RSMetadata *meta)
 			pixbuf = pixbuf2;
 		}
 
-		/* Scale to a bounding box of 128x128 pixels */
-		ratio = ((gdouble) gdk_pixbuf_get_width(pixbuf))/((gdouble) gdk_pixbuf_get_height(pixbuf));
-		if (ratio>1.0)
-			pixbuf2 = gdk_pixbuf_scale_simple(pixbuf, 128, (gint) (128.0/ratio), GDK_INTERP_BILINEAR);
-		else
-			pixbuf2 = gdk_pixbuf_scale_simple(pixbuf, (gint) (128.0*ratio), 128, GDK_INTERP_BILINEAR);
-		g_object_unref(pixbuf);
-		pixbuf = pixbuf2;
+		/* Scale to the largest thumbnail size, the smaller sizes are made from this */
+		width = gdk_pixbuf_get_width(pixbuf);
+		height = gdk_pixbuf_get_height(pixbuf);
+		if (width > RS_METADATA_THUMBNAIL_MAX || height > RS_METADATA_THUMBNAIL_MAX)
+		{
+			rs_constrain_to_bounding_box(RS_METADATA_THUMBNAIL_MAX, RS_METADATA_THUMBNAIL_MAX, &width, &height);
+			pixbuf2 = gdk_pixbuf_scale_simple(pixbuf, width, height, GDK_INTERP_BILINEAR);
+			g_object_unref(pixbuf);
+			pixbuf = pixbuf2;
+		}
 
 		/* Rotate thumbnail in place */
 		switch (meta->orientation)
@@ -1983,33 +1985,54 @@ thumbnail_store(GdkPixbuf *pixbuf, RSMetadata *meta)
 				pixbuf = pixbuf2;
 				break;
 		}
-		meta->thumbnail = pixbuf;
+		rs_metadata_set_thumbnail(meta, pixbuf);
+		g_object_unref(pixbuf);
 		return TRUE;
 	}
 	return FALSE;	
 }
 
 		
-static GdkPixbuf*
-raw_thumbnail_reader(const gchar *service, RSMetadata *meta)
+/* Raw renders running at once, each one holds a full CFA image in memory */
+#define RAW_THUMBNAIL_RENDERS_MAX 4
+/* Idle filter chains kept around for the next file from the same camera */
+#define RAW_THUMBNAIL_CHAINS_KEEP 8
+
+typedef struct {
+	gchar *camera;
+	RSFilter *input;
+	RSFilter *demosaic;
+	RSFilter *resample;
+	RSFilter *dcp;
+	RSFilter *cst;
+	RSSettings *settings;
+} RawThumbnailChain;
+
+static GMutex raw_thumbnail_lock;
+static GCond raw_thumbnail_cond;
+static GList *raw_thumbnail_chains = NULL;
+static gint raw_thumbnail_renders = 0;
+
+static RawThumbnailChain *
+raw_thumbnail_chain_new(const gchar *camera, RSMetadata *meta)
 {
-	GdkPixbuf* pixbuf = 0;
-	gint c;
-	gfloat pre_mul[4];
+	RawThumbnailChain *chain = g_new0(RawThumbnailChain, 1);
 
-	RSFilter *finput = rs_filter_new("RSInputFile", NULL);
-	RSFilter *fdemosaic = rs_filter_new("RSDemosaic", finput);
-	RSFilter *fresample = rs_filter_new("RSResample", fdemosaic);
-	RSFilter *fdcp = rs_filter_new("RSDcp", fresample);
-	RSFilter *fcst = rs_filter_new("RSColorspaceTransform", fdcp);
-	
-	g_object_set(fresample, "width", 256,
-				 "height", 256, 
+	chain->camera = g_strdup(camera);
+	chain->input = rs_filter_new("RSInputImage16", NULL);
+	chain->demosaic = rs_filter_new("RSDemosaic", chain->input);
+	chain->resample = rs_filter_new("RSResample", chain->demosaic);
+	chain->dcp = rs_filter_new("RSDcp", chain->resample);
+	chain->cst = rs_filter_new("RSColorspaceTransform", chain->dcp);
+
+	g_object_set(chain->resample, "width", RS_METADATA_THUMBNAIL_MAX,
+				 "height", RS_METADATA_THUMBNAIL_MAX, 
 				"bounding-box", TRUE, NULL);
 
-	g_object_set(finput, "filename", service, NULL);
+	/* Quick requests will give us a half size image without interpolation */
+	rs_filter_set_recursive(RS_FILTER(chain->demosaic), "demosaic-allow-downscale",  TRUE, NULL);
 
-	/* Find a dcp profile */
+	/* Find a dcp profile, this is only done once per camera */
 	RSDcpFile *dcp = NULL;
 	RSProfileFactory *factory = rs_profile_factory_new_default();
 	GSList *all_profiles = rs_profile_factory_find_from_model(factory, meta->make_ascii, meta->model_ascii);
@@ -2025,22 +2048,138 @@ raw_thumbnail_reader(const gchar *service, RSMetadata *meta)
 	}
 
 	if (NULL != dcp)
-		g_object_set(fdcp, "use-profile", TRUE, "profile", dcp, NULL);
+	{
+		/* RSDcp doesn't hold a reference to the settings, the chain owns them */
+		chain->settings = rs_settings_new();
+		g_object_set(chain->dcp, "use-profile", TRUE, "profile", dcp, "settings", chain->settings, NULL);
+	}
 	else
-		g_object_set(fdcp, "use-profile", FALSE, NULL);
-	
-	rs_filter_set_recursive(RS_FILTER(fdemosaic), "demosaic-allow-downscale",  TRUE, NULL);
-	
+	{
+		g_object_set(chain->dcp, "use-profile", FALSE, NULL);
+		g_object_set(chain->input, "color-space", rs_color_space_new_singleton("RSSrgb"), NULL);
+	}
+
+	return chain;
+}
+
+static void
+raw_thumbnail_chain_free(RawThumbnailChain *chain)
+{
+	g_object_unref(chain->input);
+	g_object_unref(chain->demosaic);
+	g_object_unref(chain->resample);
+	g_object_unref(chain->dcp);
+	g_object_unref(chain->cst);
+	if (chain->settings)
+		g_object_unref(chain->settings);
+	g_free(chain->camera);
+	g_free(chain);
+}
+
+/**
+ * Waits for a free render slot and returns a filter chain for the camera
+ * @param meta Metadata of the file to render
+ * @return A chain owned by the caller until raw_thumbnail_chain_release()
+ */
+static RawThumbnailChain *
+raw_thumbnail_chain_get(RSMetadata *meta)
+{
+	RawThumbnailChain *chain = NULL;
+	GList *node;
+	gint max_renders = MIN(rs_get_number_of_processor_cores(), RAW_THUMBNAIL_RENDERS_MAX);
+	gchar *camera = g_strdup_printf("%s/%s", meta->make_ascii ? meta->make_ascii : "", meta->model_ascii ? meta->model_ascii : "");
+
+	g_mutex_lock(&raw_thumbnail_lock);
+	while (raw_thumbnail_renders >= max_renders)
+		g_cond_wait(&raw_thumbnail_cond, &raw_thumbnail_lock);
+	raw_thumbnail_renders++;
+
+	for (node = raw_thumbnail_chains; node; node = node->next)
+	{
+		RawThumbnailChain *idle = node->data;
+		if (g_str_equal(idle->camera, camera))
+		{
+			chain = idle;
+			raw_thumbnail_chains = g_list_delete_link(raw_thumbnail_chains, node);
+			break;
+		}
+	}
+	g_mutex_unlock(&raw_thumbnail_lock);
+
+	if (!chain)
+	{
+		RS_DEBUG(PERFORMANCE, "Creating thumbnail chain for %s", camera);
+		chain = raw_thumbnail_chain_new(camera, meta);
+	}
+
+	g_free(camera);
+	return chain;
+}
+
+/**
+ * Puts a chain back in the idle list and frees the render slot
+ * @param chain A chain from raw_thumbnail_chain_get()
+ */
+static void
+raw_thumbnail_chain_release(RawThumbnailChain *chain)
+{
+	RawThumbnailChain *old = NULL;
+
+	/* Don't keep the image around while the chain is idle */
+	RSFilterResponse *empty = rs_filter_response_new();
+	g_object_set(chain->input, "image", empty, NULL);
+	g_object_unref(empty);
+
+	g_mutex_lock(&raw_thumbnail_lock);
+	raw_thumbnail_chains = g_list_prepend(raw_thumbnail_chains, chain);
+	if (g_list_length(raw_thumbnail_chains) > RAW_THUMBNAIL_CHAINS_KEEP)
+	{
+		GList *last = g_list_last(raw_thumbnail_chains);
+		old = last->data;
+		raw_thumbnail_chains = g_list_delete_link(raw_thumbnail_chains, last);
+	}
+	raw_thumbnail_renders--;
+	g_cond_signal(&raw_thumbnail_cond);
+	g_mutex_unlock(&raw_thumbnail_lock);
+
+	if (old)
+		raw_thumbnail_chain_free(old);
+}
+
+/**
+ * Renders a thumbnail from the raw data, used when a file has no usable
+ * embedded preview. Chains are reused per camera and only a limited number
+ * of renders run at once, so scanning a directory of these can't exhaust memory
+ * @param service The file to render
+ * @param meta Metadata of the file, white balance and camera are used
+ * @return A new GdkPixbuf or NULL on failure
+ */
+static GdkPixbuf*
+raw_thumbnail_reader(const gchar *service, RSMetadata *meta)
+{
+	GdkPixbuf* pixbuf = NULL;
+	gint c;
+	gfloat pre_mul[4];
+	RawThumbnailChain *chain = raw_thumbnail_chain_get(meta);
+
+	RSFilterResponse *response = rs_filetype_load(service);
+	if (!response || !rs_filter_response_has_image(response))
+	{
+		if (response)
+			g_object_unref(response);
+		raw_thumbnail_chain_release(chain);
+		return NULL;
+	}
+	g_object_set(chain->input, "image", response, NULL);
+	g_object_unref(response);
+
 	RSFilterRequest *request = rs_filter_request_new();
 	rs_filter_request_set_roi(request, FALSE);
 	rs_filter_request_set_quick(request, TRUE);
 
-
-	if (dcp)
+	if (chain->settings)
 	{
-		RSSettings *settings = rs_settings_new();
 		gdouble buf[3];
-		gint c;
 		gdouble max=0.0, warmth, tint;
 	
 		for (c=0; c < 3; c++)
@@ -2059,30 +2198,24 @@ raw_thumbnail_reader(const gchar *service, RSMetadata *meta)
 
 		tint = (buf[B] + buf[R] - 4.0)/-2.0;
 		warmth = (buf[R]/(2.0-tint))-1.0;
-		rs_settings_set_wb(settings, warmth, tint, "");
-		g_object_set(fdcp, "settings", settings, NULL);
+		rs_settings_set_wb(chain->settings, warmth, tint, "");
 	}
 	else
 	{
-		g_object_set(finput, "color-space", rs_color_space_new_singleton("RSSrgb"), NULL);
 		for(c=0;c<4;c++)
 			pre_mul[c] = (gfloat) meta->cam_mul[c] * 1.5f;
 		rs_filter_param_set_float4(RS_FILTER_PARAM(request), "premul", pre_mul);
 	}
 	rs_filter_param_set_object(RS_FILTER_PARAM(request), "colorspace", rs_color_space_new_singleton("RSSrgb"));	
 
-	RSFilterResponse *response = rs_filter_get_image8(fcst, request);
+	response = rs_filter_get_image8(chain->cst, request);
 	pixbuf = rs_filter_response_get_image8(response);
 
-	g_object_unref(finput);
-	g_object_unref(fdemosaic);
-	g_object_unref(fresample);
-	if (NULL != fdcp)
-			g_object_unref(fdcp);
-	g_object_unref(fcst);
 	g_object_unref(request);
 	g_object_unref(response);
 
+	raw_thumbnail_chain_release(chain);
+
 	return pixbuf;
 }
 
@@ -118,7 +118,7 @@ x3f_load_meta(const gchar *service, RAWFILE *rawfile, guint offset, RSMetadata *
 	X3F_IMAGE_DATA image_data;
 	guint start=0, width=0, height=0, rowstride=0;
 	GdkPixbuf *pixbuf = NULL, *pixbuf2 = NULL;
-	gdouble ratio=1.0;
+	gint thumb_width, thumb_height;
 
 	/* Check if this is infact a Sigma-file */
 	if (!raw_strcmp(rawfile, G_STRUCT_OFFSET(X3F_FILE, identifier), "FOVb", 4))
@@ -126,7 +126,7 @@ x3f_load_meta(const gchar *service, RAWFILE *rawfile, guint offset, RSMetadata *
 		return FALSE;
 	}
 
-	rs_io_lock();
+	rs_io_lock_file(raw_get_filename(rawfile));
 
 	raw_set_byteorder(rawfile, 0x4949); /* x3f is always little endian */
 
@@ -286,13 +286,18 @@ x3f_load_meta(const gchar *service, RAWFILE *rawfile, guint offset, RSMetadata *
 			g_object_unref(pixbuf);
 			pixbuf = pixbuf2;
 		}
-		ratio = ((gdouble) gdk_pixbuf_get_width(pixbuf))/((gdouble) gdk_pixbuf_get_height(pixbuf));
-		if (ratio>1.0)
-			pixbuf2 = gdk_pixbuf_scale_simple(pixbuf, 128, (gint) (128.0/ratio), GDK_INTERP_BILINEAR);
-		else
-			pixbuf2 = gdk_pixbuf_scale_simple(pixbuf, (gint) (128.0*ratio), 128, GDK_INTERP_BILINEAR);
+		/* Scale to the largest thumbnail size, the smaller sizes are made from this */
+		thumb_width = gdk_pixbuf_get_width(pixbuf);
+		thumb_height = gdk_pixbuf_get_height(pixbuf);
+		if (thumb_width > RS_METADATA_THUMBNAIL_MAX || thumb_height > RS_METADATA_THUMBNAIL_MAX)
+		{
+			rs_constrain_to_bounding_box(RS_METADATA_THUMBNAIL_MAX, RS_METADATA_THUMBNAIL_MAX, &thumb_width, &thumb_height);
+			pixbuf2 = gdk_pixbuf_scale_simple(pixbuf, thumb_width, thumb_height, GDK_INTERP_BILINEAR);
+			g_object_unref(pixbuf);
+			pixbuf = pixbuf2;
+		}
+		rs_metadata_set_thumbnail(meta, pixbuf);
 		g_object_unref(pixbuf);
-		meta->thumbnail = pixbuf2;
 	}
 	return TRUE;
 }
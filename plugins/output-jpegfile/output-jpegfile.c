@@ -248,7 +248,7 @@ execute(RSOutput *output, RSFilter *filter)
 	cinfo.in_color_space = JCS_RGB;
 	jpeg_set_defaults(&cinfo);
 	jpeg_set_quality(&cinfo, jpegfile->quality, TRUE);
-	rs_io_lock();
+	rs_io_lock_file(jpegfile->filename);
 	jpeg_start_compress(&cinfo, TRUE);
 	if (jpegfile->color_space && !g_str_equal(G_OBJECT_TYPE_NAME(jpegfile->color_space), "RSSrgb"))
 	{
@@ -247,7 +247,7 @@ execute(RSOutput *output, RSFilter *filter)
 #ifdef G_BIG_ENDIAN
 		png_set_swap(png_ptr);
 #endif
-		rs_io_lock();
+		rs_io_lock_file(pngfile->filename);
 		png_write_image(png_ptr, row_pointers);
 		g_object_unref(image);
 	}
@@ -276,7 +276,7 @@ execute(RSOutput *output, RSFilter *filter)
 		if (n_channels == 4)
 			png_set_filler(png_ptr, 0, PNG_FILLER_AFTER);
 		
-		rs_io_lock();
+		rs_io_lock_file(pngfile->filename);
 		png_write_image(png_ptr, row_pointers);
 		g_object_unref(pixbuf);
 	}
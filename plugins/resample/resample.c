@@ -43,6 +43,7 @@ struct _RSResample {
 	gfloat scale;
 	gboolean bounding_box;
 	gboolean never_quick;
+	GMutex lock; /* Protects the dimensions and settings above */
 };
 
 struct _RSResampleClass {
@@ -58,7 +59,6 @@ typedef struct {
 	guint dest_end_other;		/* Where in the unchanged direction should we stop writing? */
 	guint (*resample_support)(void);
 	gfloat (*resample_func)(gfloat);
-	GThread *threadid;
 	gboolean use_compatible;	/* Use compatible resampler if pixelsize != 4 */
 	gboolean use_fast;		/* Use nearest neighbour resampler, also compatible*/
 } ResampleInfo;
@@ -74,6 +74,7 @@ enum {
 	PROP_SCALE
 };
 
+static void finalize(GObject *object);
 static void get_property (GObject *object, guint property_id, GValue *value, GParamSpec *pspec);
 static void set_property (GObject *object, guint property_id, const GValue *value, GParamSpec *pspec);
 static void previous_changed(RSFilter *filter, RSFilter *parent, RSFilterChangedMask mask);
@@ -92,7 +93,6 @@ void ResizeV_fast(ResampleInfo *info);
 
 static RSFilterClass *rs_resample_parent_class = NULL;
 static inline guint clampbits(gint x, guint n) { guint32 _y_temp; if( (_y_temp=x>>n) ) x = ~_y_temp >> (32-n); return x;}
-static GRecMutex resampler_mutex;
 
 G_MODULE_EXPORT void
 rs_plugin_load(RSPlugin *plugin)
@@ -110,6 +110,7 @@ rs_resample_class_init(RSResampleClass *klass)
 
 	object_class->get_property = get_property;
 	object_class->set_property = set_property;
+	object_class->finalize = finalize;
 
 	g_object_class_install_property(object_class,
 		PROP_WIDTH, g_param_spec_int(
@@ -153,6 +154,17 @@ rs_resample_init(RSResample *resample)
 	resample->bounding_box = FALSE;
 	resample->scale = 1.0;
 	resample->never_quick = FALSE;
+	g_mutex_init(&resample->lock);
+}
+
+static void
+finalize(GObject *object)
+{
+	RSResample *resample = RS_RESAMPLE(object);
+
+	g_mutex_clear(&resample->lock);
+
+	G_OBJECT_CLASS(rs_resample_parent_class)->finalize(object);
 }
 
 static void
@@ -160,6 +172,7 @@ get_property(GObject *object, guint property_id, GValue *value, GParamSpec *pspe
 {
 	RSResample *resample = RS_RESAMPLE(object);
 
+	g_mutex_lock(&resample->lock);
 	switch (property_id)
 	{
 		case PROP_WIDTH:
@@ -180,6 +193,7 @@ get_property(GObject *object, guint property_id, GValue *value, GParamSpec *pspe
 		default:
 			G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
 	}
+	g_mutex_unlock(&resample->lock);
 }
 
 static void
@@ -187,8 +201,9 @@ set_property(GObject *object, guint property_id, const GValue *value, GParamSpec
 {
 	RSResample *resample = RS_RESAMPLE(object);
 	RSFilterChangedMask mask = 0;
+	gboolean recalculate = FALSE;
 
-	g_rec_mutex_lock(&resampler_mutex);
+	g_mutex_lock(&resample->lock);
 
 	switch (property_id)
 	{
@@ -196,21 +211,21 @@ set_property(GObject *object, guint property_id, const GValue *value, GParamSpec
 			if (g_value_get_int(value) != resample->target_width)
 			{
 				resample->target_width = g_value_get_int(value);
-				mask |= recalculate_dimensions(resample);
+				recalculate = TRUE;
 			}
 			break;
 		case PROP_HEIGHT:
 			if (g_value_get_int(value) != resample->target_height)
 			{
 				resample->target_height = g_value_get_int(value);
-				mask |= recalculate_dimensions(resample);
+				recalculate = TRUE;
 			}
 			break;
 		case PROP_BOUNDING_BOX:
 			if (g_value_get_boolean(value) != resample->bounding_box)
 			{
 				resample->bounding_box = g_value_get_boolean(value);
-				mask |= recalculate_dimensions(resample);
+				recalculate = TRUE;
 			}
 			break;
 		case PROP_NEVER_QUICK:
@@ -224,7 +239,10 @@ set_property(GObject *object, guint property_id, const GValue *value, GParamSpec
 			G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
 	}
 
-	g_rec_mutex_unlock(&resampler_mutex);
+	g_mutex_unlock(&resample->lock);
+
+	if (recalculate)
+		mask |= recalculate_dimensions(resample);
 	if (mask)
 		rs_filter_changed(RS_FILTER(object), mask);
 }
@@ -245,11 +263,13 @@ recalculate_dimensions(RSResample *resample)
 	gint new_width, new_height;
 	gint previous_width = 0;
 	gint previous_height = 0;
-	g_rec_mutex_lock(&resampler_mutex);
 
+	/* Ask for the input size before locking, the chain may call back into us */
 	if (RS_FILTER(resample)->previous)
 		rs_filter_get_size_simple(RS_FILTER(resample)->previous, RS_FILTER_REQUEST_QUICK, &previous_width, &previous_height);
 
+	g_mutex_lock(&resample->lock);
+
 	if (resample->bounding_box && RS_FILTER(resample)->previous)
 	{
 		new_width = previous_width;
@@ -284,7 +304,7 @@ recalculate_dimensions(RSResample *resample)
 	if (new_width < 0 || new_height < 0)
 		resample->scale = 1.0f;
 
-	g_rec_mutex_unlock(&resampler_mutex);
+	g_mutex_unlock(&resample->lock);
 	return mask;
 }
 
@@ -314,14 +334,12 @@ start_thread_resampler(gpointer _thread_info)
 	if (!t->input)
 	{
 		g_debug("Resampler: input is NULL");
-		g_thread_exit(NULL);
 		return NULL;
 	}
 
 	if (!t->output)
 	{
 		g_debug("Resampler: output is NULL");
-		g_thread_exit(NULL);
 		return NULL;
 	}
 
@@ -357,9 +375,7 @@ start_thread_resampler(gpointer _thread_info)
 		bit_blt((char*)GET_PIXEL(t->output,0,0), t->output->rowstride * 2, 
 			(const char*)GET_PIXEL(t->input,0,0), t->input->rowstride * 2, t->input->rowstride * 2, t->input->h);
 
-	g_thread_exit(NULL);
-
-	return NULL; /* Make the compiler shut up - we'll never return */
+	return NULL;
 }
 
 static RSFilterResponse *
@@ -374,15 +390,24 @@ get_image(RSFilter *filter, const RSFilterRequest *request)
 	RS_IMAGE16 *output = NULL;
 	gint input_width;
 	gint input_height;
+	gint new_width, new_height;
+	gboolean never_quick;
+
+	/* Snapshot settings, so property changes don't have to wait for us */
+	g_mutex_lock(&resample->lock);
+	new_width = resample->new_width;
+	new_height = resample->new_height;
+	never_quick = resample->never_quick;
+	g_mutex_unlock(&resample->lock);
 
 	rs_filter_get_size_simple(filter->previous, request, &input_width, &input_height);
 
 	/* Return the input, if the new size is uninitialized */
-	if ((resample->new_width == -1) || (resample->new_height == -1))
+	if ((new_width == -1) || (new_height == -1))
 		return rs_filter_get_image(filter->previous, request);
 
 	/* Simply return the input, if we don't scale */
-	if ((input_width == resample->new_width) && (input_height == resample->new_height))
+	if ((input_width == new_width) && (input_height == new_height))
 		return rs_filter_get_image(filter->previous, request);	
 	
 	/* Remove ROI, it doesn't make sense across resampler */
@@ -401,7 +426,6 @@ get_image(RSFilter *filter, const RSFilterRequest *request)
 	if (!RS_IS_IMAGE16(input))
 		return previous_response;
 
-	g_rec_mutex_lock(&resampler_mutex);
 	input_width = input->w;
 	input_height = input->h;	
 
@@ -412,7 +436,7 @@ get_image(RSFilter *filter, const RSFilterRequest *request)
 	/* Use compatible (and slow) version if input isn't 3 channels and pixelsize 4 */
 	gboolean use_compatible = ( ! ( input->pixelsize == 4 && input->channels == 3));
 
-	if (!resample->never_quick && rs_filter_request_get_quick(request))
+	if (!never_quick && rs_filter_request_get_quick(request))
 	{
 		use_fast = TRUE;
 		rs_filter_response_set_quick(response);
@@ -427,7 +451,7 @@ get_image(RSFilter *filter, const RSFilterRequest *request)
 	ResampleInfo* v_resample = g_new(ResampleInfo,  threads);
 
 	/* Create intermediate and output images*/
-	afterVertical = rs_image16_new(input_width, resample->new_height, input->channels, input->pixelsize);
+	afterVertical = rs_image16_new(input_width, new_height, input->channels, input->pixelsize);
 
 	// Only even count
 	guint output_x_per_thread = ((input_width + threads - 1 ) / threads );
@@ -443,32 +467,28 @@ get_image(RSFilter *filter, const RSFilterRequest *request)
 		v->input = input;
 		v->output  = afterVertical;
 		v->old_size = input_height;
-		v->new_size = resample->new_height;
+		v->new_size = new_height;
 		v->dest_offset_other = output_x_offset;
 		v->dest_end_other  = MIN(output_x_offset + output_x_per_thread, input_width);
 		v->use_compatible = use_compatible;
 		v->use_fast = use_fast;
 
-		/* Start it up */
-		v->threadid = g_thread_new("RSResample worker (vertical)", start_thread_resampler, v);
-
 		/* Update offset */
 		output_x_offset = v->dest_end_other;
 	}
 
-	/* Wait for vertical threads to finish */
-	for(i = 0; i < threads; i++)
-		g_thread_join(v_resample[i].threadid);
+	/* Run vertical resamplers */
+	rs_thread_pool_run(start_thread_resampler, v_resample, sizeof(ResampleInfo), threads);
 
 	/* input no longer needed */
 	g_object_unref(input);
 	input = NULL;
 
 	/* create output */
-	output = rs_image16_new(resample->new_width,  resample->new_height, afterVertical->channels, afterVertical->pixelsize);
+	output = rs_image16_new(new_width,  new_height, afterVertical->channels, afterVertical->pixelsize);
 
 	guint input_y_offset = 0;
-	guint input_y_per_thread = (resample->new_height+threads-1) / threads;
+	guint input_y_per_thread = (new_height+threads-1) / threads;
 
 	for (i = 0; i < threads; i++)
 	{
@@ -477,23 +497,18 @@ get_image(RSFilter *filter, const RSFilterRequest *request)
 		h->input = afterVertical;
 		h->output  = output;
 		h->old_size = input_width;
-		h->new_size = resample->new_width;
+		h->new_size = new_width;
 		h->dest_offset_other = input_y_offset;
-		h->dest_end_other  = MIN(input_y_offset+input_y_per_thread, resample->new_height);
+		h->dest_end_other  = MIN(input_y_offset+input_y_per_thread, new_height);
 		h->use_compatible = use_compatible;
 		h->use_fast = use_fast;
 
-		/* Start it up */
-		h->threadid = g_thread_new("RSResample worker (horizontal)", start_thread_resampler, h);
-
 		/* Update offset */
 		input_y_offset = h->dest_end_other;
-
 	}
 
-	/* Wait for horizontal threads to finish */
-	for(i = 0; i < threads; i++)
-		g_thread_join(h_resample[i].threadid);
+	/* Run horizontal resamplers */
+	rs_thread_pool_run(start_thread_resampler, h_resample, sizeof(ResampleInfo), threads);
 
 	/* Clean up */
 	g_free(h_resample);
@@ -503,7 +518,6 @@ get_image(RSFilter *filter, const RSFilterRequest *request)
 	rs_filter_response_set_image(response, output);
 	rs_filter_param_set_boolean(RS_FILTER_PARAM(response), "half-size", FALSE);
 	g_object_unref(output);
-	g_rec_mutex_unlock(&resampler_mutex);
 	return response;
 }
 
@@ -512,15 +526,21 @@ get_size(RSFilter *filter, const RSFilterRequest *request)
 {
 	RSResample *resample = RS_RESAMPLE(filter);
 	RSFilterResponse *previous_response = rs_filter_get_size(filter->previous, request);
+	gint new_width, new_height;
+
+	g_mutex_lock(&resample->lock);
+	new_width = resample->new_width;
+	new_height = resample->new_height;
+	g_mutex_unlock(&resample->lock);
 
-	if ((resample->new_width == -1) || (resample->new_height == -1))
+	if ((new_width == -1) || (new_height == -1))
 		return previous_response;
 
 	RSFilterResponse *response = rs_filter_response_clone(previous_response);
 	g_object_unref(previous_response);
 
-	rs_filter_response_set_width(response, resample->new_width);
-	rs_filter_response_set_height(response, resample->new_height);
+	rs_filter_response_set_width(response, new_width);
+	rs_filter_response_set_height(response, new_height);
 
 	return response;
 }
@@ -60,7 +60,6 @@ typedef struct {
 	RS_IMAGE16 *output;			/* Output Image*/
 	gint start_y;
 	gint end_y;
-	GThread *threadid;
 	gboolean use_straight;
 	RSRotate* rotate;
 	gboolean use_fast;		/* Use nearest neighbour resampler */
@@ -292,13 +291,9 @@ get_image(RSFilter *filter, const RSFilterRequest *request)
 		t[i].end_y = y_offset;
 		t[i].rotate = rotate;
 		t[i].use_fast = use_fast;
-
-		t[i].threadid = g_thread_new("RSRotate worker", start_rotate_thread, &t[i]);
 	}
 
-	/* Wait for threads to finish */
-	for(i = 0; i < threads; i++)
-		g_thread_join(t[i].threadid);
+	rs_thread_pool_run(start_rotate_thread, t, sizeof(ThreadInfo), threads);
 
 	g_free(t);
 	g_object_unref(input);
@@ -320,7 +315,6 @@ start_rotate_thread(gpointer _thread_info)
 
 	if (t->use_straight) {
 		turn_right_angle(input, output, t->start_y, t->end_y, rotate->orientation);
-		g_thread_exit(NULL);
 		return NULL;
 	}
 
@@ -346,9 +340,7 @@ start_rotate_thread(gpointer _thread_info)
 		}
 	}
 
-	g_thread_exit(NULL);
-
-	return NULL; /* Make the compiler shut up - we'll never return */
+	return NULL;
 }
 
 
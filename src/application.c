@@ -25,6 +25,7 @@
 #include <glib/gstdio.h>
 #include <glib.h>
 #include <unistd.h>
+#include <stdlib.h> /* strtol() */
 #include <math.h> /* pow() */
 #include <string.h> /* memset() */
 #include <time.h>
@@ -290,7 +291,7 @@ test(void)
 		status = g_io_channel_read_line(io, &next_filename, NULL, NULL, NULL);
 		g_strstrip(next_filename);
 		if (status != G_IO_STATUS_EOF)
-			rs_io_idle_prefetch_file(next_filename, -1);
+			g_object_unref(rs_io_idle_prefetch_file(next_filename, -1));
 		gboolean filetype_ok = FALSE;
 		gboolean load_ok = FALSE;
 		gboolean thumbnail_ok = FALSE;
@@ -554,6 +555,94 @@ RS_BLOB* rs_get_blob(void)
 	return main_blob;
 }
 
+/**
+ * Parse a --size argument
+ * @param size "WIDTHxHEIGHT" for a bounding box, "WIDTH", "xHEIGHT" or "SCALE%"
+ * @return TRUE if size could be parsed, FALSE otherwise
+ */
+static gboolean
+batch_parse_size(const gchar *size, RS_QUEUE_SIZE_LOCK *size_lock, gint *width, gint *height, gint *scale)
+{
+	gchar *end;
+	gint value;
+
+	if (size[0] == 'x')
+	{
+		*size_lock = LOCK_HEIGHT;
+		*height = strtol(size+1, &end, 10);
+		return (*end == '\0' && *height > 0);
+	}
+
+	value = strtol(size, &end, 10);
+	if (value <= 0)
+		return FALSE;
+
+	if (g_str_equal(end, "%"))
+	{
+		*size_lock = LOCK_SCALE;
+		*scale = value;
+		return TRUE;
+	}
+	else if (*end == '\0')
+	{
+		*size_lock = LOCK_WIDTH;
+		*width = value;
+		return TRUE;
+	}
+	else if (*end == 'x')
+	{
+		*size_lock = LOCK_BOUNDING_BOX;
+		*width = value;
+		*height = strtol(end+1, &end, 10);
+		return (*end == '\0' && *height > 0);
+	}
+
+	return FALSE;
+}
+
+/**
+ * Export the photos given on the command line without opening any windows
+ * @return The exit status for Rawstudio
+ */
+static gint
+batch_main(int argc, char **argv, const gchar *format, const gchar *directory, const gchar *filename, const gchar *size)
+{
+	RS_QUEUE_SIZE_LOCK size_lock = LOCK_SCALE;
+	gint width = 0, height = 0, scale = 100;
+	GList *inputs = NULL;
+	gchar *cwd = NULL;
+	gint i, failed;
+
+	if (size && !batch_parse_size(size, &size_lock, &width, &height, &scale))
+	{
+		g_printerr("Invalid size: %s\n", size);
+		return 1;
+	}
+
+	for (i = 1; i < argc; i++)
+		inputs = g_list_append(inputs, argv[i]);
+
+	if (!inputs)
+	{
+		g_printerr("You must specify at least one batch queue, directory or photo to work in batch mode.\n");
+		return 1;
+	}
+
+	if (!directory)
+		directory = cwd = g_get_current_dir();
+
+	failed = rs_batch_process_headless(inputs,
+		format ? format : DEFAULT_CONF_BATCH_FILETYPE,
+		directory,
+		filename ? filename : DEFAULT_CONF_BATCH_FILENAME,
+		size_lock, width, height, scale);
+
+	g_list_free(inputs);
+	g_free(cwd);
+
+	return (failed == 0) ? 0 : 1;
+}
+
 int
 main(int argc, char **argv)
 {
@@ -563,6 +652,11 @@ main(int argc, char **argv)
 	gboolean use_system_theme = DEFAULT_CONF_USE_SYSTEM_THEME;
 	gchar *debug = NULL;
     gchar *client_mode_dest = NULL;
+	gboolean batch = FALSE;
+	gchar *batch_format = NULL;
+	gchar *batch_directory = NULL;
+	gchar *batch_filename = NULL;
+	gchar *batch_size = NULL;
 
 	GError *error = NULL;
 	GOptionContext *option_context;
@@ -571,6 +665,11 @@ main(int argc, char **argv)
 		{ "debug", 'd', 0, G_OPTION_ARG_STRING, &debug, "Debug flags to use", "flags" },
 		{ "do-tests", 't', G_OPTION_FLAG_HIDDEN, G_OPTION_ARG_NONE, &do_test, "Do internal tests", NULL },
 		{ "version", 'V', 0, G_OPTION_ARG_NONE, &print_version, "Output version information and exit", NULL },
+		{ "batch", 'b', 0, G_OPTION_ARG_NONE, &batch, "Export batch queues, directories or photos without a user interface", NULL },
+		{ "output-format", 0, 0, G_OPTION_ARG_STRING, &batch_format, "Output format for batch mode (default jpeg)", "format" },
+		{ "output-dir", 0, 0, G_OPTION_ARG_FILENAME, &batch_directory, "Output directory for batch mode (default current directory)", "directory" },
+		{ "filename", 0, 0, G_OPTION_ARG_STRING, &batch_filename, "Output filename template for batch mode (default " DEFAULT_CONF_BATCH_FILENAME ")", "template" },
+		{ "size", 0, 0, G_OPTION_ARG_STRING, &batch_size, "Output size for batch mode: WIDTHxHEIGHT, WIDTH, xHEIGHT or SCALE%", "size" },
 		{ NULL }
 	};
 
@@ -635,6 +734,15 @@ main(int argc, char **argv)
 	g_type_init();
 #endif
 
+	if (batch)
+	{
+		/* Headless, leave GTK+ alone */
+		rs_filetype_init();
+		rs_plugin_manager_load_all_plugins();
+		rs_lens_fix_init();
+		exit(batch_main(argc, argv, batch_format, batch_directory, batch_filename, batch_size));
+	}
+
 	gtk_init(&argc, &argv);
 	check_install();
 
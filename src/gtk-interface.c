@@ -444,6 +444,26 @@ gui_fullscreen_changed(GtkWidget *widget, gboolean is_fullscreen, const gchar *a
 }
 
 
+static void
+gui_thumbnail_size_changed(GtkComboBox *combo, RS_BLOB *rs)
+{
+	const gint sizes[] = { 128, 256, 512 };
+	const gint active = gtk_combo_box_get_active(combo);
+
+	if (active >= 0 && active < G_N_ELEMENTS(sizes))
+		rs_store_set_thumbnail_size(rs->store, sizes[active]);
+}
+
+static void
+gui_export_demosaic_changed(GtkComboBox *combo, gpointer user_data)
+{
+	const gchar *methods[] = { "pixel-grouping", "adaptive-homogeneity" };
+	const gint active = gtk_combo_box_get_active(combo);
+
+	if (active >= 0 && active < G_N_ELEMENTS(methods))
+		rs_conf_set_string(CONF_EXPORT_DEMOSAIC, methods[active]);
+}
+
 static gboolean
 gui_histogram_height_changed(GtkAdjustment *caller, RS_BLOB *rs)
 {
@@ -915,6 +935,14 @@ gui_make_preference_window(RS_BLOB *rs)
 	GtkWidget* cs_widget;
 	GtkWidget *local_cache_check;
 	GtkWidget *enfuse_cache_check;
+	GtkWidget *thumbsize_hbox;
+	GtkWidget *thumbsize_label;
+	GtkWidget *thumbsize;
+	gint thumbnail_size;
+	GtkWidget *demosaic_hbox;
+	GtkWidget *demosaic_label;
+	GtkWidget *demosaic_combo;
+	gchar *demosaic;
 	GtkWidget *system_theme_check;
 	gchar *str;
 
@@ -969,6 +997,35 @@ gui_make_preference_window(RS_BLOB *rs)
 	gtk_box_pack_start (GTK_BOX (histsize_hbox), histsize, FALSE, TRUE, 0);
 	gtk_box_pack_start (GTK_BOX (preview_page), histsize_hbox, FALSE, TRUE, 0);
 
+	if (!rs_conf_get_integer(CONF_THUMBNAIL_SIZE, &thumbnail_size))
+		thumbnail_size = DEFAULT_CONF_THUMBNAIL_SIZE;
+	thumbsize_hbox = gtk_hbox_new(FALSE, 0);
+	thumbsize_label = gtk_label_new(_("Thumbnail Size:"));
+	gtk_misc_set_alignment(GTK_MISC(thumbsize_label), 0.0, 0.5);
+	thumbsize = gtk_combo_box_text_new();
+	gtk_combo_box_text_append_text(GTK_COMBO_BOX_TEXT(thumbsize), _("Small"));
+	gtk_combo_box_text_append_text(GTK_COMBO_BOX_TEXT(thumbsize), _("Medium"));
+	gtk_combo_box_text_append_text(GTK_COMBO_BOX_TEXT(thumbsize), _("Large"));
+	gtk_combo_box_set_active(GTK_COMBO_BOX(thumbsize), (thumbnail_size > 256) ? 2 : ((thumbnail_size > 128) ? 1 : 0));
+	g_signal_connect(thumbsize, "changed", G_CALLBACK(gui_thumbnail_size_changed), rs);
+	gtk_box_pack_start (GTK_BOX (thumbsize_hbox), thumbsize_label, TRUE, TRUE, 0);
+	gtk_box_pack_start (GTK_BOX (thumbsize_hbox), thumbsize, FALSE, TRUE, 0);
+	gtk_box_pack_start (GTK_BOX (preview_page), thumbsize_hbox, FALSE, TRUE, 0);
+
+	demosaic = rs_conf_get_string(CONF_EXPORT_DEMOSAIC);
+	demosaic_hbox = gtk_hbox_new(FALSE, 0);
+	demosaic_label = gtk_label_new(_("Export Demosaic:"));
+	gtk_misc_set_alignment(GTK_MISC(demosaic_label), 0.0, 0.5);
+	demosaic_combo = gtk_combo_box_text_new();
+	gtk_combo_box_text_append_text(GTK_COMBO_BOX_TEXT(demosaic_combo), _("Pixel Grouping (Faster)"));
+	gtk_combo_box_text_append_text(GTK_COMBO_BOX_TEXT(demosaic_combo), _("Adaptive Homogeneity (Better)"));
+	gtk_combo_box_set_active(GTK_COMBO_BOX(demosaic_combo), g_strcmp0(demosaic ? demosaic : DEFAULT_CONF_EXPORT_DEMOSAIC, "pixel-grouping") == 0 ? 0 : 1);
+	g_free(demosaic);
+	g_signal_connect(demosaic_combo, "changed", G_CALLBACK(gui_export_demosaic_changed), NULL);
+	gtk_box_pack_start (GTK_BOX (demosaic_hbox), demosaic_label, TRUE, TRUE, 0);
+	gtk_box_pack_start (GTK_BOX (demosaic_hbox), demosaic_combo, FALSE, TRUE, 0);
+	gtk_box_pack_start (GTK_BOX (preview_page), demosaic_hbox, FALSE, TRUE, 0);
+
 	system_theme_check = checkbox_from_conf(CONF_USE_SYSTEM_THEME, _("Use System Theme"), DEFAULT_CONF_USE_SYSTEM_THEME);
 	gtk_box_pack_start (GTK_BOX (preview_page), system_theme_check, FALSE, TRUE, 0);
 	g_signal_connect ((gpointer) system_theme_check, "toggled",
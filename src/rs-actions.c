@@ -394,9 +394,7 @@ ACTION(quit)
 	if (rs->photo)
 		rs_photo_close(rs->photo);
 	rs_conf_set_integer(CONF_LAST_PRIORITY_PAGE, rs_store_get_current_page(rs->store));
-	rs_io_idle_cancel_class(METADATA_CLASS);
-	rs_io_idle_cancel_class(PRELOAD_CLASS);
-	rs_io_idle_cancel_class(RESTORE_TAGS_CLASS);
+	rs_store_cancel_jobs(rs->store);
 	
 	RS_PROGRESS *progress;
 	gint total_items = rs_io_get_jobs_left();
@@ -986,7 +984,7 @@ tag_photo_input_changed(GtkWidget *button, gpointer user_data)
 			for(cur=0;cur<num_selected;cur++)
 			{
 				gchar* filename = g_list_nth_data(selected, cur);
-				rs_io_idle_add_tag(filename, tag_id, FALSE, -1);
+				g_object_unref(rs_io_idle_add_tag(filename, tag_id, FALSE, -1));
 				
 				if (0 == i)
 				{
@@ -1002,7 +1000,7 @@ tag_photo_input_changed(GtkWidget *button, gpointer user_data)
 		g_hash_table_iter_init (&iter, directories);
 		while (g_hash_table_iter_next (&iter, &key, &value)) 
 		{
-			rs_io_idle_add_tag(value, -2, FALSE, -1);
+			g_object_unref(rs_io_idle_add_tag(value, -2, FALSE, -1));
 		}
 		g_hash_table_remove_all(directories);
 		g_list_free(tags);
@@ -1573,7 +1571,7 @@ get_thumbnails_from_list(GList *files)
   for(i=0; i<num_selected; i++) 
     {
       name = (gchar*) g_list_nth_data(files, i);
-      thumbnails = g_list_append(thumbnails, rs_metadata_dotdir_helper(name, DOTDIR_THUMB));
+      thumbnails = g_list_append(thumbnails, rs_metadata_get_thumbnail_filename(name));
     }
 
   return thumbnails;
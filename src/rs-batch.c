@@ -20,6 +20,7 @@
 #include <rawstudio.h>
 #include <glib.h>
 #include <stdio.h>
+#include <string.h> /* strstr() */
 #include <gtk/gtk.h>
 #include <config.h>
 #include <libxml/encoding.h>
@@ -81,25 +82,29 @@ batch_queue_save(RS_QUEUE *queue)
 	return;
 }
 
-static void
-batch_queue_load(RS_QUEUE *queue)
+typedef void (*BatchQueueEntryFunc)(const gchar *filename, gint setting_id, gpointer user_data);
+
+/**
+ * Read a batch queue as written by batch_queue_save()
+ * @param queue_filename The file to read
+ * @param func Called for each entry in the queue
+ * @param user_data Passed on to func
+ * @return TRUE if the file could be parsed, FALSE otherwise
+ */
+static gboolean
+batch_queue_read(const gchar *queue_filename, BatchQueueEntryFunc func, gpointer user_data)
 {
 	xmlDocPtr doc;
 	xmlNodePtr cur;
 	xmlNodePtr entry = NULL;
 	xmlChar *val;
 
-	g_assert(queue != NULL);
-
-	if (!batch_queue_filename)
-		batch_queue_filename = g_build_filename(rs_confdir_get(), "batch-queue.xml", NULL);
-
-	if (!g_file_test(batch_queue_filename, G_FILE_TEST_IS_REGULAR))
-		return;
+	if (!g_file_test(queue_filename, G_FILE_TEST_IS_REGULAR))
+		return FALSE;
 
-	doc = xmlParseFile(batch_queue_filename);
+	doc = xmlParseFile(queue_filename);
 	if (!doc)
-		return;
+		return FALSE;
 
 	cur = xmlDocGetRootElement(doc);
 	cur = cur->xmlChildrenNode;
@@ -131,7 +136,7 @@ batch_queue_load(RS_QUEUE *queue)
 			}
 			if (filename && (setting_id >= 0))
 			{
-				rs_batch_add_to_queue(queue, (gchar *) filename, setting_id);
+				func((gchar *) filename, setting_id, user_data);
 				xmlFree(filename);
 			}
 		}
@@ -139,7 +144,24 @@ batch_queue_load(RS_QUEUE *queue)
 	}
 
 	xmlFreeDoc(doc);
-	return;
+	return TRUE;
+}
+
+static void
+batch_queue_load_entry(const gchar *filename, gint setting_id, gpointer user_data)
+{
+	rs_batch_add_to_queue(user_data, filename, setting_id);
+}
+
+static void
+batch_queue_load(RS_QUEUE *queue)
+{
+	g_assert(queue != NULL);
+
+	if (!batch_queue_filename)
+		batch_queue_filename = g_build_filename(rs_confdir_get(), "batch-queue.xml", NULL);
+
+	batch_queue_read(batch_queue_filename, batch_queue_load_entry, queue);
 }
 
 RS_QUEUE* rs_batch_new_queue(RS_BLOB *rs)
@@ -371,19 +393,506 @@ cancel_clicked(GtkButton *button, gpointer user_data)
 	return;
 }
 
+/* Filters of the chain used for batch export, from input to output */
+static const gchar *batch_chain[] = {
+	"RSInputImage16",
+	"RSDemosaic",
+	"RSFujiRotate",
+	"RSLensfun",
+	"RSRotate",
+	"RSCrop",
+	"RSColorspaceTransform",
+	"RSDcp",
+	"RSCache",
+	"RSResample",
+	"RSDenoise",
+	"RSColorspaceTransform",
+};
+#define BATCH_CHAIN_LENGTH G_N_ELEMENTS(batch_chain)
+#define BATCH_CHAIN_DEMOSAIC 1
+#define BATCH_CHAIN_CROP 5
+
+typedef struct {
+	gchar *filename;
+	gint setting_id;
+	RS_PHOTO *photo;
+	gsize bytes;
+	gchar *output_filename;
+	GdkPixbuf *preview;
+	gboolean processed;
+	gboolean exported;
+	const gchar *error;
+	gdouble seconds;
+} BatchJob;
+
+typedef struct {
+	RSFilter *filters[BATCH_CHAIN_LENGTH];
+	RSOutput *output;
+	GThread *thread;
+	struct _BatchEngine *engine;
+} BatchWorker;
+
+typedef struct _BatchEngine {
+	gchar *output_type;
+	gchar *filename_template;
+	RS_QUEUE_SIZE_LOCK size_lock;
+	gint width;
+	gint height;
+	gint scale;
+	RSColorSpace *preview_color_space; /* NULL to skip rendering previews */
+	GList *jobs;
+	GAsyncQueue *loaded;
+	GAsyncQueue *finished;
+	BatchWorker *workers;
+	gint n_workers;
+	GThread *loader;
+
+	GMutex lock;
+	GCond cond;
+	gint photos;		/* Photos loaded but not finished */
+	gsize bytes;		/* Estimated memory used by those photos */
+	gsize budget;
+	gint dispatched;	/* Jobs handed to workers */
+	gboolean loader_done;
+	gboolean abort;
+} BatchEngine;
+
+/* Pushed to the workers to make them exit */
+static BatchJob batch_job_stop;
+
+static void
+batch_job_free(BatchJob *job)
+{
+	g_free(job->filename);
+	g_free(job->output_filename);
+	if (job->photo)
+		g_object_unref(job->photo);
+	if (job->preview)
+		g_object_unref(job->preview);
+	g_free(job);
+}
+
+/**
+ * Estimate the memory needed to export a photo: the raw input plus the
+ * demosaiced image and the copies made by the filters after it
+ */
+static gsize
+batch_photo_bytes(RS_PHOTO *photo)
+{
+	gsize bytes = 0;
+	RS_IMAGE16 *image = rs_filter_response_get_image(photo->input_response);
+
+	if (image)
+	{
+		bytes = (gsize) image->rowstride * image->h * sizeof(gushort);
+		bytes += (gsize) image->w * image->h * 4 * sizeof(gushort) * 3;
+		g_object_unref(image);
+	}
+	return bytes;
+}
+
+static gboolean
+batch_engine_aborted(BatchEngine *engine)
+{
+	gboolean abort;
+
+	g_mutex_lock(&engine->lock);
+	abort = engine->abort;
+	g_mutex_unlock(&engine->lock);
+
+	return abort;
+}
+
+/**
+ * Load photos ahead of the workers, as long as there is a free worker and
+ * the photos in flight are within the memory budget
+ */
+static gpointer
+batch_loader(gpointer data)
+{
+	BatchEngine *engine = data;
+	GList *node;
+	gint i;
+
+	for (node = engine->jobs; node; node = g_list_next(node))
+	{
+		BatchJob *job = node->data;
+
+		g_mutex_lock(&engine->lock);
+		/* Allow one photo more than we have workers, so the next photo is
+		 * ready when a worker finishes */
+		while (!engine->abort && engine->photos > 0
+			&& (engine->photos > engine->n_workers || engine->bytes >= engine->budget))
+			g_cond_wait(&engine->cond, &engine->lock);
+		if (engine->abort)
+		{
+			g_mutex_unlock(&engine->lock);
+			break;
+		}
+		engine->photos++;
+		engine->dispatched++;
+		g_mutex_unlock(&engine->lock);
+
+		job->photo = rs_photo_load_from_file(job->filename);
+		if (job->photo)
+		{
+			rs_metadata_load_from_file(job->photo->metadata, job->filename);
+			rs_cache_load(job->photo);
+			job->bytes = batch_photo_bytes(job->photo);
+
+			g_mutex_lock(&engine->lock);
+			engine->bytes += job->bytes;
+			g_mutex_unlock(&engine->lock);
+		}
+
+		/* Get the file after this one going while we wait */
+		if (g_list_next(node))
+			g_object_unref(rs_io_idle_prefetch_file(((BatchJob *) g_list_next(node)->data)->filename, 0xC01A));
+
+		g_async_queue_push(engine->loaded, job);
+	}
+
+	for (i = 0; i < engine->n_workers; i++)
+		g_async_queue_push(engine->loaded, &batch_job_stop);
+
+	g_mutex_lock(&engine->lock);
+	engine->loader_done = TRUE;
+	g_mutex_unlock(&engine->lock);
+
+	return NULL;
+}
+
+static void
+batch_worker_export(BatchWorker *worker, BatchJob *job)
+{
+	BatchEngine *engine = worker->engine;
+	RSFilter *fend = worker->filters[BATCH_CHAIN_LENGTH-1];
+	RSFilter *fcrop = worker->filters[BATCH_CHAIN_CROP];
+	RS_PHOTO *photo = job->photo;
+	RSFilterResponse *filter_response;
+	gint width, height;
+	gdouble scale;
+	gchar *parsed_dir;
+
+	job->output_filename = filename_parse(engine->filename_template, job->filename, job->setting_id, TRUE);
+
+	/* Create directory, if it doesn't exist */
+	parsed_dir = g_path_get_dirname(job->output_filename);
+	if (FALSE == g_file_test(parsed_dir, G_FILE_TEST_EXISTS | G_FILE_TEST_IS_DIR))
+		if (g_mkdir_with_parents(parsed_dir, 0x1ff))
+			job->error = _("Could not create output directory.");
+	g_free(parsed_dir);
+	if (job->error)
+		return;
+
+	GList *filters = g_list_append(NULL, fend);
+	rs_photo_apply_to_filters(photo, filters, job->setting_id);
+	g_list_free(filters);
+
+	rs_filter_set_recursive(fend,
+		"image", photo->input_response,
+		"filename", photo->filename,
+		"bounding-box", TRUE,
+		"width", 250,
+		"height", 250,
+		NULL);
+
+	if (engine->preview_color_space)
+	{
+		/* Render preview image. This leaves the full size output of RSDcp in the
+		 * RSCache, so the export below only has to run the filters after it. */
+		RSFilterRequest *request = rs_filter_request_new();
+		rs_filter_request_set_quick(RS_FILTER_REQUEST(request), FALSE);
+		/* FIXME: Should be set to output colorspace, not forced to sRGB */
+		rs_filter_param_set_object(RS_FILTER_PARAM(request), "colorspace", engine->preview_color_space);
+		filter_response = rs_filter_get_image8(fend, request);
+		job->preview = rs_filter_response_get_image8(filter_response);
+		g_object_unref(request);
+		g_object_unref(filter_response);
+	}
+
+	width = 65535;
+	height = 65535;
+	/* Calculate new size */
+	switch (engine->size_lock)
+	{
+		case LOCK_SCALE:
+			scale = engine->scale/100.0;
+			rs_filter_get_size_simple(fcrop, RS_FILTER_REQUEST_QUICK, &width, &height);
+			width = (gint) (((gdouble) width) * scale);
+			height = (gint) (((gdouble) height) * scale);
+			break;
+		case LOCK_WIDTH:
+			width = engine->width;
+			break;
+		case LOCK_HEIGHT:
+			height = engine->height;
+			break;
+		case LOCK_BOUNDING_BOX:
+			width = engine->width;
+			height = engine->height;
+			break;
+	}
+	rs_filter_set_recursive(fend,
+		"width", width,
+		"height", height,
+		NULL);
+
+	/* Save the image */
+	if (g_object_class_find_property(G_OBJECT_GET_CLASS(worker->output), "filename"))
+		g_object_set(worker->output, "filename", job->output_filename, NULL);
+
+	job->exported = rs_output_execute(worker->output, fend);
+	if (!job->exported)
+		job->error = _("Could not export photo.");
+}
+
+static gpointer
+batch_worker(gpointer data)
+{
+	BatchWorker *worker = data;
+	BatchEngine *engine = worker->engine;
+	BatchJob *job;
+
+	while ((job = g_async_queue_pop(engine->loaded)) != &batch_job_stop)
+	{
+		if (batch_engine_aborted(engine))
+			job->processed = FALSE;
+		else if (job->photo)
+		{
+			GTimer *timer = g_timer_new();
+			batch_worker_export(worker, job);
+			job->seconds = g_timer_elapsed(timer, NULL);
+			g_timer_destroy(timer);
+			job->processed = TRUE;
+		}
+		else
+			/* Photos that could not be loaded are done as well */
+			job->processed = TRUE;
+
+		if (job->photo)
+		{
+			g_object_unref(job->photo);
+			job->photo = NULL;
+		}
+
+		g_mutex_lock(&engine->lock);
+		engine->photos--;
+		engine->bytes -= job->bytes;
+		g_cond_signal(&engine->cond);
+		g_mutex_unlock(&engine->lock);
+
+		g_async_queue_push(engine->finished, job);
+	}
+
+	return NULL;
+}
+
+static BatchJob *
+batch_job_new(const gchar *filename, gint setting_id)
+{
+	BatchJob *job = g_new0(BatchJob, 1);
+
+	job->filename = g_strdup(filename);
+	job->setting_id = setting_id;
+
+	return job;
+}
+
+/**
+ * Build the template used to name exported files
+ * @param directory The output directory, used if filename does not contain %p
+ * @param filename A filename template as understood by filename_parse()
+ * @param extension The filename extension to append
+ * @return A newly allocated template
+ */
+static gchar *
+batch_filename_template(const gchar *directory, const gchar *filename, const gchar *extension)
+{
+	GString *template;
+
+	if (NULL == g_strrstr(filename, "%p"))
+	{
+		template = g_string_new(directory);
+		g_string_append(template, G_DIR_SEPARATOR_S);
+		g_string_append(template, filename);
+	}
+	else
+		template = g_string_new(filename);
+
+	g_string_append(template, ".");
+	g_string_append(template, extension);
+
+	return g_string_free(template, FALSE);
+}
+
+/**
+ * Create a batch engine
+ * @note Filter chains are created here, before any threads are running,
+ *       some filters are not safe to instantiate concurrently
+ * @param jobs A list of BatchJob, the engine takes ownership
+ * @param output_type The type name of the RSOutput to use, it is configured from the "batch" settings
+ * @param filename_template A template from batch_filename_template()
+ * @param preview_color_space The colorspace to render previews in, NULL to skip previews
+ */
+static BatchEngine *
+batch_engine_new(GList *jobs, const gchar *output_type, const gchar *filename_template,
+	RS_QUEUE_SIZE_LOCK size_lock, gint width, gint height, gint scale, RSColorSpace *preview_color_space)
+{
+	BatchEngine *engine = g_new0(BatchEngine, 1);
+	gint max_photos = DEFAULT_CONF_BATCH_CONCURRENT_PHOTOS;
+	gint budget = DEFAULT_CONF_BATCH_MEMORY_BUDGET;
+	gchar *demosaic;
+	gint i, j;
+
+	engine->jobs = jobs;
+	engine->output_type = g_strdup(output_type);
+	engine->filename_template = g_strdup(filename_template);
+	engine->size_lock = size_lock;
+	engine->width = width;
+	engine->height = height;
+	engine->scale = scale;
+	engine->preview_color_space = preview_color_space;
+	g_mutex_init(&engine->lock);
+	g_cond_init(&engine->cond);
+	engine->loaded = g_async_queue_new();
+	engine->finished = g_async_queue_new();
+
+	rs_conf_get_integer(CONF_BATCH_CONCURRENT_PHOTOS, &max_photos);
+	rs_conf_get_integer(CONF_BATCH_MEMORY_BUDGET, &budget);
+	demosaic = rs_conf_get_string(CONF_EXPORT_DEMOSAIC);
+	engine->n_workers = CLAMP(max_photos, 1, rs_get_number_of_processor_cores());
+	engine->budget = (gsize) MAX(budget, 64) * 1024 * 1024;
+
+	engine->workers = g_new0(BatchWorker, engine->n_workers);
+	for (i = 0; i < engine->n_workers; i++)
+	{
+		BatchWorker *worker = &engine->workers[i];
+		RSFilter *previous = NULL;
+
+		for (j = 0; j < BATCH_CHAIN_LENGTH; j++)
+			previous = worker->filters[j] = rs_filter_new(batch_chain[j], previous);
+		g_object_set(worker->filters[BATCH_CHAIN_DEMOSAIC], "method", demosaic ? demosaic : DEFAULT_CONF_EXPORT_DEMOSAIC, NULL);
+
+		worker->output = rs_output_new(output_type);
+		rs_output_set_from_conf(worker->output, "batch");
+		worker->engine = engine;
+	}
+	g_free(demosaic);
+
+	return engine;
+}
+
+/**
+ * Create a batch engine for all entries currently in the queue
+ */
+static BatchEngine *
+batch_engine_new_from_queue(RS_QUEUE *queue, RSColorSpace *display_color_space)
+{
+	BatchEngine *engine;
+	GList *jobs = NULL;
+	GtkTreeIter iter;
+	gchar *template;
+
+	if (gtk_tree_model_get_iter_first(queue->list, &iter))
+		do {
+			BatchJob *job = g_new0(BatchJob, 1);
+			gtk_tree_model_get(queue->list, &iter,
+				RS_QUEUE_ELEMENT_FILENAME, &job->filename,
+				RS_QUEUE_ELEMENT_SETTING_ID, &job->setting_id,
+				-1);
+			jobs = g_list_append(jobs, job);
+		} while (gtk_tree_model_iter_next(queue->list, &iter));
+
+	template = batch_filename_template(queue->directory, queue->filename, rs_output_get_extension(queue->output));
+	engine = batch_engine_new(jobs, G_OBJECT_TYPE_NAME(queue->output), template,
+		queue->size_lock, queue->width, queue->height, queue->scale, display_color_space);
+	g_free(template);
+
+	return engine;
+}
+
+static void
+batch_engine_start(BatchEngine *engine)
+{
+	gint i;
+
+	for (i = 0; i < engine->n_workers; i++)
+		engine->workers[i].thread = g_thread_new("batch-worker", batch_worker, &engine->workers[i]);
+	engine->loader = g_thread_new("batch-loader", batch_loader, engine);
+}
+
+/**
+ * Wait for the next finished job
+ * @return A finished job, NULL on timeout or when all jobs are done
+ */
+static BatchJob *
+batch_engine_next(BatchEngine *engine, gint *received, guint64 timeout)
+{
+	BatchJob *job = g_async_queue_timeout_pop(engine->finished, timeout);
+
+	if (job)
+		(*received)++;
+
+	return job;
+}
+
+static gboolean
+batch_engine_done(BatchEngine *engine, gint received)
+{
+	gboolean done;
+
+	g_mutex_lock(&engine->lock);
+	done = engine->loader_done && (received == engine->dispatched);
+	g_mutex_unlock(&engine->lock);
+
+	return done;
+}
+
+static void
+batch_engine_abort(BatchEngine *engine)
+{
+	g_mutex_lock(&engine->lock);
+	engine->abort = TRUE;
+	g_cond_broadcast(&engine->cond);
+	g_mutex_unlock(&engine->lock);
+}
+
+/**
+ * Stop and free a batch engine, all dispatched jobs must have been received
+ */
+static void
+batch_engine_free(BatchEngine *engine)
+{
+	gint i, j;
+
+	g_thread_join(engine->loader);
+	for (i = 0; i < engine->n_workers; i++)
+	{
+		BatchWorker *worker = &engine->workers[i];
+
+		g_thread_join(worker->thread);
+		for (j = BATCH_CHAIN_LENGTH-1; j >= 0; j--)
+			g_object_unref(worker->filters[j]);
+		g_object_unref(worker->output);
+	}
+	g_free(engine->workers);
+
+	g_list_foreach(engine->jobs, (GFunc) batch_job_free, NULL);
+	g_list_free(engine->jobs);
+	g_async_queue_unref(engine->loaded);
+	g_async_queue_unref(engine->finished);
+	g_free(engine->output_type);
+	g_free(engine->filename_template);
+	g_mutex_clear(&engine->lock);
+	g_cond_clear(&engine->cond);
+	g_free(engine);
+}
+
 void
 rs_batch_process(RS_QUEUE *queue)
 {
-	RS_PHOTO *photo = NULL;
-	GtkTreeIter iter;
-	gchar *filename_in;
-	gint setting_id;
 	GtkWidget *preview = gtk_image_new();
-	GdkPixbuf *pixbuf = NULL;
-	gint width = -1, height = -1;
-	gdouble scale = -1.0;
-	gchar *parsed_filename, *basename, *parsed_dir;
-	GString *filename;
 	GString *status = g_string_new(NULL);
 	GtkWidget *window;
 	GtkWidget *label = gtk_label_new(NULL);
@@ -394,24 +903,13 @@ rs_batch_process(RS_QUEUE *queue)
 	GTimeVal now_time = {0,0};
 	gint time, eta;
 	GtkWidget *eta_label = gtk_label_new(NULL);
-	gchar *eta_text, *title_text;
+	gchar *eta_text, *title_text, *basename;
 	gint h = 0, m = 0, s = 0;
 	gint done = 0, left = 0;
-	RSFilter *finput = rs_filter_new("RSInputImage16", NULL);
-	RSFilter *fdemosaic = rs_filter_new("RSDemosaic", finput);
-	RSFilter *ffujirotate = rs_filter_new("RSFujiRotate", fdemosaic);
-	RSFilter *flensfun = rs_filter_new("RSLensfun", ffujirotate);
-	RSFilter *frotate = rs_filter_new("RSRotate", flensfun);
-	RSFilter *fcrop = rs_filter_new("RSCrop", frotate);
-	RSFilter *ftransform_input = rs_filter_new("RSColorspaceTransform", fcrop);
-	RSFilter *fdcp= rs_filter_new("RSDcp", ftransform_input);
-	RSFilter *fcache = rs_filter_new("RSCache", fdcp);
-	RSFilter *fresample= rs_filter_new("RSResample", fcache);
-	RSFilter *fdenoise= rs_filter_new("RSDenoise", fresample);
-	RSFilter *ftransform_display = rs_filter_new("RSColorspaceTransform", fdenoise);
-	RSFilter *fend = ftransform_display;
-	RSFilterResponse *filter_response;
 	RSColorSpace *display_color_space;
+	BatchEngine *engine;
+	BatchJob *job;
+	gint received;
 
 	gdk_threads_enter();
 	window = gtk_window_new(GTK_WINDOW_TOPLEVEL);
@@ -440,195 +938,252 @@ rs_batch_process(RS_QUEUE *queue)
 
 	g_get_current_time(&start_time);
 
-	while(gtk_tree_model_get_iter_first(queue->list, &iter) && (!abort_render))
+	/* Entries added while we run are picked up by the next round */
+	while (rs_batch_num_entries(queue) > 0 && !abort_render)
 	{
-		left = rs_batch_num_entries(queue);
-		if (done > 0 && now_time.tv_sec > 0)
-		{
-			time = (gint) (now_time.tv_sec-start_time.tv_sec);
-			eta = (time/done)*left;
-			h = (eta/3600);
-			eta %= 3600;
-			m = (eta/60);
-			eta %= 60;
-			s = eta;
-
-			eta_text = g_strdup_printf(_("Time left: %dh %dm %ds"), h, m, s);
-			title_text = g_strdup_printf(_("Processing Image %d/%d"), done+1, done+left);
-		}
-		else
-		{
-			eta_text = g_strdup(_("Time left: ..."));
-			title_text = g_strdup_printf(_("Processing Image 1/%d."), left);
-		}
-
-		gtk_window_set_title(GTK_WINDOW(window), title_text);
-		gtk_label_set_text(GTK_LABEL(eta_label), eta_text);
-		g_free(eta_text);
-		g_free(title_text);
-		done++;
-
-		gtk_tree_model_get(queue->list, &iter,
-			RS_QUEUE_ELEMENT_FILENAME, &filename_in,
-			RS_QUEUE_ELEMENT_SETTING_ID, &setting_id,
-			-1);
-		basename = g_path_get_basename(filename_in);
-		g_string_printf(status, _("Loading %s ..."), basename);
-		gtk_label_set_text(GTK_LABEL(label), status->str);
-		while (gtk_events_pending()) gtk_main_iteration();
-		g_free(basename);
+		engine = batch_engine_new_from_queue(queue, display_color_space);
+		batch_engine_start(engine);
+		received = 0;
 
-		gdk_threads_leave();
-		photo = rs_photo_load_from_file(filename_in);
-		if (photo)
+		while (!batch_engine_done(engine, received))
 		{
-			rs_metadata_load_from_file(photo->metadata, filename_in);
-			rs_cache_load(photo);
-
-			/* Build new filename */
-			if (NULL == g_strrstr(queue->filename, "%p"))
+			left = rs_batch_num_entries(queue);
+			if (done > 0 && now_time.tv_sec > 0)
 			{
-				filename = g_string_new(queue->directory);
-				g_string_append(filename, G_DIR_SEPARATOR_S);
-				g_string_append(filename, queue->filename);
-			} 
+				time = (gint) (now_time.tv_sec-start_time.tv_sec);
+				eta = (time/done)*left;
+				h = (eta/3600);
+				eta %= 3600;
+				m = (eta/60);
+				eta %= 60;
+				s = eta;
+
+				eta_text = g_strdup_printf(_("Time left: %dh %dm %ds"), h, m, s);
+				title_text = g_strdup_printf(_("Processing Image %d/%d"), done+1, done+left);
+			}
 			else
-				filename = g_string_new(queue->filename);
-			
-			g_string_append(filename, ".");
-			g_string_append(filename, rs_output_get_extension(queue->output));
-			parsed_filename = filename_parse(filename->str, filename_in, setting_id, TRUE);
-			
-			/* Create directory, if it doesn't exist */
-			parsed_dir = g_path_get_dirname(parsed_filename);
-			if (FALSE == g_file_test(parsed_dir, G_FILE_TEST_EXISTS | G_FILE_TEST_IS_DIR))
-				if (g_mkdir_with_parents(parsed_dir, 0x1ff))
-				{
-					gdk_threads_enter();
-					gui_status_notify(_("Could not create output directory."));
-					break;
-				}
-
-			GList *filters = g_list_append(NULL, fend);
-			rs_photo_apply_to_filters(photo, filters, setting_id);
-			g_list_free(filters);
-
-			rs_filter_set_recursive(fend,
-				"image", photo->input_response,
-				"filename", photo->filename,
-				"bounding-box", TRUE,
-				"width", 250,
-				"height", 250,
-				NULL);
-
-			/* Render preview image */
-			RSFilterRequest *request = rs_filter_request_new();
-			rs_filter_request_set_quick(RS_FILTER_REQUEST(request), FALSE);
-			/* FIXME: Should be set to output colorspace, not forced to sRGB */
-
-			rs_filter_param_set_object(RS_FILTER_PARAM(request), "colorspace", display_color_space);	
-			filter_response = rs_filter_get_image8(fend, request);
-			pixbuf = rs_filter_response_get_image8(filter_response);
-			gdk_threads_enter();
-			if (pixbuf)
 			{
-				gtk_image_set_from_pixbuf(GTK_IMAGE(preview), pixbuf);
-				g_object_unref(pixbuf);
+				eta_text = g_strdup(_("Time left: ..."));
+				title_text = g_strdup_printf(_("Processing Image 1/%d."), left);
 			}
-			g_object_unref(request);
-			g_object_unref(filter_response);
 
-			if (left > 1)
-			{
-				GtkTreeIter iter2 = iter;
-				if (gtk_tree_model_iter_next (queue->list, &iter2))
-				{
-					gtk_tree_model_get(queue->list, &iter2, RS_QUEUE_ELEMENT_FILENAME, &filename_in, -1);
-					rs_io_idle_prefetch_file(filename_in, 0xC01A);
-				}
-			}
-			/* Build text for small preview-window */
-			basename = g_path_get_basename(parsed_filename);
-			g_string_printf(status, _("Saving %s ..."), basename);
-			gtk_label_set_text(GTK_LABEL(label), status->str);
-			while (gtk_events_pending())
-				gtk_main_iteration();
-			g_free(basename);
+			gtk_window_set_title(GTK_WINDOW(window), title_text);
+			gtk_label_set_text(GTK_LABEL(eta_label), eta_text);
+			g_free(eta_text);
+			g_free(title_text);
+			while (gtk_events_pending()) gtk_main_iteration();
+
+			if (abort_render)
+				batch_engine_abort(engine);
+
+			/* Let the workers run while we wait */
 			gdk_threads_leave();
+			job = batch_engine_next(engine, &received, G_USEC_PER_SEC / 10);
+			gdk_threads_enter();
 
-			width = 65535;
-			height = 65535;
-			/* Calculate new size */
-			switch (queue->size_lock)
+			if (!job || !job->processed)
+				continue;
+
+			if (job->error)
 			{
-				case LOCK_SCALE:
-					scale = queue->scale/100.0;
-					rs_filter_get_size_simple(fcrop, RS_FILTER_REQUEST_QUICK, &width, &height);
-					width = (gint) (((gdouble) width) * scale);
-					height = (gint) (((gdouble) height) * scale);
-					break;
-				case LOCK_WIDTH:
-					width = queue->width;
-					break;
-				case LOCK_HEIGHT:
-					height = queue->height;
-					break;
-				case LOCK_BOUNDING_BOX:
-					width = queue->width;
-					height = queue->height;
-					break;
+				gui_status_notify(job->error);
+				abort_render = TRUE;
+				batch_engine_abort(engine);
+				continue;
 			}
-			rs_filter_set_recursive(fend,
-				"width", width,
-				"height", height,
-				NULL);
-
-			/* Save the image */
-			if (g_object_class_find_property(G_OBJECT_GET_CLASS(queue->output), "filename"))
-				g_object_set(queue->output, "filename", parsed_filename, NULL);
 
-			rs_output_set_from_conf(queue->output, "batch");
+			if (job->preview)
+				gtk_image_set_from_pixbuf(GTK_IMAGE(preview), job->preview);
 
-			g_assert(RS_IS_OUTPUT(queue->output));
-			g_assert(RS_IS_FILTER(fend));
-
-			gboolean exported = rs_output_execute(queue->output, fend);
-			gdk_threads_enter();
-			if (exported)
-				rs_store_set_flags(NULL, photo->filename, NULL, NULL, &exported, NULL);
-			else
+			if (job->output_filename)
 			{
-				gui_status_notify(_("Could not export photo."));
-				break;
+				basename = g_path_get_basename(job->output_filename);
+				g_string_printf(status, _("Saved %s"), basename);
+				gtk_label_set_text(GTK_LABEL(label), status->str);
+				g_free(basename);
 			}
 
-			g_free(parsed_filename);
-			g_string_free(filename, TRUE);
-			g_object_unref(photo);
-			photo = NULL;
+			if (job->exported)
+				rs_store_set_flags(NULL, job->filename, NULL, NULL, &job->exported, NULL);
+
+			rs_batch_remove_from_queue(queue, job->filename, job->setting_id);
+			done++;
+			g_get_current_time(&now_time);
 		}
-		gtk_list_store_remove(GTK_LIST_STORE(queue->list), &iter);
-		batch_queue_save(queue);
 
-		g_get_current_time(&now_time);
+		gdk_threads_leave();
+		batch_engine_free(engine);
+		gdk_threads_enter();
 	}
 	gtk_widget_destroy(window);
 
 	batch_queue_update_sensivity(queue);
 	gdk_threads_leave();
 
-	g_object_unref(finput);
-	g_object_unref(fdemosaic);
-	g_object_unref(ffujirotate);
-	g_object_unref(flensfun);
-	g_object_unref(frotate);
-	g_object_unref(fcrop);
-	g_object_unref(fcache);
-	g_object_unref(fresample);
-	g_object_unref(fdcp);
-	g_object_unref(fdenoise);
-	g_object_unref(ftransform_input);
-	g_object_unref(ftransform_display);
+	g_string_free(status, TRUE);
+}
+
+/**
+ * Find the RSOutput matching a format given on the command line
+ * @param format A filename extension ("jpg"), a format name ("jpeg") or a type name ("RSJpegfile")
+ * @return The type name of the output or NULL if none matched, this should not be freed
+ */
+static const gchar *
+batch_output_type_for_format(const gchar *format)
+{
+	GType *savers;
+	guint n_savers = 0, i;
+	const gchar *type_name = NULL;
+	gchar *needle = g_ascii_strdown(format, -1);
+
+	savers = g_type_children(RS_TYPE_OUTPUT, &n_savers);
+	for (i = 0; i < n_savers && !type_name; i++)
+	{
+		RSOutputClass *klass = g_type_class_ref(savers[i]);
+		gchar *name = g_ascii_strdown(g_type_name(savers[i]), -1);
+
+		if ((klass->extension && g_ascii_strcasecmp(klass->extension, format) == 0)
+			|| strstr(name, needle))
+			type_name = g_type_name(savers[i]);
+
+		g_free(name);
+		g_type_class_unref(klass);
+	}
+	g_free(savers);
+	g_free(needle);
+
+	return type_name;
+}
+
+static void
+batch_headless_add_entry(const gchar *filename, gint setting_id, gpointer user_data)
+{
+	GList **jobs = user_data;
+
+	*jobs = g_list_append(*jobs, batch_job_new(filename, setting_id));
+}
+
+static void
+batch_headless_add_directory(const gchar *path, GList **jobs)
+{
+	GDir *dir = g_dir_open(path, 0, NULL);
+	GList *names = NULL, *node;
+	const gchar *name;
+
+	if (!dir)
+		return;
+
+	while ((name = g_dir_read_name(dir)))
+	{
+		gchar *filename = g_build_filename(path, name, NULL);
+		if (g_file_test(filename, G_FILE_TEST_IS_REGULAR) && rs_filetype_can_load(filename))
+			names = g_list_insert_sorted(names, filename, (GCompareFunc) g_strcmp0);
+		else
+			g_free(filename);
+	}
+	g_dir_close(dir);
+
+	for (node = names; node; node = g_list_next(node))
+		batch_headless_add_entry(node->data, 0, jobs);
+
+	g_list_foreach(names, (GFunc) g_free, NULL);
+	g_list_free(names);
+}
+
+gint
+rs_batch_process_headless(GList *inputs, const gchar *format, const gchar *directory, const gchar *filename,
+	RS_QUEUE_SIZE_LOCK size_lock, gint width, gint height, gint scale)
+{
+	const gchar *output_type;
+	RSOutputClass *klass;
+	BatchEngine *engine;
+	BatchJob *job;
+	GList *jobs = NULL;
+	GList *node;
+	GTimer *timer;
+	gchar *template;
+	gint received = 0, done = 0, failed = 0;
+
+	output_type = batch_output_type_for_format(format);
+	if (!output_type)
+	{
+		g_printerr("Unknown output format: %s\n", format);
+		return -1;
+	}
+
+	for (node = inputs; node; node = g_list_next(node))
+	{
+		gchar *input = node->data;
+		gchar *path;
+
+		/* rs_io wants absolute paths */
+		if (g_path_is_absolute(input))
+			path = g_strdup(input);
+		else
+		{
+			gchar *cwd = g_get_current_dir();
+			path = g_build_filename(cwd, input, NULL);
+			g_free(cwd);
+		}
+
+		if (g_file_test(path, G_FILE_TEST_IS_DIR))
+			batch_headless_add_directory(path, &jobs);
+		else if (g_str_has_suffix(path, ".xml"))
+		{
+			if (!batch_queue_read(path, batch_headless_add_entry, &jobs))
+				g_printerr("Could not read batch queue: %s\n", input);
+		}
+		else if (rs_filetype_can_load(path))
+			batch_headless_add_entry(path, 0, &jobs);
+		else
+			g_printerr("Skipping %s\n", input);
+
+		g_free(path);
+	}
+
+	if (!jobs)
+	{
+		g_printerr("Nothing to process\n");
+		return -1;
+	}
+
+	g_mkdir_with_parents(directory, 00755);
+
+	klass = g_type_class_ref(g_type_from_name(output_type));
+	template = batch_filename_template(directory, filename, klass->extension);
+	g_type_class_unref(klass);
+
+	engine = batch_engine_new(jobs, output_type, template, size_lock, width, height, scale, NULL);
+	g_free(template);
+
+	timer = g_timer_new();
+	batch_engine_start(engine);
+
+	while (!batch_engine_done(engine, received))
+	{
+		job = batch_engine_next(engine, &received, G_USEC_PER_SEC);
+
+		if (!job)
+			continue;
+
+		if (job->exported)
+		{
+			g_print("%s -> %s: %.2fs\n", job->filename, job->output_filename, job->seconds);
+			done++;
+		}
+		else
+		{
+			g_printerr("%s: %s\n", job->filename, job->error ? job->error : "Could not load photo.");
+			failed++;
+		}
+	}
+
+	batch_engine_free(engine);
+
+	g_print("%d photos exported, %d failed in %.2fs\n", done, failed, g_timer_elapsed(timer, NULL));
+	g_timer_destroy(timer);
+
+	return failed;
 }
 
 static void
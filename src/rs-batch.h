@@ -66,6 +66,21 @@ extern gboolean rs_batch_exists_in_queue(RS_QUEUE *queue, const gchar *filename,
 extern void rs_batch_process(RS_QUEUE *queue);
 extern GtkWidget *make_batchbox(RS_QUEUE *queue);
 
+/**
+ * Export photos without any user interface, per-photo timings are printed on stdout
+ * @param inputs A list of paths: saved batch queues (.xml), directories or photos
+ * @param format The output format, an extension ("jpg") or name ("jpeg", "tiff")
+ * @param directory The directory to save exported photos in
+ * @param filename A filename template as understood by filename_parse()
+ * @param size_lock How to size the exported photos, see RS_QUEUE_SIZE_LOCK
+ * @param width Width for LOCK_WIDTH and LOCK_BOUNDING_BOX
+ * @param height Height for LOCK_HEIGHT and LOCK_BOUNDING_BOX
+ * @param scale Scale in percent for LOCK_SCALE
+ * @return The number of photos that could not be exported, or -1 on errors in the arguments
+ */
+extern gint rs_batch_process_headless(GList *inputs, const gchar *format, const gchar *directory, const gchar *filename,
+	RS_QUEUE_SIZE_LOCK size_lock, gint width, gint height, gint scale);
+
 /**
  * Returns the number of entries in the batch queue
  * @param queue A RS_QUEUE
@@ -863,7 +863,6 @@ void
 rs_photo_close(RS_PHOTO *photo)
 {
 	GdkPixbuf *pixbuf=NULL;
-	GdkPixbuf *pixbuf2=NULL;
 	if (!photo) return;
 
 	rs_cache_save(photo, MASK_ALL);
@@ -877,20 +876,16 @@ rs_photo_close(RS_PHOTO *photo)
 		RSFilterResponse *response = rs_filter_get_image8(photo->thumbnail_filter, request);
 		pixbuf = rs_filter_response_get_image8(response);
 
-		/* Scale to a bounding box of 128x128 pixels */
-		gdouble ratio = ((gdouble) gdk_pixbuf_get_width(pixbuf))/((gdouble) gdk_pixbuf_get_height(pixbuf));
-		if (ratio>1.0)
-			pixbuf2 = gdk_pixbuf_scale_simple(pixbuf, 128, (gint) (128.0/ratio), GDK_INTERP_BILINEAR);
-		else
-			pixbuf2 = gdk_pixbuf_scale_simple(pixbuf, (gint) (128.0*ratio), 128, GDK_INTERP_BILINEAR);
-		g_object_unref(pixbuf);
 		g_object_unref(request);
 		g_object_unref(response);
 
-		if (photo->metadata->thumbnail)
-			g_object_unref(photo->metadata->thumbnail);
+		/* Generate all thumbnail sizes */
+		if (pixbuf)
+		{
+			rs_metadata_set_thumbnail(photo->metadata, pixbuf);
+			g_object_unref(pixbuf);
+		}
 
-		photo->metadata->thumbnail = pixbuf2;
 		rs_metadata_cache_save(photo->metadata, photo->filename);
 	}
 }
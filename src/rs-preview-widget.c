@@ -396,6 +396,9 @@ rs_preview_widget_init(RSPreviewWidget *preview)
 
 		rs_filter_set_recursive(preview->filter_end[i], "bounding-box", TRUE, NULL);
 		g_object_set(preview->filter_cache3[i], "latency", 1, NULL);
+		/* Everything before denoise is pixel exact for any ROI, so panning
+		 * only has to render the strips not already cached */
+		g_object_set(preview->filter_cache2[i], "partial-roi", TRUE, NULL);
 
 		preview->request[i] = rs_filter_request_new();
 		rs_filter_param_set_object(RS_FILTER_PARAM(preview->request[i]), "colorspace", preview->display_color_space);
@@ -304,6 +304,11 @@ job(RSJobQueueSlot *slot, gpointer data)
 	gint input_width;
 	rs_filter_get_size_simple(dialog->fcrop, RS_FILTER_REQUEST_QUICK, &input_width, NULL);
 
+	/* Exports use the high quality demosaic unless told otherwise */
+	gchar *demosaic = rs_conf_get_string(CONF_EXPORT_DEMOSAIC);
+	g_object_set(dialog->fdemosaic, "method", demosaic ? demosaic : DEFAULT_CONF_EXPORT_DEMOSAIC, NULL);
+	g_free(demosaic);
+
 	/* Set input profile */
 	RSDcpFile *dcp_profile  = rs_photo_get_dcp_profile(dialog->photo);
 	RSIccProfile *icc_profile  = rs_photo_get_icc_profile(dialog->photo);
@@ -20,6 +20,8 @@
 #include <rawstudio.h>
 #include <gtk/gtk.h>
 #include <glib/gprintf.h>
+#include <glib/gstdio.h>
+#include <sys/stat.h>
 #include <config.h>
 #include <libxml/encoding.h>
 #include <libxml/xmlwriter.h>
@@ -49,6 +51,10 @@
 
 #define DROPSHADOWOFFSET 6
 
+/* io priorities of metadata jobs, visible thumbnails are loaded first */
+#define METADATA_PRIORITY 10
+#define METADATA_PRIORITY_VISIBLE 5
+
 /* Overlay icons */
 static GdkPixbuf *icon_priority_1 = NULL;
 static GdkPixbuf *icon_priority_2 = NULL;
@@ -99,6 +105,15 @@ struct _RSStore
 	gint open_selected;  /* Contains status message ID, if enabled, 0 otherwise */
 	gchar *next_file;
 	gulong delay_load;
+	guint load_serial;			/* Incremented for every directory load, older scans are discarded */
+	gboolean loading;			/* A directory scan is running */
+	gchar *select_after_load;		/* Photo to select when the directory being loaded is shown */
+	GMutex pending_lock;
+	GHashTable *pending;			/* Filename -> WORKER_JOB of queued metadata jobs, protected by pending_lock */
+	GList *boosted;				/* RSIoJobs given METADATA_PRIORITY_VISIBLE */
+	GMutex updates_lock;
+	GList *updates;				/* WORKER_JOBs with metadata waiting for the GUI thread, protected by updates_lock */
+	guint updates_source;
 };
 
 /* Define the boiler plate stuff using the predefined macro */
@@ -118,8 +133,25 @@ typedef struct _worker_job {
 	GtkTreeIter iter;
 	gchar *name;
 	GtkTreeModel *model;
+	RSIoJob *io_job;
+
+	/* Result of the job, applied to the store by apply_updates() */
+	RSMetadata *metadata;
+	GdkPixbuf *pixbuf;
+	GdkPixbuf *pixbuf_clean;
+	gint priority;
+	gboolean exported;
+	gboolean enfuse;
 } WORKER_JOB;
 
+typedef struct {
+	RSStore *store;
+	gchar *path;
+	gboolean load_recursive;
+	GPtrArray *files;
+	guint serial; /* The load_serial of the store when the scan was started */
+} DIRECTORY_SCAN;
+
 /* FIXME: Remember to remove stores from this too! */
 static GList *all_stores = NULL;
 
@@ -134,6 +166,7 @@ static void selection_changed(GtkIconView *iconview, gpointer data);
 static void thumbnail_overlay(GdkPixbuf *pixbuf, GdkPixbuf *lowerleft, GdkPixbuf *lowerright, GdkPixbuf *topleft, GdkPixbuf *topright, gint shadow);
 static void thumbnail_update(GdkPixbuf *pixbuf, GdkPixbuf *pixbuf_clean, gint priority, gboolean exported, gboolean enfuse, gint shadow);
 static void switch_page(GtkNotebook *notebook, gpointer page, guint page_num, gpointer data);
+static void prioritize_visible(RSStore *store);
 static void selection_changed(GtkIconView *iconview, gpointer data);
 static GtkWidget *make_iconview(GtkWidget *iconview, RSStore *store, gint prio);
 static gboolean model_filter_prio(GtkTreeModel *model, GtkTreeIter *iter, gpointer data);
@@ -165,6 +198,8 @@ void store_get_type(GtkListStore *store, GtkTreeIter *iter, gint *type);
 void store_get_fullname(GtkListStore *store, GtkTreeIter *iter, gchar **fullname);
 void store_set_members(GtkListStore *store, GtkTreeIter *iter, GList *members);
 void got_metadata(RSMetadata *metadata, gpointer user_data);
+static gboolean apply_updates(gpointer data);
+static void thumbnail_size_update(RSStore *store);
 static gboolean button(GtkWidget *widget, GdkEventButton *event, RSStore *store);
 
 /**
@@ -221,6 +256,12 @@ rs_store_init(RSStore *store)
 
 	store->counter_blocked = FALSE;
 	store->open_selected = 0;
+	g_mutex_init(&store->pending_lock);
+	store->pending = g_hash_table_new(g_str_hash, g_str_equal);
+	store->boosted = NULL;
+	g_mutex_init(&store->updates_lock);
+	store->updates = NULL;
+	store->updates_source = 0;
 	store->notebook = GTK_NOTEBOOK(gtk_notebook_new());
 	store->store = gtk_list_store_new (NUM_COLUMNS,
 		GDK_TYPE_PIXBUF,
@@ -278,6 +319,7 @@ rs_store_init(RSStore *store)
 
 		/* Attach the model to iconview */
 		gtk_icon_view_set_model (GTK_ICON_VIEW (store->iconview[n]), filter);
+		g_object_unref(filter);
 
 		store->label[n] = gtk_label_new(NULL);
 
@@ -327,6 +369,8 @@ rs_store_init(RSStore *store)
 		gtk_notebook_append_page(store->notebook, make_iconview(store->iconview[n], store, priorities[n]), label_tt[n]);
 	}
 
+	thumbnail_size_update(store);
+
 	/* Load show filenames state from config */
 	rs_conf_get_boolean_with_default(CONF_SHOW_FILENAMES, &show_filenames, DEFAULT_CONF_SHOW_FILENAMES);
 	rs_store_set_show_filenames(store, show_filenames);
@@ -357,6 +401,9 @@ rs_store_init(RSStore *store)
 	store->last_path = NULL;
 	store->next_file = NULL;
 	store->delay_load = 0;
+	store->load_serial = 0;
+	store->loading = FALSE;
+	store->select_after_load = NULL;
 	gint sort_method = RS_STORE_SORT_BY_NAME;
 	rs_conf_get_integer(CONF_STORE_SORT_METHOD, &sort_method);
 	rs_store_set_sort_method(store, sort_method);
@@ -415,16 +462,138 @@ switch_page(GtkNotebook *notebook, gpointer page, guint page_num, gpointer data)
 
 	store->current_iconview = store->iconview[page_num];
 	store->current_priority = priorities[page_num];
+	prioritize_visible(store);
 	return;
 }
 
+static void
+worker_job_free(WORKER_JOB *job)
+{
+	g_free(job->filename);
+	g_free(job->name);
+	g_object_unref(job->store);
+	g_object_unref(job->model);
+	g_object_unref(job->io_job);
+	if (job->metadata)
+		g_object_unref(job->metadata);
+	if (job->pixbuf)
+		g_object_unref(job->pixbuf);
+	if (job->pixbuf_clean)
+		g_object_unref(job->pixbuf_clean);
+	g_free(job);
+}
+
+/**
+ * Move metadata jobs of thumbnails currently shown to the front of the io
+ * queue, and jobs we moved there earlier back where they came from
+ */
+static void
+prioritize_visible(RSStore *store)
+{
+	GtkIconView *iconview = GTK_ICON_VIEW(store->current_iconview);
+	GtkTreeModel *model = gtk_icon_view_get_model(iconview);
+	GtkTreePath *start, *end;
+	GtkTreeIter iter;
+	GList *node;
+	gchar *filename;
+	WORKER_JOB *job;
+
+	for (node = store->boosted; node; node = g_list_next(node))
+	{
+		rs_io_idle_set_priority(node->data, METADATA_PRIORITY);
+		g_object_unref(node->data);
+	}
+	g_list_free(store->boosted);
+	store->boosted = NULL;
+
+	if (!model || !gtk_icon_view_get_visible_range(iconview, &start, &end))
+		return;
+
+	g_mutex_lock(&store->pending_lock);
+	if (g_hash_table_size(store->pending) > 0 && gtk_tree_model_get_iter(model, &iter, start))
+		do {
+			gtk_tree_model_get(model, &iter, FULLNAME_COLUMN, &filename, -1);
+			job = g_hash_table_lookup(store->pending, filename);
+			if (job && rs_io_idle_set_priority(job->io_job, METADATA_PRIORITY_VISIBLE))
+				store->boosted = g_list_prepend(store->boosted, g_object_ref(job->io_job));
+			g_free(filename);
+
+			if (gtk_tree_path_compare(start, end) >= 0)
+				break;
+			gtk_tree_path_next(start);
+		} while (gtk_tree_model_iter_next(model, &iter));
+	g_mutex_unlock(&store->pending_lock);
+
+	gtk_tree_path_free(start);
+	gtk_tree_path_free(end);
+}
+
+static void
+scrolled(GtkAdjustment *adjustment, RSStore *store)
+{
+	prioritize_visible(store);
+}
+
+/**
+ * Cancel queued metadata jobs
+ * @param store A RSStore
+ * @param filename The photo to cancel the job for, or NULL for all jobs
+ */
+static void
+cancel_pending(RSStore *store, const gchar *filename)
+{
+	GHashTableIter hash_iter;
+	GList *node, *next;
+	WORKER_JOB *job;
+
+	g_mutex_lock(&store->pending_lock);
+	g_hash_table_iter_init(&hash_iter, store->pending);
+	while (g_hash_table_iter_next(&hash_iter, NULL, (gpointer *) &job))
+	{
+		if (filename && !g_str_equal(filename, job->filename))
+			continue;
+
+		/* Jobs already running will finish and clean up after themselves */
+		if (rs_io_idle_cancel(job->io_job))
+		{
+			g_hash_table_iter_remove(&hash_iter);
+			worker_job_free(job);
+			if (g_atomic_int_dec_and_test(&store->jobs_to_do) && store->counter_blocked)
+			{
+				g_signal_handler_unblock(store->store, store->counthandler);
+				store->counter_blocked = FALSE;
+			}
+		}
+	}
+	g_mutex_unlock(&store->pending_lock);
+
+	/* Finished jobs not yet applied to the store would refer to removed rows */
+	g_mutex_lock(&store->updates_lock);
+	for (node = store->updates; node; node = next)
+	{
+		next = g_list_next(node);
+		job = node->data;
+		if (filename && !g_str_equal(filename, job->filename))
+			continue;
+
+		store->updates = g_list_delete_link(store->updates, node);
+		worker_job_free(job);
+		if (g_atomic_int_dec_and_test(&store->jobs_to_do) && store->counter_blocked)
+		{
+			g_signal_handler_unblock(store->store, store->counthandler);
+			store->counter_blocked = FALSE;
+		}
+	}
+	g_mutex_unlock(&store->updates_lock);
+}
+
 static void
 preload_iter(GtkTreeModel *model, GtkTreeIter *iter)
 {
 	gchar *filename;
 	gtk_tree_model_get(model, iter, FULLNAME_COLUMN, &filename, -1);
 
-	rs_io_idle_prefetch_file(filename, PRELOAD_CLASS);
+	g_object_unref(rs_io_idle_prefetch_file(filename, PRELOAD_CLASS));
 }
 
 static void
@@ -760,6 +929,10 @@ make_iconview(GtkWidget *iconview, RSStore *store, gint prio)
 	/* Handle scroll events not handled by scroller to allow scrolling in horizontal iconview */
 	g_signal_connect_after(scroller, "scroll-event", G_CALLBACK(scroll_event), NULL);
 
+	/* Load what the user is looking at first */
+	g_signal_connect(gtk_scrolled_window_get_hadjustment(GTK_SCROLLED_WINDOW(scroller)),
+		"value-changed", G_CALLBACK(scrolled), store);
+
 	gtk_container_add (GTK_CONTAINER (scroller), iconview);
 
 	return(scroller);
@@ -1202,15 +1375,16 @@ tree_find_filename(GtkTreeModel *store, const gchar *filename, GtkTreeIter *iter
 	return ret;
 }
 
-void
-rs_store_load_file(RSStore *store, gchar *fullname)
+/**
+ * Add a row for a photo to the store, the thumbnail is loaded by store_queue_metadata()
+ * @note Must be called with the GDK lock held
+ * @param store A RSStore
+ * @param fullname The full path to the photo
+ * @param iter Set to the new row
+ */
+static void
+store_add_file(RSStore *store, const gchar *fullname, GtkTreeIter *iter)
 {
-	GtkTreeIter iter;
-	WORKER_JOB *job;
-	
-	if (!fullname)
-		return;
-
 	gchar *name = g_path_get_basename(fullname);
 	gchar *name_full = g_strdup(name);
 
@@ -1229,9 +1403,7 @@ rs_store_load_file(RSStore *store, gchar *fullname)
 		icon_default = gdk_pixbuf_new_from_file(PACKAGE_DATA_DIR G_DIR_SEPARATOR_S "icons" G_DIR_SEPARATOR_S PACKAGE ".png", NULL);
 
 	/* Add file to store */
-	gdk_threads_enter();
-	gtk_list_store_append (store->store, &iter);
-	gtk_list_store_set (store->store, &iter,
+	gtk_list_store_insert_with_values (store->store, iter, -1,
 			    METADATA_COLUMN, NULL,
 			    PIXBUF_COLUMN, icon_default,
 			    PIXBUF_CLEAN_COLUMN, icon_default,
@@ -1240,35 +1412,68 @@ rs_store_load_file(RSStore *store, gchar *fullname)
 			    FULLNAME_COLUMN, fullname,
 			    -1);
 
-	gdk_threads_leave();
+	g_free(name);
+	g_free(name_full);
+}
 
-	/* Push an asynchronous job for loading the thumbnail */
-	job = g_new(WORKER_JOB, 1);
+/**
+ * Push an asynchronous job for loading metadata and thumbnail of a row
+ * @param store A RSStore
+ * @param iter The row of the photo
+ * @param fullname The full path to the photo
+ */
+static void
+store_queue_metadata(RSStore *store, GtkTreeIter *iter, const gchar *fullname)
+{
+	WORKER_JOB *job;
+
+	job = g_new0(WORKER_JOB, 1);
 	job->store = g_object_ref(store);
-	job->iter = iter;
+	job->iter = *iter;
 	job->filename = g_strdup(fullname);
-	job->name = g_strdup(name);
+	job->name = g_path_get_basename(fullname);
 	job->model = g_object_ref(GTK_TREE_MODEL(store->store));
-
-	rs_io_idle_read_metadata(job->filename, METADATA_CLASS, got_metadata, job);
+	/* Keep a reference, so we can reprioritize or cancel the job later */
+	job->io_job = g_object_ref(rs_io_job_metadata_new(job->filename, got_metadata));
 
 	g_atomic_int_inc(&store->jobs_to_do);
+
+	g_mutex_lock(&store->pending_lock);
+	g_hash_table_insert(store->pending, job->filename, job);
+	g_mutex_unlock(&store->pending_lock);
+
+	rs_io_idle_add_job(job->io_job, METADATA_CLASS, METADATA_PRIORITY, job);
 }
 
-static gint
-load_directory(RSStore *store, const gchar *path, RSLibrary *library, const gboolean load_8bit, const gboolean load_recursive)
+void
+rs_store_load_file(RSStore *store, gchar *fullname)
+{
+	GtkTreeIter iter;
+
+	if (!fullname)
+		return;
+
+	gdk_threads_enter();
+	store_add_file(store, fullname, &iter);
+	gdk_threads_leave();
+
+	store_queue_metadata(store, &iter, fullname);
+}
+
+static void
+load_directory(const gchar *path, GPtrArray *files, const gboolean load_recursive)
 {
 	const gchar *name;
 	gchar *fullname;
+	GStatBuf st;
 	GDir *dir;
-	gint count = 0;
 
 	gchar *path_normalized = rs_normalize_path(path);
 
 	if (!path_normalized)
-		return 0;
+		return;
 
-	rs_io_idle_restore_tags(path_normalized, RESTORE_TAGS_CLASS);
+	g_object_unref(rs_io_idle_restore_tags(path_normalized, RESTORE_TAGS_CLASS));
 
 	dir = g_dir_open(path_normalized, 0, NULL); /* FIXME: check errors */
 
@@ -1280,13 +1485,17 @@ load_directory(RSStore *store, const gchar *path, RSLibrary *library, const gboo
 
 		fullname = g_build_filename(path, name, NULL);
 
+		/* Stat while the directory is hot, the metadata cache will need it too */
 		if (rs_filetype_can_load(fullname))
 		{
-			rs_store_load_file(store, fullname);
-			count++;
+			if (g_stat(fullname, &st) == 0 && S_ISREG(st.st_mode))
+			{
+				g_ptr_array_add(files, fullname);
+				continue;
+			}
 		}
-		else if (load_recursive && g_file_test(fullname, G_FILE_TEST_IS_DIR))
-			count += load_directory(store, fullname, library, load_8bit, load_recursive);
+		else if (load_recursive && g_stat(fullname, &st) == 0 && S_ISDIR(st.st_mode))
+			load_directory(fullname, files, load_recursive);
 
 		g_free(fullname);
 	}
@@ -1294,10 +1503,124 @@ load_directory(RSStore *store, const gchar *path, RSLibrary *library, const gboo
 	g_free(path_normalized);
 	if (dir)
 		g_dir_close(dir);
+}
+
+static gint
+compare_filenames(gconstpointer a, gconstpointer b)
+{
+	return g_utf8_collate(*(const gchar **) a, *(const gchar **) b);
+}
 
-	return count;
+static gboolean directory_scanned(gpointer data);
+
+/**
+ * Enumerates a directory in a thread of its own, the result is added to the
+ * store by directory_scanned() in the GUI thread
+ */
+static gpointer
+directory_scan(gpointer data)
+{
+	DIRECTORY_SCAN *scan = data;
+	GTimer *gt = g_timer_new();
+
+	/* While we're loading, we keep the IO lock to ourself. We need to read very basic meta and directory data */
+	rs_io_lock_file(scan->path);
+	load_directory(scan->path, scan->files, scan->load_recursive);
+	rs_io_unlock();
+
+	/* Queue metadata jobs in the order photos will be shown */
+	g_ptr_array_sort(scan->files, compare_filenames);
+
+	RS_DEBUG(PERFORMANCE, "Found %u photos in %s in %.03fs", scan->files->len, scan->path, g_timer_elapsed(gt, NULL));
+	g_timer_destroy(gt);
+
+	gdk_threads_add_idle(directory_scanned, scan);
+
+	return NULL;
 }
 
+/**
+ * Add the photos found by directory_scan() to the store and queue loading
+ * their metadata, called from the main loop with the GDK lock held
+ */
+static gboolean
+directory_scanned(gpointer data)
+{
+	DIRECTORY_SCAN *scan = data;
+	RSStore *store = scan->store;
+	GtkTreeIter *iters;
+	gint items, n;
+
+	/* Another directory was loaded while we were scanning */
+	if (scan->serial != store->load_serial)
+		goto out;
+
+	store->loading = FALSE;
+	items = scan->files->len;
+
+	/* Unset models while adding rows, the filters and views would otherwise act on every single row */
+	for(n=0;n<NUM_VIEWS;n++)
+		gtk_icon_view_set_model (GTK_ICON_VIEW (store->iconview[n]), NULL);
+
+	iters = g_new(GtkTreeIter, items);
+	for(n=0;n<items;n++)
+		store_add_file(store, g_ptr_array_index(scan->files, n), &iters[n]);
+
+	/* Make sure we have enough columns */
+	rs_store_set_iconview_size(store, items);
+
+	/* Sort the store */
+	rs_store_set_sort_method(store, store->sort_method);
+
+	/* set model for all 6 iconviews */
+	for(n=0;n<NUM_VIEWS;n++)
+	{
+		GtkTreeModel *tree;
+
+		tree = gtk_tree_model_filter_new(GTK_TREE_MODEL (store->store), NULL);
+		gtk_tree_model_filter_set_visible_func(GTK_TREE_MODEL_FILTER (tree),
+			model_filter_prio, GINT_TO_POINTER (priorities[n]), NULL);
+		gtk_icon_view_set_model (GTK_ICON_VIEW (store->iconview[n]), tree);
+		g_object_unref(tree);
+	}
+
+	/* Thumbnails are filled in by apply_updates() as metadata arrives */
+	for(n=0;n<items;n++)
+		store_queue_metadata(store, &iters[n], g_ptr_array_index(scan->files, n));
+	g_free(iters);
+
+	/* Nothing to wait for, unblock the counter right away */
+	if (items == 0 && store->counter_blocked)
+	{
+		g_signal_handler_unblock(store->store, store->counthandler);
+		store->counter_blocked = FALSE;
+		count_priorities(GTK_TREE_MODEL(store->store), NULL, NULL, store->label);
+	}
+
+#ifdef EXPERIMENTAL
+	/* load group file and group photos */
+	store_load_groups(store->store);
+#endif
+	prioritize_visible(store);
+
+	if (store->select_after_load)
+	{
+		rs_store_set_selected_name(store, store->select_after_load, TRUE);
+		g_free(store->select_after_load);
+		store->select_after_load = NULL;
+	}
+
+	/* Start the preloader */
+	predict_preload(store, TRUE);
+
+out:
+	g_ptr_array_free(scan->files, TRUE);
+	g_free(scan->path);
+	g_object_unref(scan->store);
+	g_free(scan);
+
+	return FALSE;
+}
 
 /* Public functions */
 
@@ -1311,6 +1634,21 @@ rs_store_new(void)
 	return g_object_new (RS_STORE_TYPE_WIDGET, NULL);
 }
 
+/**
+ * Cancel all queued io jobs of a store
+ * @param store A RSStore
+ */
+void
+rs_store_cancel_jobs(RSStore *store)
+{
+	g_return_if_fail(RS_IS_STORE(store));
+
+	/* Metadata jobs own a WORKER_JOB, they must be cancelled through the store */
+	cancel_pending(store, NULL);
+	rs_io_idle_cancel_class(PRELOAD_CLASS);
+	rs_io_idle_cancel_class(RESTORE_TAGS_CLASS);
+}
+
 /**
  * Remove thumbnail(s) from store
  * @param store A RSStore
@@ -1324,10 +1662,7 @@ rs_store_remove(RSStore *store, const gchar *filename, GtkTreeIter *iter)
 
 	/* Empty the loader queue */
 	if (!filename && !iter)
-	{
-		rs_io_idle_cancel_class(METADATA_CLASS);
 		rs_io_idle_cancel_class(PRELOAD_CLASS);
-	}
 
 	/* If we got no store, iterate though all */
 	if (!store)
@@ -1340,6 +1675,18 @@ rs_store_remove(RSStore *store, const gchar *filename, GtkTreeIter *iter)
 
 	/* By now we should have a valid store */
 	g_return_if_fail (RS_IS_STORE(store));
+
+	/* Don't load metadata for photos we're about to remove */
+	if (filename || !iter)
+		cancel_pending(store, filename);
+
+	/* Photos of a directory still being scanned would show up later */
+	if (!filename && !iter && store->loading)
+	{
+		store->load_serial++;
+		store->loading = FALSE;
+	}
+
 	gdk_threads_enter();
 
 	/* If we got filename, but no iter, try to find correct iter */
@@ -1371,22 +1718,19 @@ rs_store_remove(RSStore *store, const gchar *filename, GtkTreeIter *iter)
 }
 
 /**
- * Load thumbnails from a directory into the store
+ * Load thumbnails from a directory into the store. The directory is scanned
+ * in the background, and photos show up once the scan is done. Loading
+ * another directory before that discards the scan
  * @param store A RSStore
  * @param path The path to load
- * @return The number of files loaded or -1
+ * @return 0 if loading was started or -1
  */
 gint
 rs_store_load_directory(RSStore *store, const gchar *path)
 {
-	RSLibrary *library = rs_library_get_singleton();
-	static gboolean running = FALSE;
-	static GMutex lock;
-
 	GtkTreeSortable *sortable;
-	gboolean load_8bit = FALSE;
 	gboolean load_recursive = DEFAULT_CONF_LOAD_RECURSIVE;
-	gint items=0, n;
+	DIRECTORY_SCAN *scan;
 
 	g_return_val_if_fail(RS_IS_STORE(store), -1);
 	if (!path)
@@ -1403,14 +1747,6 @@ rs_store_load_directory(RSStore *store, const gchar *path)
 		store->last_path = g_strdup(path);
 	}
 
-	/* We should really only be running one instance at a time */
-	g_mutex_lock(&lock);
-	if (running)
-		return -1;
-	running = TRUE;
-	g_mutex_unlock(&lock);
-
-	rs_conf_get_boolean(CONF_LOAD_GDK, &load_8bit);
 	rs_conf_get_boolean(CONF_LOAD_RECURSIVE, &load_recursive);
 	if (!rs_conf_get_string(CONF_LWD))
 		load_recursive = FALSE;
@@ -1426,46 +1762,27 @@ rs_store_load_directory(RSStore *store, const gchar *path)
 	gtk_label_set_markup(GTK_LABEL(store->label[3]), _("3 <small>(-)</small>"));
 	gtk_label_set_markup(GTK_LABEL(store->label[4]), _("U <small>(-)</small>"));
 	gtk_label_set_markup(GTK_LABEL(store->label[5]), _("D <small>(-)</small>"));
-	g_signal_handler_block(store->store, store->counthandler);
-	store->counter_blocked = TRUE;
-
-	/* While we're loading, we keep the IO lock to ourself. We need to read very basic meta and directory data */
-	rs_io_lock();
-	items = load_directory(store, path, library, load_8bit, load_recursive);
-	rs_io_unlock();
-
-	/* unset model and make sure we have enough columns */
-	gdk_threads_enter();
-	rs_store_set_iconview_size(store, items);
-
-	/* Sort the store */
-	rs_store_set_sort_method(store, store->sort_method);
-
-	/* set model for all 6 iconviews */
-	for(n=0;n<NUM_VIEWS;n++)
+	if (!store->counter_blocked)
 	{
-		GtkTreeModel *tree;
-
-		tree = gtk_tree_model_filter_new(GTK_TREE_MODEL (store->store), NULL);
-		gtk_tree_model_filter_set_visible_func(GTK_TREE_MODEL_FILTER (tree),
-			model_filter_prio, GINT_TO_POINTER (priorities[n]), NULL);
-		gtk_icon_view_set_model (GTK_ICON_VIEW (store->iconview[n]), tree);
+		g_signal_handler_block(store->store, store->counthandler);
+		store->counter_blocked = TRUE;
 	}
 
-#ifdef EXPERIMENTAL
-	/* load group file and group photos */
-	store_load_groups(store->store);
-#endif
-	gdk_threads_leave();
+	/* A selection made for a previous load is of no use anymore */
+	g_free(store->select_after_load);
+	store->select_after_load = NULL;
 
-	/* Start the preloader */
-	predict_preload(store, TRUE);
+	/* Enumerate and stat everything off the GUI thread */
+	scan = g_new0(DIRECTORY_SCAN, 1);
+	scan->store = g_object_ref(store);
+	scan->path = g_strdup(path);
+	scan->load_recursive = load_recursive;
+	scan->files = g_ptr_array_new_with_free_func(g_free);
+	scan->serial = ++store->load_serial;
+	store->loading = TRUE;
+	g_thread_unref(g_thread_new("rs-store-scan", directory_scan, scan));
 
-	g_mutex_lock(&lock);
-	running = FALSE;
-	g_mutex_unlock(&lock);
-	/* Return the number of files successfully recognized */
-	return items;
+	return 0;
 }
 
 /**
@@ -1567,6 +1884,14 @@ rs_store_set_selected_name(RSStore *store, const gchar *filename, gboolean desel
 	if (deselect_others)
 		gtk_icon_view_unselect_all(GTK_ICON_VIEW(store->current_iconview));
 
+	/* Select it when the directory being loaded is shown */
+	if (store->loading)
+	{
+		g_free(store->select_after_load);
+		store->select_after_load = g_strdup(filename);
+		return FALSE;
+	}
+
 	tree_find_filename(GTK_TREE_MODEL(store->store), filename, NULL, &path);
 
 	if (path)
@@ -2872,46 +3197,117 @@ got_metadata(RSMetadata *metadata, gpointer user_data)
 	g_assert(pixbuf != NULL);
 	g_assert(pixbuf_clean != NULL);
 
-	/* Add the new thumbnail to the store */
-	gdk_threads_enter();
-	gtk_list_store_set(GTK_LIST_STORE(job->model), &job->iter,
-		METADATA_COLUMN, metadata,
-		PIXBUF_COLUMN, pixbuf,
-		PIXBUF_CLEAN_COLUMN, pixbuf_clean,
-		PRIORITY_COLUMN, priority,
-		EXPORTED_COLUMN, exported,
-		ENFUSE_COLUMN, enfuse,
-		-1);
-	gdk_threads_leave();
-
 	/* Add to library */
 	rs_library_add_photo_with_metadata(rs_library_get_singleton(), job->filename, metadata);
 
-	/* The GtkListStore should have ref'ed these */
-	g_object_unref(pixbuf);
-	g_object_unref(pixbuf_clean);
+	job->metadata = g_object_ref(metadata);
+	job->pixbuf = pixbuf;
+	job->pixbuf_clean = pixbuf_clean;
+	job->priority = priority;
+	job->exported = exported;
+	job->enfuse = enfuse;
+
+	/* Hand the result to the GUI thread, which applies everything that
+	   arrived since last time in one go. The job moves from pending to
+	   updates atomically, so cancel_pending() will always find it */
+	g_mutex_lock(&job->store->pending_lock);
+	if (g_hash_table_lookup(job->store->pending, job->filename) == job)
+		g_hash_table_remove(job->store->pending, job->filename);
+	g_mutex_lock(&job->store->updates_lock);
+	job->store->updates = g_list_prepend(job->store->updates, job);
+	if (!job->store->updates_source)
+		job->store->updates_source = gdk_threads_add_idle(apply_updates, job->store);
+	g_mutex_unlock(&job->store->updates_lock);
+	g_mutex_unlock(&job->store->pending_lock);
+}
+
+/**
+ * Add finished metadata jobs to the store, called from the main loop with the GDK lock held
+ */
+static gboolean
+apply_updates(gpointer data)
+{
+	RSStore *store = RS_STORE(data);
+	GList *updates, *node;
+	WORKER_JOB *job;
+	gboolean finished = FALSE;
+
+	g_mutex_lock(&store->updates_lock);
+	updates = g_list_reverse(store->updates);
+	store->updates = NULL;
+	store->updates_source = 0;
+	g_mutex_unlock(&store->updates_lock);
 
-	if (g_atomic_int_dec_and_test(&job->store->jobs_to_do))
+	for (node = updates; node; node = g_list_next(node))
+	{
+		job = node->data;
+
+		/* Add the new thumbnail to the store */
+		gtk_list_store_set(GTK_LIST_STORE(job->model), &job->iter,
+			METADATA_COLUMN, job->metadata,
+			PIXBUF_COLUMN, job->pixbuf,
+			PIXBUF_CLEAN_COLUMN, job->pixbuf_clean,
+			PRIORITY_COLUMN, job->priority,
+			EXPORTED_COLUMN, job->exported,
+			ENFUSE_COLUMN, job->enfuse,
+			-1);
+
+		if (g_atomic_int_dec_and_test(&store->jobs_to_do))
+			finished = TRUE;
+
+		/* Clean up the job */
+		worker_job_free(job);
+	}
+	g_list_free(updates);
+
+	if (finished)
 	{
-		gdk_threads_enter();
 		/* FIXME: Refilter as this point - not before */
-		if (job->store->counter_blocked)
-			g_signal_handler_unblock(job->store->store, job->store->counthandler);
-		job->store->counter_blocked = FALSE;
+		if (store->counter_blocked)
+			g_signal_handler_unblock(store->store, store->counthandler);
+		store->counter_blocked = FALSE;
 
-		count_priorities(GTK_TREE_MODEL(job->store->store), NULL, NULL, job->store->label);
+		count_priorities(GTK_TREE_MODEL(store->store), NULL, NULL, store->label);
 		RS_STORE_SORT_METHOD sort_method;
 		if (rs_conf_get_integer(CONF_STORE_SORT_METHOD, (gint*)&sort_method))
-			rs_store_set_sort_method(job->store, sort_method);
+			rs_store_set_sort_method(store, sort_method);
 		else
-			rs_store_set_sort_method(job->store, RS_STORE_SORT_BY_NAME);
-		gdk_threads_leave();
+			rs_store_set_sort_method(store, RS_STORE_SORT_BY_NAME);
+	}
+
+	return FALSE;
+}
+
+/**
+ * Select the thumbnail size from config, high resolution displays get larger thumbnails
+ */
+static void
+thumbnail_size_update(RSStore *store)
+{
+	gint size = DEFAULT_CONF_THUMBNAIL_SIZE;
+	gdouble dpi = gdk_screen_get_resolution(gtk_widget_get_screen(GTK_WIDGET(store)));
+
+	rs_conf_get_integer(CONF_THUMBNAIL_SIZE, &size);
+	if (dpi > 0.0)
+		size *= MAX(1, (gint) (dpi/96.0 + 0.5));
+
+	rs_metadata_set_thumbnail_size(size);
+}
+
+void
+rs_store_set_thumbnail_size(RSStore *store, gint size)
+{
+	g_return_if_fail(RS_IS_STORE(store));
+
+	rs_conf_set_integer(CONF_THUMBNAIL_SIZE, size);
+	thumbnail_size_update(store);
+
+	/* Reload, the metadata cache holds all sizes */
+	if (store->last_path)
+	{
+		rs_store_remove(store, NULL, NULL);
+		rs_store_load_directory(store, NULL);
 	}
-	/* Clean up the job */
-	g_free(job->filename);
-	g_object_unref(job->store);
-	g_object_unref(job->model);
-	g_free(job);
 }
 
 void rs_store_set_iconview_size(RSStore *store, gint size)
@@ -60,14 +60,22 @@ rs_store_new(void);
 #define RESTORE_TAGS_CLASS (4845658)
 
 /**
- * Load thumbnails from a directory into the store
+ * Load thumbnails from a directory into the store. The directory is scanned
+ * in the background, and photos show up once the scan is done
  * @param store A RSStore
  * @param path The path to load
- * @return The number of files loaded or -1
+ * @return 0 if loading was started or -1
  */
 extern gint
 rs_store_load_directory(RSStore *store, const gchar *path);
 
+/**
+ * Cancel all queued io jobs of a store
+ * @param store A RSStore
+ */
+extern void
+rs_store_cancel_jobs(RSStore *store);
+
 /**
  * Set priority and exported flags of a thumbnail
  * @param store A RSStore
@@ -268,6 +276,14 @@ rs_store_set_iconview_size(RSStore *store, gint size);
 extern gint
 rs_store_get_iconview_size(RSStore *store);
 
+/**
+ * Set the size of thumbnails and reload the current directory
+ * @param store A RSStore
+ * @param size The bounding box size in pixels, before scaling for high resolution displays
+ */
+extern void
+rs_store_set_thumbnail_size(RSStore *store, gint size);
+
 extern gboolean
 rs_store_set_open_selected(RSStore *store, gboolean open_selected);
 